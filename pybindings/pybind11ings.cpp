@@ -5,6 +5,15 @@
  */
 
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <utility>
+
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/numpy.h>
@@ -42,35 +51,206 @@ py::array_t<T> to_pyarray(const Matrix<T> &matrix)
 }
 
 
+/*
+ * NumPy arrays in C order, which are converted only if necessary.
+ */
 template<class T>
-CSRMatrix<T> to_csr_matrix(py::object &py_obj)
-{
-    // Access the indptr, data, and indices arrays
-    py::array_t<T> py_sparse_data(py_obj.attr("data"));
-    py::array_t<size_t> py_sparse_indices(py_obj.attr("indices"));
-    py::array_t<size_t> py_sparse_indptr(py_obj.attr("indptr"));
+using CArray = py::array_t<T, py::array::c_style | py::array::forcecast>;
 
-    py::tuple shape = py_obj.attr("shape");
 
-    T* sparse_data = static_cast<T*>(
-        py_sparse_data.request().ptr
-    );
-    size_t* sparse_indices = static_cast<size_t*>(
-        py_sparse_indices.request().ptr
+/*
+ * @brief Returns a matrix viewing the data of a 2D NumPy array.
+ */
+template<class T>
+Matrix<T> to_matrix(CArray<T> &py_data, const std::string &name)
+{
+    if (py_data.ndim() != 2)
+    {
+        throw std::runtime_error(
+            "NumPy array '" + name + "' must have dimension 2"
+        );
+    }
+    return Matrix<T>(
+        py_data.shape()[0], py_data.shape()[1], py_data.mutable_data()
     );
-    size_t* sparse_indptr = static_cast<size_t*>(
-        py_sparse_indptr.request().ptr
+}
+
+
+/*
+ * @brief Returns a CSR matrix viewing the arrays of a sparse SciPy CSR matrix.
+ *
+ * Arrays of type float32 and index arrays of type int64 are viewed without
+ * copying, others are converted. 'arrays' receives the viewed arrays, which
+ * must outlive the matrix.
+ */
+template<class T>
+CSRMatrix<T> to_csr_matrix(py::object &py_obj, py::list &arrays)
+{
+    static_assert(
+        sizeof(size_t) == sizeof(int64_t), "size_t must have 64 bits"
     );
+    CArray<T> py_sparse_data(py_obj.attr("data"));
+    CArray<int64_t> py_sparse_indices(py_obj.attr("indices"));
+    CArray<int64_t> py_sparse_indptr(py_obj.attr("indptr"));
+    arrays.append(py_sparse_data);
+    arrays.append(py_sparse_indices);
+    arrays.append(py_sparse_indptr);
+
+    py::tuple shape = py_obj.attr("shape");
     size_t rows = py::cast<size_t>(shape[0]);
     size_t cols = py::cast<size_t>(shape[1]);
     size_t nnz = py::cast<size_t>(py_obj.attr("nnz"));
+    if (
+        (size_t)py_sparse_indptr.size() != rows + 1
+        || (size_t)py_sparse_data.size() < nnz
+        || (size_t)py_sparse_indices.size() < nnz
+    )
+    {
+        throw std::runtime_error("Inconsistent sparse CSR matrix");
+    }
 
     return CSRMatrix<T>(
-        rows, cols, nnz, sparse_data, sparse_indices, sparse_indptr
+        rows,
+        cols,
+        nnz,
+        py_sparse_data.mutable_data(),
+        reinterpret_cast<size_t*>(py_sparse_indices.mutable_data()),
+        reinterpret_cast<size_t*>(py_sparse_indptr.mutable_data())
     );
 }
 
 
+/*
+ * @brief Returns true if 'py_obj' looks like a sparse SciPy CSR matrix.
+ */
+bool is_csr_matrix(const py::object &py_obj)
+{
+    return py::hasattr(py_obj, "indptr")
+        && py::hasattr(py_obj, "data")
+        && py::hasattr(py_obj, "indices");
+}
+
+
+const char *INVALID_QUERY_DATA =
+    "'query_data' must be either a 2D NumPy array of type float32 "
+    "or a sparse CSR matrix containing the attributes 'data', "
+    "'indices' and 'indptr' (for example "
+    "'scipy.sparse._csr.csr_matrix').";
+
+
+/*
+ * @brief A query converted for NNDescent::query together with the NumPy
+ * arrays it reads from and writes into.
+ *
+ * Must be created while holding the GIL. The NNDescent matrices view the
+ * NumPy arrays, so they can be used without the GIL.
+ */
+struct PreparedQuery
+{
+    py::list arrays;
+    Matrix<float> dense_data;
+    CSRMatrix<float> sparse_data;
+    bool is_sparse;
+    CArray<int> py_indices;
+    CArray<float> py_distances;
+    Matrix<int> indices;
+    Matrix<float> distances;
+
+    PreparedQuery(py::object &py_obj, int k)
+    {
+        size_t n_queries;
+        if (py::isinstance<py::array_t<float>>(py_obj))
+        {
+            CArray<float> py_data(py_obj);
+            arrays.append(py_data);
+            dense_data = to_matrix(py_data, "query_data");
+            n_queries = dense_data.nrows();
+            is_sparse = false;
+        }
+        else if (is_csr_matrix(py_obj))
+        {
+            sparse_data = to_csr_matrix<float>(py_obj, arrays);
+            n_queries = sparse_data.nrows();
+            is_sparse = true;
+        }
+        else
+        {
+            throw std::runtime_error(INVALID_QUERY_DATA);
+        }
+        py_indices = CArray<int>({n_queries, (size_t)k});
+        py_distances = CArray<float>({n_queries, (size_t)k});
+        indices = to_matrix(py_indices, "indices");
+        distances = to_matrix(py_distances, "distances");
+    }
+
+    py::tuple result() const
+    {
+        return py::make_tuple(py_indices, py_distances);
+    }
+};
+
+
+/*
+ * @brief Handle of a query running in a background thread.
+ *
+ * The interface follows concurrent.futures.Future.
+ */
+class QueryFuture
+{
+public:
+
+    /*
+     * The index and the query with its arrays, which must stay alive while
+     * the query runs. Declared before 'future' so they are released after
+     * the query finished.
+     */
+    py::object index;
+    std::shared_ptr<PreparedQuery> query;
+
+    std::shared_future<void> future;
+
+    bool done() const
+    {
+        return future.wait_for(std::chrono::seconds(0))
+            == std::future_status::ready;
+    }
+
+    /*
+     * @brief Waits for the query without holding the GIL and returns the
+     * tuple (indices, distances).
+     *
+     * @param timeout The maximum number of seconds to wait or None.
+     */
+    py::tuple result(const py::object &timeout)
+    {
+        bool ready = true;
+        bool wait_forever = timeout.is_none();
+        std::chrono::duration<double> seconds(
+            wait_forever ? 0.0 : timeout.cast<double>()
+        );
+        {
+            py::gil_scoped_release release;
+            if (wait_forever)
+            {
+                future.wait();
+            }
+            else
+            {
+                ready = future.wait_for(seconds) == std::future_status::ready;
+            }
+        }
+        if (!ready)
+        {
+            PyErr_SetString(PyExc_TimeoutError, "Query not finished");
+            throw py::error_already_set();
+        }
+        // Rethrows an exception of the query.
+        future.get();
+        return query->result();
+    }
+};
+
+
 /**
  * @brief Wrapper class for binding the NND (Nearest Neighbor Descent)
  * algorithm in Python.
@@ -83,6 +263,70 @@ public:
     CSRMatrix<float> csr_data;
     NNDescent nnd;
 
+    /*
+     * The NumPy arrays viewed by 'data' or 'csr_data' if the training data
+     * was not copied.
+     */
+    py::list data_arrays;
+
+    /*
+     * Serializes the queries of several Python threads, since a query
+     * modifies the index (results and search state).
+     */
+    std::shared_ptr<std::mutex> query_mutex = std::make_shared<std::mutex>();
+
+    /*
+     * @brief Queries the index and writes the results into the arrays of
+     * 'query'. Must be called without holding the GIL.
+     */
+    void run_query(
+        PreparedQuery &query, int k, float epsilon, const QueryBudget &budget
+    )
+    {
+        std::lock_guard<std::mutex> lock(*query_mutex);
+        nnd.query_budget = budget;
+        try
+        {
+            if (query.is_sparse)
+            {
+                nnd.query(
+                    query.sparse_data,
+                    query.indices,
+                    query.distances,
+                    k,
+                    epsilon
+                );
+            }
+            else
+            {
+                nnd.query(
+                    query.dense_data,
+                    query.indices,
+                    query.distances,
+                    k,
+                    epsilon
+                );
+            }
+        }
+        catch (...)
+        {
+            clear_query_results();
+            throw;
+        }
+        clear_query_results();
+    }
+
+    /*
+     * @brief Clears the query results of the index, which view the NumPy
+     * arrays of the last query. The arrays are returned to Python, which may
+     * free them while the index lives on.
+     */
+    void clear_query_results()
+    {
+        nnd.query_indices = Matrix<int>();
+        nnd.query_distances = Matrix<float>();
+    }
+
     NNDWrapper(
         py::object &py_obj,
         const std::string& metric,
@@ -99,7 +343,15 @@ public:
         float delta,
         int n_threads,
         bool verbose,
-        const std::string &algorithm
+        const std::string &algorithm,
+        const std::string &storage,
+        bool rerank,
+        const std::string &reorder,
+        bool prepare_on_build,
+        bool cache_norms,
+        const std::string &numa,
+        int pq_subspaces,
+        bool copy_data
     )
     {
         // Read parameters
@@ -119,33 +371,50 @@ public:
         parms.n_threads = n_threads;
         parms.verbose = verbose;
         parms.algorithm = algorithm;
+        parms.storage = storage;
+        parms.rerank = rerank;
+        parms.reorder = reorder;
+        parms.prepare_on_build = prepare_on_build;
+        parms.cache_norms = cache_norms;
+        parms.numa = numa;
+        parms.pq_subspaces = pq_subspaces;
 
+        // The index gets views of the training data, which is either
+        // copied into this wrapper or kept alive by 'data_arrays'.
         // Input data is a NumPy array
         if (py::isinstance<py::array_t<float>>(py_obj))
         {
-            py::array_t<float> py_data(py_obj);
-            if (py_data.ndim() != 2)
+            CArray<float> py_data(py_obj);
+            data_arrays.append(py_data);
+            data = to_matrix(py_data, "data");
+            if (copy_data)
             {
-                throw std::runtime_error(
-                    "NumPy array 'data' must have dimension 2"
-                );
+                data.deep_copy();
+                data_arrays = py::list();
             }
-            data = Matrix<float>(
-                py_data.shape()[0],
-                py_data.shape()[1],
-                static_cast<float*>(py_data.request().ptr)
-            );
-            nnd = NNDescent(data, parms);
+            Matrix<float> train_data(data.nrows(), data.ncols(), data.m_ptr);
+            py::gil_scoped_release release;
+            nnd = NNDescent(train_data, parms);
         }
         // Input data is a sparse SciPy CSR matrix
-        else if (
-            py::hasattr(py_obj, "indptr") &&
-            py::hasattr(py_obj, "data") &&
-            py::hasattr(py_obj, "indices")
-        )
+        else if (is_csr_matrix(py_obj))
         {
-            csr_data = to_csr_matrix<float>(py_obj);
-            nnd = NNDescent(csr_data, parms);
+            csr_data = to_csr_matrix<float>(py_obj, data_arrays);
+            if (copy_data)
+            {
+                csr_data.deep_copy();
+                data_arrays = py::list();
+            }
+            CSRMatrix<float> train_data(
+                csr_data.nrows(),
+                csr_data.ncols(),
+                csr_data.nnz(),
+                csr_data.m_ptr_data,
+                csr_data.m_ptr_col_ind,
+                csr_data.m_ptr_row_ptr
+            );
+            py::gil_scoped_release release;
+            nnd = NNDescent(train_data, parms);
         }
         else
         {
@@ -156,6 +425,252 @@ public:
                 "'scipy.sparse._csr.csr_matrix')."
             );
         }
+        // A reordered index owns a permuted copy of the training data, and
+        // an index with only reduced-precision data needs no array.
+        if (!nnd.original_indices().empty() || !nnd.has_float_data())
+        {
+            view_index_data();
+            data_arrays = py::list();
+        }
+    }
+
+    /*
+     * @brief Wraps an index read by NNDescent::load. The training data is
+     * owned by the index or by its memory mapped file.
+     */
+    explicit NNDWrapper(NNDescent &&loaded)
+        : nnd(std::move(loaded))
+    {
+        view_index_data();
+    }
+
+    /*
+     * @brief Points 'data' and 'csr_data' to the training data owned by the
+     * index.
+     */
+    void view_index_data()
+    {
+        const Matrix<float> &dense = nnd.dense_data();
+        data = Matrix<float>(dense.nrows(), dense.ncols(), dense.m_ptr);
+        const CSRMatrix<float> &sparse = nnd.sparse_data();
+        csr_data = CSRMatrix<float>(
+            sparse.nrows(),
+            sparse.ncols(),
+            sparse.nnz(),
+            sparse.m_ptr_data,
+            sparse.m_ptr_col_ind,
+            sparse.m_ptr_row_ptr
+        );
+    }
+
+    /*
+     * @brief Inserts new points into the index. Afterwards the index owns
+     * all training data.
+     */
+    void add_points(py::object &py_obj)
+    {
+        py::list arrays;
+        if (py::isinstance<py::array_t<float>>(py_obj))
+        {
+            CArray<float> py_data(py_obj);
+            Matrix<float> new_data = to_matrix(py_data, "data");
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(*query_mutex);
+            nnd.add_points(new_data);
+            view_index_data();
+        }
+        else if (is_csr_matrix(py_obj))
+        {
+            CSRMatrix<float> new_data = to_csr_matrix<float>(py_obj, arrays);
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(*query_mutex);
+            nnd.add_points(new_data);
+            view_index_data();
+        }
+        else
+        {
+            throw std::runtime_error(
+                "'data' must be either a 2D NumPy array of type float32 "
+                "or a sparse CSR matrix."
+            );
+        }
+        data_arrays = py::list();
+    }
+
+    void prepare()
+    {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(*query_mutex);
+        nnd.prepare();
+    }
+
+    void reorder_points(const std::string &method)
+    {
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(*query_mutex);
+            nnd.reorder_points(method);
+            view_index_data();
+        }
+        data_arrays = py::list();
+    }
+
+    /*
+     * @brief Returns the rows in the original order of the points, where
+     * 'rows' is the inverse of NNDescent::original_indices.
+     */
+    std::vector<int> original_rows() const
+    {
+        const std::vector<int> &ids = nnd.original_indices();
+        std::vector<int> rows(ids.size());
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            rows[ids[i]] = i;
+        }
+        return rows;
+    }
+
+    /*
+     * @brief Returns the performance counters of the index as a dictionary
+     * of plain Python values.
+     */
+    py::dict get_stats()
+    {
+        Stats stats;
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(*query_mutex);
+            stats = nnd.stats;
+        }
+        py::list iterations;
+        for (const IterationStats &iteration : stats.iterations)
+        {
+            py::dict item;
+            item["sample_seconds"] = iteration.sample_seconds;
+            item["generate_seconds"] = iteration.generate_seconds;
+            item["apply_seconds"] = iteration.apply_seconds;
+            item["dist_evals"] = iteration.dist_evals;
+            item["updates_generated"] = iteration.updates_generated;
+            item["updates_applied"] = iteration.updates_applied;
+            iterations.append(item);
+        }
+        py::dict result;
+        result["forest_seconds"] = stats.forest_seconds;
+        result["leaves_seconds"] = stats.leaves_seconds;
+        result["leaves_dist_evals"] = stats.leaves_dist_evals;
+        result["iterations"] = iterations;
+        result["prepare_seconds"] = stats.prepare_seconds;
+        result["n_queries"] = stats.n_queries;
+        result["query_seconds"] = stats.query_seconds;
+        result["query_dist_evals"] = stats.query_dist_evals;
+        result["visited_histogram"] = py::cast(stats.visited_histogram);
+        result["query_budget_hits"] = stats.query_budget_hits;
+        result["adaptive_epsilon"] = stats.adaptive_epsilon;
+        return result;
+    }
+    void reset_stats()
+    {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(*query_mutex);
+        nnd.stats.reset_queries();
+    }
+
+    void save(const std::string &path)
+    {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(*query_mutex);
+        nnd.save(path);
+    }
+    static NNDWrapper load(const std::string &path, bool mmap)
+    {
+        NNDescent loaded;
+        {
+            py::gil_scoped_release release;
+            loaded = NNDescent::load(path, mmap);
+        }
+        // The wrapper owns Python objects, so it is built with the GIL.
+        return NNDWrapper(std::move(loaded));
+    }
+    py::bytes get_state()
+    {
+        std::string state;
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(*query_mutex);
+            std::ostringstream out(std::ios::binary);
+            nnd.save(out);
+            state = out.str();
+        }
+        return py::bytes(state);
+    }
+    /*
+     * @brief Merges indices built on shards of the data. The parameters are
+     * those of the first shard, except that the number of trees and
+     * iterations are chosen for the merged data.
+     */
+    static NNDWrapper merge(const py::list &py_shards)
+    {
+        std::vector<const NNDescent*> shards;
+        std::vector<std::mutex*> mutexes;
+        for (const py::handle &py_shard : py_shards)
+        {
+            NNDWrapper &shard = py_shard.cast<NNDWrapper&>();
+            shards.push_back(&shard.nnd);
+            mutexes.push_back(shard.query_mutex.get());
+        }
+        // Each mutex is locked once and in the same order by all merges, so
+        // repeated shards and concurrent merges do not deadlock.
+        std::sort(mutexes.begin(), mutexes.end(), std::less<std::mutex*>());
+        mutexes.erase(
+            std::unique(mutexes.begin(), mutexes.end()), mutexes.end()
+        );
+        if (shards.empty())
+        {
+            throw std::invalid_argument("No shards to merge");
+        }
+        const NNDescent &first = *shards[0];
+        Parms parms;
+        parms.metric = first.metric;
+        parms.p_metric = first.p_metric;
+        parms.n_neighbors = first.n_neighbors;
+        parms.leaf_size = first.leaf_size;
+        parms.pruning_degree_multiplier = first.pruning_degree_multiplier;
+        parms.pruning_prob = first.pruning_prob;
+        parms.tree_init = first.tree_init;
+        parms.seed = first.seed;
+        parms.max_candidates = first.max_candidates;
+        parms.delta = first.delta;
+        parms.n_threads = first.n_threads;
+        parms.verbose = first.verbose;
+        parms.algorithm = first.algorithm;
+        parms.storage = first.storage;
+        parms.rerank = first.rerank;
+        parms.reorder = first.reorder;
+        parms.prepare_on_build = first.prepare_on_build;
+        parms.cache_norms = first.cache_norms;
+        parms.numa = first.numa;
+        parms.pq_subspaces = first.pq_subspaces;
+        NNDescent merged;
+        {
+            py::gil_scoped_release release;
+            std::vector<std::unique_lock<std::mutex>> locks;
+            for (std::mutex *mutex : mutexes)
+            {
+                locks.emplace_back(*mutex);
+            }
+            merged = NNDescent::merge(shards, parms);
+        }
+        return NNDWrapper(std::move(merged));
+    }
+    static NNDWrapper set_state(const py::bytes &state)
+    {
+        std::istringstream in(std::string(state), std::ios::binary);
+        NNDescent loaded;
+        {
+            py::gil_scoped_release release;
+            loaded = NNDescent::load(in);
+        }
+        return NNDWrapper(std::move(loaded));
     }
 
     std::string get_metric() const { return nnd.metric; }
@@ -175,13 +690,40 @@ public:
     int get_n_threads() const { return nnd.n_threads; }
     bool get_verbose() const { return nnd.verbose; }
     std::string get_algorithm() const { return nnd.algorithm; }
-    py::array_t<float> get_data() const { return to_pyarray(data); }
+    std::string get_storage() const { return nnd.storage; }
+    bool get_rerank() const { return nnd.rerank; }
+    std::string get_reorder() const { return nnd.reorder; }
+    bool get_prepare_on_build() const { return nnd.prepare_on_build; }
+    bool get_cache_norms() const { return nnd.cache_norms; }
+    std::string get_numa() const { return nnd.numa; }
+    int get_pq_subspaces() const { return nnd.pq_subspaces; }
+    py::array_t<float> get_data() const
+    {
+        if (nnd.original_indices().empty() || !nnd.has_float_data())
+        {
+            return to_pyarray(data);
+        }
+        return to_pyarray(permute_rows(data, original_rows()));
+    }
     py::tuple get_csr_data() const
     {
+        if (!nnd.original_indices().empty())
+        {
+            CSRMatrix<float> original = permute_rows(
+                csr_data, original_rows()
+            );
+            return csr_arrays(original);
+        }
+        return csr_arrays(csr_data);
+    }
+    static py::tuple csr_arrays(const CSRMatrix<float> &csr_data)
+    {
+        size_t nnz = csr_data.nnz();
+        size_t n_ptr = csr_data.nrows() == 0 ? 0 : csr_data.nrows() + 1;
         return py::make_tuple(
-            py::array_t<float>(py::cast(csr_data.m_data)),
-            py::array_t<float>(py::cast(csr_data.m_col_ind)),
-            py::array_t<float>(py::cast(csr_data.m_row_ptr))
+            py::array_t<float>(nnz, csr_data.m_ptr_data),
+            py::array_t<size_t>(nnz, csr_data.m_ptr_col_ind),
+            py::array_t<size_t>(n_ptr, csr_data.m_ptr_row_ptr)
         );
     }
     py::tuple get_neighbor_graph() const
@@ -190,7 +732,7 @@ public:
     }
     py::array_t<int> get_indices() const
     {
-        return to_pyarray(nnd.current_graph.indices);
+        return to_pyarray(nnd.neighbor_indices);
     }
     py::array_t<float> get_distances() const
     {
@@ -200,57 +742,64 @@ public:
     {
         return to_pyarray(nnd.current_graph.flags);
     }
-    py::tuple query(
-        py::object &py_obj, int k, float epsilon
-    )
+
+    /*
+     * @brief Returns whether the search of each point of the last finished
+     * query stopped at its budget.
+     */
+    py::array_t<bool> get_query_truncated()
     {
-        // Input query_data is a NumPy array
-        if (py::isinstance<py::array_t<float>>(py_obj))
+        std::vector<uint8_t> truncated;
         {
-            py::array_t<float> py_data(py_obj);
-            if (py_data.ndim() != 2)
-            {
-                throw std::runtime_error(
-                    "NumPy array 'query_data' must have dimension 2"
-                );
-            }
-            Matrix<float> query_data(
-                py_data.shape()[0],
-                py_data.shape()[1],
-                static_cast<float*>(py_data.request().ptr)
-            );
-
-            nnd.query(query_data, k, epsilon);
-            Matrix<int> query_indices = nnd.query_indices;
-            Matrix<float> query_distances = nnd.query_distances;
-            return py::make_tuple(
-                to_pyarray(query_indices), to_pyarray(query_distances)
-            );
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(*query_mutex);
+            truncated = nnd.query_truncated;
         }
-        // Input query_data is a sparse SciPy CSR matrix
-        else if(
-            py::hasattr(py_obj, "indptr") &&
-            py::hasattr(py_obj, "data") &&
-            py::hasattr(py_obj, "indices")
-        )
+        py::array_t<bool> result(truncated.size());
+        bool *ptr = result.mutable_data();
+        for (size_t i = 0; i < truncated.size(); ++i)
         {
-            CSRMatrix<float> csr_query_data = to_csr_matrix<float>(py_obj);
-            nnd.query(csr_query_data, k, epsilon);
-            Matrix<int> query_indices = nnd.query_indices;
-            Matrix<float> query_distances = nnd.query_distances;
-            return py::make_tuple(
-                to_pyarray(query_indices), to_pyarray(query_distances)
-            );
+            ptr[i] = truncated[i];
         }
-        else
+        return result;
+    }
+    py::tuple query(
+        py::object &py_obj, int k, float epsilon, const QueryBudget &budget
+    )
+    {
+        PreparedQuery query(py_obj, k);
         {
-            throw std::runtime_error(
-                "'query_data' must be either a 2D NumPy array of type float32 "
-                "or a sparse CSR matrix containing the attributes 'data', "
-                "'indices' and 'indptr' (for example "
-                "'scipy.sparse._csr.csr_matrix')."
-            );
+            py::gil_scoped_release release;
+            run_query(query, k, epsilon, budget);
         }
+        return query.result();
+    }
+
+    /*
+     * @brief Starts a query in a background thread and returns immediately.
+     *
+     * @param self The Python object of this wrapper.
+     */
+    QueryFuture query_async(
+        py::object self,
+        py::object &py_obj,
+        int k,
+        float epsilon,
+        const QueryBudget &budget
+    )
+    {
+        QueryFuture future;
+        future.index = self;
+        future.query = std::make_shared<PreparedQuery>(py_obj, k);
+        PreparedQuery *query = future.query.get();
+        future.future = std::async(
+            std::launch::async,
+            [this, query, k, epsilon, budget]()
+            {
+                run_query(*query, k, epsilon, budget);
+            }
+        ).share();
+        return future;
     }
     void set_metric(const std::string& m) { nnd.metric = m; }
     void set_p_metric(float x) { nnd.p_metric = x; }
@@ -270,6 +819,13 @@ public:
     void set_n_threads(int x) { nnd.n_threads = x; }
     void set_verbose(bool x) { nnd.verbose = x; }
     void set_algorithm(const std::string& alg) { nnd.algorithm = alg; }
+    void set_storage(const std::string& x) { nnd.storage = x; }
+    void set_rerank(bool x) { nnd.rerank = x; }
+    void set_reorder(const std::string& x) { nnd.reorder = x; }
+    void set_prepare_on_build(bool x) { nnd.prepare_on_build = x; }
+    void set_cache_norms(bool x) { nnd.cache_norms = x; }
+    void set_numa(const std::string& x) { nnd.numa = x; }
+    void set_pq_subspaces(int x) { nnd.pq_subspaces = x; }
 };
 
 
@@ -277,6 +833,42 @@ PYBIND11_MODULE(nndescent, m)
 {
     m.doc() = "Calculates approximate k-nearest neighbors";
     m.attr("__version__") = PROJECT_VERSION;
+    py::class_<QueryFuture>(m, "QueryFuture")
+        .def("done", &QueryFuture::done)
+        .def("result", &QueryFuture::result, py::arg("timeout")=py::none());
+    py::class_<QueryBudget>(m, "QueryBudget")
+        .def(
+            py::init(
+                [](
+                    size_t max_dist_evals,
+                    size_t max_expansions,
+                    double max_seconds,
+                    double batch_seconds,
+                    size_t target_dist_evals
+                )
+                {
+                    QueryBudget budget;
+                    budget.max_dist_evals = max_dist_evals;
+                    budget.max_expansions = max_expansions;
+                    budget.max_seconds = max_seconds;
+                    budget.batch_seconds = batch_seconds;
+                    budget.target_dist_evals = target_dist_evals;
+                    return budget;
+                }
+            ),
+            py::arg("max_dist_evals")=0,
+            py::arg("max_expansions")=0,
+            py::arg("max_seconds")=0.0,
+            py::arg("batch_seconds")=0.0,
+            py::arg("target_dist_evals")=0
+        )
+        .def_readwrite("max_dist_evals", &QueryBudget::max_dist_evals)
+        .def_readwrite("max_expansions", &QueryBudget::max_expansions)
+        .def_readwrite("max_seconds", &QueryBudget::max_seconds)
+        .def_readwrite("batch_seconds", &QueryBudget::batch_seconds)
+        .def_readwrite(
+            "target_dist_evals", &QueryBudget::target_dist_evals
+        );
     py::class_<NNDWrapper>(m, "NNDescent")
         .def(
             py::init<
@@ -295,7 +887,15 @@ PYBIND11_MODULE(nndescent, m)
                 float,
                 int,
                 bool,
-                const std::string&
+                const std::string&,
+                const std::string&,
+                bool,
+                const std::string&,
+                bool,
+                bool,
+                const std::string&,
+                int,
+                bool
             >(),
             py::arg("data"),
             py::arg("metric")=DEFAULT_PARMS.metric,
@@ -314,14 +914,71 @@ PYBIND11_MODULE(nndescent, m)
             py::arg("delta")=DEFAULT_PARMS.delta,
             py::arg("n_threads")=DEFAULT_PARMS.n_threads,
             py::arg("verbose")=DEFAULT_PARMS.verbose,
-            py::arg("algorithm")=DEFAULT_PARMS.algorithm
+            py::arg("algorithm")=DEFAULT_PARMS.algorithm,
+            py::arg("storage")=DEFAULT_PARMS.storage,
+            py::arg("rerank")=DEFAULT_PARMS.rerank,
+            py::arg("reorder")=DEFAULT_PARMS.reorder,
+            py::arg("prepare_on_build")=DEFAULT_PARMS.prepare_on_build,
+            py::arg("cache_norms")=DEFAULT_PARMS.cache_norms,
+            py::arg("numa")=DEFAULT_PARMS.numa,
+            py::arg("pq_subspaces")=DEFAULT_PARMS.pq_subspaces,
+            py::arg("copy_data")=true
         )
         .def(
             "query",
             &NNDWrapper::query,
             py::arg("query_data"),
             py::arg("k")=DEFAULT_K,
-            py::arg("epsilon")=DEFAULT_EPSILON
+            py::arg("epsilon")=DEFAULT_EPSILON,
+            py::arg("budget")=QueryBudget()
+        )
+        .def(
+            "query_async",
+            [](
+                py::object self,
+                py::object &query_data,
+                int k,
+                float epsilon,
+                const QueryBudget &budget
+            )
+            {
+                return self.cast<NNDWrapper&>().query_async(
+                    self, query_data, k, epsilon, budget
+                );
+            },
+            py::arg("query_data"),
+            py::arg("k")=DEFAULT_K,
+            py::arg("epsilon")=DEFAULT_EPSILON,
+            py::arg("budget")=QueryBudget()
+        )
+        .def_property_readonly(
+            "query_truncated", &NNDWrapper::get_query_truncated
+        )
+        .def("add_points", &NNDWrapper::add_points, py::arg("data"))
+        .def("save", &NNDWrapper::save, py::arg("path"))
+        .def_static("merge", &NNDWrapper::merge, py::arg("shards"))
+        .def("prepare", &NNDWrapper::prepare)
+        .def_property_readonly("stats", &NNDWrapper::get_stats)
+        .def("reset_stats", &NNDWrapper::reset_stats)
+        .def(
+            "reorder_points",
+            &NNDWrapper::reorder_points,
+            py::arg("method")
+        )
+        .def_static(
+            "load",
+            &NNDWrapper::load,
+            py::arg("path"),
+            py::arg("mmap")=false
+        )
+        .def(
+            py::pickle(
+                [](NNDWrapper &wrapper) { return wrapper.get_state(); },
+                [](const py::bytes &state)
+                {
+                    return NNDWrapper::set_state(state);
+                }
+            )
         )
         .def_property(
             "metric", &NNDWrapper::get_metric, &NNDWrapper::set_metric
@@ -373,6 +1030,33 @@ PYBIND11_MODULE(nndescent, m)
         .def_property(
             "algorithm", &NNDWrapper::get_algorithm, &NNDWrapper::set_algorithm
         )
+        .def_property(
+            "storage", &NNDWrapper::get_storage, &NNDWrapper::set_storage
+        )
+        .def_property(
+            "rerank", &NNDWrapper::get_rerank, &NNDWrapper::set_rerank
+        )
+        .def_property(
+            "reorder", &NNDWrapper::get_reorder, &NNDWrapper::set_reorder
+        )
+        .def_property(
+            "prepare_on_build",
+            &NNDWrapper::get_prepare_on_build,
+            &NNDWrapper::set_prepare_on_build
+        )
+        .def_property(
+            "cache_norms",
+            &NNDWrapper::get_cache_norms,
+            &NNDWrapper::set_cache_norms
+        )
+        .def_property(
+            "numa", &NNDWrapper::get_numa, &NNDWrapper::set_numa
+        )
+        .def_property(
+            "pq_subspaces",
+            &NNDWrapper::get_pq_subspaces,
+            &NNDWrapper::set_pq_subspaces
+        )
         .def_property_readonly("data", &NNDWrapper::get_data)
         .def_property_readonly("csr_data", &NNDWrapper::get_csr_data)
         .def_property_readonly("indices", &NNDWrapper::get_indices)
@@ -23,6 +23,10 @@ include_dirs = [
 # Get the value of the NND_DEBUG environment variable
 debug = os.getenv("NND_DEBUG") == "1"
 
+# NND_PORTABLE=1 builds without -march=native, e.g. for wheels shipped to
+# different CPUs. The dense kernels are then selected at runtime.
+portable = os.getenv("NND_PORTABLE") == "1"
+
 # Set the compiler flags based on the debug flag
 if debug:
     print("\n*** Debugging compiler flags are used. ***\n")
@@ -41,9 +45,9 @@ else:
         "-flto",
         "-fno-math-errno",
         "-fopenmp",
-        "-march=native",
-        "-mtune=native",
     ]
+    if not portable:
+        compile_args += ["-march=native", "-mtune=native"]
 
 module = Extension(
     name="nndescent",
@@ -10,4 +10,36 @@ namespace nndescent
 {
 
 
+RowNorms::RowNorms(const Matrix<float> &data, int n_threads)
+    : sq_norms(data.nrows())
+{
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < data.nrows(); ++i)
+    {
+        double sq_norm = 0.0;
+        for (const float *it = data.begin(i); it != data.end(i); ++it)
+        {
+            sq_norm += (*it) * (*it);
+        }
+        sq_norms[i] = sq_norm;
+    }
+}
+
+
+RowNorms::RowNorms(const CSRMatrix<float> &data, int n_threads)
+    : sq_norms(data.nrows())
+{
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < data.nrows(); ++i)
+    {
+        double sq_norm = 0.0;
+        for (const float *it = data.begin_data(i); it != data.end_data(i); ++it)
+        {
+            sq_norm += (*it) * (*it);
+        }
+        sq_norms[i] = sq_norm;
+    }
+}
+
+
 } // namespace nndescent
@@ -11,11 +11,14 @@
 #include <limits>
 #include <numeric>
 #include <string>
-#include <tuple>
+#include <type_traits>
 #include <vector>
 
+#include <omp.h>
+
 #include "utils.h"
 #include "dtypes.h"
+#include "simd.h"
 
 
 namespace nndescent
@@ -35,6 +38,8 @@ using Metric = float (*)(It, It, It);
 using SparseMetric = float (*)(size_t*, size_t*, It, size_t*, size_t*, It);
 using MetricP = float (*)(It, It, It, float);
 using SparseMetricP = float (*)(size_t*, size_t*, It, size_t*, size_t*, It, float);
+using MetricBatch = void (*)(It, It, size_t, const int*, size_t, float*);
+using SparseMetricScattered = float (*)(size_t*, size_t*, It, It, double);
 
 
 /*
@@ -123,74 +128,6 @@ float sparse_squared_euclidean(
 }
 
 
-/*
- * @brief Computes the element-wise sum of two sparse vectors.
- */
-template<class IterCol, class IterData>
-std::tuple<std::vector<size_t>, std::vector<float>> sparse_sum(
-    IterCol first0,
-    IterCol last0,
-    IterData data0,
-    IterCol first1,
-    IterCol last1,
-    IterData data1
-)
-{
-    std::vector<size_t> result_col_ind;
-    std::vector<float> result_data;
-
-    // Pass through both index lists
-    while(first0 != last0 && first1 != last1)
-    {
-        if (*first0 == *first1)
-        {
-            result_col_ind.push_back(*first0);
-            result_data.push_back(*data0 + *data1);
-
-            ++first0;
-            ++data0;
-
-            ++first1;
-            ++data1;
-        }
-        else if (*first0 < *first1)
-        {
-            result_col_ind.push_back(*first0);
-            result_data.push_back(*data0);
-
-            ++first0;
-            ++data0;
-        }
-        else
-        {
-            result_col_ind.push_back(*first1);
-            result_data.push_back(*data1);
-
-            ++first1;
-            ++data1;
-        }
-    }
-    // Pass over the tails
-    while(first0 != last0)
-    {
-        result_col_ind.push_back(*first0);
-        result_data.push_back(*data0);
-
-        ++first0;
-        ++data0;
-    }
-    while(first1 != last1)
-    {
-        result_col_ind.push_back(*first1);
-        result_data.push_back(*data1);
-
-        ++first1;
-        ++data1;
-    }
-    return std::make_tuple(result_col_ind, result_data);
-}
-
-
 /*
  * @brief Sparse inner product.
  */
@@ -235,19 +172,28 @@ float sparse_inner_product(
 
 /*
  * @brief Computes the element-wise difference of two sparse vectors.
+ *
+ * The result is written to 'result_col_ind' and 'result_data', whose previous
+ * content is discarded. Their capacity is reused, so repeated calls with the
+ * same vectors allocate only when a longer result is needed.
  */
 template<class IterCol, class IterData>
-std::tuple<std::vector<size_t>, std::vector<float>> sparse_diff(
+void sparse_diff(
     IterCol first0,
     IterCol last0,
     IterData data0,
     IterCol first1,
     IterCol last1,
-    IterData data1
+    IterData data1,
+    std::vector<size_t> &result_col_ind,
+    std::vector<float> &result_data
 )
 {
-    std::vector<size_t> result_col_ind;
-    std::vector<float> result_data;
+    size_t size = (last0 - first0) + (last1 - first1);
+    result_col_ind.clear();
+    result_data.clear();
+    result_col_ind.reserve(size);
+    result_data.reserve(size);
 
     // Pass through both index lists
     while(first0 != last0 && first1 != last1)
@@ -297,16 +243,18 @@ std::tuple<std::vector<size_t>, std::vector<float>> sparse_diff(
         ++first1;
         ++data1;
     }
-    return std::make_tuple(result_col_ind, result_data);
 }
 
 
 /*
  * @brief Computes the element-wise difference of the normalized form of two
  * sparse vectors.
+ *
+ * The result is written to 'result_col_ind' and 'result_data' as in
+ * 'sparse_diff'.
  */
 template<class IterCol, class IterData>
-std::tuple<std::vector<size_t>, std::vector<float>> sparse_weighted_diff(
+void sparse_weighted_diff(
     IterCol first0,
     IterCol last0,
     IterData data0,
@@ -314,11 +262,16 @@ std::tuple<std::vector<size_t>, std::vector<float>> sparse_weighted_diff(
     IterCol first1,
     IterCol last1,
     IterData data1,
-    float weight1
+    float weight1,
+    std::vector<size_t> &result_col_ind,
+    std::vector<float> &result_data
 )
 {
-    std::vector<size_t> result_col_ind;
-    std::vector<float> result_data;
+    size_t size = (last0 - first0) + (last1 - first1);
+    result_col_ind.clear();
+    result_data.clear();
+    result_col_ind.reserve(size);
+    result_data.reserve(size);
 
     // Pass through both index lists
     while(first0 != last0 && first1 != last1)
@@ -368,7 +321,6 @@ std::tuple<std::vector<size_t>, std::vector<float>> sparse_weighted_diff(
         ++first1;
         ++data1;
     }
-    return std::make_tuple(result_col_ind, result_data);
 }
 
 
@@ -3612,6 +3564,300 @@ float sparse_symmetric_kl(
 }
 
 
+/*
+ * @brief Squared euclidean distance using the vectorized kernel selected for
+ * the CPU at runtime.
+ */
+inline float fast_squared_euclidean(It first0, It last0, It first1)
+{
+    return active_kernels->squared_euclidean(first0, first1, last0 - first0);
+}
+
+
+/*
+ * @brief Manhattan distance using the vectorized kernel selected for the CPU
+ * at runtime.
+ */
+inline float fast_manhattan(It first0, It last0, It first1)
+{
+    return active_kernels->manhattan(first0, first1, last0 - first0);
+}
+
+
+/*
+ * @brief Cosine similarity using the vectorized kernel selected for the CPU at
+ * runtime.
+ */
+inline float fast_cosine(It first0, It last0, It first1)
+{
+    float result, norm0, norm1;
+    active_kernels->inner_product_and_norms(
+        first0, first1, last0 - first0, result, norm0, norm1
+    );
+    if ((norm0 == 0.0f) && (norm1 == 0.0f))
+    {
+        return 0.0f;
+    }
+    else if ((norm0 == 0.0f) || (norm1 == 0.0f))
+    {
+        return 1.0f;
+    }
+    return 1.0f - (result / std::sqrt(norm0 * norm1));
+}
+
+
+/*
+ * @brief Alternative cosine similarity using the vectorized kernel selected
+ * for the CPU at runtime.
+ */
+inline float fast_alternative_cosine(It first0, It last0, It first1)
+{
+    float result, norm0, norm1;
+    active_kernels->inner_product_and_norms(
+        first0, first1, last0 - first0, result, norm0, norm1
+    );
+    if ((norm0 == 0.0f) && (norm1 == 0.0f))
+    {
+        return 0.0f;
+    }
+    else if ((norm0 == 0.0f) || (norm1 == 0.0f))
+    {
+        return FLOAT_MAX;
+    }
+    else if (result <= 0.0f)
+    {
+        return FLOAT_MAX;
+    }
+    result = std::sqrt(norm0 * norm1) / result;
+    return std::log2(result);
+}
+
+
+/*
+ * @brief Dot using the vectorized kernel selected for the CPU at runtime.
+ */
+inline float fast_dot(It first0, It last0, It first1)
+{
+    float result = active_kernels->inner_product(
+        first0, first1, last0 - first0
+    );
+    if (result <= 0.0f)
+    {
+        return 1.0f;
+    }
+    return 1.0f - result;
+}
+
+
+/*
+ * @brief Alternative dot using the vectorized kernel selected for the CPU at
+ * runtime.
+ */
+inline float fast_alternative_dot(It first0, It last0, It first1)
+{
+    float result = active_kernels->inner_product(
+        first0, first1, last0 - first0
+    );
+    if (result <= 0.0f)
+    {
+        return FLOAT_MAX;
+    }
+    return -std::log2(result);
+}
+
+
+/*
+ * @brief Batched squared euclidean distance.
+ *
+ * Computes the distances between the point 'first' and the rows
+ * indices[0], ..., indices[n - 1] of the row-major matrix 'data' with 'dim'
+ * columns.
+ */
+inline void fast_squared_euclidean_batch(
+    It first, It data, size_t dim, const int *indices, size_t n, float *out
+)
+{
+    active_kernels->squared_euclidean_batch(first, data, dim, indices, n, out);
+}
+
+
+/*
+ * @brief Batched dot, see 'fast_squared_euclidean_batch'.
+ */
+inline void fast_dot_batch(
+    It first, It data, size_t dim, const int *indices, size_t n, float *out
+)
+{
+    active_kernels->inner_product_batch(first, data, dim, indices, n, out);
+    for (size_t j = 0; j < n; ++j)
+    {
+        out[j] = out[j] <= 0.0f ? 1.0f : 1.0f - out[j];
+    }
+}
+
+
+/*
+ * @brief Batched alternative dot, see 'fast_squared_euclidean_batch'.
+ */
+inline void fast_alternative_dot_batch(
+    It first, It data, size_t dim, const int *indices, size_t n, float *out
+)
+{
+    active_kernels->inner_product_batch(first, data, dim, indices, n, out);
+    for (size_t j = 0; j < n; ++j)
+    {
+        out[j] = out[j] <= 0.0f ? FLOAT_MAX : -std::log2(out[j]);
+    }
+}
+
+
+/*
+ * @brief Returns a zero-filled array of at least 'size' floats owned by the
+ * calling thread.
+ *
+ * Used to scatter a sparse vector into dense form. Callers must set the
+ * entries they changed back to zero, so the array is only allocated when a
+ * thread needs a larger one.
+ */
+inline float *scatter_buffer(size_t size)
+{
+    static thread_local std::vector<float> buffer;
+    if (buffer.size() < size)
+    {
+        buffer.resize(size, 0.0f);
+    }
+    return buffer.data();
+}
+
+
+/*
+ * @brief Squared euclidean distance between a sparse vector and a vector
+ * scattered into a dense array.
+ *
+ * 'dense' holds the second vector at its column indices and zeros elsewhere
+ * and 'sq_norm' is its squared norm. Only the nonzeros j of the sparse vector
+ * are visited: the squared differences (x_j - y_j)^2 are summed over them,
+ * and the sum of y_j^2 over the other columns is the squared norm minus the
+ * y_j^2 at the visited ones. This difference is taken in double precision,
+ * since it cancels for close points with large norms; its error is about
+ * 1e-16 |y|^2.
+ */
+inline float scattered_squared_euclidean(
+    size_t *first, size_t *last, It data, It dense, double sq_norm
+)
+{
+    float result = 0.0f;
+    double rest = sq_norm;
+    for (; first != last; ++first, ++data)
+    {
+        float y = dense[*first];
+        result += (*data - y) * (*data - y);
+        rest -= (double)y * y;
+    }
+    return result + (float)std::max(rest, 0.0);
+}
+
+
+/*
+ * @brief Dot of a sparse and a scattered vector, see
+ * 'scattered_squared_euclidean'.
+ */
+inline float scattered_dot(
+    size_t *first, size_t *last, It data, It dense, double
+)
+{
+    float result = 0.0f;
+    for (; first != last; ++first, ++data)
+    {
+        result += (*data) * dense[*first];
+    }
+    if (result <= 0.0f)
+    {
+        return 1.0f;
+    }
+    return 1.0f - result;
+}
+
+
+/*
+ * @brief Alternative dot of a sparse and a scattered vector, see
+ * 'scattered_squared_euclidean'.
+ */
+inline float scattered_alternative_dot(
+    size_t *first, size_t *last, It data, It dense, double
+)
+{
+    float result = 0.0f;
+    for (; first != last; ++first, ++data)
+    {
+        result += (*data) * dense[*first];
+    }
+    if (result <= 0.0f)
+    {
+        return FLOAT_MAX;
+    }
+    return -std::log2(result);
+}
+
+
+/*
+ * @brief Cosine of a sparse and a scattered vector, see
+ * 'scattered_squared_euclidean'.
+ */
+inline float scattered_cosine(
+    size_t *first, size_t *last, It data, It dense, double sq_norm
+)
+{
+    float result = 0.0f;
+    float norm0 = 0.0f;
+    for (; first != last; ++first, ++data)
+    {
+        result += (*data) * dense[*first];
+        norm0 += (*data) * (*data);
+    }
+    if ((norm0 == 0.0f) && (sq_norm == 0.0f))
+    {
+        return 0.0f;
+    }
+    else if ((norm0 == 0.0f) || (sq_norm == 0.0f))
+    {
+        return 1.0f;
+    }
+    return 1.0f - (result / std::sqrt(norm0 * sq_norm));
+}
+
+
+/*
+ * @brief Alternative cosine of a sparse and a scattered vector, see
+ * 'scattered_squared_euclidean'.
+ */
+inline float scattered_alternative_cosine(
+    size_t *first, size_t *last, It data, It dense, double sq_norm
+)
+{
+    float result = 0.0f;
+    float norm0 = 0.0f;
+    for (; first != last; ++first, ++data)
+    {
+        result += (*data) * dense[*first];
+        norm0 += (*data) * (*data);
+    }
+    if ((norm0 == 0.0f) && (sq_norm == 0.0f))
+    {
+        return 0.0f;
+    }
+    else if ((norm0 == 0.0f) || (sq_norm == 0.0f))
+    {
+        return FLOAT_MAX;
+    }
+    else if (result <= 0.0f)
+    {
+        return FLOAT_MAX;
+    }
+    return std::log2(std::sqrt(norm0 * sq_norm) / result);
+}
+
+
 /*
  * @brief Class template representing a distance function.
  *
@@ -3622,11 +3868,20 @@ float sparse_symmetric_kl(
  * @tparam Sparse The sparse metric function.
  * @tparam Correction function if a faster alternative of the distance function
  * is used. Otherwise this is simply the identity function.
+ * @tparam DenseBatch Optional batched version of the dense metric (see
+ * 'fast_squared_euclidean_batch'). If it is nullptr, the batched member
+ * functions evaluate the dense metric pair by pair.
+ * @tparam SparseScattered Optional version of the sparse metric whose second
+ * argument is scattered into a dense array (see
+ * 'scattered_squared_euclidean'). If it is nullptr, the batched member
+ * functions evaluate the sparse metric pair by pair.
  */
 template<
     float (*Dense)(It, It, It),
     float (*Sparse)(size_t*, size_t*, It, size_t*, size_t*, It),
-    float (*Correction)(float)
+    float (*Correction)(float),
+    MetricBatch DenseBatch=nullptr,
+    SparseMetricScattered SparseScattered=nullptr
 >
 class Dist
 {
@@ -3641,9 +3896,27 @@ public:
     inline float correction(float value) const { return Correction(value); }
 
     /*
-     * Calculates the distance between two data points using the dense metric
-     * function.
-     *
+     * Loads training point 'idx' into the cache ahead of the distance
+     * evaluations (see 'prefetch').
+     */
+    template<class MatrixType>
+    inline void prefetch(const MatrixType &data, int idx) const
+    {
+        data.prefetch_row(idx);
+    }
+
+    /*
+     * Applies the dense metric function to two arrays of floats.
+     */
+    inline float dense(It first0, It last0, It first1) const
+    {
+        return Dense(first0, last0, first1);
+    }
+
+    /*
+     * Calculates the distance between two data points using the dense metric
+     * function.
+     *
      * @param data The input data matrix.
      * @param idx0 The index of the first data point.
      * @param idx1 The index of the second data point.
@@ -3742,6 +4015,191 @@ public:
         );
     }
 
+    /*
+     * Calculates the distances between the data point 'idx0' and the data
+     * points indices[0], ..., indices[n - 1] and stores them in 'out'.
+     *
+     * This is used to evaluate all candidate pairs of one row of the local
+     * join and all neighbors of a node in a graph search with one call. Dense
+     * metrics with a batched kernel process several rows per pass over
+     * 'idx0'; all other metrics are evaluated pair by pair.
+     *
+     * @param data The input data matrix.
+     * @param idx0 The index of the first data point.
+     * @param indices Pointer to the indices of the other data points.
+     * @param n The number of other data points.
+     * @param out Pointer to an array of at least 'n' floats.
+     */
+    inline void one_to_many
+    (
+        const Matrix<float> &data,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        if (DenseBatch == nullptr)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                out[j] = (*this)(data, idx0, indices[j]);
+            }
+            return;
+        }
+        DenseBatch(
+            data.begin(idx0), data.begin(0), data.ncols(), indices, n, out
+        );
+    }
+
+    /*
+     * Calculates the distances between the query point 'idx_q' and the data
+     * points indices[0], ..., indices[n - 1] and stores them in 'out'.
+     */
+    inline void one_to_many
+    (
+        const Matrix<float> &data,
+        const int *indices,
+        size_t n,
+        const Matrix<float> &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        if (DenseBatch == nullptr)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                out[j] = (*this)(data, indices[j], query_data, idx_q);
+            }
+            return;
+        }
+        DenseBatch(
+            query_data.begin(idx_q), data.begin(0), data.ncols(), indices, n, out
+        );
+    }
+
+    /*
+     * Calculates the distances between the point 'idx' of 'points' and the
+     * data points indices[0], ..., indices[n - 1] with the scattered sparse
+     * metric.
+     *
+     * The point 'idx' is scattered once into a dense array of the calling
+     * thread, so each distance costs a single pass over the nonzeros of the
+     * data point instead of a merge of two index lists.
+     */
+    inline void scattered_one_to_many
+    (
+        const CSRMatrix<float> &data,
+        const int *indices,
+        size_t n,
+        const CSRMatrix<float> &points,
+        int idx,
+        float *out
+    ) const
+    {
+        float *dense = scatter_buffer(std::max(data.ncols(), points.ncols()));
+        double sq_norm = 0.0;
+        const float *value = points.begin_data(idx);
+        for (
+            const size_t *col = points.begin_col(idx);
+            col != points.end_col(idx);
+            ++col, ++value
+        )
+        {
+            dense[*col] = *value;
+            sq_norm += (double)(*value) * (*value);
+        }
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = SparseScattered(
+                data.begin_col(indices[j]),
+                data.end_col(indices[j]),
+                data.begin_data(indices[j]),
+                dense,
+                sq_norm
+            );
+        }
+        for (
+            const size_t *col = points.begin_col(idx);
+            col != points.end_col(idx);
+            ++col
+        )
+        {
+            dense[*col] = 0.0f;
+        }
+    }
+
+    /*
+     * Sparse version of 'one_to_many'. Metrics with a scattered version
+     * scatter 'idx0' once; all other metrics are evaluated pair by pair.
+     */
+    inline void one_to_many
+    (
+        const CSRMatrix<float> &data,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        if (SparseScattered == nullptr || n < 2)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                out[j] = (*this)(data, idx0, indices[j]);
+            }
+            return;
+        }
+        scattered_one_to_many(data, indices, n, data, idx0, out);
+    }
+
+    /*
+     * Sparse version of 'one_to_many' for a query point.
+     */
+    inline void one_to_many
+    (
+        const CSRMatrix<float> &data,
+        const int *indices,
+        size_t n,
+        const CSRMatrix<float> &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        if (SparseScattered == nullptr || n < 2)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                out[j] = (*this)(data, indices[j], query_data, idx_q);
+            }
+            return;
+        }
+        scattered_one_to_many(data, indices, n, query_data, idx_q, out);
+    }
+
+    /*
+     * Calculates the n0 x n1 block of distances between the data points
+     * indices0[0], ..., indices0[n0 - 1] and indices1[0], ...,
+     * indices1[n1 - 1] and stores it row-major in 'out'.
+     */
+    template<class MatrixType>
+    inline void many_to_many
+    (
+        const MatrixType &data,
+        const int *indices0,
+        size_t n0,
+        const int *indices1,
+        size_t n1,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n0; ++j)
+        {
+            one_to_many(data, indices0[j], indices1, n1, out + j * n1);
+        }
+    }
+
 };
 
 
@@ -3768,6 +4226,21 @@ public:
 
     inline float correction(float value) const { return Correction(value); }
 
+    /*
+     * Loads training point 'idx' into the cache ahead of the distance
+     * evaluations (see 'prefetch').
+     */
+    template<class MatrixType>
+    inline void prefetch(const MatrixType &data, int idx) const
+    {
+        data.prefetch_row(idx);
+    }
+
+    inline float dense(It first0, It last0, It first1) const
+    {
+        return Dense(first0, last0, first1, p_metric);
+    }
+
     inline float operator()
     (
         const Matrix<float> &data,
@@ -3830,6 +4303,56 @@ public:
         );
     }
 
+    template<class MatrixType>
+    inline void one_to_many
+    (
+        const MatrixType &data,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = (*this)(data, idx0, indices[j]);
+        }
+    }
+
+    template<class MatrixType>
+    inline void one_to_many
+    (
+        const MatrixType &data,
+        const int *indices,
+        size_t n,
+        const MatrixType &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = (*this)(data, indices[j], query_data, idx_q);
+        }
+    }
+
+    template<class MatrixType>
+    inline void many_to_many
+    (
+        const MatrixType &data,
+        const int *indices0,
+        size_t n0,
+        const int *indices1,
+        size_t n1,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n0; ++j)
+        {
+            one_to_many(data, indices0[j], indices1, n1, out + j * n1);
+        }
+    }
+
 };
 
 
@@ -3855,6 +4378,21 @@ public:
 
     inline float correction(float value) const { return Correction(value); }
 
+    /*
+     * Loads training point 'idx' into the cache ahead of the distance
+     * evaluations (see 'prefetch').
+     */
+    template<class MatrixType>
+    inline void prefetch(const MatrixType &data, int idx) const
+    {
+        data.prefetch_row(idx);
+    }
+
+    inline float dense(It first0, It last0, It first1) const
+    {
+        return Dense(first0, last0, first1);
+    }
+
     inline float operator()
     (
         const Matrix<float> &data,
@@ -3917,31 +4455,109 @@ public:
         );
     }
 
+    template<class MatrixType>
+    inline void one_to_many
+    (
+        const MatrixType &data,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = (*this)(data, idx0, indices[j]);
+        }
+    }
+
+    template<class MatrixType>
+    inline void one_to_many
+    (
+        const MatrixType &data,
+        const int *indices,
+        size_t n,
+        const MatrixType &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = (*this)(data, indices[j], query_data, idx_q);
+        }
+    }
+
+    template<class MatrixType>
+    inline void many_to_many
+    (
+        const MatrixType &data,
+        const int *indices0,
+        size_t n0,
+        const int *indices1,
+        size_t n1,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n0; ++j)
+        {
+            one_to_many(data, indices0[j], indices1, n1, out + j * n1);
+        }
+    }
+
 };
 
 
 // METRICS WITH NO PARAMETERS
-using AltCosine = Dist<alternative_cosine, sparse_alternative_cosine, identity>;
-using AltDot = Dist<alternative_dot, sparse_alternative_dot, identity>;
+using AltCosine = Dist<
+    fast_alternative_cosine,
+    sparse_alternative_cosine,
+    identity,
+    nullptr,
+    scattered_alternative_cosine
+>;
+using AltDot = Dist<
+    fast_alternative_dot,
+    sparse_alternative_dot,
+    identity,
+    fast_alternative_dot_batch,
+    scattered_alternative_dot
+>;
 using AltJaccard = Dist<
     alternative_jaccard, sparse_alternative_jaccard, correct_alternative_jaccard
 >;
 using BrayCurtis = Dist<bray_curtis, sparse_bray_curtis, identity>;
 using Canberra = Dist<canberra, sparse_canberra, identity>;
 using Chebyshev = Dist<chebyshev, sparse_chebyshev, identity>;
-using Cosine = Dist<cosine, sparse_cosine, identity>;
+using Cosine = Dist<
+    fast_cosine, sparse_cosine, identity, nullptr, scattered_cosine
+>;
 using Dice = Dist<dice, sparse_dice, identity>;
-using Dot = Dist<dot, sparse_dot, identity>;
-using Euclidean = Dist<squared_euclidean, sparse_squared_euclidean, std::sqrt>;
+using Dot = Dist<
+    fast_dot, sparse_dot, identity, fast_dot_batch, scattered_dot
+>;
+using Euclidean = Dist<
+    fast_squared_euclidean,
+    sparse_squared_euclidean,
+    std::sqrt,
+    fast_squared_euclidean_batch,
+    scattered_squared_euclidean
+>;
 using Hamming = Dist<hamming, sparse_hamming, identity>;
 using Haversine = Dist<haversine, nullptr, identity>;
 using Hellinger = Dist<hellinger, sparse_hellinger, identity>;
 using Jaccard = Dist<jaccard, sparse_jaccard, identity>;
-using Manhattan = Dist<manhattan, sparse_manhattan, identity>;
+using Manhattan = Dist<fast_manhattan, sparse_manhattan, identity>;
 using Matching = Dist<matching, sparse_matching, identity>;
 using SokalSneath = Dist<sokal_sneath, sparse_sokal_sneath, identity>;
 using SpearmanR = Dist<spearmanr, nullptr, identity>;
-using SqEuclidean = Dist<squared_euclidean, sparse_squared_euclidean, identity>;
+using SqEuclidean = Dist<
+    fast_squared_euclidean,
+    sparse_squared_euclidean,
+    identity,
+    fast_squared_euclidean_batch,
+    scattered_squared_euclidean
+>;
 using TrueAngular = Dist<true_angular, sparse_true_angular, identity>;
 using Tsss = Dist<tsss, sparse_tsss, identity>;
 
@@ -3963,4 +4579,881 @@ using SymmetriyKL = DistD<symmetric_kl, sparse_symmetric_kl, identity>;
 using Yule = DistD<yule, sparse_yule, identity>;
 
 
+/*
+ * @brief Dense metrics that may be evaluated on a QuantizedMatrix.
+ */
+template<class DistType>
+struct supports_quantized_storage : std::false_type {};
+
+template<> struct supports_quantized_storage<AltCosine> : std::true_type {};
+template<> struct supports_quantized_storage<AltDot> : std::true_type {};
+template<> struct supports_quantized_storage<Cosine> : std::true_type {};
+template<> struct supports_quantized_storage<Dot> : std::true_type {};
+template<> struct supports_quantized_storage<Euclidean> : std::true_type {};
+template<> struct supports_quantized_storage<Manhattan> : std::true_type {};
+template<> struct supports_quantized_storage<SqEuclidean> : std::true_type {};
+
+
+/*
+ * @brief A distance which evaluates a dense metric on training data stored in
+ * reduced precision.
+ *
+ * The training points are read from a QuantizedMatrix and decoded into
+ * per-thread buffers, so the 'data' argument of the call operators only
+ * provides the row indices. Query points are used in full precision
+ * (asymmetric distance).
+ *
+ * @tparam DistType The distance evaluated on the decoded rows.
+ */
+template<class DistType>
+class QuantizedDist
+{
+private:
+
+    /*
+     * The distance evaluated on the decoded rows.
+     */
+    DistType dist;
+
+    /*
+     * The training data in reduced precision.
+     */
+    const QuantizedMatrix *storage;
+
+    /*
+     * Two decoding buffers of 'ncols' floats per thread.
+     */
+    mutable std::vector<float> buffers;
+
+    /*
+     * Returns the first decoding buffer of the calling thread.
+     */
+    inline float *buffer() const
+    {
+        return &buffers[2 * storage->ncols() * omp_get_thread_num()];
+    }
+
+public:
+
+    /*
+     * @brief Constructs the distance.
+     *
+     * @param dist The distance evaluated on the decoded rows.
+     * @param storage The training data in reduced precision.
+     * @param n_threads The maximal number of threads calling the distance
+     * simultaneously.
+     */
+    QuantizedDist(
+        const DistType &dist, const QuantizedMatrix &storage, int n_threads
+    )
+        : dist(dist)
+        , storage(&storage)
+        , buffers(2 * storage.ncols() * std::max(n_threads, 1))
+    {
+    }
+
+    inline float correction(float value) const
+    {
+        return dist.correction(value);
+    }
+
+    inline void prefetch(const Matrix<float> &, int idx) const
+    {
+        storage->prefetch_row(idx);
+    }
+
+    inline float operator()
+    (
+        const Matrix<float> &,
+        int idx0,
+        int idx1
+    ) const
+    {
+        float *row0 = buffer();
+        float *row1 = row0 + storage->ncols();
+        storage->decode(idx0, row0);
+        storage->decode(idx1, row1);
+        return dist.dense(row0, row0 + storage->ncols(), row1);
+    }
+
+    inline float operator()
+    (
+        const Matrix<float> &,
+        int idx_d,
+        const Matrix<float> &query_data,
+        int idx_q
+    ) const
+    {
+        float *row = buffer();
+        storage->decode(idx_d, row);
+        return dist.dense(
+            row, row + storage->ncols(), query_data.begin(idx_q)
+        );
+    }
+
+    inline void one_to_many
+    (
+        const Matrix<float> &,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        float *row0 = buffer();
+        float *row1 = row0 + storage->ncols();
+        storage->decode(idx0, row0);
+        for (size_t j = 0; j < n; ++j)
+        {
+            storage->decode(indices[j], row1);
+            out[j] = dist.dense(row0, row0 + storage->ncols(), row1);
+        }
+    }
+
+    inline void one_to_many
+    (
+        const Matrix<float> &,
+        const int *indices,
+        size_t n,
+        const Matrix<float> &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        float *row = buffer();
+        for (size_t j = 0; j < n; ++j)
+        {
+            storage->decode(indices[j], row);
+            out[j] = dist.dense(
+                row, row + storage->ncols(), query_data.begin(idx_q)
+            );
+        }
+    }
+
+    inline void many_to_many
+    (
+        const Matrix<float> &data,
+        const int *indices0,
+        size_t n0,
+        const int *indices1,
+        size_t n1,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n0; ++j)
+        {
+            one_to_many(data, indices0[j], indices1, n1, out + j * n1);
+        }
+    }
+
+
+    /*
+     * Sparse data is never stored in reduced precision, so its distances are
+     * forwarded to the full precision distance.
+     */
+    inline float operator()
+    (
+        const CSRMatrix<float> &data,
+        int idx0,
+        int idx1
+    ) const
+    {
+        return dist(data, idx0, idx1);
+    }
+
+};
+
+
+/*
+ * @brief Per-row statistics of a matrix used by 'NormCachedDist'.
+ *
+ * The squared norm of each row is stored, so that it is not recomputed for
+ * every pair of rows.
+ */
+class RowNorms
+{
+public:
+
+    /*
+     * The squared norm of each row.
+     */
+    std::vector<float> sq_norms;
+
+    RowNorms() {}
+
+    /*
+     * @brief Computes the statistics of all rows of 'data'.
+     *
+     * @param data The dense or sparse input matrix.
+     * @param n_threads The number of threads used.
+     */
+    RowNorms(const Matrix<float> &data, int n_threads);
+    RowNorms(const CSRMatrix<float> &data, int n_threads);
+
+    size_t size() const { return sq_norms.size(); }
+};
+
+
+/*
+ * @brief Cosine from the inner product and the squared norms of two rows.
+ */
+struct CosineFormula
+{
+    static inline float distance(float product, float norm0, float norm1)
+    {
+        if ((norm0 == 0.0f) && (norm1 == 0.0f))
+        {
+            return 0.0f;
+        }
+        else if ((norm0 == 0.0f) || (norm1 == 0.0f))
+        {
+            return 1.0f;
+        }
+        return 1.0f - (product / std::sqrt(norm0 * norm1));
+    }
+};
+
+
+/*
+ * @brief Alternative cosine, see 'CosineFormula'.
+ */
+struct AltCosineFormula
+{
+    static inline float distance(float product, float norm0, float norm1)
+    {
+        if ((norm0 == 0.0f) && (norm1 == 0.0f))
+        {
+            return 0.0f;
+        }
+        else if ((norm0 == 0.0f) || (norm1 == 0.0f) || (product <= 0.0f))
+        {
+            return FLOAT_MAX;
+        }
+        return std::log2(std::sqrt(norm0 * norm1) / product);
+    }
+};
+
+
+/*
+ * @brief True angular, see 'CosineFormula'.
+ */
+struct TrueAngularFormula
+{
+    static inline float distance(float product, float norm0, float norm1)
+    {
+        if ((norm0 == 0.0f) && (norm1 == 0.0f))
+        {
+            return 0.0f;
+        }
+        else if ((norm0 == 0.0f) || (norm1 == 0.0f) || (product <= 0.0f))
+        {
+            return FLOAT_MAX;
+        }
+        float result = std::min(product / std::sqrt(norm0 * norm1), 1.0f);
+        return 1.0f - std::acos(result) / PI;
+    }
+};
+
+
+/*
+ * @brief The formula of the metrics that can use cached row norms (see
+ * 'NormCachedDist'), or void for all other metrics.
+ *
+ * Correlation is left out on purpose: the inner product of the centered rows
+ * would follow from <x, y> - dim * mean(x) * mean(y), which cancels badly in
+ * float for data far from the origin.
+ */
+template<class DistType>
+struct norm_cache_formula { typedef void type; };
+
+template<> struct norm_cache_formula<AltCosine>
+{
+    typedef AltCosineFormula type;
+};
+template<> struct norm_cache_formula<Cosine> { typedef CosineFormula type; };
+template<> struct norm_cache_formula<TrueAngular>
+{
+    typedef TrueAngularFormula type;
+};
+
+
+/*
+ * @brief A distance which evaluates a norm based metric from the inner
+ * product of two rows and their cached statistics.
+ *
+ * The statistics of the training rows and of the query rows are computed once
+ * (see 'RowNorms'), so each pair of rows costs a single inner product.
+ *
+ * @tparam Formula The metric as function of the inner product and the squared
+ * norms (e.g. 'CosineFormula').
+ */
+template<class Formula>
+class NormCachedDist
+{
+private:
+
+    /*
+     * The statistics of the training rows and of the query rows.
+     */
+    const RowNorms *data_norms;
+    const RowNorms *query_norms;
+
+    inline float distance(
+        float product, const RowNorms &norms0, int idx0, const RowNorms &norms1,
+        int idx1
+    ) const
+    {
+        return Formula::distance(
+            product, norms0.sq_norms[idx0], norms1.sq_norms[idx1]
+        );
+    }
+
+    /*
+     * Scattered inner products as in 'Dist::scattered_one_to_many'.
+     */
+    inline void scattered_one_to_many
+    (
+        const CSRMatrix<float> &data,
+        const int *indices,
+        size_t n,
+        const CSRMatrix<float> &points,
+        int idx,
+        float *out
+    ) const
+    {
+        float *dense = scatter_buffer(std::max(data.ncols(), points.ncols()));
+        const float *point_value = points.begin_data(idx);
+        for (
+            const size_t *col = points.begin_col(idx);
+            col != points.end_col(idx);
+            ++col, ++point_value
+        )
+        {
+            dense[*col] = *point_value;
+        }
+        for (size_t j = 0; j < n; ++j)
+        {
+            float product = 0.0f;
+            const float *value = data.begin_data(indices[j]);
+            for (
+                const size_t *col = data.begin_col(indices[j]);
+                col != data.end_col(indices[j]);
+                ++col, ++value
+            )
+            {
+                product += (*value) * dense[*col];
+            }
+            out[j] = product;
+        }
+        for (
+            const size_t *col = points.begin_col(idx);
+            col != points.end_col(idx);
+            ++col
+        )
+        {
+            dense[*col] = 0.0f;
+        }
+    }
+
+public:
+
+    /*
+     * @brief Constructs the distance.
+     *
+     * @param data_norms The statistics of the training rows.
+     * @param query_norms The statistics of the query rows (may be empty if
+     * no query points are used).
+     */
+    NormCachedDist(const RowNorms &data_norms, const RowNorms &query_norms)
+        : data_norms(&data_norms)
+        , query_norms(&query_norms)
+    {
+    }
+
+    inline float correction(float value) const { return value; }
+
+    template<class MatrixType>
+    inline void prefetch(const MatrixType &data, int idx) const
+    {
+        data.prefetch_row(idx);
+        nndescent::prefetch(&data_norms->sq_norms[idx], sizeof(float));
+    }
+
+    inline float operator()
+    (
+        const Matrix<float> &data,
+        int idx0,
+        int idx1
+    ) const
+    {
+        float product = active_kernels->inner_product(
+            data.begin(idx0), data.begin(idx1), data.ncols()
+        );
+        return distance(product, *data_norms, idx0, *data_norms, idx1);
+    }
+
+    inline float operator()
+    (
+        const Matrix<float> &data,
+        int idx_d,
+        const Matrix<float> &query_data,
+        int idx_q
+    ) const
+    {
+        float product = active_kernels->inner_product(
+            data.begin(idx_d), query_data.begin(idx_q), data.ncols()
+        );
+        return distance(product, *data_norms, idx_d, *query_norms, idx_q);
+    }
+
+    inline float operator()
+    (
+        const CSRMatrix<float> &data,
+        int idx0,
+        int idx1
+    ) const
+    {
+        float product = sparse_inner_product(
+            data.begin_col(idx0),
+            data.end_col(idx0),
+            data.begin_data(idx0),
+            data.begin_col(idx1),
+            data.end_col(idx1),
+            data.begin_data(idx1)
+        );
+        return distance(product, *data_norms, idx0, *data_norms, idx1);
+    }
+
+    inline float operator()
+    (
+        const CSRMatrix<float> &data,
+        int idx_d,
+        const CSRMatrix<float> &query_data,
+        int idx_q
+    ) const
+    {
+        float product = sparse_inner_product(
+            data.begin_col(idx_d),
+            data.end_col(idx_d),
+            data.begin_data(idx_d),
+            query_data.begin_col(idx_q),
+            query_data.end_col(idx_q),
+            query_data.begin_data(idx_q)
+        );
+        return distance(product, *data_norms, idx_d, *query_norms, idx_q);
+    }
+
+    inline void one_to_many
+    (
+        const Matrix<float> &data,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        active_kernels->inner_product_batch(
+            data.begin(idx0), data.begin(0), data.ncols(), indices, n, out
+        );
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = distance(
+                out[j], *data_norms, idx0, *data_norms, indices[j]
+            );
+        }
+    }
+
+    inline void one_to_many
+    (
+        const Matrix<float> &data,
+        const int *indices,
+        size_t n,
+        const Matrix<float> &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        active_kernels->inner_product_batch(
+            query_data.begin(idx_q), data.begin(0), data.ncols(), indices, n,
+            out
+        );
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = distance(
+                out[j], *data_norms, indices[j], *query_norms, idx_q
+            );
+        }
+    }
+
+    inline void one_to_many
+    (
+        const CSRMatrix<float> &data,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        scattered_one_to_many(data, indices, n, data, idx0, out);
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = distance(
+                out[j], *data_norms, idx0, *data_norms, indices[j]
+            );
+        }
+    }
+
+    inline void one_to_many
+    (
+        const CSRMatrix<float> &data,
+        const int *indices,
+        size_t n,
+        const CSRMatrix<float> &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        scattered_one_to_many(data, indices, n, query_data, idx_q, out);
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = distance(
+                out[j], *data_norms, indices[j], *query_norms, idx_q
+            );
+        }
+    }
+
+    template<class MatrixType>
+    inline void many_to_many
+    (
+        const MatrixType &data,
+        const int *indices0,
+        size_t n0,
+        const int *indices1,
+        size_t n1,
+        float *out
+    ) const
+    {
+        for (size_t j = 0; j < n0; ++j)
+        {
+            one_to_many(data, indices0[j], indices1, n1, out + j * n1);
+        }
+    }
+
+};
+
+
+/*
+ * @brief Squared euclidean distance from the sum of the squared distances in
+ * the subspaces of a product quantization.
+ */
+struct PQSqEuclideanFormula
+{
+    static const bool inner_product = false;
+
+    static inline float distance(float sum, float, float)
+    {
+        return sum;
+    }
+};
+
+
+/*
+ * @brief Dot distance of normalized rows from the sum of the inner products
+ * in the subspaces.
+ */
+struct PQDotFormula
+{
+    static const bool inner_product = true;
+
+    static inline float distance(float product, float, float)
+    {
+        return product <= 0.0f ? 1.0f : 1.0f - product;
+    }
+};
+
+
+/*
+ * @brief Cosine from the sum of the inner products in the subspaces and the
+ * squared norms.
+ */
+struct PQCosineFormula
+{
+    static const bool inner_product = true;
+
+    static inline float distance(float product, float norm0, float norm1)
+    {
+        return CosineFormula::distance(product, norm0, norm1);
+    }
+};
+
+
+/*
+ * @brief The formula of the metrics that can be evaluated on a PQMatrix (see
+ * 'PQDist'), or void for all other metrics.
+ */
+template<class DistType>
+struct pq_formula { typedef void type; };
+
+template<> struct pq_formula<Cosine> { typedef PQCosineFormula type; };
+template<> struct pq_formula<Dot> { typedef PQDotFormula type; };
+template<> struct pq_formula<Euclidean>
+{
+    typedef PQSqEuclideanFormula type;
+};
+template<> struct pq_formula<SqEuclidean>
+{
+    typedef PQSqEuclideanFormula type;
+};
+
+
+/*
+ * @brief A distance which evaluates the distances between query points and
+ * training points compressed by product quantization (asymmetric distance
+ * computation).
+ *
+ * Each thread computes a lookup table of the squared distances or inner
+ * products between a query point and all centroids of all subspaces, and
+ * keeps the tables of its most recently used query points, one for each of
+ * the searches it runs interleaved. The distance to a training point then
+ * costs one table lookup per subspace. All distances between training points
+ * are evaluated in full precision by 'dist'.
+ *
+ * @tparam DistType The full precision distance.
+ */
+template<class DistType>
+class PQDist
+{
+private:
+
+    typedef typename pq_formula<DistType>::type Formula;
+
+    /*
+     * The lookup table for the query point starting at 'row', which was last
+     * used at time 'last_use' of its thread.
+     */
+    struct Table
+    {
+        std::vector<float> values;
+        const float *row = nullptr;
+        float sq_norm = 0.0f;
+        size_t last_use = 0;
+    };
+
+    /*
+     * The lookup tables of a thread and the number of lookups so far.
+     */
+    struct ThreadTables
+    {
+        std::vector<Table> tables;
+        size_t n_lookups = 0;
+    };
+
+    /*
+     * The full precision distance.
+     */
+    DistType dist;
+
+    /*
+     * The compressed training data.
+     */
+    const PQMatrix *codes;
+
+    /*
+     * The lookup tables of each thread.
+     */
+    mutable std::vector<ThreadTables> thread_tables;
+
+    /*
+     * Returns the lookup table of the calling thread for row 'idx_q' of
+     * 'query_data', which replaces its least recently used table if the row
+     * has none.
+     */
+    inline const Table &table(const Matrix<float> &query_data, int idx_q) const
+    {
+        ThreadTables &cache = thread_tables[omp_get_thread_num()];
+        const float *row = query_data.begin(idx_q);
+        ++cache.n_lookups;
+        Table *oldest = &cache.tables[0];
+        for (Table &table : cache.tables)
+        {
+            if (table.row == row)
+            {
+                table.last_use = cache.n_lookups;
+                return table;
+            }
+            if (table.last_use < oldest->last_use)
+            {
+                oldest = &table;
+            }
+        }
+        Table &table = *oldest;
+        table.last_use = cache.n_lookups;
+        table.row = row;
+        table.sq_norm = 0.0f;
+        for (size_t j = 0; j < codes->ncols(); ++j)
+        {
+            table.sq_norm += row[j] * row[j];
+        }
+        for (size_t s = 0; s < codes->nsubspaces(); ++s)
+        {
+            size_t start = codes->subspace_start(s);
+            size_t end = codes->subspace_start(s + 1);
+            float *values = &table.values[s * PQ_CENTROIDS];
+            std::fill(values, values + PQ_CENTROIDS, 0.0f);
+            for (size_t j = start; j < end; ++j)
+            {
+                const float *coords = codes->centroids.begin(j);
+                float value = row[j];
+                for (size_t c = 0; c < PQ_CENTROIDS; ++c)
+                {
+                    values[c] += Formula::inner_product
+                        ? value * coords[c]
+                        : (value - coords[c]) * (value - coords[c]);
+                }
+            }
+        }
+        return table;
+    }
+
+    /*
+     * Returns the distance between the query point of 'table' and training
+     * point 'idx'.
+     */
+    inline float distance(const Table &table, int idx) const
+    {
+        const uint8_t *code = codes->codes.begin(idx);
+        const float *values = table.values.data();
+        float sum = 0.0f;
+        for (size_t s = 0; s < codes->nsubspaces(); ++s)
+        {
+            sum += values[s * PQ_CENTROIDS + code[s]];
+        }
+        return Formula::distance(
+            sum, codes->sq_norms(idx, 0), table.sq_norm
+        );
+    }
+
+public:
+
+    /*
+     * @brief Constructs the distance.
+     *
+     * @param dist The full precision distance.
+     * @param codes The compressed training data.
+     * @param n_threads The maximal number of threads calling the distance
+     * simultaneously.
+     * @param n_tables The number of query points per thread whose lookup
+     * tables are kept.
+     */
+    PQDist(
+        const DistType &dist,
+        const PQMatrix &codes,
+        int n_threads,
+        int n_tables=1
+    )
+        : dist(dist)
+        , codes(&codes)
+        , thread_tables(std::max(n_threads, 1))
+    {
+        for (ThreadTables &cache : thread_tables)
+        {
+            cache.tables.resize(std::max(n_tables, 1));
+            for (Table &table : cache.tables)
+            {
+                table.values.resize(codes.nsubspaces() * PQ_CENTROIDS);
+            }
+        }
+    }
+
+    inline float correction(float value) const
+    {
+        return dist.correction(value);
+    }
+
+    inline void prefetch(const Matrix<float> &, int idx) const
+    {
+        codes->codes.prefetch_row(idx);
+        codes->sq_norms.prefetch_row(idx);
+    }
+
+    inline float operator()
+    (
+        const Matrix<float> &data,
+        int idx0,
+        int idx1
+    ) const
+    {
+        return dist(data, idx0, idx1);
+    }
+
+    inline float operator()
+    (
+        const Matrix<float> &,
+        int idx_d,
+        const Matrix<float> &query_data,
+        int idx_q
+    ) const
+    {
+        return distance(table(query_data, idx_q), idx_d);
+    }
+
+    inline void one_to_many
+    (
+        const Matrix<float> &data,
+        int idx0,
+        const int *indices,
+        size_t n,
+        float *out
+    ) const
+    {
+        dist.one_to_many(data, idx0, indices, n, out);
+    }
+
+    inline void one_to_many
+    (
+        const Matrix<float> &,
+        const int *indices,
+        size_t n,
+        const Matrix<float> &query_data,
+        int idx_q,
+        float *out
+    ) const
+    {
+        const Table &query_table = table(query_data, idx_q);
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[j] = distance(query_table, indices[j]);
+        }
+    }
+
+    inline void many_to_many
+    (
+        const Matrix<float> &data,
+        const int *indices0,
+        size_t n0,
+        const int *indices1,
+        size_t n1,
+        float *out
+    ) const
+    {
+        dist.many_to_many(data, indices0, n0, indices1, n1, out);
+    }
+
+    /*
+     * Sparse data is never compressed, so its distances are forwarded to the
+     * full precision distance.
+     */
+    inline float operator()
+    (
+        const CSRMatrix<float> &data,
+        int idx0,
+        int idx1
+    ) const
+    {
+        return dist(data, idx0, idx1);
+    }
+
+};
+
+
 } // namespace nndescent
@@ -1,11 +1,16 @@
 /**
  * @file dtypes.cpp
  *
- * @brief Data types used (Matrix, Heap, HeapList).
+ * @brief Data types used (Matrix, QuantizedMatrix, PQMatrix, Heap, HeapList).
  */
 
 
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
 #include "dtypes.h"
+#include "simd.h"
 
 
 namespace nndescent
@@ -87,4 +92,407 @@ std::ostream& operator<<(std::ostream &out, const std::vector<NNUpdate> &updates
 }
 
 
+uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t abs_bits = bits & 0x7FFFFFFFu;
+
+    // NaN and infinity
+    if (abs_bits >= 0x7F800000u)
+    {
+        return sign | 0x7C00u | (abs_bits > 0x7F800000u ? 0x200u : 0u);
+    }
+    // Overflow to infinity
+    if (abs_bits >= 0x477FF000u)
+    {
+        return sign | 0x7C00u;
+    }
+    // Normal half-precision numbers
+    if (abs_bits >= 0x38800000u)
+    {
+        uint32_t rounded = abs_bits + 0xFFFu + ((abs_bits >> 13) & 1u);
+        return sign | ((rounded - 0x38000000u) >> 13);
+    }
+    // Subnormal half-precision numbers and zero
+    if (abs_bits < 0x33000000u)
+    {
+        return sign;
+    }
+    uint32_t exponent = abs_bits >> 23;
+    uint32_t mantissa = (abs_bits & 0x7FFFFFu) | 0x800000u;
+    uint32_t shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t remainder = mantissa & ((1u << shift) - 1u);
+    uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1u)))
+    {
+        ++half;
+    }
+    return sign | half;
+}
+
+
+float half_to_float(uint16_t value)
+{
+    uint32_t sign = (uint32_t)(value & 0x8000u) << 16;
+    uint32_t exponent = (value >> 10) & 0x1Fu;
+    uint32_t mantissa = value & 0x3FFu;
+    uint32_t bits;
+    if (exponent == 0x1Fu)
+    {
+        bits = sign | 0x7F800000u | (mantissa << 13);
+    }
+    else if (exponent != 0)
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    else if (mantissa == 0)
+    {
+        bits = sign;
+    }
+    else
+    {
+        // Normalize the subnormal number.
+        exponent = 113;
+        while ((mantissa & 0x400u) == 0)
+        {
+            mantissa <<= 1;
+            --exponent;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FFu) << 13);
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+
+uint16_t float_to_bfloat16(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7FFFFFFFu) > 0x7F800000u)
+    {
+        // Keep NaN a quiet NaN.
+        return (bits >> 16) | 0x40u;
+    }
+    bits += 0x7FFFu + ((bits >> 16) & 1u);
+    return bits >> 16;
+}
+
+
+float bfloat16_to_float(uint16_t value)
+{
+    uint32_t bits = (uint32_t)value << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+
+StorageType storage_type(const std::string &name)
+{
+    if (name == "float16")
+    {
+        return StorageType::FLOAT16;
+    }
+    if (name == "bfloat16")
+    {
+        return StorageType::BFLOAT16;
+    }
+    if (name == "int8")
+    {
+        return StorageType::INT8;
+    }
+    throw std::invalid_argument("Invalid storage type '" + name + "'");
+}
+
+
+QuantizedMatrix::QuantizedMatrix()
+    : m_rows(0)
+    , m_cols(0)
+    , m_type(StorageType::FLOAT16)
+{
+}
+
+
+QuantizedMatrix::QuantizedMatrix(
+    const Matrix<float> &matrix, StorageType type
+)
+    : m_rows(0)
+    , m_cols(matrix.ncols())
+    , m_type(type)
+{
+    if (type == StorageType::INT8)
+    {
+        // Column ranges
+        m_offset.assign(m_cols, std::numeric_limits<float>::max());
+        m_scale.assign(m_cols, -std::numeric_limits<float>::max());
+        for (size_t i = 0; i < matrix.nrows(); ++i)
+        {
+            for (size_t j = 0; j < m_cols; ++j)
+            {
+                m_offset[j] = std::min(m_offset[j], matrix(i, j));
+                m_scale[j] = std::max(m_scale[j], matrix(i, j));
+            }
+        }
+        for (size_t j = 0; j < m_cols; ++j)
+        {
+            m_scale[j] = (m_scale[j] - m_offset[j]) / 255.0f;
+            if (matrix.nrows() == 0)
+            {
+                m_offset[j] = 0.0f;
+                m_scale[j] = 0.0f;
+            }
+        }
+    }
+    append(matrix);
+}
+
+
+void QuantizedMatrix::append(const Matrix<float> &matrix)
+{
+    size_t first = m_rows * m_cols;
+    size_t size = first + matrix.nrows() * m_cols;
+    if (m_type == StorageType::FLOAT16 || m_type == StorageType::BFLOAT16)
+    {
+        m_half.resize(size);
+        uint16_t (*convert)(float) = m_type == StorageType::FLOAT16
+            ? float_to_half : float_to_bfloat16;
+        #pragma omp parallel for
+        for (size_t i = 0; i < matrix.nrows(); ++i)
+        {
+            for (size_t j = 0; j < m_cols; ++j)
+            {
+                m_half[first + i * m_cols + j] = convert(matrix(i, j));
+            }
+        }
+    }
+    else
+    {
+        m_int8.resize(size);
+        #pragma omp parallel for
+        for (size_t i = 0; i < matrix.nrows(); ++i)
+        {
+            for (size_t j = 0; j < m_cols; ++j)
+            {
+                float level = m_scale[j] > 0.0f
+                    ? (matrix(i, j) - m_offset[j]) / m_scale[j] : 0.0f;
+                level = std::min(255.0f, std::max(0.0f, std::round(level)));
+                m_int8[first + i * m_cols + j] = (uint8_t)level;
+            }
+        }
+    }
+    m_rows += matrix.nrows();
+}
+
+
+size_t QuantizedMatrix::nbytes() const
+{
+    return m_half.size() * sizeof(uint16_t)
+        + m_int8.size() * sizeof(uint8_t)
+        + (m_offset.size() + m_scale.size()) * sizeof(float);
+}
+
+
+void QuantizedMatrix::decode(size_t i, float *out) const
+{
+    switch (m_type)
+    {
+        case StorageType::FLOAT16:
+            active_kernels->decode_float16(&m_half[i * m_cols], m_cols, out);
+            break;
+        case StorageType::BFLOAT16:
+            active_kernels->decode_bfloat16(&m_half[i * m_cols], m_cols, out);
+            break;
+        case StorageType::INT8:
+            active_kernels->decode_int8(
+                &m_int8[i * m_cols], &m_offset[0], &m_scale[0], m_cols, out
+            );
+            break;
+    }
+}
+
+
+// The number of rows on which the centroids of a PQMatrix are trained.
+const size_t PQ_TRAINING_SAMPLES = 32 * PQ_CENTROIDS;
+
+// The number of k-means iterations of the training.
+const int PQ_KMEANS_ITERS = 10;
+
+
+/*
+ * @brief Returns the index of the centroid nearest to 'row' in the columns
+ * 'start', ..., 'end' - 1.
+ *
+ * @param dists Scratch memory for the distances to all centroids.
+ */
+size_t nearest_centroid(
+    const float *row,
+    const Matrix<float> &centroids,
+    size_t start,
+    size_t end,
+    float *dists
+)
+{
+    std::fill(dists, dists + PQ_CENTROIDS, 0.0f);
+    for (size_t j = start; j < end; ++j)
+    {
+        // The loop over the centroids is vectorized.
+        const float *coords = centroids.begin(j);
+        float value = row[j];
+        for (size_t c = 0; c < PQ_CENTROIDS; ++c)
+        {
+            float diff = value - coords[c];
+            dists[c] += diff * diff;
+        }
+    }
+    return std::min_element(dists, dists + PQ_CENTROIDS) - dists;
+}
+
+
+/*
+ * @brief Finds the centroids of the columns 'start', ..., 'end' - 1 of the
+ * rows 'sample' by k-means and stores them in 'centroids'.
+ */
+void train_subspace(
+    const Matrix<float> &matrix,
+    const std::vector<int> &sample,
+    size_t start,
+    size_t end,
+    RandomState &rng_state,
+    Matrix<float> &centroids
+)
+{
+    for (size_t c = 0; c < PQ_CENTROIDS; ++c)
+    {
+        const float *row = matrix.begin(
+            sample[rand_int(rng_state) % sample.size()]
+        );
+        for (size_t j = start; j < end; ++j)
+        {
+            centroids(j, c) = row[j];
+        }
+    }
+    size_t width = end - start;
+    std::vector<float> sums(PQ_CENTROIDS * width);
+    std::vector<size_t> counts(PQ_CENTROIDS);
+    std::vector<float> dists(PQ_CENTROIDS);
+    for (int iter = 0; iter < PQ_KMEANS_ITERS; ++iter)
+    {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (int idx : sample)
+        {
+            const float *row = matrix.begin(idx);
+            size_t c = nearest_centroid(
+                row, centroids, start, end, dists.data()
+            );
+            for (size_t j = 0; j < width; ++j)
+            {
+                sums[c * width + j] += row[start + j];
+            }
+            ++counts[c];
+        }
+        for (size_t c = 0; c < PQ_CENTROIDS; ++c)
+        {
+            // Restart empty clusters from a random row.
+            const float *row = counts[c] > 0 ? nullptr : matrix.begin(
+                sample[rand_int(rng_state) % sample.size()]
+            );
+            for (size_t j = 0; j < width; ++j)
+            {
+                centroids(start + j, c) = row
+                    ? row[start + j] : sums[c * width + j] / counts[c];
+            }
+        }
+    }
+}
+
+
+PQMatrix::PQMatrix(
+    const Matrix<float> &matrix,
+    size_t n_subspaces,
+    RandomState &rng_state,
+    int n_threads
+)
+    : centroids(matrix.ncols(), PQ_CENTROIDS, 0.0f)
+    , codes(0, std::max((size_t)1, std::min(n_subspaces, matrix.ncols())))
+    , sq_norms(0, 1)
+{
+    if (matrix.nrows() == 0)
+    {
+        return;
+    }
+
+    // Partial Fisher-Yates shuffle for a sample without repetitions.
+    std::vector<int> sample(matrix.nrows());
+    for (size_t i = 0; i < sample.size(); ++i)
+    {
+        sample[i] = i;
+    }
+    size_t n_samples = std::min(sample.size(), PQ_TRAINING_SAMPLES);
+    for (size_t i = 0; i < n_samples; ++i)
+    {
+        size_t j = i + rand_int(rng_state) % (sample.size() - i);
+        std::swap(sample[i], sample[j]);
+    }
+    sample.resize(n_samples);
+
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+    for (size_t s = 0; s < nsubspaces(); ++s)
+    {
+        RandomState local_rng_state;
+        for (int state = 0; state < STATE_SIZE; ++state)
+        {
+            local_rng_state[state] = rng_state[state] + s + 1;
+        }
+        train_subspace(
+            matrix,
+            sample,
+            subspace_start(s),
+            subspace_start(s + 1),
+            local_rng_state,
+            centroids
+        );
+    }
+    append(matrix, n_threads);
+}
+
+
+void PQMatrix::append(const Matrix<float> &matrix, int n_threads)
+{
+    size_t n_old = nrows();
+    codes.append(Matrix<uint8_t>(matrix.nrows(), nsubspaces()));
+    sq_norms.append(Matrix<float>(matrix.nrows(), 1));
+    #pragma omp parallel num_threads(n_threads)
+    {
+    std::vector<float> dists(PQ_CENTROIDS);
+    #pragma omp for
+    for (size_t i = 0; i < matrix.nrows(); ++i)
+    {
+        const float *row = matrix.begin(i);
+        for (size_t s = 0; s < nsubspaces(); ++s)
+        {
+            codes(n_old + i, s) = nearest_centroid(
+                row,
+                centroids,
+                subspace_start(s),
+                subspace_start(s + 1),
+                dists.data()
+            );
+        }
+        float norm = 0.0f;
+        for (size_t j = 0; j < ncols(); ++j)
+        {
+            norm += row[j] * row[j];
+        }
+        sq_norms(n_old + i, 0) = norm;
+    }
+    }
+}
+
+
 } // namespace nndescent
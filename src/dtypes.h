@@ -1,15 +1,18 @@
 /**
  * @file dtypes.h
  *
- * @brief Data types used (Matrix, CSRMatrix, Heap, HeapList).
+ * @brief Data types used (Matrix, CSRMatrix, Heap, HeapList, CSRGraph).
  */
 
 
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
-#include <queue>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -50,6 +53,12 @@ public:
      */
     T* m_ptr;
 
+    /**
+     * The storage of a matrix placed by 'first_touch', which is used instead
+     * of 'm_data'.
+     */
+    std::shared_ptr<T> m_buffer;
+
     /**
      * Default constructor. Creates an empty matrix.
      */
@@ -119,6 +128,15 @@ public:
      */
     Matrix<T>& operator=(const Matrix<T>& other);
 
+    /**
+     * Move assignment operator. Moves the contents of another matrix to this
+     * matrix.
+     *
+     * @param other The matrix to be moved.
+     * @return A reference to this matrix after the assignment.
+     */
+    Matrix<T>& operator=(Matrix<T>&& other) noexcept;
+
     /**
      * Resizes an empty matrix to the specified number of rows and columns.
      *
@@ -127,6 +145,16 @@ public:
      */
     void resize(size_t rows, size_t cols);
 
+    /**
+     * @brief Appends the rows of 'other', which must have the same number of
+     * columns unless this matrix is empty.
+     *
+     * A matrix viewing external memory is copied into own storage first.
+     *
+     * @param other The matrix whose rows are appended.
+     */
+    void append(const Matrix<T> &other);
+
     /**
      * Accesses the element at the specified row and column index in the
      * matrix.
@@ -191,6 +219,15 @@ public:
      */
     T* end(size_t i) const { return m_ptr + (i + 1)*m_cols; }
 
+    /**
+     * Loads the beginning of row 'i' into the cache ahead of its use (see
+     * 'prefetch').
+     */
+    void prefetch_row(size_t i) const
+    {
+        prefetch(begin(i), m_cols * sizeof(T));
+    }
+
     /**
      * Returns the count of non-none elements in the matrix.
      *
@@ -220,7 +257,23 @@ public:
             m_data.assign(m_ptr, m_ptr + m_rows*m_cols);
         }
         m_ptr = &m_data[0];
+        m_buffer.reset();
     }
+
+    /**
+     * @brief Moves the data into new storage whose pages are first touched
+     * by the threads that work on the rows.
+     *
+     * The rows are split into 'n_threads' blocks of 'nrows() / n_threads + 1'
+     * rows like the partitions of 'UpdateBuckets', and thread t copies block
+     * t. Since Linux allocates a page on the NUMA node of the thread touching
+     * it first, each block then resides on the node of the thread applying
+     * its updates. A matrix viewing external memory is left unchanged.
+     *
+     * @param n_threads The number of threads of the parallel regions working
+     * on the matrix.
+     */
+    void first_touch(int n_threads);
 };
 
 
@@ -281,6 +334,10 @@ Matrix<T>::Matrix(const Matrix<T>& other)
     , m_data(other.m_data)
     , m_ptr(m_data.empty() ? other.m_ptr : &m_data[0])
 {
+    if (other.m_buffer)
+    {
+        deep_copy();
+    }
 }
 
 
@@ -290,6 +347,7 @@ Matrix<T>::Matrix(Matrix<T>&& other) noexcept
     , m_cols(other.m_cols)
     , m_data(std::move(other.m_data))
     , m_ptr(m_data.empty() ? other.m_ptr : &m_data[0])
+    , m_buffer(std::move(other.m_buffer))
 {
     other.m_ptr = nullptr;
 }
@@ -302,8 +360,29 @@ Matrix<T>& Matrix<T>::operator=(const Matrix<T>& other)
     {
         m_data = other.m_data;
         m_ptr = m_data.empty() ? other.m_ptr : &m_data[0];
+        m_buffer.reset();
+        m_rows = other.m_rows;
+        m_cols = other.m_cols;
+        if (other.m_buffer)
+        {
+            deep_copy();
+        }
+    }
+    return *this;
+}
+
+
+template <class T>
+Matrix<T>& Matrix<T>::operator=(Matrix<T>&& other) noexcept
+{
+    if (this != &other)
+    {
+        m_data = std::move(other.m_data);
+        m_ptr = m_data.empty() ? other.m_ptr : &m_data[0];
+        m_buffer = std::move(other.m_buffer);
         m_rows = other.m_rows;
         m_cols = other.m_cols;
+        other.m_ptr = nullptr;
     }
     return *this;
 }
@@ -316,6 +395,50 @@ void Matrix<T>::resize(size_t rows, size_t cols)
     m_cols = cols;
     m_data.resize(rows*cols);
     m_ptr = &m_data[0];
+    m_buffer.reset();
+}
+
+
+template <class T>
+void Matrix<T>::append(const Matrix<T> &other)
+{
+    if (m_rows == 0)
+    {
+        m_cols = other.m_cols;
+    }
+    deep_copy();
+    m_data.insert(
+        m_data.end(), other.m_ptr, other.m_ptr + other.m_rows*other.m_cols
+    );
+    m_rows += other.m_rows;
+    m_ptr = m_data.data();
+}
+
+
+template <class T>
+void Matrix<T>::first_touch(int n_threads)
+{
+    size_t size = m_rows*m_cols;
+    if (size == 0 || (m_data.empty() && !m_buffer))
+    {
+        return;
+    }
+    // Unlike a vector, 'new T[]' does not initialize the pages.
+    std::shared_ptr<T> buffer(new T[size], std::default_delete<T[]>());
+    size_t block_size = m_rows / n_threads + 1;
+    #pragma omp parallel for num_threads(n_threads)
+    for (int thread = 0; thread < n_threads; ++thread)
+    {
+        size_t start = std::min(thread * block_size, m_rows);
+        size_t end = std::min(start + block_size, m_rows);
+        std::copy(
+            m_ptr + start*m_cols, m_ptr + end*m_cols,
+            buffer.get() + start*m_cols
+        );
+    }
+    std::vector<T>().swap(m_data);
+    m_buffer = buffer;
+    m_ptr = buffer.get();
 }
 
 
@@ -396,7 +519,8 @@ std::ostream& operator<<(std::ostream &out, Matrix<T> const& matrix)
  *
  * The CSRMatrix class is used to store and manipulate sparse matrices in
  * compressed sparse row format. It provides efficient storage and access to
- * the non-zero elements of the matrix.
+ * the non-zero elements of the matrix. Like Matrix it either owns its data or
+ * is a view of external arrays.
  *
  * @tparam T The data type of the matrix elements.
  */
@@ -439,6 +563,8 @@ public:
 
     size_t* m_ptr_col_ind;
 
+    size_t* m_ptr_row_ptr;
+
     /**
      * Default constructor. Creates an empty matrix.
      */
@@ -463,7 +589,8 @@ public:
     );
 
     /**
-     * @brief Constructor for the CSRMatrix class.
+     * @brief Constructor for the CSRMatrix class creating a view of external
+     * arrays without copying them.
      *
      * @param rows The number of rows in the matrix.
      * @param cols The number of columns in the matrix.
@@ -512,6 +639,15 @@ public:
      */
     CSRMatrix<T>& operator=(const CSRMatrix<T>& other);
 
+    /**
+     * @brief Move assignment operator for the CSRMatrix class.
+     *
+     * @param other The CSRMatrix object to be moved.
+     *
+     * @return Reference to the assigned CSRMatrix object.
+     */
+    CSRMatrix<T>& operator=(CSRMatrix<T>&& other) noexcept;
+
     /**
      * Accesses the element at the specified row and column index in the matrix
      * (const version).
@@ -523,11 +659,11 @@ public:
      */
     inline const T operator()(size_t i, size_t j) const
     {
-        for (size_t k = m_row_ptr[i]; k < m_row_ptr[i + 1]; k++)
+        for (size_t k = m_ptr_row_ptr[i]; k < m_ptr_row_ptr[i + 1]; k++)
         {
-            if (m_col_ind[k] == j)
+            if (m_ptr_col_ind[k] == j)
             {
-                return m_data[k];
+                return m_ptr_data[k];
             }
         }
         return (T)0;
@@ -544,7 +680,7 @@ public:
      */
     size_t* begin_col(size_t i) const
     {
-        return m_ptr_col_ind + m_row_ptr[i];
+        return m_ptr_col_ind + m_ptr_row_ptr[i];
     }
 
     /**
@@ -557,7 +693,7 @@ public:
      */
     size_t* end_col(size_t i) const
     {
-        return m_ptr_col_ind + m_row_ptr[i + 1];
+        return m_ptr_col_ind + m_ptr_row_ptr[i + 1];
     }
 
     /**
@@ -571,7 +707,7 @@ public:
      */
     T* begin_data(size_t i) const
     {
-        return m_ptr_data + m_row_ptr[i];
+        return m_ptr_data + m_ptr_row_ptr[i];
     }
 
     /**
@@ -583,7 +719,18 @@ public:
      */
     T* end_data(size_t i) const
     {
-        return m_ptr_data + m_row_ptr[i + 1];
+        return m_ptr_data + m_ptr_row_ptr[i + 1];
+    }
+
+    /**
+     * Loads the beginning of the column indices and values of row 'i' into
+     * the cache ahead of their use (see 'prefetch').
+     */
+    void prefetch_row(size_t i) const
+    {
+        size_t nnz = m_ptr_row_ptr[i + 1] - m_ptr_row_ptr[i];
+        prefetch(begin_col(i), nnz * sizeof(size_t));
+        prefetch(begin_data(i), nnz * sizeof(T));
     }
 
     /**
@@ -595,10 +742,29 @@ public:
     void normalize();
 
     /**
-     *  This function does not modify the current object. It is provided for
-     *  compatibility purposes.
+     * @brief Creates a deep copy of the data storage if necessary.
+     *
+     * If the matrix is a view of external arrays, this function copies them,
+     * ensuring that modifications to the copy do not affect the original data.
+     */
+    void deep_copy();
+
+    /**
+     * @brief Appends the rows of 'other', which must have the same number of
+     * columns unless this matrix is empty.
+     *
+     * A matrix viewing external arrays is copied into own storage first.
+     *
+     * @param other The matrix whose rows are appended.
+     */
+    void append(const CSRMatrix<T> &other);
+
+    /**
+     * Returns the number of non-zero elements in the matrix.
+     *
+     * @return The number of non-zero elements.
      */
-    void deep_copy() {}
+    size_t nnz() const { return m_rows == 0 ? 0 : m_ptr_row_ptr[m_rows]; }
 
     /**
      * Returns the number of rows in the matrix.
@@ -613,9 +779,36 @@ public:
      * @return The number of columns.
      */
     size_t ncols() const { return m_cols; }
+
+private:
+
+    /*
+     * @brief Points to the own vectors or, if the matrix is a view, to the
+     * arrays viewed by 'other'.
+     */
+    void set_pointers(const CSRMatrix<T> &other);
 };
 
 
+template <class T>
+void CSRMatrix<T>::set_pointers(const CSRMatrix<T> &other)
+{
+    // Owned matrices always store rows + 1 row pointers.
+    if (m_row_ptr.empty())
+    {
+        m_ptr_data = other.m_ptr_data;
+        m_ptr_col_ind = other.m_ptr_col_ind;
+        m_ptr_row_ptr = other.m_ptr_row_ptr;
+    }
+    else
+    {
+        m_ptr_data = m_data.data();
+        m_ptr_col_ind = m_col_ind.data();
+        m_ptr_row_ptr = m_row_ptr.data();
+    }
+}
+
+
 template <class T>
 CSRMatrix<T>::CSRMatrix()
     : m_rows(0)
@@ -623,8 +816,9 @@ CSRMatrix<T>::CSRMatrix()
     , m_data(0)
     , m_col_ind(0)
     , m_row_ptr(0)
-    , m_ptr_data(&m_data[0])
-    , m_ptr_col_ind(&m_col_ind[0])
+    , m_ptr_data(nullptr)
+    , m_ptr_col_ind(nullptr)
+    , m_ptr_row_ptr(nullptr)
 {
 }
 
@@ -642,8 +836,9 @@ CSRMatrix<T>::CSRMatrix(
     , m_data(data)
     , m_col_ind(col_ind)
     , m_row_ptr(row_ptr)
-    , m_ptr_data(&m_data[0])
-    , m_ptr_col_ind(&m_col_ind[0])
+    , m_ptr_data(m_data.data())
+    , m_ptr_col_ind(m_col_ind.data())
+    , m_ptr_row_ptr(m_row_ptr.data())
 {
 }
 
@@ -652,18 +847,19 @@ template <class T>
 CSRMatrix<T>::CSRMatrix(
     size_t rows,
     size_t cols,
-    size_t nnz,
+    size_t /* nnz */,
     T *data,
     size_t *col_ind,
     size_t *row_ptr
 )
     : m_rows(rows)
     , m_cols(cols)
-    , m_data(data, data + nnz)
-    , m_col_ind(col_ind, col_ind + nnz)
-    , m_row_ptr(row_ptr, row_ptr + rows + 1)
-    , m_ptr_data(&m_data[0])
-    , m_ptr_col_ind(&m_col_ind[0])
+    , m_data(0)
+    , m_col_ind(0)
+    , m_row_ptr(0)
+    , m_ptr_data(data)
+    , m_ptr_col_ind(col_ind)
+    , m_ptr_row_ptr(row_ptr)
 {
 }
 
@@ -687,8 +883,9 @@ CSRMatrix<T>::CSRMatrix(Matrix<T> matrix)
             }
         }
     }
-    m_ptr_col_ind = &m_col_ind[0];
-    m_ptr_data = &m_data[0];
+    m_ptr_col_ind = m_col_ind.data();
+    m_ptr_data = m_data.data();
+    m_ptr_row_ptr = m_row_ptr.data();
     for (size_t i = 1; i <= m_rows; i++)
     {
         m_row_ptr[i] += m_row_ptr[i - 1];
@@ -703,9 +900,8 @@ CSRMatrix<T>::CSRMatrix(const CSRMatrix<T>& other)
     , m_data(other.m_data)
     , m_col_ind(other.m_col_ind)
     , m_row_ptr(other.m_row_ptr)
-    , m_ptr_data(&m_data[0])
-    , m_ptr_col_ind(&m_col_ind[0])
 {
+    set_pointers(other);
 }
 
 
@@ -716,11 +912,12 @@ CSRMatrix<T>::CSRMatrix(CSRMatrix<T>&& other) noexcept
     , m_data(std::move(other.m_data))
     , m_col_ind(std::move(other.m_col_ind))
     , m_row_ptr(std::move(other.m_row_ptr))
-    , m_ptr_data(&m_data[0])
-    , m_ptr_col_ind(&m_col_ind[0])
 {
+    set_pointers(other);
+    other.m_rows = 0;
     other.m_ptr_data = nullptr;
     other.m_ptr_col_ind = nullptr;
+    other.m_ptr_row_ptr = nullptr;
 }
 
 
@@ -734,31 +931,92 @@ CSRMatrix<T>& CSRMatrix<T>::operator=(const CSRMatrix<T>& other)
         m_data = other.m_data;
         m_col_ind = other.m_col_ind;
         m_row_ptr = other.m_row_ptr;
-        m_ptr_data = &m_data[0];
-        m_ptr_col_ind = &m_col_ind[0];
+        set_pointers(other);
+    }
+    return *this;
+}
+
+
+template <class T>
+CSRMatrix<T>& CSRMatrix<T>::operator=(CSRMatrix<T>&& other) noexcept
+{
+    if (this != &other)
+    {
+        m_rows = other.m_rows;
+        m_cols = other.m_cols;
+        m_data = std::move(other.m_data);
+        m_col_ind = std::move(other.m_col_ind);
+        m_row_ptr = std::move(other.m_row_ptr);
+        set_pointers(other);
+        other.m_rows = 0;
+        other.m_ptr_data = nullptr;
+        other.m_ptr_col_ind = nullptr;
+        other.m_ptr_row_ptr = nullptr;
     }
     return *this;
 }
 
 
+template <class T>
+void CSRMatrix<T>::deep_copy()
+{
+    if (m_row_ptr.empty() && m_ptr_row_ptr != nullptr)
+    {
+        size_t n_values = nnz();
+        m_data.assign(m_ptr_data, m_ptr_data + n_values);
+        m_col_ind.assign(m_ptr_col_ind, m_ptr_col_ind + n_values);
+        m_row_ptr.assign(m_ptr_row_ptr, m_ptr_row_ptr + m_rows + 1);
+        set_pointers(*this);
+    }
+}
+
+
+template <class T>
+void CSRMatrix<T>::append(const CSRMatrix<T> &other)
+{
+    if (m_rows == 0)
+    {
+        m_cols = other.m_cols;
+    }
+    deep_copy();
+    if (m_row_ptr.empty())
+    {
+        m_row_ptr.push_back(0);
+    }
+    size_t n_values = nnz();
+    m_data.insert(
+        m_data.end(), other.m_ptr_data, other.m_ptr_data + other.nnz()
+    );
+    m_col_ind.insert(
+        m_col_ind.end(), other.m_ptr_col_ind, other.m_ptr_col_ind + other.nnz()
+    );
+    for (size_t i = 1; i <= other.m_rows; ++i)
+    {
+        m_row_ptr.push_back(n_values + other.m_ptr_row_ptr[i]);
+    }
+    m_rows += other.m_rows;
+    set_pointers(*this);
+}
+
+
 template <class T>
 void CSRMatrix<T>::normalize()
 {
     for (size_t i = 0; i < m_rows; ++i)
     {
         float norm = 0.0f;
-        for (size_t j = m_row_ptr[i]; j < m_row_ptr[i + 1]; ++j)
+        for (size_t j = m_ptr_row_ptr[i]; j < m_ptr_row_ptr[i + 1]; ++j)
         {
-            norm += m_data[j] * m_data[j];
+            norm += m_ptr_data[j] * m_ptr_data[j];
         }
         norm = std::sqrt(norm);
 
         // Avoid division by zero
         if (norm > 0.0f)
         {
-            for (size_t j = m_row_ptr[i]; j < m_row_ptr[i + 1]; ++j)
+            for (size_t j = m_ptr_row_ptr[i]; j < m_ptr_row_ptr[i + 1]; ++j)
             {
-                m_data[j] /= norm;
+                m_ptr_data[j] /= norm;
             }
         }
     }
@@ -776,10 +1034,10 @@ std::ostream& operator<<(std::ostream &out, CSRMatrix<T> const& matrix)
         << ", m_cols=" << matrix.ncols() << ",\n";
     for (size_t i = 0; i < matrix.nrows(); ++i)
     {
-        for (size_t j = matrix.m_row_ptr[i]; j < matrix.m_row_ptr[i + 1]; ++j)
+        const T *value = matrix.begin_data(i);
+        for (auto col = matrix.begin_col(i); col != matrix.end_col(i); ++col)
         {
-            out << "    (" << i << ", " << matrix.m_col_ind[j] << ")\t"
-                << matrix.m_data[j] << "\n";
+            out << "    (" << i << ", " << *col << ")\t" << *value++ << "\n";
         }
     }
     out << ")\n";
@@ -788,136 +1046,568 @@ std::ostream& operator<<(std::ostream &out, CSRMatrix<T> const& matrix)
 
 
 /*
- * @brief A struct for nearst neighbor candidates in a query search.
+ * @brief Returns the matrix whose row i is the row order[i] of 'matrix'.
  */
-struct Candidate
+template <class T>
+Matrix<T> permute_rows(const Matrix<T> &matrix, const std::vector<int> &order)
 {
-    /*
-     * The identifier of the candidate.
-     */
-    int idx;
+    Matrix<T> result(order.size(), matrix.ncols());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        std::copy(
+            matrix.begin(order[i]), matrix.begin(order[i] + 1), result.begin(i)
+        );
+    }
+    return result;
+}
 
-    /*
-     * The key/distance of the candidate.
-     */
-    float key;
 
-    /*
-     * Overloaded less-than operator used to store Candidates in a MinHeap.
-     */
-    bool operator<(const Candidate& other) const
+/*
+ * @brief Returns the matrix whose row i is the row order[i] of 'matrix'.
+ */
+template <class T>
+CSRMatrix<T> permute_rows(
+    const CSRMatrix<T> &matrix, const std::vector<int> &order
+)
+{
+    std::vector<T> data;
+    std::vector<size_t> col_ind;
+    std::vector<size_t> row_ptr = {0};
+    data.reserve(matrix.nnz());
+    col_ind.reserve(matrix.nnz());
+    row_ptr.reserve(order.size() + 1);
+    for (int row : order)
     {
-        return key > other.key;
+        data.insert(data.end(), matrix.begin_data(row), matrix.end_data(row));
+        col_ind.insert(
+            col_ind.end(), matrix.begin_col(row), matrix.end_col(row)
+        );
+        row_ptr.push_back(data.size());
     }
-};
+    return CSRMatrix<T>(order.size(), matrix.ncols(), data, col_ind, row_ptr);
+}
 
 
 /*
- * @brief A template class representing a maximum heap data structure.
+ * @brief Converts a float to IEEE half precision (round to nearest even).
  */
-template<class T>
-class Heap
-{
+uint16_t float_to_half(float value);
 
-private:
 
-    /*
-     * The underlying priority queue used to implement the heap.
-     */
-    std::priority_queue<T> heap;
+/*
+ * @brief Converts an IEEE half-precision value to float.
+ */
+float half_to_float(uint16_t value);
 
-public:
 
-    /*
-     * Pushes a new element into the heap.
-     *
-     * @param value The value to be pushed into the heap.
-     */
-    void push(const T& value)
-    {
-        heap.push(value);
-    }
+/*
+ * @brief Converts a float to bfloat16 (round to nearest even).
+ */
+uint16_t float_to_bfloat16(float value);
 
-    /*
-     * Removes and returns the top element from the heap.
-     *
-     * @return The top element of the heap.
-     */
-    T pop()
-    {
-        T top = heap.top();
-        heap.pop();
-        return top;
-    }
 
-    /*
-     * Checks if the heap is empty.
-     *
-     * @return True if the heap is empty, false otherwise.
-     */
-    bool empty() const
-    {
-        return heap.empty();
-    }
+/*
+ * @brief Converts a bfloat16 value to float.
+ */
+float bfloat16_to_float(uint16_t value);
+
+
+/*
+ * @brief The formats in which a QuantizedMatrix stores its elements.
+ */
+enum class StorageType
+{
+    // IEEE half precision, 2 bytes per value.
+    FLOAT16,
 
+    // Brain floating point (8 bit exponent, 7 bit mantissa), 2 bytes per
+    // value.
+    BFLOAT16,
+
+    // Scalar quantization to 256 levels between the minimum and the maximum
+    // of each column, 1 byte per value.
+    INT8
 };
 
 
 /*
- * @brief A cache-friendly implementation of a list of maximum heaps.
- *
- * The HeapList class provides a cache-friendly representation of multiple
- * heaps, each containing nodes with associated indices, keys and flags.
- * It supports operations such as pushing nodes into the heaps, sorting
- * the heaps, and retrieving information about the heaps.
+ * @brief Parses the name of a storage type ('float16', 'bfloat16' or 'int8').
+ */
+StorageType storage_type(const std::string &name);
+
+
+/*
+ * @brief A dense matrix stored in reduced precision.
  *
- * @tparam KeyType The type of keys associated with the nodes.
+ * The rows are decoded to float on demand, so the distance evaluations read
+ * two (float16, bfloat16) or four (int8) times less memory per row than with
+ * a Matrix<float>.
  */
-template <class KeyType>
-class HeapList
+class QuantizedMatrix
 {
-
 private:
 
+    friend class BinaryWriter;
+    friend class BinaryReader;
+
     /*
-     * Number of heaps.
+     * The number of rows in the matrix.
      */
-    size_t n_heaps;
+    size_t m_rows;
 
     /*
-     * Number of nodes.
+     * The number of columns in the matrix.
      */
-    size_t n_nodes;
+    size_t m_cols;
 
-public:
+    /*
+     * The format of the elements.
+     */
+    StorageType m_type;
 
     /*
-     * Matrix storing indices of nodes in the heaps.
+     * The elements in float16 or bfloat16 format.
      */
-    Matrix<int> indices;
+    std::vector<uint16_t> m_half;
 
     /*
-     * Matrix storing keys associated with nodes.
+     * The quantized elements in int8 format.
      */
-    Matrix<KeyType> keys;
+    std::vector<uint8_t> m_int8;
 
     /*
-     * Matrix storing flags associated with nodes.
-     *
-     * As bool leads to problems since std::vector<bool> is special from all
-     * other std::vector specializations, char is used instead.
+     * The minimum of each column (int8 format only).
      */
-    Matrix<char> flags;
+    std::vector<float> m_offset;
 
     /*
-     * Default constructor. Creates an empty HeapList.
+     * The quantization step of each column (int8 format only).
      */
-    HeapList() : n_heaps(0), n_nodes(0) {}
+    std::vector<float> m_scale;
+
+public:
 
     /*
-     * Constructor that initializes the HeapList with specified parameters.
+     * Default constructor. Creates an empty matrix.
+     */
+    QuantizedMatrix();
+
+    /*
+     * @brief Converts a float matrix to the specified format.
      *
-     * @param n_heaps The number of heaps.
+     * @param matrix The matrix to be converted.
+     * @param type The format of the elements.
+     */
+    QuantizedMatrix(const Matrix<float> &matrix, StorageType type);
+
+    /*
+     * @brief Converts the rows of 'matrix' and appends them.
+     *
+     * The int8 format keeps the column ranges determined by the constructor,
+     * so values outside of them are clipped.
+     *
+     * @param matrix The rows to be appended, with 'ncols()' columns.
+     */
+    void append(const Matrix<float> &matrix);
+
+    /*
+     * Returns the number of rows in the matrix.
+     */
+    size_t nrows() const { return m_rows; }
+
+    /*
+     * Returns the number of columns in the matrix.
+     */
+    size_t ncols() const { return m_cols; }
+
+    /*
+     * Returns the format of the elements.
+     */
+    StorageType type() const { return m_type; }
+
+    /*
+     * Returns the number of bytes used by the elements and the quantization
+     * parameters.
+     */
+    size_t nbytes() const;
+
+    /*
+     * Loads the beginning of row 'i' into the cache ahead of its decoding
+     * (see 'prefetch').
+     */
+    void prefetch_row(size_t i) const
+    {
+        if (m_type == StorageType::INT8)
+        {
+            prefetch(&m_int8[i * m_cols], m_cols);
+        }
+        else
+        {
+            prefetch(&m_half[i * m_cols], m_cols * sizeof(uint16_t));
+        }
+    }
+
+    /*
+     * @brief Decodes row 'i' to float.
+     *
+     * @param i The row index.
+     * @param out Pointer to an array of at least 'ncols()' floats.
+     */
+    void decode(size_t i, float *out) const;
+};
+
+
+/*
+ * @brief The number of centroids of each subspace of a PQMatrix, such that a
+ * code fits into one byte.
+ */
+const size_t PQ_CENTROIDS = 256;
+
+
+/*
+ * @brief A dense matrix compressed by product quantization.
+ *
+ * The columns are split into 'nsubspaces()' contiguous subspaces of almost
+ * equal width, and the part of a row in each subspace is replaced by the index
+ * of the nearest of 'PQ_CENTROIDS' centroids, which are found by k-means on a
+ * sample of the rows. A row thus takes one byte per subspace plus its squared
+ * norm. Distances to a query point are evaluated from lookup tables of the
+ * distances between the query point and all centroids (see 'PQDist').
+ */
+class PQMatrix
+{
+public:
+
+    /*
+     * The centroids, where entry (j, c) is coordinate j of centroid c of
+     * the subspace containing column j. Storing the centroids of a
+     * subspace column by column lets the loops over the centroids vectorize.
+     */
+    Matrix<float> centroids;
+
+    /*
+     * The centroid index of each row (one column per subspace).
+     */
+    Matrix<uint8_t> codes;
+
+    /*
+     * The squared norm of each row before the compression (one column).
+     */
+    Matrix<float> sq_norms;
+
+    /*
+     * Default constructor. Creates an empty matrix.
+     */
+    PQMatrix() {}
+
+    /*
+     * @brief Trains the centroids on a sample of the rows of 'matrix' and
+     * encodes all rows.
+     *
+     * @param matrix The matrix to be compressed.
+     * @param n_subspaces The number of subspaces, at most 'matrix.ncols()'.
+     * @param rng_state The random state used for the sample and the initial
+     * centroids.
+     * @param n_threads The number of threads used.
+     */
+    PQMatrix(
+        const Matrix<float> &matrix,
+        size_t n_subspaces,
+        RandomState &rng_state,
+        int n_threads
+    );
+
+    /*
+     * @brief Encodes the rows of 'matrix' with the existing centroids and
+     * appends them.
+     *
+     * @param matrix The rows to be appended, with 'ncols()' columns.
+     * @param n_threads The number of threads used.
+     */
+    void append(const Matrix<float> &matrix, int n_threads);
+
+    /*
+     * Returns the number of rows in the matrix.
+     */
+    size_t nrows() const { return codes.nrows(); }
+
+    /*
+     * Returns the number of columns of the uncompressed matrix.
+     */
+    size_t ncols() const { return centroids.nrows(); }
+
+    /*
+     * Returns the number of subspaces.
+     */
+    size_t nsubspaces() const { return codes.ncols(); }
+
+    /*
+     * Returns the first column of subspace 's'. Subspace s ends where
+     * subspace s + 1 starts.
+     */
+    size_t subspace_start(size_t s) const
+    {
+        return s * ncols() / nsubspaces();
+    }
+
+    /*
+     * Returns the number of bytes used by the codes, the norms and the
+     * centroids.
+     */
+    size_t nbytes() const
+    {
+        return nrows() * (nsubspaces() + sizeof(float))
+            + PQ_CENTROIDS * ncols() * sizeof(float);
+    }
+};
+
+
+/*
+ * @brief A struct for nearst neighbor candidates in a query search.
+ */
+struct Candidate
+{
+    /*
+     * The identifier of the candidate.
+     */
+    int idx;
+
+    /*
+     * The key/distance of the candidate.
+     */
+    float key;
+
+    /*
+     * Overloaded less-than operator used to store Candidates in a MinHeap.
+     */
+    bool operator<(const Candidate& other) const
+    {
+        return key > other.key;
+    }
+};
+
+
+/*
+ * @brief A template class representing a maximum heap data structure.
+ *
+ * The elements are stored in a std::vector, so the heap can be cleared
+ * without releasing its memory and be reused for many searches.
+ */
+template<class T>
+class Heap
+{
+
+private:
+
+    /*
+     * The underlying array of the heap.
+     */
+    std::vector<T> heap;
+
+public:
+
+    /*
+     * Pushes a new element into the heap.
+     *
+     * @param value The value to be pushed into the heap.
+     */
+    void push(const T& value)
+    {
+        heap.push_back(value);
+        std::push_heap(heap.begin(), heap.end());
+    }
+
+    /*
+     * Removes and returns the top element from the heap.
+     *
+     * @return The top element of the heap.
+     */
+    T pop()
+    {
+        std::pop_heap(heap.begin(), heap.end());
+        T top = heap.back();
+        heap.pop_back();
+        return top;
+    }
+
+    /*
+     * Checks if the heap is empty.
+     *
+     * @return True if the heap is empty, false otherwise.
+     */
+    bool empty() const
+    {
+        return heap.empty();
+    }
+
+    /*
+     * Removes all elements but keeps the allocated memory.
+     */
+    void clear()
+    {
+        heap.clear();
+    }
+
+};
+
+
+/*
+ * @brief The sets of visited nodes of up to MAX_LANES searches which run
+ * interleaved on one thread.
+ *
+ * Each node stores one bit per search, so the table costs one byte per node
+ * regardless of the number of searches. Every search also records the nodes
+ * it visited, such that 'clear' resets only those and a search costs time
+ * proportional to the number of visited nodes rather than to the size of the
+ * index.
+ */
+class VisitedSets
+{
+
+public:
+
+    /*
+     * The maximal number of searches.
+     */
+    static const int MAX_LANES = 8;
+
+private:
+
+    /*
+     * Bit 'lane' of entry i is set if search 'lane' has visited node i.
+     */
+    std::vector<uint8_t> marks;
+
+    /*
+     * The nodes visited by each search.
+     */
+    std::vector<std::vector<int>> visited;
+
+public:
+
+    VisitedSets() {}
+
+    /*
+     * @brief Constructs empty sets of 'n_lanes' searches for the nodes
+     * 0, ..., n_nodes - 1.
+     */
+    VisitedSets(size_t n_nodes, int n_lanes)
+        : marks(n_nodes, 0)
+        , visited(n_lanes)
+    {
+        if (n_lanes < 1 || n_lanes > MAX_LANES)
+        {
+            throw std::invalid_argument(
+                "The number of searches must be between 1 and "
+                + std::to_string(MAX_LANES)
+            );
+        }
+    }
+
+    /*
+     * Returns the number of nodes the sets can hold.
+     */
+    size_t size() const
+    {
+        return marks.size();
+    }
+
+    /*
+     * Returns the number of searches.
+     */
+    int nlanes() const
+    {
+        return visited.size();
+    }
+
+    /*
+     * Removes all nodes from the set of search 'lane'.
+     */
+    void clear(int lane)
+    {
+        uint8_t mask = ~(uint8_t)(1u << lane);
+        for (int i : visited[lane])
+        {
+            marks[i] &= mask;
+        }
+        visited[lane].clear();
+    }
+
+    /*
+     * Checks if search 'lane' has visited the node 'i'.
+     */
+    bool contains(int lane, int i) const
+    {
+        return marks[i] & (1u << lane);
+    }
+
+    /*
+     * Marks the node 'i' as visited by search 'lane'.
+     */
+    void insert(int lane, int i)
+    {
+        marks[i] |= (uint8_t)(1u << lane);
+        visited[lane].push_back(i);
+    }
+
+};
+
+
+/*
+ * @brief A cache-friendly implementation of a list of maximum heaps.
+ *
+ * The HeapList class provides a cache-friendly representation of multiple
+ * heaps, each containing nodes with associated indices, keys and flags.
+ * It supports operations such as pushing nodes into the heaps, sorting
+ * the heaps, and retrieving information about the heaps.
+ *
+ * @tparam KeyType The type of keys associated with the nodes.
+ */
+template <class KeyType>
+class HeapList
+{
+
+private:
+
+    /*
+     * Number of heaps.
+     */
+    size_t n_heaps;
+
+    /*
+     * Number of nodes.
+     */
+    size_t n_nodes;
+
+public:
+
+    /*
+     * Matrix storing indices of nodes in the heaps.
+     */
+    Matrix<int> indices;
+
+    /*
+     * Matrix storing keys associated with nodes.
+     */
+    Matrix<KeyType> keys;
+
+    /*
+     * Matrix storing flags associated with nodes.
+     *
+     * As bool leads to problems since std::vector<bool> is special from all
+     * other std::vector specializations, char is used instead.
+     */
+    Matrix<char> flags;
+
+    /*
+     * Default constructor. Creates an empty HeapList.
+     */
+    HeapList() : n_heaps(0), n_nodes(0) {}
+
+    /*
+     * Constructor that initializes the HeapList with specified parameters.
+     *
+     * @param n_heaps The number of heaps.
      * @param n_nodes The number of nodes in each heap.
      * @param key0 The initial key value for all nodes.
      * @param flag0 The initial flag value for all nodes.
@@ -948,6 +1638,28 @@ public:
     {
     }
 
+    /*
+     * Constructor that takes over existing matrices, which may be views of
+     * external memory.
+     *
+     * @param indices The indices of the nodes.
+     * @param keys The keys of the nodes, of the same shape as 'indices'.
+     * @param flags The flags of the nodes, either of the same shape as
+     * 'indices' or empty.
+     */
+    HeapList(
+        Matrix<int> &&indices,
+        Matrix<KeyType> &&keys,
+        Matrix<char> &&flags
+    )
+        : n_heaps(indices.nrows())
+        , n_nodes(indices.ncols())
+        , indices(std::move(indices))
+        , keys(std::move(keys))
+        , flags(std::move(flags))
+    {
+    }
+
     /*
      * Retrieves the number of heaps in the HeapList.
      *
@@ -969,6 +1681,19 @@ public:
      */
     bool noflags() const { return flags.nrows() == 0; }
 
+    /*
+     * Places the heaps on the NUMA nodes of the threads working on them (see
+     * Matrix::first_touch).
+     *
+     * @param n_threads The number of threads.
+     */
+    void first_touch(int n_threads)
+    {
+        indices.first_touch(n_threads);
+        keys.first_touch(n_threads);
+        flags.first_touch(n_threads);
+    }
+
     /*
      * Retrieves the maximum key value in the specified heap.
      *
@@ -987,6 +1712,19 @@ public:
      */
     size_t size(size_t i) const;
 
+    /*
+     * Empties the specified heap by setting all indices to 'NONE' and all
+     * keys to 'key0'.
+     *
+     * @param i The index of the heap.
+     * @param key0 The initial key value for all nodes.
+     */
+    void reset(size_t i, KeyType key0)
+    {
+        std::fill(indices.begin(i), indices.end(i), NONE);
+        std::fill(keys.begin(i), keys.end(i), key0);
+    }
+
     /*
      * Pushes a node with the specified index, key, and flag into the
      * specified heap if its key is smaller and it is not already in the heap.
@@ -1043,31 +1781,105 @@ public:
      * "Heapsort" algorithm is executed.
      */
     void heapsort();
+
+    /*
+     * @brief Sorts all heaps like 'heapsort' with 'n_threads' threads.
+     *
+     * Not an overload of 'heapsort', which would take a row index of type
+     * int for the number of threads.
+     */
+    void parallel_heapsort(int n_threads);
+
+    /*
+     * @brief Sorts heap 'i' in ascending key order.
+     */
+    void heapsort(size_t i);
+
+    /*
+     * @brief Restores the heap criterion of heap 'i' after it was sorted by
+     * 'heapsort' and sets its flags to 'flag0'.
+     *
+     * A sorted heap reversed is again a valid max heap.
+     *
+     * @param i The index of the heap.
+     * @param flag0 The flag value for all nodes of the heap.
+     */
+    void restore_heap(size_t i, char flag0);
+
+    /*
+     * @brief Appends 'n' empty heaps.
+     *
+     * @param n The number of heaps to append.
+     * @param key0 The initial key value for all nodes.
+     * @param flag0 The initial flag value for all nodes, unused if the
+     * HeapList has no flags.
+     */
+    void add_heaps(size_t n, KeyType key0, char flag0);
 };
 
 
 template <class KeyType>
 void HeapList<KeyType>::heapsort()
+{
+    this->parallel_heapsort(1);
+}
+
+
+template <class KeyType>
+void HeapList<KeyType>::parallel_heapsort(int n_threads)
+{
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < n_heaps; ++i)
+    {
+        this->heapsort(i);
+    }
+}
+
+
+template <class KeyType>
+void HeapList<KeyType>::heapsort(size_t i)
 {
     int tmp_id;
     KeyType tmp_key;
 
-    for (size_t i = 0; i < n_heaps; ++i)
+    for (size_t j = n_nodes - 1; j > 0; --j)
     {
-        for (size_t j = n_nodes - 1; j > 0; --j)
-        {
-            tmp_id = indices(i, 0);
-            tmp_key = keys(i, 0);
+        tmp_id = indices(i, 0);
+        tmp_key = keys(i, 0);
 
-            indices(i, 0) = indices(i, j);
-            keys(i, 0) = keys(i, j);
+        indices(i, 0) = indices(i, j);
+        keys(i, 0) = keys(i, j);
 
-            indices(i, j) = tmp_id;
-            keys(i, j) = tmp_key;
+        indices(i, j) = tmp_id;
+        keys(i, j) = tmp_key;
 
-            this->siftdown(i, j);
-        }
+        this->siftdown(i, j);
+    }
+}
+
+
+template <class KeyType>
+void HeapList<KeyType>::restore_heap(size_t i, char flag0)
+{
+    std::reverse(indices.begin(i), indices.end(i));
+    std::reverse(keys.begin(i), keys.end(i));
+    if (!noflags())
+    {
+        std::fill(flags.begin(i), flags.end(i), flag0);
+    }
+}
+
+
+template <class KeyType>
+void HeapList<KeyType>::add_heaps(size_t n, KeyType key0, char flag0)
+{
+    indices.append(Matrix<int>(n, n_nodes, NONE));
+    keys.append(Matrix<KeyType>(n, n_nodes, key0));
+    if (!noflags())
+    {
+        flags.append(Matrix<char>(n, n_nodes, flag0));
     }
+    n_heaps += n;
 }
 
 
@@ -1433,6 +2245,113 @@ std::ostream& operator<<(std::ostream &out, HeapList<KeyType> &heaplist)
 }
 
 
+/*
+ * @brief A graph stored as adjacency lists in compressed sparse row format.
+ *
+ * The neighbors of node i are indices[offsets[i]], ..., indices[offsets[i +
+ * 1] - 1]. Unlike a HeapList there are neither keys nor padding with NONE
+ * entries, which makes it the compact graph traversed by queries. Both arrays
+ * are matrices with one column, so they may be views of a memory mapped file.
+ */
+class CSRGraph
+{
+public:
+
+    /*
+     * The start of the adjacency list of each node followed by the number of
+     * edges.
+     */
+    Matrix<size_t> offsets;
+
+    /*
+     * The concatenated adjacency lists.
+     */
+    Matrix<int> indices;
+
+    /*
+     * Default constructor. Creates a graph without nodes.
+     */
+    CSRGraph() {}
+
+    /*
+     * Constructor that takes over existing arrays, which may be views of
+     * external memory.
+     *
+     * @param offsets The 'nnodes() + 1' offsets of the adjacency lists.
+     * @param indices The 'nedges()' neighbors.
+     */
+    CSRGraph(Matrix<size_t> &&offsets, Matrix<int> &&indices)
+        : offsets(std::move(offsets))
+        , indices(std::move(indices))
+    {
+    }
+
+    /*
+     * Returns the number of nodes.
+     */
+    size_t nnodes() const
+    {
+        return offsets.nrows() == 0 ? 0 : offsets.nrows() - 1;
+    }
+
+    /*
+     * Returns the number of edges.
+     */
+    size_t nedges() const { return indices.nrows(); }
+
+    /*
+     * Returns the number of neighbors of node 'i'.
+     */
+    size_t degree(size_t i) const
+    {
+        return offsets.m_ptr[i + 1] - offsets.m_ptr[i];
+    }
+
+    /*
+     * Returns a pointer to the first neighbor of node 'i'.
+     */
+    const int *begin(size_t i) const
+    {
+        return indices.m_ptr + offsets.m_ptr[i];
+    }
+
+    /*
+     * Returns a pointer past the last neighbor of node 'i'.
+     */
+    const int *end(size_t i) const
+    {
+        return indices.m_ptr + offsets.m_ptr[i + 1];
+    }
+
+    /*
+     * Loads the neighbors of node 'i' into the cache ahead of their use (see
+     * 'prefetch').
+     */
+    void prefetch_row(size_t i) const
+    {
+        prefetch(begin(i), degree(i) * sizeof(int));
+    }
+
+    /*
+     * Spreads the pages of the graph over the NUMA nodes of 'n_threads'
+     * threads (see Matrix::first_touch).
+     */
+    void first_touch(int n_threads)
+    {
+        offsets.first_touch(n_threads);
+        indices.first_touch(n_threads);
+    }
+
+    /*
+     * Returns the number of bytes used by the offsets and the indices.
+     */
+    size_t nbytes() const
+    {
+        return offsets.nrows() * sizeof(size_t) + nedges() * sizeof(int);
+    }
+};
+
+
 /*
  * @brief Debug function to print the data as 2d map.
  */
@@ -1487,6 +2406,161 @@ typedef struct
 } NNUpdate;
 
 
+/*
+ * @brief A struct holding a candidate 'idx1' to be added to the candidate
+ * heap of node 'idx0' together with its random sampling priority and the flag
+ * of the corresponding graph edge.
+ */
+typedef struct
+{
+    int idx0;
+    int idx1;
+    int priority;
+    char flag;
+} CandidateUpdate;
+
+
+/*
+ * @brief Buckets of updates sorted by the partition of their destination row.
+ *
+ * The rows 0, ..., n_rows - 1 of a graph are split into 'n_parts' contiguous
+ * blocks. Each producing thread owns one bucket per partition and appends an
+ * update to the bucket of the partition containing its destination row
+ * 'idx0'. Hence, when applying the updates, thread p only needs to read the
+ * buckets (0, p), ..., (n_threads - 1, p) and every row is written by a single
+ * thread, which makes locking unnecessary.
+ *
+ * @tparam UpdateType A struct whose first member 'idx0' is the destination
+ * row (e.g. NNUpdate).
+ */
+template <class UpdateType>
+class UpdateBuckets
+{
+
+private:
+
+    /*
+     * Number of producing threads.
+     */
+    size_t n_threads;
+
+    /*
+     * Number of row partitions.
+     */
+    size_t n_parts;
+
+    /*
+     * Number of rows per partition (the last partition may contain less).
+     */
+    size_t block_size;
+
+    /*
+     * The buckets, where bucket (thread, part) is stored at position
+     * thread*n_parts + part.
+     */
+    std::vector<std::vector<UpdateType>> buckets;
+
+public:
+
+    /*
+     * Default constructor. Creates an empty object.
+     */
+    UpdateBuckets() : n_threads(0), n_parts(0), block_size(1) {}
+
+    /*
+     * Constructor that creates 'n_threads' x 'n_threads' empty buckets for a
+     * graph with 'n_rows' rows.
+     *
+     * @param n_threads The number of threads producing and applying updates.
+     * @param n_rows The number of rows of the graph.
+     */
+    UpdateBuckets(size_t n_threads, size_t n_rows)
+        : n_threads(n_threads)
+        , n_parts(n_threads)
+        , block_size(n_rows / n_threads + 1)
+        , buckets(n_threads * n_threads)
+    {
+    }
+
+    /*
+     * Returns the partition containing row 'idx'.
+     */
+    size_t partition(int idx) const { return idx / block_size; }
+
+    /*
+     * Returns the first row of partition 'part'.
+     */
+    size_t block_start(size_t part) const { return part * block_size; }
+
+    /*
+     * Returns the row following the last row of partition 'part'.
+     */
+    size_t block_end(size_t part, size_t n_rows) const
+    {
+        return std::min((part + 1) * block_size, n_rows);
+    }
+
+    /*
+     * Retrieves the number of row partitions.
+     */
+    size_t nparts() const { return n_parts; }
+
+    /*
+     * Appends an update to the bucket of 'thread' belonging to the partition
+     * of 'update.idx0'.
+     */
+    void push(size_t thread, const UpdateType &update)
+    {
+        buckets[thread * n_parts + partition(update.idx0)].push_back(update);
+    }
+
+    /*
+     * Retrieves the updates generated by 'thread' for partition 'part'.
+     */
+    const std::vector<UpdateType>& get(size_t thread, size_t part) const
+    {
+        return buckets[thread * n_parts + part];
+    }
+
+    /*
+     * Removes all updates while keeping the allocated memory.
+     */
+    void clear()
+    {
+        for (auto &bucket : buckets)
+        {
+            bucket.clear();
+        }
+    }
+
+    /*
+     * Number of bytes allocated by all buckets.
+     */
+    size_t capacity_bytes() const
+    {
+        size_t cnt = 0;
+        for (const auto &bucket : buckets)
+        {
+            cnt += bucket.capacity();
+        }
+        return cnt * sizeof(UpdateType);
+    }
+
+    /*
+     * Total number of updates stored in all buckets.
+     */
+    size_t size() const
+    {
+        size_t cnt = 0;
+        for (const auto &bucket : buckets)
+        {
+            cnt += bucket.size();
+        }
+        return cnt;
+    }
+};
+
+
 /*
  * @brief Prints a NNUpdate object to an output stream.
  */
@@ -6,8 +6,18 @@
 
 
 #include <assert.h>
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <numeric>
+#include <set>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <stdexcept>
 
@@ -64,16 +74,97 @@ void init_random(
 
 
 /*
- * @brief Adds every node to its own neighborhod.
+ * @brief Sorts the rows of the final nearest neighbor graph and stores its
+ * indices and corrected distances.
+ *
+ * All steps are done row by row in one parallel pass, so every row is read
+ * into the cache only once.
+ *
+ * @param current_graph The nearest neighbor graph, sorted afterwards.
+ * @param dist The distance function containing a correction function.
+ * @param add_zero_node Whether every node is first added to its own
+ * neighborhood.
+ * @param indices The indices of the sorted graph.
+ * @param distances The corrected distances of the sorted graph. Kept if it
+ * is a view of external memory of the right shape.
+ * @param n_threads The number of threads to use for parallelization.
  */
-void add_zero_node(
-    HeapList<float> &current_graph
+template<class DistType>
+void finalize_graph(
+    HeapList<float> &current_graph,
+    const DistType &dist,
+    bool add_zero_node,
+    Matrix<int> &indices,
+    Matrix<float> &distances,
+    int n_threads
 )
 {
-    for (size_t idx0 = 0; idx0 < current_graph.nheaps(); ++idx0)
+    size_t n_rows = current_graph.nheaps();
+    size_t n_cols = current_graph.nnodes();
+    indices.resize(n_rows, n_cols);
+    if (distances.nrows() != n_rows || distances.ncols() != n_cols)
+    {
+        distances.resize(n_rows, n_cols);
+    }
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t idx0 = 0; idx0 < n_rows; ++idx0)
+    {
+        if (add_zero_node)
+        {
+            current_graph.checked_push(idx0, idx0, 0.0f, NEW);
+        }
+        current_graph.heapsort(idx0);
+        std::copy(
+            current_graph.indices.begin(idx0),
+            current_graph.indices.end(idx0),
+            indices.begin(idx0)
+        );
+        for (size_t j = 0; j < n_cols; ++j)
+        {
+            distances(idx0, j) = dist.correction(current_graph.keys(idx0, j));
+        }
+    }
+}
+
+
+/*
+ * @brief Applies graph updates to the current nearest neighbor graph.
+ *
+ * Each thread applies the updates of exactly one row partition, so every
+ * thread only reads its own buckets and no row is written concurrently.
+ *
+ * @param current_graph The current nearest neighbor graph.
+ * @param updates The potential graph updates bucketed by the partition of
+ * their destination row 'idx0'.
+ * @param n_threads The number of threads to use for parallelization.
+ *
+ * @return The number of updates applied to the graph.
+ */
+int apply_graph_updates(
+    HeapList<float> &current_graph,
+    const UpdateBuckets<NNUpdate> &updates,
+    int n_threads
+)
+{
+    int n_changes = 0;
+
+    #pragma omp parallel for num_threads(n_threads) reduction(+:n_changes)
+    for (int part = 0; part < (int)updates.nparts(); ++part)
     {
-        current_graph.checked_push(idx0, idx0, 0.0f, NEW);
+        for (int thread = 0; thread < n_threads; ++thread)
+        {
+            for (const auto& update : updates.get(thread, part))
+            {
+                assert(update.idx0 >= 0);
+                assert(update.idx1 >= 0);
+                n_changes += current_graph.checked_push(
+                    update.idx0, update.idx1, update.key, NEW
+                );
+            }
+        }
     }
+
+    return n_changes;
 }
 
 
@@ -89,24 +180,30 @@ void add_zero_node(
  * @param leaf_array The matrix of leaf indices.
  * @param dist The distance function used for nearest neighbor calculations.
  * @param n_threads The number of threads to use for parallelization.
+ * @param workspace The scratch memory holding the update buckets.
+ *
+ * @return The number of distance evaluations.
  */
 template<class MatrixType, class DistType>
-void update_by_leaves(
+size_t update_by_leaves(
     const MatrixType &data,
     HeapList<float> &current_graph,
     Matrix<int> &leaf_array,
     const DistType &dist,
-    int n_threads
+    int n_threads,
+    Workspace &workspace
 )
 {
     int n_leaves = leaf_array.nrows();
     int leaf_size = leaf_array.ncols();
     int block_size = n_leaves / n_threads;
 
-    std::vector<std::vector<NNUpdate>> updates(n_threads);
+    UpdateBuckets<NNUpdate> &updates = workspace.updates;
+    updates.clear();
+    size_t dist_evals = 0;
 
     // Generate leaf updates
-    #pragma omp parallel for
+    #pragma omp parallel for num_threads(n_threads) reduction(+:dist_evals)
     for (int thread = 0; thread < n_threads; ++thread)
     {
         int block_start  = thread * block_size;
@@ -130,43 +227,23 @@ void update_by_leaves(
                         break;
                     }
                     float d = dist(data, idx0, idx1);
-                    if (
-                        (d < current_graph.max(idx0)) ||
-                        (d < current_graph.max(idx1))
-                    )
+                    ++dist_evals;
+                    if (d < current_graph.max(idx0))
                     {
-                        NNUpdate update = {idx0, idx1, d};
-                        updates[thread].push_back(update);
+                        updates.push(thread, {idx0, idx1, d});
+                    }
+                    if (d < current_graph.max(idx1))
+                    {
+                        updates.push(thread, {idx1, idx0, d});
                     }
                 }
             }
         }
     }
 
-    // Apply updates
-    #pragma omp parallel for
-    for (int thread = 0; thread < n_threads; ++thread)
-    {
-        for (const auto& updates_vec : updates)
-        {
-            for (const auto& update : updates_vec)
-            {
-                int idx0 = update.idx0;
-                int idx1 = update.idx1;
-                assert(idx0 >= 0);
-                assert(idx1 >= 0);
-                float d = update.key;
-                if (idx0 % n_threads == thread)
-                {
-                    current_graph.checked_push(idx0, idx1, d, NEW);
-                }
-                if (idx1 % n_threads == thread)
-                {
-                    current_graph.checked_push(idx1, idx0, d, NEW);
-                }
-            }
-        }
-    }
+    workspace.update_high_water_mark();
+    apply_graph_updates(current_graph, updates, n_threads);
+    return dist_evals;
 }
 
 
@@ -176,21 +253,34 @@ void update_by_leaves(
  * For each vertex, the candidate neighbors include any current neighbors and
  * any vertices that have the vertex as one of their nearest neighbors.
  *
+ * The rows are split into one partition per thread. In a first pass every
+ * thread samples the forward candidates of its own rows and buckets the
+ * reverse candidates by the partition of their destination row. In a second
+ * pass every thread applies the reverse candidates of its partition and marks
+ * the sampled new neighbors of its rows as 'OLD'.
+ *
  * @param current_graph The current nearest neighbor graph.
- * @param new_candidates The empty heap of new candidate neighbors.
- * @param old_candidates The empty heap of old candidate neighbors.
+ * @param workspace The scratch memory whose candidate heaps are reset and
+ * filled with the new and old candidate neighbors.
  * @param rng_state The random state used for randomization.
  * @param n_threads The number of threads to use for parallelization.
  */
 void sample_candidates(
     HeapList<float> &current_graph,
-    HeapList<int> &new_candidates,
-    HeapList<int> &old_candidates,
+    Workspace &workspace,
     const RandomState &rng_state,
     int n_threads
 )
 {
-    #pragma omp parallel for
+    size_t n_rows = current_graph.nheaps();
+    HeapList<int> &new_candidates = workspace.new_candidates;
+    HeapList<int> &old_candidates = workspace.old_candidates;
+    UpdateBuckets<CandidateUpdate> &reverse_candidates =
+        workspace.reverse_candidates;
+    reverse_candidates.clear();
+
+    // Sample forward candidates and collect reverse candidates.
+    #pragma omp parallel for num_threads(n_threads)
     for (int thread = 0; thread < n_threads; ++thread)
     {
         RandomState local_rng_state;
@@ -198,9 +288,16 @@ void sample_candidates(
         {
             local_rng_state[state] = rng_state[state] + thread + 1;
         }
-        for (int idx0 = 0; idx0 < (int)current_graph.nheaps(); ++idx0)
+        size_t block_start = reverse_candidates.block_start(thread);
+        size_t block_end = reverse_candidates.block_end(thread, n_rows);
+        for (size_t idx0 = block_start; idx0 < block_end; ++idx0)
+        {
+            new_candidates.reset(idx0, MAX_INT);
+            old_candidates.reset(idx0, MAX_INT);
+        }
+        for (size_t idx0 = block_start; idx0 < block_end; ++idx0)
         {
-            for (int j = 0; j < (int)current_graph.nnodes(); ++j)
+            for (size_t j = 0; j < current_graph.nnodes(); ++j)
             {
                 int idx1 = current_graph.indices(idx0, j);
                 char flag = current_graph.flags(idx0, j);
@@ -214,45 +311,62 @@ void sample_candidates(
                 // of at most 'max_candidates' candidates.
                 int priority = rand_int(local_rng_state);
 
-                if (flag == NEW)
+                HeapList<int> &candidates = (flag == NEW)
+                    ? new_candidates
+                    : old_candidates;
+                candidates.checked_push(idx0, idx1, priority);
+
+                // Reverse nearest neighbours.
+                if ((int)reverse_candidates.partition(idx1) == thread)
                 {
-                    if (idx0 % n_threads == thread)
-                    {
-                        new_candidates.checked_push(idx0, idx1, priority);
-                    }
-                    // Reverse nearest neighbours.
-                    if (idx1 % n_threads == thread)
-                    {
-                        new_candidates.checked_push(idx1, idx0, priority);
-                    }
+                    candidates.checked_push(idx1, idx0, priority);
                 }
                 else
                 {
-                    if (idx0 % n_threads == thread)
-                    {
-                        old_candidates.checked_push(idx0, idx1, priority);
-                    }
-                    // Reverse nearest neighbours.
-                    if (idx1 % n_threads == thread)
-                    {
-                        old_candidates.checked_push(idx1, idx0, priority);
-                    }
+                    reverse_candidates.push(
+                        thread, {idx1, (int)idx0, priority, flag}
+                    );
                 }
             }
         }
     }
-    // Mark sampled nodes in current_graph as 'OLD'.
-    for (size_t idx0 = 0; idx0 < current_graph.nheaps(); ++idx0)
+
+    workspace.update_high_water_mark();
+
+    // Add reverse candidates and mark sampled nodes in current_graph as 'OLD'.
+    #pragma omp parallel for num_threads(n_threads)
+    for (int part = 0; part < n_threads; ++part)
     {
-        for (size_t j = 0; j < current_graph.nnodes(); ++j)
+        for (int thread = 0; thread < n_threads; ++thread)
+        {
+            for (const auto &update : reverse_candidates.get(thread, part))
+            {
+                HeapList<int> &candidates = (update.flag == NEW)
+                    ? new_candidates
+                    : old_candidates;
+                candidates.checked_push(
+                    update.idx0, update.idx1, update.priority
+                );
+            }
+        }
+        size_t block_start = reverse_candidates.block_start(part);
+        size_t block_end = reverse_candidates.block_end(part, n_rows);
+        for (size_t idx0 = block_start; idx0 < block_end; ++idx0)
         {
-            int idx1 = current_graph.indices(idx0, j);
-            for (size_t k = 0; k < new_candidates.nnodes(); ++k)
+            for (size_t j = 0; j < current_graph.nnodes(); ++j)
             {
-                if (new_candidates.indices(idx0, k) == idx1)
+                int idx1 = current_graph.indices(idx0, j);
+                if (idx1 == NONE || current_graph.flags(idx0, j) == OLD)
                 {
-                    current_graph.flags(idx0, j) = OLD;
-                    break;
+                    continue;
+                }
+                for (size_t k = 0; k < new_candidates.nnodes(); ++k)
+                {
+                    if (new_candidates.indices(idx0, k) == idx1)
+                    {
+                        current_graph.flags(idx0, j) = OLD;
+                        break;
+                    }
                 }
             }
         }
@@ -267,133 +381,150 @@ void sample_candidates(
  * objects containing two identifiers that identify nodes and their
  * corresponding distance.
  *
+ * The number of distance evaluations differs considerably between rows.
+ * Therefore the rows are grouped into chunks of roughly equal numbers of
+ * candidate pairs, which are scheduled dynamically over all threads.
+ *
+ * The resulting NNUpdate objects are stored in 'workspace.updates', bucketed
+ * by the partition of their destination row.
+ *
  * @param data The input data matrix.
  * @param current_graph The current nearest neighbor graph.
- * @param new_candidate_neighbors The heap of new candidate neighbors.
- * @param old_candidate_neighbors The heap of old candidate neighbors.
+ * @param workspace The scratch memory containing the heaps of new and old
+ * candidate neighbors.
  * @param dist The distance metric used for calculating distances.
  * @param n_threads The number of threads to use for parallelization.
- *
- * @return A vector of vectors of NNUpdate objects representing the nearest
- * neighbor updates.
+ * @param load Per-thread counters to which the number of distance
+ * evaluations and the time spent are added.
  */
 template<class MatrixType, class DistType>
-std::vector<std::vector<NNUpdate>> generate_graph_updates(
+void generate_graph_updates(
     const MatrixType &data,
     HeapList<float> &current_graph,
-    HeapList<int> &new_candidate_neighbors,
-    HeapList<int> &old_candidate_neighbors,
+    Workspace &workspace,
     const DistType &dist,
-    int n_threads
+    int n_threads,
+    ThreadLoad &load
 )
 {
+    HeapList<int> &new_candidate_neighbors = workspace.new_candidates;
+    HeapList<int> &old_candidate_neighbors = workspace.old_candidates;
     assert(data.nrows() == new_candidate_neighbors.nheaps());
     assert(data.nrows() == old_candidate_neighbors.nheaps());
-    std::vector<std::vector<NNUpdate>> updates(n_threads);
-    int size_new = new_candidate_neighbors.nheaps();
-    int block_size = size_new / 4 + 1;
-    #pragma omp parallel for
-    for (int thread = 0; thread < n_threads; ++thread)
+    UpdateBuckets<NNUpdate> &updates = workspace.updates;
+    updates.clear();
+    size_t size_new = new_candidate_neighbors.nheaps();
+
+    // Number of candidate pairs of each row.
+    std::vector<size_t> &pair_cnt = workspace.pair_cnt;
+    pair_cnt.resize(size_new);
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < size_new; ++i)
+    {
+        size_t n_new = new_candidate_neighbors.size(i);
+        size_t n_old = old_candidate_neighbors.size(i);
+        pair_cnt[i] = n_new * (n_new - 1) / 2 + n_new * n_old + 1;
+    }
+    std::vector<size_t> chunks = balanced_chunks(
+        pair_cnt, n_threads * CHUNKS_PER_THREAD
+    );
+    int n_chunks = chunks.size() - 1;
+
+    #pragma omp parallel num_threads(n_threads)
     {
-        size_t block_start = thread * block_size;
-        size_t block_end = std::min((thread + 1) * block_size, size_new);
-        for (size_t i = block_start; i < block_end; ++i)
+        int thread = omp_get_thread_num();
+
+        // The new candidates of a row followed by its old candidates.
+        std::vector<int> candidates;
+        candidates.reserve(
+            new_candidate_neighbors.nnodes() + old_candidate_neighbors.nnodes()
+        );
+        std::vector<float> distances(candidates.capacity());
+
+        // Prefetches the data of the candidates of row 'i' and their current
+        // distance bounds.
+        auto prefetch_candidates = [&](const HeapList<int> &heaps, size_t i)
         {
-            for (size_t j = 0; j < new_candidate_neighbors.nnodes(); ++j)
+            for (size_t j = 0; j < heaps.nnodes(); ++j)
             {
-                int idx0 = new_candidate_neighbors.indices(i, j);
-                if (idx0 == NONE)
+                int idx = heaps.indices(i, j);
+                if (idx != NONE)
                 {
-                    continue;
+                    dist.prefetch(data, idx);
+                    current_graph.keys.prefetch_row(idx);
                 }
-                for (
-                    size_t k = j + 1; k < new_candidate_neighbors.nnodes(); ++k
-                )
-                {
-                    int idx1 = new_candidate_neighbors.indices(i, k);
-                    if (idx1 == NONE)
-                    {
-                        continue;
-                    }
-                    float d = dist(data, idx0, idx1);
-                    if (
-                        (d < current_graph.max(idx0)) ||
-                        (d < current_graph.max(idx1))
-                    )
-                    {
-                        NNUpdate update = {idx0, idx1, d};
-                        updates[thread].push_back(update);
-                    }
+            }
+        };
+
+        #pragma omp for schedule(dynamic)
+        for (int chunk = 0; chunk < n_chunks; ++chunk)
+        {
+            auto time_start = std::chrono::steady_clock::now();
+            size_t dist_evals = 0;
 
+            for (size_t i = chunks[chunk]; i < chunks[chunk + 1]; ++i)
+            {
+                // Load the rows of the next row's candidates while this
+                // row's distances are evaluated.
+                if (i + 1 < chunks[chunk + 1])
+                {
+                    prefetch_candidates(new_candidate_neighbors, i + 1);
+                    prefetch_candidates(old_candidate_neighbors, i + 1);
                 }
-                for (size_t k = 0; k < old_candidate_neighbors.nnodes(); ++k)
+                candidates.clear();
+                for (size_t j = 0; j < new_candidate_neighbors.nnodes(); ++j)
                 {
-                    int idx1 = old_candidate_neighbors.indices(i, k);
-                    if (idx1 == NONE)
+                    int idx = new_candidate_neighbors.indices(i, j);
+                    if (idx != NONE)
                     {
-                        continue;
+                        candidates.push_back(idx);
                     }
-                    float d = dist(data, idx0, idx1);
-                    if (
-                        (d < current_graph.max(idx0)) ||
-                        (d < current_graph.max(idx1))
-                    )
+                }
+                size_t n_new = candidates.size();
+                for (size_t j = 0; j < old_candidate_neighbors.nnodes(); ++j)
+                {
+                    int idx = old_candidate_neighbors.indices(i, j);
+                    if (idx != NONE)
                     {
-                        NNUpdate update = {idx0, idx1, d};
-                        updates[thread].push_back(update);
+                        candidates.push_back(idx);
                     }
                 }
-            }
-        }
-    }
-
-    return updates;
-}
-
-
-/*
- * @brief Applies graph updates to the current nearest neighbor graph.
- *
- * @param current_graph The current nearest neighbor graph.
- * @param updates A vector of vectors of NNUpdate objects representing the
- * potential graph updates.
- * @param n_threads The number of threads to use for parallelization.
- *
- * @return The number of updates applied to the graph.
- */
-int apply_graph_updates(
-    HeapList<float> &current_graph,
-    const std::vector<std::vector<NNUpdate>> &updates,
-    int n_threads
-)
-{
-    int n_changes = 0;
 
-    #pragma omp parallel for
-    for (int thread = 0; thread < n_threads; ++thread)
-    {
-        for (const auto& updates_vec : updates)
-        {
-            for (const auto& update : updates_vec)
-            {
-                int idx0 = update.idx0;
-                int idx1 = update.idx1;
-                assert(idx0 >= 0);
-                assert(idx1 >= 0);
-                float d = update.key;
-                if (idx0 % n_threads == thread)
-                {
-                    n_changes += current_graph.checked_push(idx0, idx1, d, NEW);
-                }
-                if (idx1 % n_threads == thread)
+                // Compare each new candidate with all subsequent new and all
+                // old candidates in one batch.
+                for (size_t j = 0; j < n_new; ++j)
                 {
-                    n_changes += current_graph.checked_push(idx1, idx0, d, NEW);
+                    int idx0 = candidates[j];
+                    const int *others = candidates.data() + j + 1;
+                    size_t n_others = candidates.size() - j - 1;
+                    dist.one_to_many(
+                        data, idx0, others, n_others, distances.data()
+                    );
+                    dist_evals += n_others;
+                    for (size_t k = 0; k < n_others; ++k)
+                    {
+                        int idx1 = others[k];
+                        float d = distances[k];
+                        if (d < current_graph.max(idx0))
+                        {
+                            updates.push(thread, {idx0, idx1, d});
+                        }
+                        if (d < current_graph.max(idx1))
+                        {
+                            updates.push(thread, {idx1, idx0, d});
+                        }
+                    }
                 }
             }
+
+            std::chrono::duration<double> time_passed =
+                std::chrono::steady_clock::now() - time_start;
+            load.dist_evals[thread] += dist_evals;
+            load.seconds[thread] += time_passed.count();
         }
     }
 
-    return n_changes;
+    workspace.update_high_water_mark();
 }
 
 
@@ -424,6 +555,10 @@ int apply_graph_updates(
   * @param n_threads The number of threads to use for parallelization.
   * @param verbose Flag indicating whether to print progress and diagnostic
   * messages.
+  * @param load Per-thread counters of the local join, which are reset at the
+  * beginning.
+  * @param workspace The scratch memory reused by all iterations.
+  * @param iterations Receives the counters of each iteration.
   */
 template<class MatrixType, class DistType>
 void nn_descent(
@@ -436,10 +571,15 @@ void nn_descent(
     int n_iters,
     float delta,
     int n_threads,
-    bool verbose
+    bool verbose,
+    ThreadLoad &load,
+    Workspace &workspace,
+    std::vector<IterationStats> &iterations
 )
 {
     assert(current_graph.nheaps() == data.nrows());
+    load.reset(n_threads);
+    workspace.init(data.nrows(), max_candidates, n_threads);
 
     log("NN descent for " + std::to_string(n_iters) + " iterations", verbose);
 
@@ -453,31 +593,39 @@ void nn_descent(
             verbose
         );
 
-        HeapList<int> new_candidates(data.nrows(), max_candidates, MAX_INT);
-        HeapList<int> old_candidates(data.nrows(), max_candidates, MAX_INT);
-
+        IterationStats iteration;
+        auto time_start = std::chrono::steady_clock::now();
         sample_candidates(
             current_graph,
-            new_candidates,
-            old_candidates,
+            workspace,
             rng_state,
             n_threads
         );
+        iteration.sample_seconds = seconds_since(time_start);
 
-        std::vector<std::vector<NNUpdate>> updates = generate_graph_updates(
+        time_start = std::chrono::steady_clock::now();
+        size_t dist_evals = load.total_dist_evals();
+        generate_graph_updates(
             data,
             current_graph,
-            new_candidates,
-            old_candidates,
+            workspace,
             dist,
-            n_threads
+            n_threads,
+            load
         );
+        iteration.generate_seconds = seconds_since(time_start);
+        iteration.dist_evals = load.total_dist_evals() - dist_evals;
+        iteration.updates_generated = workspace.updates.size();
 
+        time_start = std::chrono::steady_clock::now();
         int cnt = apply_graph_updates(
             current_graph,
-            updates,
+            workspace.updates,
             n_threads
         );
+        iteration.apply_seconds = seconds_since(time_start);
+        iteration.updates_applied = cnt;
+        iterations.push_back(iteration);
         log("\t\t" + std::to_string(cnt) + " updates applied", verbose);
 
         if (cnt < delta * data.nrows() * n_neighbors)
@@ -490,10 +638,129 @@ void nn_descent(
             break;
         }
     }
+    log("Local join: " + load.summary(), verbose);
+    log(
+        "Workspace high-water mark: "
+            + std::to_string(workspace.high_water_mark / (1 << 20)) + " MB",
+        verbose
+    );
     log("NN descent done.", verbose);
 }
 
 
+void Workspace::init(size_t n_rows, int max_candidates, int n_threads)
+{
+    bool rows_changed = new_candidates.nheaps() != n_rows;
+    if (rows_changed || new_candidates.nnodes() != (size_t)max_candidates)
+    {
+        new_candidates = HeapList<int>(n_rows, max_candidates, MAX_INT);
+        old_candidates = HeapList<int>(n_rows, max_candidates, MAX_INT);
+    }
+    if (rows_changed || reverse_candidates.nparts() != (size_t)n_threads)
+    {
+        reverse_candidates = UpdateBuckets<CandidateUpdate>(n_threads, n_rows);
+        updates = UpdateBuckets<NNUpdate>(n_threads, n_rows);
+    }
+    update_high_water_mark();
+}
+
+
+void Workspace::release()
+{
+    new_candidates = HeapList<int>();
+    old_candidates = HeapList<int>();
+    reverse_candidates = UpdateBuckets<CandidateUpdate>();
+    updates = UpdateBuckets<NNUpdate>();
+    pair_cnt = std::vector<size_t>();
+}
+
+
+size_t Workspace::nbytes() const
+{
+    size_t heap_entries = new_candidates.nheaps() * new_candidates.nnodes()
+        + old_candidates.nheaps() * old_candidates.nnodes();
+    return heap_entries * (sizeof(int) + sizeof(int))
+        + reverse_candidates.capacity_bytes()
+        + updates.capacity_bytes()
+        + pair_cnt.capacity() * sizeof(size_t);
+}
+
+
+size_t ThreadLoad::total_dist_evals() const
+{
+    return std::accumulate(dist_evals.begin(), dist_evals.end(), (size_t)0);
+}
+
+
+std::string ThreadLoad::summary() const
+{
+    size_t total_evals = 0;
+    size_t max_evals = 0;
+    double total_seconds = 0.0;
+    double max_seconds = 0.0;
+    for (size_t i = 0; i < dist_evals.size(); ++i)
+    {
+        total_evals += dist_evals[i];
+        max_evals = std::max(max_evals, dist_evals[i]);
+        total_seconds += seconds[i];
+        max_seconds = std::max(max_seconds, seconds[i]);
+    }
+    double n = dist_evals.size();
+    std::stringstream ss;
+    ss << std::setprecision(3)
+        << total_evals << " distance evaluations on " << n
+        << " threads (imbalance: evaluations="
+        << (total_evals > 0 ? max_evals * n / total_evals : 1.0)
+        << ", time="
+        << (total_seconds > 0.0 ? max_seconds * n / total_seconds : 1.0)
+        << ")";
+    return ss.str();
+}
+
+
+void Stats::reset_queries()
+{
+    n_queries = 0;
+    query_seconds = 0.0;
+    query_dist_evals = 0;
+    visited_histogram.clear();
+    query_budget_hits = 0;
+    adaptive_epsilon = 0.0f;
+}
+
+
+std::string Stats::summary() const
+{
+    std::stringstream ss;
+    ss << std::setprecision(3)
+        << "Forest: " << forest_seconds << " s\n"
+        << "Update by leaves: " << leaves_seconds << " s, "
+        << leaves_dist_evals << " distance evaluations\n";
+    for (size_t i = 0; i < iterations.size(); ++i)
+    {
+        const IterationStats &iteration = iterations[i];
+        ss << "NN-descent iteration " << i + 1 << ": sample "
+            << iteration.sample_seconds << " s, generate "
+            << iteration.generate_seconds << " s, apply "
+            << iteration.apply_seconds << " s, " << iteration.dist_evals
+            << " distance evaluations, " << iteration.updates_applied
+            << " of " << iteration.updates_generated << " updates applied\n";
+    }
+    ss << "Prepare: " << prepare_seconds << " s\n"
+        << "Queries: " << n_queries << " in " << query_seconds << " s, "
+        << query_dist_evals << " distance evaluations, "
+        << query_budget_hits << " stopped at the budget\n"
+        << "Visited nodes per query:";
+    for (size_t i = 0; i < visited_histogram.size(); ++i)
+    {
+        ss << " [" << ((size_t)1 << i) << ", " << ((size_t)1 << (i + 1))
+            << "): " << visited_histogram[i];
+    }
+    ss << "\n";
+    return ss.str();
+}
+
+
 float recall_accuracy(Matrix<int> apx, Matrix<int> ect)
 {
     assert(apx.nrows() == ect.nrows());
@@ -539,6 +806,13 @@ void NNDescent::set_parameters(Parms &parms)
     n_threads = parms.n_threads;
     verbose = parms.verbose;
     algorithm = parms.algorithm;
+    storage = parms.storage;
+    rerank = parms.rerank;
+    reorder = parms.reorder;
+    prepare_on_build = parms.prepare_on_build;
+    cache_norms = parms.cache_norms;
+    numa = parms.numa;
+    pq_subspaces = parms.pq_subspaces;
 
     if (leaf_size == NONE)
     {
@@ -590,6 +864,28 @@ void NNDescent::set_parameters(Parms &parms)
         data.deep_copy();
         data.normalize();
     }
+    if (storage != "float32" && storage != "pq")
+    {
+        // Throws if the storage type is invalid.
+        storage_type(storage);
+    }
+    if (pq_subspaces != NONE && pq_subspaces <= 0)
+    {
+        throw std::invalid_argument(
+            "The number of PQ subspaces must be positive"
+        );
+    }
+    if (
+        reorder != "none" && reorder != "leaves" && reorder != "bfs"
+        && reorder != "rcm"
+    )
+    {
+        throw std::invalid_argument("Invalid reorder method '" + reorder + "'");
+    }
+    if (numa != "none" && numa != "local" && numa != "replicate")
+    {
+        throw std::invalid_argument("Invalid NUMA mode '" + numa + "'");
+    }
     seed_state(rng_state, seed);
     if (verbose)
     {
@@ -598,6 +894,30 @@ void NNDescent::set_parameters(Parms &parms)
 }
 
 
+void NNDescent::finish_build()
+{
+    reorder_points(reorder);
+    if (prepare_on_build || releases_float_data())
+    {
+        prepare();
+    }
+    if (!releases_float_data())
+    {
+        return;
+    }
+    if (
+        quantized_data.nrows() != data_size
+        || quantized_data.type() != storage_type(storage)
+    )
+    {
+        quantized_data = QuantizedMatrix(data, storage_type(storage));
+    }
+    data = Matrix<float>(0, data_dim);
+    data_replicas.clear();
+    log("Released the float32 training data", verbose);
+}
+
+
 NNDescent::NNDescent(Matrix<float> &train_data, Parms &parms)
     : data(train_data)
     , data_size(data.nrows())
@@ -607,6 +927,7 @@ NNDescent::NNDescent(Matrix<float> &train_data, Parms &parms)
     is_sparse = false;
     this->set_parameters(parms);
     this->set_dist_and_start_nn<Matrix<float>>();
+    this->finish_build();
 }
 
 
@@ -619,292 +940,2336 @@ NNDescent::NNDescent(CSRMatrix<float> &train_data, Parms &parms)
     is_sparse = true;
     this->set_parameters(parms);
     this->set_dist_and_start_nn<CSRMatrix<float>>();
+    this->finish_build();
 }
 
 
-template<class MatrixType, class DistType>
-void NNDescent::run_nn_descent(
-    const MatrixType &train_data,
-    const DistType &dist
-)
+HeapList<float> NNDescent::query_heaps(size_t n_queries, int k)
 {
-    if (algorithm == "bf")
+    if (query_indices_out == nullptr)
     {
-        this->start_brute_force(train_data, dist);
-        return;
+        return HeapList<float>(n_queries, k, FLOAT_MAX);
     }
+    Matrix<int> indices(n_queries, k, query_indices_out->m_ptr);
+    Matrix<float> keys(n_queries, k, query_distances_out->m_ptr);
+    std::fill(indices.m_ptr, indices.m_ptr + n_queries*k, NONE);
+    std::fill(keys.m_ptr, keys.m_ptr + n_queries*k, FLOAT_MAX);
+    return HeapList<float>(
+        std::move(indices), std::move(keys), Matrix<char>(0, 0)
+    );
+}
 
-    if (tree_init)
+
+void NNDescent::save(std::ostream &out) const
+{
+    BinaryWriter writer(out);
+    writer.write_header();
+
+    // Parameters
+    writer.write(metric);
+    writer.write(p_metric);
+    writer.write(n_neighbors);
+    writer.write(n_trees);
+    writer.write(leaf_size);
+    writer.write(pruning_degree_multiplier);
+    writer.write(pruning_prob);
+    writer.write(tree_init);
+    writer.write(seed);
+    writer.write(max_candidates);
+    writer.write(n_iters);
+    writer.write(delta);
+    writer.write(n_threads);
+    writer.write(verbose);
+    writer.write(algorithm);
+    writer.write(storage);
+    writer.write(rerank);
+    writer.write(reorder);
+    writer.write(pq_subspaces);
+
+    // Training data
+    writer.write(is_sparse);
+    writer.write(angular_trees);
+    writer.write<uint64_t>(data_size);
+    writer.write<uint64_t>(data_dim);
+    writer.write_array(rng_state, STATE_SIZE);
+    if (is_sparse)
     {
-        log(
-            "Building RP forest with " + std::to_string(n_trees) + " trees",
-            verbose
-        );
+        writer.write(csr_data);
+    }
+    else
+    {
+        writer.write(data);
+    }
+    // The reduced-precision copy, only present if the float32 data was
+    // released.
+    bool released = !has_float_data();
+    writer.write(released);
+    if (released)
+    {
+        writer.write(quantized_data);
+    }
 
-        forest = make_forest(
-            train_data, n_trees, leaf_size, rng_state
-        );
+    // Nearest neighbor graph
+    writer.write(current_graph);
+    writer.write(neighbor_distances);
+    writer.write(point_ids);
 
-        log("Update Graph by  RP forest", verbose);
+    // Search index, only present if the index was prepared, which the build
+    // does by default ('prepare_on_build').
+    bool prepared = search_graph.nnodes() > 0;
+    writer.write(prepared);
+    if (prepared)
+    {
+        writer.write(search_tree);
+        writer.write(search_graph);
+    }
+
+    // Product quantization, only present if it was trained by a query.
+    bool compressed = pq_data.nrows() > 0;
+    writer.write(compressed);
+    if (compressed)
+    {
+        writer.write(pq_data);
+    }
+}
+
+
+void NNDescent::save(const std::string &path) const
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open '" + path + "' for writing");
+    }
+    save(file);
+}
+
+
+/*
+ * @brief Checks that all indices in [first, last) refer to one of 'size'
+ * points, or are NONE if 'allow_none' is set.
+ */
+bool valid_indices(
+    const int *first, const int *last, size_t size, bool allow_none
+)
+{
+    for (const int *it = first; it != last; ++it)
+    {
+        bool in_range = *it >= 0 && (size_t)*it < size;
+        if (!in_range && !(allow_none && *it == NONE))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * @brief Checks that 'ids' is a permutation of 0, ..., size - 1.
+ */
+bool valid_permutation(const std::vector<int> &ids, size_t size)
+{
+    if (ids.size() != size)
+    {
+        return false;
+    }
+    std::vector<char> seen(size, 0);
+    for (int id : ids)
+    {
+        if (id < 0 || (size_t)id >= size || seen[id])
+        {
+            return false;
+        }
+        seen[id] = 1;
+    }
+    return true;
+}
+
+
+void NNDescent::read_index(BinaryReader &reader, NNDescent &nnd)
+{
+    reader.read_header();
+
+    // Parameters
+    reader.read(nnd.metric);
+    reader.read(nnd.p_metric);
+    reader.read(nnd.n_neighbors);
+    reader.read(nnd.n_trees);
+    reader.read(nnd.leaf_size);
+    reader.read(nnd.pruning_degree_multiplier);
+    reader.read(nnd.pruning_prob);
+    reader.read(nnd.tree_init);
+    reader.read(nnd.seed);
+    reader.read(nnd.max_candidates);
+    reader.read(nnd.n_iters);
+    reader.read(nnd.delta);
+    reader.read(nnd.n_threads);
+    reader.read(nnd.verbose);
+    reader.read(nnd.algorithm);
+    reader.read(nnd.storage);
+    reader.read(nnd.rerank);
+    reader.read(nnd.reorder);
+    reader.read(nnd.pq_subspaces);
+    // Not stored, as they do not change the index.
+    nnd.cache_norms = Parms().cache_norms;
+    nnd.numa = Parms().numa;
+
+    // Training data
+    uint64_t data_size, data_dim;
+    reader.read(nnd.is_sparse);
+    reader.read(nnd.angular_trees);
+    reader.read(data_size);
+    reader.read(data_dim);
+    nnd.data_size = data_size;
+    nnd.data_dim = data_dim;
+    reader.read_array(nnd.rng_state, STATE_SIZE);
+    size_t n_rows, n_cols;
+    if (nnd.is_sparse)
+    {
+        reader.read(nnd.csr_data);
+        n_rows = nnd.csr_data.nrows();
+        n_cols = nnd.csr_data.ncols();
+    }
+    else
+    {
+        reader.read(nnd.data);
+        n_rows = nnd.data.nrows();
+        n_cols = nnd.data.ncols();
+    }
+    bool released;
+    reader.read(released);
+    if (released)
+    {
+        reader.read(nnd.quantized_data);
+        // The reduced-precision copy replaces the float32 data.
+        if (
+            !nnd.releases_float_data()
+            || nnd.quantized_data.nrows() != nnd.data_size
+            || nnd.quantized_data.ncols() != nnd.data_dim
+            || nnd.quantized_data.type() != storage_type(nnd.storage)
+        )
+        {
+            throw std::runtime_error(
+                "Inconsistent reduced-precision data in index file"
+            );
+        }
+        n_rows = nnd.data_size;
+    }
+    if (
+        n_rows != nnd.data_size
+        || n_cols != nnd.data_dim
+        || (released && nnd.data.nrows() != 0)
+    )
+    {
+        throw std::runtime_error("Inconsistent training data in index file");
+    }
+
+    // Nearest neighbor graph
+    reader.read(nnd.current_graph);
+    reader.read(nnd.neighbor_distances);
+    reader.read(nnd.point_ids);
+    const Matrix<int> &graph_indices = nnd.current_graph.indices;
+    if (
+        nnd.current_graph.nheaps() != nnd.data_size
+        || !valid_indices(
+            graph_indices.m_ptr,
+            graph_indices.m_ptr + graph_indices.nrows()*graph_indices.ncols(),
+            nnd.data_size,
+            true
+        )
+        || (
+            !nnd.point_ids.empty()
+            && !valid_permutation(nnd.point_ids, nnd.data_size)
+        )
+    )
+    {
+        throw std::runtime_error("Inconsistent graph in index file");
+    }
+    if (nnd.point_ids.empty())
+    {
+        nnd.neighbor_indices = nnd.current_graph.indices;
+    }
+    else
+    {
+        nnd.neighbor_indices = nnd.original_row_order(
+            nnd.current_graph.indices
+        );
+        nnd.to_original_ids(nnd.neighbor_indices);
+    }
+
+    // Search index
+    bool prepared;
+    reader.read(prepared);
+    if (prepared)
+    {
+        reader.read(nnd.search_tree);
+        const FlatRPTree &tree = nnd.search_tree;
+        bool valid_tree = valid_indices(
+            tree.leaf_indices.data(),
+            tree.leaf_indices.data() + tree.leaf_indices.size(),
+            nnd.data_size,
+            false
+        );
+        // Dense hyperplanes are applied to whole query rows.
+        for (
+            size_t i = 0;
+            valid_tree && !nnd.is_sparse && i < tree.nnodes();
+            ++i
+        )
+        {
+            size_t length = tree.hyperplane_ptr[i + 1] - tree.hyperplane_ptr[i];
+            valid_tree = length == 0 || length == nnd.data_dim;
+        }
+        if (!valid_tree)
+        {
+            throw std::runtime_error("Inconsistent search tree in index file");
+        }
+        reader.read(nnd.search_graph);
+        const Matrix<int> &neighbors = nnd.search_graph.indices;
+        if (
+            nnd.search_graph.nnodes() != nnd.data_size
+            || !valid_indices(
+                neighbors.m_ptr,
+                neighbors.m_ptr + neighbors.nrows()*neighbors.ncols(),
+                nnd.data_size,
+                false
+            )
+        )
+        {
+            throw std::runtime_error("Inconsistent search graph in index file");
+        }
+    }
+    else if (released)
+    {
+        // The search index cannot be built without the float32 data.
+        throw std::runtime_error("Missing search graph in index file");
+    }
+
+    // Product quantization
+    bool compressed;
+    reader.read(compressed);
+    if (compressed)
+    {
+        reader.read(nnd.pq_data);
+        if (
+            nnd.pq_data.nrows() != nnd.data_size
+            || nnd.pq_data.ncols() != nnd.data_dim
+        )
+        {
+            throw std::runtime_error(
+                "Inconsistent product quantization in index file"
+            );
+        }
+    }
+}
+
+
+NNDescent NNDescent::load(std::istream &in)
+{
+    NNDescent nnd;
+    BinaryReader reader(in);
+    read_index(reader, nnd);
+    return nnd;
+}
+
+
+NNDescent NNDescent::load(const std::string &path, bool mmap)
+{
+    NNDescent nnd;
+    if (mmap)
+    {
+        nnd.mapped_file = std::make_shared<MappedFile>(path);
+        BinaryReader reader(*nnd.mapped_file);
+        read_index(reader, nnd);
+        return nnd;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open '" + path + "' for reading");
+    }
+    BinaryReader reader(file);
+    read_index(reader, nnd);
+    return nnd;
+}
+
+
+template<class MatrixType, class DistType>
+void NNDescent::run_nn_descent(
+    const MatrixType &train_data,
+    const DistType &dist
+)
+{
+    stats = Stats();
+    ThreadPinning pinning(n_threads, numa != "none");
+    place_on_numa_nodes();
+    if (algorithm == "bf")
+    {
+        this->start_brute_force(train_data, dist);
+        return;
+    }
+    if (numa != "none")
+    {
+        // Allocated here to place the candidate heaps, which are reset row by
+        // row like 'current_graph'. The iterations reuse them.
+        workspace.init(data_size, max_candidates, n_threads);
+        workspace.new_candidates.first_touch(n_threads);
+        workspace.old_candidates.first_touch(n_threads);
+    }
+
+    if (tree_init)
+    {
+        log(
+            "Building RP forest with " + std::to_string(n_trees) + " trees",
+            verbose
+        );
+
+        auto time_start = std::chrono::steady_clock::now();
+        forest = make_forest(
+            train_data, n_trees, leaf_size, rng_state
+        );
+        stats.forest_seconds = seconds_since(time_start);
 
+        log("Update Graph by  RP forest", verbose);
+
+        time_start = std::chrono::steady_clock::now();
         Matrix<int> leaf_array = get_leaves_from_forest(forest);
-        update_by_leaves(
-            train_data, current_graph, leaf_array, dist, n_threads
+        workspace.init(data_size, max_candidates, n_threads);
+        stats.leaves_dist_evals = update_by_leaves(
+            train_data, current_graph, leaf_array, dist, n_threads, workspace
+        );
+        stats.leaves_seconds = seconds_since(time_start);
+    }
+
+    init_random(
+        train_data, current_graph, n_neighbors, dist, rng_state
+    );
+
+    nn_descent(
+        train_data,
+        current_graph,
+        n_neighbors,
+        rng_state,
+        max_candidates,
+        dist,
+        n_iters,
+        delta,
+        n_threads,
+        verbose,
+        local_join_load,
+        workspace,
+        stats.iterations
+    );
+    workspace.release();
+
+    // Make shure every nodes neighborhod contains the node itself.
+    finalize_graph(
+        current_graph,
+        dist,
+        true,
+        neighbor_indices,
+        neighbor_distances,
+        n_threads
+    );
+}
+
+
+/*
+ * @brief The data and graph rows of a shard in 'build_on_disk'.
+ */
+struct Shard
+{
+    /*
+     * The index of the first row of the shard in the whole data.
+     */
+    size_t start;
+
+    Matrix<float> data;
+
+    /*
+     * The graph rows, whose indices refer to the whole data.
+     */
+    HeapList<float> graph;
+};
+
+
+/*
+ * @brief Copies the rows 'start', ..., 'end' - 1 of 'train_data' into a
+ * shard and reads their graph rows from 'graph_file' unless it is null.
+ */
+Shard load_shard(
+    const Matrix<float> &train_data,
+    size_t start,
+    size_t end,
+    bool normalize,
+    const GraphFile *graph_file
+)
+{
+    Shard shard;
+    shard.start = start;
+    shard.data = Matrix<float>(end - start, train_data.ncols());
+    std::copy(
+        train_data.begin(start), train_data.begin(end), shard.data.m_ptr
+    );
+    if (normalize)
+    {
+        shard.data.normalize();
+    }
+    if (graph_file)
+    {
+        shard.graph = HeapList<float>(
+            end - start, graph_file->ncols(), FLOAT_MAX
+        );
+        graph_file->read_rows(start, shard.graph);
+    }
+    return shard;
+}
+
+
+/*
+ * @brief Merges the graph rows of two shards by NN-descent on their union.
+ *
+ * The graph of the pair holds the neighbors within the pair with local
+ * indices. The neighbors in other shards become entries with index 'NONE',
+ * which keep their keys and therefore the heap bounds. As pushes always
+ * replace the largest key, the entries without index left after NN-descent
+ * stand for the nearest neighbors in other shards. The neighbors within the
+ * pair are marked as 'OLD', so the local join starts from the new neighbors
+ * found in the leaves of random projection trees on the union.
+ *
+ * @param first The first shard, whose graph rows are updated.
+ * @param second The second shard, whose graph rows are updated.
+ * @param dist The distance metric used for calculating distances.
+ * @param n_trees The number of random projection trees on the union.
+ * @param leaf_size The maximum number of points in a leaf.
+ * @param rng_state The random state used for randomization.
+ * @param max_candidates The maximum number of candidate neighbors.
+ * @param n_iters The maximum number of NN-descent iterations.
+ * @param delta The value controlling the early abort.
+ * @param n_threads The number of threads to use for parallelization.
+ * @param load Per-thread counters of the local join.
+ * @param workspace The scratch memory of NN-descent.
+ * @param iterations Receives the counters of the NN-descent iterations.
+ */
+template<class DistType>
+void merge_shards(
+    Shard &first,
+    Shard &second,
+    const DistType &dist,
+    int n_trees,
+    int leaf_size,
+    RandomState &rng_state,
+    int max_candidates,
+    int n_iters,
+    float delta,
+    int n_threads,
+    ThreadLoad &load,
+    Workspace &workspace,
+    std::vector<IterationStats> &iterations
+)
+{
+    size_t n_first = first.graph.nheaps();
+    size_t n_pair = n_first + second.graph.nheaps();
+    size_t n_neighbors = first.graph.nnodes();
+
+    Matrix<float> data(n_pair, first.data.ncols());
+    std::copy(
+        first.data.m_ptr, first.data.begin(n_first), data.m_ptr
+    );
+    std::copy(
+        second.data.m_ptr,
+        second.data.begin(n_pair - n_first),
+        data.begin(n_first)
+    );
+
+    auto shard_of = [&](size_t i) -> Shard&
+    {
+        return i < n_first ? first : second;
+    };
+    auto row_of = [&](size_t i) -> size_t
+    {
+        return i < n_first ? i : i - n_first;
+    };
+    auto to_local = [&](int idx) -> int
+    {
+        if (idx == NONE)
+        {
+            return NONE;
+        }
+        for (Shard *shard : {&first, &second})
+        {
+            size_t offset = shard == &first ? 0 : n_first;
+            if (
+                (size_t)idx >= shard->start
+                && (size_t)idx < shard->start + shard->graph.nheaps()
+            )
+            {
+                return (int)(idx - shard->start + offset);
+            }
+        }
+        return NONE;
+    };
+    auto to_global = [&](int idx) -> int
+    {
+        return (int)(shard_of(idx).start + row_of(idx));
+    };
+
+    HeapList<float> graph(n_pair, n_neighbors, FLOAT_MAX, OLD);
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < n_pair; ++i)
+    {
+        const HeapList<float> &rows = shard_of(i).graph;
+        for (size_t j = 0; j < n_neighbors; ++j)
+        {
+            graph.indices(i, j) = to_local(rows.indices(row_of(i), j));
+            graph.keys(i, j) = rows.keys(row_of(i), j);
+        }
+    }
+
+    std::vector<FlatRPTree> forest = make_forest(
+        data, n_trees, leaf_size, rng_state
+    );
+    Matrix<int> leaf_array = get_leaves_from_forest(forest);
+    workspace.init(n_pair, max_candidates, n_threads);
+    update_by_leaves(data, graph, leaf_array, dist, n_threads, workspace);
+
+    nn_descent(
+        data,
+        graph,
+        n_neighbors,
+        rng_state,
+        max_candidates,
+        dist,
+        n_iters,
+        delta,
+        n_threads,
+        false,
+        load,
+        workspace,
+        iterations
+    );
+
+    #pragma omp parallel num_threads(n_threads)
+    {
+        // The neighbors of a row in other shards and the entries without
+        // index of the pair graph, both sorted by key.
+        std::vector<std::pair<float, int>> outside;
+        std::vector<std::pair<float, size_t>> slots;
+
+        #pragma omp for
+        for (size_t i = 0; i < n_pair; ++i)
+        {
+            HeapList<float> &rows = shard_of(i).graph;
+            size_t row = row_of(i);
+            outside.clear();
+            slots.clear();
+            for (size_t j = 0; j < n_neighbors; ++j)
+            {
+                int idx = rows.indices(row, j);
+                if (to_local(idx) == NONE)
+                {
+                    outside.push_back({rows.keys(row, j), idx});
+                }
+                if (graph.indices(i, j) == NONE)
+                {
+                    slots.push_back({graph.keys(i, j), j});
+                }
+            }
+            assert(slots.size() <= outside.size());
+            std::sort(outside.begin(), outside.end());
+            std::sort(slots.begin(), slots.end());
+            for (size_t j = 0; j < n_neighbors; ++j)
+            {
+                int idx = graph.indices(i, j);
+                if (idx != NONE)
+                {
+                    rows.indices(row, j) = to_global(idx);
+                    rows.keys(row, j) = graph.keys(i, j);
+                }
+            }
+            for (size_t m = 0; m < slots.size(); ++m)
+            {
+                rows.indices(row, slots[m].second) = outside[m].second;
+                rows.keys(row, slots[m].second) = outside[m].first;
+            }
+        }
+    }
+}
+
+
+template<class DistType>
+void NNDescent::run_nn_descent_on_disk(
+    const Matrix<float> &train_data,
+    const DistType &dist
+)
+{
+    size_t n_shards = (data_size + shard_size - 1) / shard_size;
+    bool normalize = metric == "dot";
+    GraphFile graph_file(graph_path, data_size, n_neighbors);
+
+    auto load = [&](size_t shard, bool read_graph) -> Shard
+    {
+        size_t start = shard * shard_size;
+        return load_shard(
+            train_data,
+            start,
+            std::min(start + shard_size, data_size),
+            normalize,
+            read_graph ? &graph_file : nullptr
+        );
+    };
+    auto write = [&graph_file](const Shard &shard)
+    {
+        graph_file.write_rows(shard.start, shard.graph);
+    };
+
+    // The next shard is read and the last one written while a shard is
+    // processed. At most one write is pending.
+    std::future<Shard> next;
+    std::future<void> written;
+
+    log(
+        "Building the graphs of " + std::to_string(n_shards) + " shards",
+        verbose
+    );
+    next = std::async(std::launch::async, load, 0, false);
+    for (size_t s = 0; s < n_shards; ++s)
+    {
+        Shard shard = next.get();
+        if (s + 1 < n_shards)
+        {
+            next = std::async(std::launch::async, load, s + 1, false);
+        }
+        HeapList<float> graph(
+            shard.data.nrows(), n_neighbors, FLOAT_MAX, NEW
         );
+        if (tree_init)
+        {
+            std::vector<FlatRPTree> shard_forest = make_forest(
+                shard.data, n_trees, leaf_size, rng_state
+            );
+            Matrix<int> leaf_array = get_leaves_from_forest(shard_forest);
+            workspace.init(graph.nheaps(), max_candidates, n_threads);
+            update_by_leaves(
+                shard.data, graph, leaf_array, dist, n_threads, workspace
+            );
+        }
+        init_random(shard.data, graph, n_neighbors, dist, rng_state);
+        nn_descent(
+            shard.data,
+            graph,
+            n_neighbors,
+            rng_state,
+            max_candidates,
+            dist,
+            n_iters,
+            delta,
+            n_threads,
+            false,
+            local_join_load,
+            workspace,
+            stats.iterations
+        );
+        for (int &idx : graph.indices.m_data)
+        {
+            idx = idx == NONE ? NONE : (int)shard.start + idx;
+        }
+        shard.graph = HeapList<float>(
+            std::move(graph.indices), std::move(graph.keys), Matrix<char>()
+        );
+        if (written.valid())
+        {
+            written.get();
+        }
+        written = std::async(std::launch::async, write, std::move(shard));
+        log(
+            "\t" + std::to_string(s + 1) + "  /  " + std::to_string(n_shards),
+            verbose
+        );
+    }
+
+    log("Merging the graphs of all pairs of shards", verbose);
+    for (size_t s0 = 0; s0 + 1 < n_shards; ++s0)
+    {
+        written.get();
+        Shard first = load(s0, true);
+        next = std::async(std::launch::async, load, s0 + 1, true);
+        for (size_t s1 = s0 + 1; s1 < n_shards; ++s1)
+        {
+            Shard second = next.get();
+            if (written.valid())
+            {
+                written.get();
+            }
+            if (s1 + 1 < n_shards)
+            {
+                next = std::async(std::launch::async, load, s1 + 1, true);
+            }
+            merge_shards(
+                first,
+                second,
+                dist,
+                n_trees,
+                leaf_size,
+                rng_state,
+                max_candidates,
+                n_iters,
+                delta,
+                n_threads,
+                local_join_load,
+                workspace,
+                stats.iterations
+            );
+            written = std::async(
+                std::launch::async, write, std::move(second)
+            );
+        }
+        written.get();
+        written = std::async(std::launch::async, write, std::move(first));
+        log(
+            "\t" + std::to_string(s0 + 1) + "  /  "
+                + std::to_string(n_shards - 1),
+            verbose
+        );
+    }
+    workspace.release();
+
+    // Sort the rows and store the corrected distances instead of the keys.
+    written.get();
+    next = std::async(std::launch::async, load, 0, true);
+    for (size_t s = 0; s < n_shards; ++s)
+    {
+        Shard shard = next.get();
+        if (s + 1 < n_shards)
+        {
+            next = std::async(std::launch::async, load, s + 1, true);
+        }
+        HeapList<float> &graph = shard.graph;
+        #pragma omp parallel for num_threads(n_threads)
+        for (size_t i = 0; i < graph.nheaps(); ++i)
+        {
+            // Make shure every nodes neighborhod contains the node itself.
+            graph.checked_push(i, shard.start + i, 0.0f);
+            graph.heapsort(i);
+        }
+        correct_distances(dist, graph.keys, graph.keys, n_threads);
+        if (written.valid())
+        {
+            written.get();
+        }
+        written = std::async(std::launch::async, write, std::move(shard));
+    }
+    written.get();
+    log("Graph written to '" + graph_path + "'", verbose);
+}
+
+
+template<class DistType>
+void NNDescent::run_nn_descent_on_disk(
+    const CSRMatrix<float> &,
+    const DistType &
+)
+{
+    throw std::invalid_argument("The build on disk requires dense data");
+}
+
+
+void NNDescent::build_on_disk(
+    const Matrix<float> &train_data,
+    Parms &parms,
+    size_t shard_size,
+    const std::string &path
+)
+{
+    if (shard_size == 0)
+    {
+        throw std::invalid_argument("'shard_size' must be positive");
+    }
+    if (parms.storage != "float32" || parms.algorithm != "nnd")
+    {
+        throw std::invalid_argument(
+            "The build on disk requires storage 'float32' and algorithm 'nnd'"
+        );
+    }
+    NNDescent nnd;
+    nnd.is_sparse = false;
+    nnd.data_dim = train_data.ncols();
+
+    // The defaults derived from the data size are chosen for one shard. The
+    // training data is set afterwards, so it is not copied for 'dot'.
+    nnd.data_size = std::min(shard_size, train_data.nrows());
+    nnd.set_parameters(parms);
+    nnd.data = Matrix<float>(
+        train_data.nrows(), train_data.ncols(), train_data.m_ptr
+    );
+    nnd.data_size = train_data.nrows();
+    nnd.shard_size = shard_size;
+    nnd.graph_path = path;
+    nnd.set_dist_and_start_nn<Matrix<float>>(Task::BUILD_ON_DISK);
+}
+
+
+NNDescent NNDescent::merge(
+    const std::vector<const NNDescent*> &shards,
+    Parms &parms
+)
+{
+    if (shards.empty())
+    {
+        throw std::invalid_argument("No shards to merge");
+    }
+    NNDescent nnd;
+    nnd.is_sparse = shards[0]->is_sparse;
+    nnd.data_dim = shards[0]->data_dim;
+    nnd.data_size = 0;
+    for (const NNDescent *shard_ptr : shards)
+    {
+        const NNDescent &shard = *shard_ptr;
+        if (
+            shard.is_sparse != nnd.is_sparse
+            || shard.data_dim != nnd.data_dim
+            || shard.metric != parms.metric
+        )
+        {
+            throw std::invalid_argument(
+                "The shards must be built with the same metric on data of "
+                "the same type and dimension"
+            );
+        }
+        if (shard.current_graph.nheaps() != shard.data_size)
+        {
+            throw std::invalid_argument(
+                "Every shard must have a nearest neighbor graph of all its "
+                "training data"
+            );
+        }
+        if (!shard.has_float_data())
+        {
+            throw std::invalid_argument(
+                "Shards which released their float32 training data cannot "
+                "be merged"
+            );
+        }
+        if (nnd.is_sparse)
+        {
+            nnd.csr_data.append(shard.csr_data);
+        }
+        else
+        {
+            nnd.data.append(shard.data);
+        }
+        nnd.data_size += shard.data_size;
+    }
+    nnd.set_parameters(parms);
+
+    // Without trees only the nearest half of the neighbors is taken over, and
+    // the random initialization adds neighbors from other shards.
+    char flag0 = nnd.tree_init ? OLD : NEW;
+    size_t n_kept = nnd.tree_init ? nnd.n_neighbors : nnd.n_neighbors / 2;
+    nnd.current_graph = HeapList<float>(
+        nnd.data_size, nnd.n_neighbors, FLOAT_MAX, flag0
+    );
+    size_t offset = 0;
+    for (const NNDescent *shard : shards)
+    {
+        // The rows are sorted by 'heapsort'.
+        const HeapList<float> &graph = shard->current_graph;
+        #pragma omp parallel for num_threads(nnd.n_threads)
+        for (size_t i = 0; i < graph.nheaps(); ++i)
+        {
+            for (size_t j = 0; j < std::min(n_kept, graph.nnodes()); ++j)
+            {
+                int idx = graph.indices(i, j);
+                if (idx != NONE)
+                {
+                    nnd.current_graph.checked_push(
+                        offset + i, offset + idx, graph.keys(i, j), flag0
+                    );
+                }
+            }
+        }
+        offset += shard->data_size;
+    }
+
+    // The rows of reordered shards keep their order, so the merged index is
+    // reordered as well.
+    bool reordered = false;
+    for (const NNDescent *shard : shards)
+    {
+        reordered = reordered || !shard->point_ids.empty();
+    }
+    if (reordered)
+    {
+        offset = 0;
+        for (const NNDescent *shard : shards)
+        {
+            for (size_t i = 0; i < shard->data_size; ++i)
+            {
+                nnd.point_ids.push_back(offset + shard->original_id(i));
+            }
+            offset += shard->data_size;
+        }
+    }
+
+    if (nnd.is_sparse)
+    {
+        nnd.set_dist_and_start_nn<CSRMatrix<float>>();
+    }
+    else
+    {
+        nnd.set_dist_and_start_nn<Matrix<float>>();
+    }
+    if (reordered)
+    {
+        nnd.neighbor_indices = nnd.original_row_order(nnd.neighbor_indices);
+        nnd.to_original_ids(nnd.neighbor_indices);
+        nnd.neighbor_distances = nnd.original_row_order(
+            nnd.neighbor_distances
+        );
+    }
+    nnd.finish_build();
+    return nnd;
+}
+
+
+/*
+ * @brief Selects the neighbors of node 'i' that are kept by the pruning of
+ * long edges.
+ *
+ * @param data The input data matrix.
+ * @param graph The k-nearest neighbor graph with sorted rows.
+ * @param i The index of the node.
+ * @param rng_state Random number generator state.
+ * @param dist The distance metric used for pruning.
+ * @param pruning_prob The probability of pruning a long edge.
+ * @param new_indices Receives the indices of the kept neighbors.
+ * @param new_keys Receives the keys of the kept neighbors.
+ */
+template<class MatrixType, class DistType>
+void prune_long_edges_of_node(
+    const MatrixType &data,
+    const HeapList<float> &graph,
+    size_t i,
+    RandomState &rng_state,
+    const DistType &dist,
+    float pruning_prob,
+    std::vector<int> &new_indices,
+    std::vector<float> &new_keys
+)
+{
+    new_indices.clear();
+    new_keys.clear();
+    // First element is node itself and can be pruned.
+    for (size_t j = 1; j < graph.nnodes(); ++j)
+    {
+        int idx = graph.indices(i, j);
+        float key = graph.keys(i, j);
+        if  (idx == NONE)
+        {
+            continue;
+        }
+
+        bool add_node = true;
+
+        for (size_t k = 0; k < new_indices.size(); ++k)
+        {
+            int new_idx = new_indices[k];
+            float new_key = new_keys[k];
+            float d = dist(data, idx, new_idx);
+            if (new_key > FLOAT_EPS && d < key)
+            {
+                // idx is closer to a node in the neighborhood than
+                // to the central node i, i.e. it is a long edge.
+                if (rand_float(rng_state) < pruning_prob)
+                {
+                    add_node = false;
+                    break;
+                }
+
+
+            }
+        }
+        if (add_node)
+        {
+            new_indices.push_back(idx);
+            new_keys.push_back(key);
+        }
+    }
+}
+
+
+/*
+ * @brief Prune long edges in the graph.
+ *
+ * This function prunes long edges in the graph, which are edges that are
+ * closer to a node's neighbor than to the node itself. It helps to improve
+ * the efficiency of the k-nearest neighbor graph query search. The kept
+ * neighbors of node i are written to the first pruned_sizes[i] columns of
+ * row i of 'pruned_indices' and 'pruned_keys'. Every thread uses its own
+ * random state and buffers.
+ *
+ * @param data The input data matrix.
+ * @param graph The k-nearest neighbor graph with sorted rows.
+ * @param rng_state Random number generator state.
+ * @param dist The distance metric used for pruning.
+ * @param n_threads The number of threads to use for parallelization.
+ * @param pruning_prob The probability of pruning a long edge.
+ * @param pruned_indices Receives the indices of the kept neighbors.
+ * @param pruned_keys Receives the keys of the kept neighbors.
+ * @param pruned_sizes Receives the number of kept neighbors of each node.
+ */
+template<class MatrixType, class DistType>
+void prune_long_edges(
+    const MatrixType &data,
+    const HeapList<float> &graph,
+    const RandomState &rng_state,
+    const DistType &dist,
+    int n_threads,
+    float pruning_prob,
+    Matrix<int> &pruned_indices,
+    Matrix<float> &pruned_keys,
+    std::vector<int> &pruned_sizes
+)
+{
+    pruned_indices = Matrix<int>(graph.nheaps(), graph.nnodes());
+    pruned_keys = Matrix<float>(graph.nheaps(), graph.nnodes());
+    pruned_sizes.resize(graph.nheaps());
+    #pragma omp parallel num_threads(n_threads)
+    {
+        RandomState local_rng_state;
+        for (int state = 0; state < STATE_SIZE; ++state)
+        {
+            local_rng_state[state] = rng_state[state]
+                + omp_get_thread_num() + 1;
+        }
+        std::vector<int> new_indices;
+        std::vector<float> new_keys;
+        new_indices.reserve(graph.nnodes());
+        new_keys.reserve(graph.nnodes());
+        #pragma omp for
+        for (size_t i = 0; i < graph.nheaps(); ++i)
+        {
+            prune_long_edges_of_node(
+                data,
+                graph,
+                i,
+                local_rng_state,
+                dist,
+                pruning_prob,
+                new_indices,
+                new_keys
+            );
+            std::copy(
+                new_indices.begin(), new_indices.end(), pruned_indices.begin(i)
+            );
+            std::copy(new_keys.begin(), new_keys.end(), pruned_keys.begin(i));
+            pruned_sizes[i] = new_indices.size();
+        }
+    }
+}
+
+
+/*
+ * @brief An edge of a graph given by the target node and the key.
+ */
+typedef std::pair<int, float> Edge;
+
+
+/*
+ * @brief Keeps the 'n_edges' closest distinct targets of 'edges'.
+ *
+ * A target occurring several times keeps its smallest key. The result is
+ * sorted by increasing key, where ties are broken by the target, so it does
+ * not depend on the order of the input.
+ */
+void keep_closest_edges(std::vector<Edge> &edges, size_t n_edges)
+{
+    std::sort(edges.begin(), edges.end());
+    edges.erase(
+        std::unique(
+            edges.begin(),
+            edges.end(),
+            [](const Edge &a, const Edge &b) { return a.first == b.first; }
+        ),
+        edges.end()
+    );
+    size_t n_kept = std::min(n_edges, edges.size());
+    std::partial_sort(
+        edges.begin(),
+        edges.begin() + n_kept,
+        edges.end(),
+        [](const Edge &a, const Edge &b)
+        {
+            return a.second < b.second
+                || (a.second == b.second && a.first < b.first);
+        }
+    );
+    edges.resize(n_kept);
+}
+
+
+/*
+ * @brief Merges a graph with its transpose.
+ *
+ * The adjacency list of node i holds the 'n_cols' closest distinct nodes
+ * among the neighbors of i and the nodes having i as neighbor. The reverse
+ * edges are grouped by a counting sort into a compressed sparse row layout,
+ * so all steps run in parallel.
+ *
+ * @param indices The neighbor indices, row i holding sizes[i] edges.
+ * @param keys The keys of the edges.
+ * @param sizes The number of edges of each node.
+ * @param n_cols The maximum number of neighbors in the result.
+ * @param n_threads The number of threads to use for parallelization.
+ *
+ * @return The symmetrized graph with adjacency lists sorted by key.
+ */
+CSRGraph symmetrize_graph(
+    const Matrix<int> &indices,
+    const Matrix<float> &keys,
+    const std::vector<int> &sizes,
+    size_t n_cols,
+    int n_threads
+)
+{
+    size_t n_rows = indices.nrows();
+
+    // Count the reverse edges of each node.
+    std::vector<size_t> reverse_ptr(n_rows + 1, 0);
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < n_rows; ++i)
+    {
+        for (int j = 0; j < sizes[i]; ++j)
+        {
+            #pragma omp atomic
+            ++reverse_ptr[indices(i, j) + 1];
+        }
+    }
+    std::partial_sum(
+        reverse_ptr.begin(), reverse_ptr.end(), reverse_ptr.begin()
+    );
+
+    // Scatter the reverse edges into the rows of their targets.
+    std::vector<size_t> reverse_end(reverse_ptr.begin(), reverse_ptr.end() - 1);
+    std::vector<int> reverse_indices(reverse_ptr[n_rows]);
+    std::vector<float> reverse_keys(reverse_ptr[n_rows]);
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < n_rows; ++i)
+    {
+        for (int j = 0; j < sizes[i]; ++j)
+        {
+            int idx = indices(i, j);
+            size_t pos;
+            #pragma omp atomic capture
+            pos = reverse_end[idx]++;
+            reverse_indices[pos] = i;
+            reverse_keys[pos] = keys(i, j);
+        }
+    }
+
+    // Merge the forward and reverse edges of each node into padded rows.
+    Matrix<int> rows(n_rows, n_cols);
+    Matrix<size_t> offsets(n_rows + 1, 1);
+    offsets(0, 0) = 0;
+    #pragma omp parallel num_threads(n_threads)
+    {
+        std::vector<Edge> edges;
+        #pragma omp for schedule(dynamic, 64)
+        for (size_t i = 0; i < n_rows; ++i)
+        {
+            edges.clear();
+            for (int j = 0; j < sizes[i]; ++j)
+            {
+                edges.push_back(Edge(indices(i, j), keys(i, j)));
+            }
+            for (size_t pos = reverse_ptr[i]; pos < reverse_ptr[i + 1]; ++pos)
+            {
+                edges.push_back(Edge(reverse_indices[pos], reverse_keys[pos]));
+            }
+            keep_closest_edges(edges, n_cols);
+            for (size_t j = 0; j < edges.size(); ++j)
+            {
+                rows(i, j) = edges[j].first;
+            }
+            offsets(i + 1, 0) = edges.size();
+        }
+    }
+
+    // Compact the rows.
+    std::partial_sum(
+        offsets.m_ptr, offsets.m_ptr + n_rows + 1, offsets.m_ptr
+    );
+    Matrix<int> adjacency(offsets(n_rows, 0), 1);
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < n_rows; ++i)
+    {
+        std::copy(
+            rows.begin(i),
+            rows.begin(i) + (offsets(i + 1, 0) - offsets(i, 0)),
+            adjacency.m_ptr + offsets(i, 0)
+        );
+    }
+    return CSRGraph(std::move(offsets), std::move(adjacency));
+}
+
+
+/*
+ * @brief Returns 'graph' extended to 'n_nodes' nodes, where the adjacency
+ * list of node rows[i] is replaced by the targets of edges[i]. The other new
+ * nodes have no neighbors.
+ *
+ * @param rows The replaced nodes in ascending order.
+ */
+CSRGraph replace_adjacency_lists(
+    const CSRGraph &graph,
+    size_t n_nodes,
+    const std::vector<int> &rows,
+    const std::vector<std::vector<Edge>> &edges
+)
+{
+    Matrix<size_t> offsets(n_nodes + 1, 1);
+    offsets(0, 0) = 0;
+    for (size_t i = 0, r = 0; i < n_nodes; ++i)
+    {
+        size_t degree = i < graph.nnodes() ? graph.degree(i) : 0;
+        if (r < rows.size() && (size_t)rows[r] == i)
+        {
+            degree = edges[r].size();
+            ++r;
+        }
+        offsets(i + 1, 0) = offsets(i, 0) + degree;
+    }
+    Matrix<int> indices(offsets(n_nodes, 0), 1);
+    // The unchanged lists between two replaced nodes are copied at once.
+    size_t first = 0;
+    for (size_t r = 0; r <= rows.size(); ++r)
+    {
+        size_t last = r < rows.size() ? rows[r] : n_nodes;
+        last = std::min(last, graph.nnodes());
+        if (first < last)
+        {
+            std::copy(
+                graph.begin(first),
+                graph.end(last - 1),
+                indices.m_ptr + offsets(first, 0)
+            );
+        }
+        if (r < rows.size())
+        {
+            int *out = indices.m_ptr + offsets(rows[r], 0);
+            for (const Edge &edge : edges[r])
+            {
+                *out++ = edge.first;
+            }
+            first = rows[r] + 1;
+        }
+    }
+    return CSRGraph(std::move(offsets), std::move(indices));
+}
+
+
+template<class DistType>
+void NNDescent::prepare(const DistType &dist)
+{
+    auto time_start = std::chrono::steady_clock::now();
+    ThreadPinning pinning(n_threads, numa != "none");
+    // Make a search tree if necessary.
+    if (forest.size() == 0)
+    {
+        if (is_sparse)
+        {
+            forest = make_forest(
+                csr_data, 1, leaf_size, rng_state
+            );
+        }
+        else
+        {
+            forest = make_forest(
+                data, 1, leaf_size, rng_state
+            );
+        }
+    }
+    // The trees are very close in their performance, so the first is selected.
+    search_tree = forest[0];
+
+    Matrix<int> pruned_indices;
+    Matrix<float> pruned_keys;
+    std::vector<int> pruned_sizes;
+    if (is_sparse)
+    {
+        prune_long_edges(
+            csr_data,
+            current_graph,
+            rng_state,
+            dist,
+            n_threads,
+            pruning_prob,
+            pruned_indices,
+            pruned_keys,
+            pruned_sizes
+        );
+    }
+    else
+    {
+        prune_long_edges(
+            data,
+            current_graph,
+            rng_state,
+            dist,
+            n_threads,
+            pruning_prob,
+            pruned_indices,
+            pruned_keys,
+            pruned_sizes
+        );
+    }
+
+    if (verbose)
+    {
+        size_t edges_cnt_before = current_graph.indices.nrows()
+            * current_graph.indices.ncols();
+        size_t edges_cnt_after = std::accumulate(
+            pruned_sizes.begin(), pruned_sizes.end(), (size_t)0
+        );
+        log(
+            "Forward graph pruning reduced edges from "
+                + std::to_string(edges_cnt_before)
+                + " to "
+                + std::to_string(edges_cnt_after)
+        );
+    }
+
+    size_t n_search_cols = std::round(n_neighbors * pruning_degree_multiplier);
+    search_graph = symmetrize_graph(
+        pruned_indices, pruned_keys, pruned_sizes, n_search_cols, n_threads
+    );
+    graph_replicas.clear();
+    data_replicas.clear();
+    if (numa != "none")
+    {
+        search_graph.first_touch(n_threads);
+    }
+
+    if (verbose)
+    {
+        log(
+            "Merging pruned graph with its transpose results in "
+                + std::to_string(search_graph.nedges())
+                + " edges for the search graph ("
+                + std::to_string(search_graph.nbytes() / (1 << 20))
+                + " MB)."
+        );
+    }
+    stats.prepare_seconds = seconds_since(time_start);
+}
+
+
+void NNDescent::prepare()
+{
+    if (search_graph.nnodes() > 0 || algorithm == "bf")
+    {
+        return;
+    }
+    if (is_sparse)
+    {
+        set_dist_and_start_nn<CSRMatrix<float>>(Task::PREPARE);
+    }
+    else
+    {
+        set_dist_and_start_nn<Matrix<float>>(Task::PREPARE);
+    }
+}
+
+
+/*
+ * @brief Pushes into a graph whose rows were sorted by 'heapsort'.
+ *
+ * A row is restored to heap order before the first push into it, and only
+ * these rows are sorted again by 'sort', so the cost is proportional to the
+ * number of changed rows.
+ */
+class SortedGraphUpdater
+{
+private:
+
+    HeapList<float> &graph;
+
+    /*
+     * The rows in heap order.
+     */
+    std::unordered_set<int> heap_rows;
+
+public:
+
+    explicit SortedGraphUpdater(HeapList<float> &graph) : graph(graph) {}
+
+    /*
+     * @brief Marks the empty row 'i' as being in heap order.
+     */
+    void add_empty_row(int i) { heap_rows.insert(i); }
+
+    /*
+     * @brief Returns the maximum key of row 'i' in either order.
+     */
+    float max(int i) const
+    {
+        return heap_rows.count(i)
+            ? graph.keys(i, 0)
+            : graph.keys(i, graph.nnodes() - 1);
+    }
+
+    /*
+     * @brief Pushes a node with flag 'NEW' (if the graph has flags) into row
+     * 'i' unless it is already contained or too far.
+     *
+     * @return 1 if the node was added to the row, 0 otherwise.
+     */
+    int push(int i, int idx, float key)
+    {
+        if (key >= max(i))
+        {
+            return 0;
+        }
+        if (heap_rows.insert(i).second)
+        {
+            // The old neighbors have already been joined.
+            graph.restore_heap(i, OLD);
+        }
+        return graph.noflags()
+            ? graph.checked_push(i, idx, key)
+            : graph.checked_push(i, idx, key, NEW);
+    }
+
+    /*
+     * @brief Sorts all rows in heap order and returns their indices in
+     * ascending order.
+     */
+    std::vector<int> sort()
+    {
+        std::vector<int> rows(heap_rows.begin(), heap_rows.end());
+        std::sort(rows.begin(), rows.end());
+        for (int i : rows)
+        {
+            graph.heapsort(i);
+        }
+        heap_rows.clear();
+        return rows;
+    }
+};
+
+
+/*
+ * @brief Performs NN-descent iterations restricted to a set of active nodes.
+ *
+ * The candidates of an active node are its neighbors and the active nodes
+ * having it as neighbor. Nodes whose neighborhoods change become the active
+ * nodes of the next iteration, so the cost is proportional to the number of
+ * changed nodes instead of the size of the graph.
+ *
+ * @param data The input data matrix.
+ * @param graph_updater The updater of 'graph' with which all updates are
+ * pushed.
+ * @param graph The nearest neighbor graph.
+ * @param active The initially active nodes.
+ * @param n_neighbors The number of neighbors of each node.
+ * @param max_candidates The maximum number of candidate neighbors of a node.
+ * @param dist The metric used for distance computation.
+ * @param n_iters The maximum number of iterations.
+ * @param delta The value controlling the early abort.
+ * @param n_threads The number of threads to use for parallelization.
+ * @param verbose Flag indicating whether to print progress messages.
+ */
+template<class MatrixType, class DistType>
+void local_nn_descent(
+    const MatrixType &data,
+    SortedGraphUpdater &graph_updater,
+    HeapList<float> &graph,
+    std::vector<int> active,
+    int n_neighbors,
+    int max_candidates,
+    const DistType &dist,
+    int n_iters,
+    float delta,
+    int n_threads,
+    bool verbose
+)
+{
+    for (int iter = 0; iter < n_iters && !active.empty(); ++iter)
+    {
+        size_t n_active = active.size();
+        std::unordered_map<int, size_t> position;
+        for (size_t i = 0; i < n_active; ++i)
+        {
+            position[active[i]] = i;
+        }
+
+        // Collect the new and old candidates of the active nodes.
+        std::vector<std::vector<int>> new_candidates(n_active);
+        std::vector<std::vector<int>> old_candidates(n_active);
+        for (size_t i = 0; i < n_active; ++i)
+        {
+            int idx0 = active[i];
+            for (size_t j = 0; j < graph.nnodes(); ++j)
+            {
+                int idx1 = graph.indices(idx0, j);
+                if (idx1 == NONE)
+                {
+                    continue;
+                }
+                bool is_new = graph.flags(idx0, j) == NEW;
+                std::vector<int> &candidates = is_new
+                    ? new_candidates[i]
+                    : old_candidates[i];
+                if (candidates.size() < (size_t)max_candidates)
+                {
+                    candidates.push_back(idx1);
+                    if (is_new)
+                    {
+                        graph.flags(idx0, j) = OLD;
+                    }
+                }
+
+                // Reverse nearest neighbours.
+                auto it = position.find(idx1);
+                if (it != position.end() && idx1 != idx0)
+                {
+                    std::vector<int> &reverse = is_new
+                        ? new_candidates[it->second]
+                        : old_candidates[it->second];
+                    if (reverse.size() < (size_t)max_candidates)
+                    {
+                        reverse.push_back(idx0);
+                    }
+                }
+            }
+        }
+
+        // Local join of the candidates.
+        std::vector<std::vector<NNUpdate>> updates(n_threads);
+        #pragma omp parallel num_threads(n_threads)
+        {
+            int thread = omp_get_thread_num();
+            std::vector<int> candidates;
+            std::vector<float> distances;
+
+            #pragma omp for schedule(dynamic)
+            for (size_t i = 0; i < n_active; ++i)
+            {
+                candidates = new_candidates[i];
+                std::sort(candidates.begin(), candidates.end());
+                candidates.erase(
+                    std::unique(candidates.begin(), candidates.end()),
+                    candidates.end()
+                );
+                size_t n_new = candidates.size();
+                for (int idx : old_candidates[i])
+                {
+                    if (
+                        !std::binary_search(
+                            candidates.begin(),
+                            candidates.begin() + n_new,
+                            idx
+                        )
+                    )
+                    {
+                        candidates.push_back(idx);
+                    }
+                }
+                distances.resize(candidates.size());
+                for (size_t j = 0; j < n_new; ++j)
+                {
+                    int idx0 = candidates[j];
+                    const int *others = candidates.data() + j + 1;
+                    size_t n_others = candidates.size() - j - 1;
+                    dist.one_to_many(
+                        data, idx0, others, n_others, distances.data()
+                    );
+                    for (size_t k = 0; k < n_others; ++k)
+                    {
+                        int idx1 = others[k];
+                        float d = distances[k];
+                        if (d < graph_updater.max(idx0))
+                        {
+                            updates[thread].push_back({idx0, idx1, d});
+                        }
+                        if (d < graph_updater.max(idx1))
+                        {
+                            updates[thread].push_back({idx1, idx0, d});
+                        }
+                    }
+                }
+            }
+        }
+
+        // Apply the updates and activate the changed nodes.
+        std::unordered_set<int> changed;
+        int cnt = 0;
+        for (const auto &thread_updates : updates)
+        {
+            for (const auto &update : thread_updates)
+            {
+                if (graph_updater.push(update.idx0, update.idx1, update.key))
+                {
+                    changed.insert(update.idx0);
+                    ++cnt;
+                }
+            }
+        }
+        log(
+            "\t" + std::to_string(iter + 1) + ": " + std::to_string(cnt)
+                + " updates applied to " + std::to_string(n_active)
+                + " active nodes",
+            verbose
+        );
+        active.assign(changed.begin(), changed.end());
+        std::sort(active.begin(), active.end());
+        if (cnt < delta * n_active * n_neighbors)
+        {
+            break;
+        }
+    }
+}
+
+
+/*
+ * @brief Appends 'new_data' to the dense training data, normalized for the
+ * dot product like the training data.
+ */
+void append_training_data(
+    Matrix<float> &train_data,
+    const Matrix<float> &new_data,
+    const std::string &metric
+)
+{
+    size_t n_old = train_data.nrows();
+    train_data.append(new_data);
+    if (metric == "dot")
+    {
+        Matrix<float> new_rows(
+            new_data.nrows(), new_data.ncols(), train_data.begin(n_old)
+        );
+        new_rows.normalize();
+    }
+}
+
+
+/*
+ * @brief Appends 'new_data' to the sparse training data.
+ */
+void append_training_data(
+    CSRMatrix<float> &train_data,
+    const CSRMatrix<float> &new_data,
+    const std::string &
+)
+{
+    train_data.append(new_data);
+}
+
+
+template<class MatrixType, class DistType>
+void NNDescent::add_points(
+    MatrixType &train_data,
+    const MatrixType &new_data,
+    DistType &dist
+)
+{
+    if (algorithm == "bf")
+    {
+        throw std::invalid_argument(
+            "Points can only be added to an index built with algorithm 'nnd'"
+        );
+    }
+    size_t n_old = data_size;
+    size_t n_new = new_data.nrows();
+    if (n_new == 0)
+    {
+        return;
+    }
+    log("Add " + std::to_string(n_new) + " points", verbose);
+
+    // Seed the neighbors by querying the index without budget, which
+    // prepares the search graph if necessary. The results of the last query
+    // are kept.
+    Matrix<int> saved_indices = std::move(query_indices);
+    Matrix<float> saved_distances = std::move(query_distances);
+    std::vector<uint8_t> saved_truncated = std::move(query_truncated);
+    QueryBudget saved_budget = query_budget;
+    query_budget = QueryBudget();
+    int k = std::min((size_t)n_neighbors, n_old);
+    try
+    {
+        query(train_data, new_data, dist, k, DEFAULT_EPSILON);
+    }
+    catch (...)
+    {
+        query_budget = saved_budget;
+        throw;
+    }
+    query_budget = saved_budget;
+    Matrix<int> seeds = std::move(query_indices);
+    query_indices = std::move(saved_indices);
+    query_distances = std::move(saved_distances);
+    query_truncated = std::move(saved_truncated);
+
+    append_training_data(train_data, new_data, metric);
+    data_size = train_data.nrows();
+    if (!point_ids.empty())
+    {
+        for (size_t i = n_old; i < data_size; ++i)
+        {
+            point_ids.push_back(i);
+        }
+    }
+    if (current_graph.noflags())
+    {
+        current_graph.flags = Matrix<char>(n_old, current_graph.nnodes(), OLD);
+    }
+    current_graph.add_heaps(n_new, FLOAT_MAX, NEW);
+
+    // Connect the new points with their seeds in both directions.
+    SortedGraphUpdater graph_updater(current_graph);
+    std::vector<int> active;
+    for (size_t i = n_old; i < data_size; ++i)
+    {
+        graph_updater.add_empty_row(i);
+        graph_updater.push(i, i, 0.0f);
+        active.push_back(i);
+    }
+    std::vector<float> seed_distances(seeds.ncols());
+    for (size_t i = 0; i < n_new; ++i)
+    {
+        int idx0 = n_old + i;
+        std::vector<int> row_seeds;
+        for (size_t j = 0; j < seeds.ncols(); ++j)
+        {
+            if (seeds(i, j) != NONE)
+            {
+                row_seeds.push_back(seeds(i, j));
+            }
+        }
+        dist.one_to_many(
+            train_data,
+            idx0,
+            row_seeds.data(),
+            row_seeds.size(),
+            seed_distances.data()
+        );
+        for (size_t j = 0; j < row_seeds.size(); ++j)
+        {
+            graph_updater.push(idx0, row_seeds[j], seed_distances[j]);
+            if (graph_updater.push(row_seeds[j], idx0, seed_distances[j]))
+            {
+                active.push_back(row_seeds[j]);
+            }
+        }
+    }
+    std::sort(active.begin(), active.end());
+    active.erase(std::unique(active.begin(), active.end()), active.end());
+
+    local_nn_descent(
+        train_data,
+        graph_updater,
+        current_graph,
+        active,
+        n_neighbors,
+        max_candidates,
+        dist,
+        n_iters,
+        delta,
+        n_threads,
+        verbose
+    );
+    std::vector<int> changed = graph_updater.sort();
+
+    // Update the results of the changed nodes.
+    neighbor_indices.append(Matrix<int>(n_new, n_neighbors, NONE));
+    neighbor_distances.append(Matrix<float>(n_new, n_neighbors, FLOAT_MAX));
+    for (int i : changed)
+    {
+        int row = original_id(i);
+        for (int j = 0; j < n_neighbors; ++j)
+        {
+            neighbor_indices(row, j) = original_id(current_graph.indices(i, j));
+            neighbor_distances(row, j) = dist.correction(
+                current_graph.keys(i, j)
+            );
+        }
+    }
+
+    // Merge the pruned neighborhoods of the changed nodes and their
+    // transposes into the search graph.
+    std::vector<std::vector<int>> pruned_indices(changed.size());
+    std::vector<std::vector<float>> pruned_keys(changed.size());
+    #pragma omp parallel num_threads(n_threads)
+    {
+        RandomState local_rng_state;
+        for (int state = 0; state < STATE_SIZE; ++state)
+        {
+            local_rng_state[state] = rng_state[state]
+                + omp_get_thread_num() + 1;
+        }
+        #pragma omp for
+        for (size_t i = 0; i < changed.size(); ++i)
+        {
+            prune_long_edges_of_node(
+                train_data,
+                current_graph,
+                changed[i],
+                local_rng_state,
+                dist,
+                pruning_prob,
+                pruned_indices[i],
+                pruned_keys[i]
+            );
+        }
+    }
+    std::map<int, std::vector<Edge>> new_edges;
+    for (size_t i = 0; i < changed.size(); ++i)
+    {
+        for (size_t j = 0; j < pruned_indices[i].size(); ++j)
+        {
+            int idx = pruned_indices[i][j];
+            float d = pruned_keys[i][j];
+            new_edges[changed[i]].push_back(Edge(idx, d));
+            new_edges[idx].push_back(Edge(changed[i], d));
+        }
     }
-
-    init_random(
-        train_data, current_graph, n_neighbors, dist, rng_state
+    std::vector<int> rows;
+    std::vector<std::vector<Edge>> row_edges;
+    for (auto &entry : new_edges)
+    {
+        rows.push_back(entry.first);
+        row_edges.push_back(std::move(entry.second));
+    }
+    // The keys of the old edges are not stored and are computed again.
+    size_t n_search_cols = std::round(n_neighbors * pruning_degree_multiplier);
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        int row = rows[i];
+        if ((size_t)row < search_graph.nnodes())
+        {
+            for (
+                const int *it = search_graph.begin(row);
+                it != search_graph.end(row);
+                ++it
+            )
+            {
+                row_edges[i].push_back(Edge(*it, dist(train_data, row, *it)));
+            }
+        }
+        keep_closest_edges(row_edges[i], n_search_cols);
+    }
+    search_graph = replace_adjacency_lists(
+        search_graph, data_size, rows, row_edges
     );
+    // Created again by the next query.
+    graph_replicas.clear();
+    data_replicas.clear();
+    log(
+        "Updated the neighbors of " + std::to_string(changed.size())
+            + " points",
+        verbose
+    );
+}
 
-    nn_descent(
-        train_data,
+
+template<class MatrixType, class DistType>
+void NNDescent::start_brute_force(
+    const MatrixType &train_data, const DistType &dist
+)
+{
+    brute_force_tiles(
+        train_data.nrows(),
+        train_data.nrows(),
+        brute_force_block_rows(train_data),
+        [&](size_t idx0, const int *indices, size_t n, float *out)
+        {
+            dist.one_to_many(train_data, idx0, indices, n, out);
+        },
         current_graph,
-        n_neighbors,
-        rng_state,
-        max_candidates,
-        dist,
-        n_iters,
-        delta,
         n_threads,
         verbose
     );
+    finalize_graph(
+        current_graph,
+        dist,
+        false,
+        neighbor_indices,
+        neighbor_distances,
+        n_threads
+    );
+}
 
-    // Make shure every nodes neighborhod contains the node itself.
-    add_zero_node(current_graph);
 
-    current_graph.heapsort();
+template<>
+Matrix<float>* NNDescent::get_data()
+{
+    if (is_sparse)
+    {
+        throw std::runtime_error(
+            "The model was trained using a sparse matrix. Applications using "
+            "a dense matrix are not supported."
+        );
+    }
+    return &data;
+}
 
-    correct_distances(
-        dist, current_graph.keys, neighbor_distances
-    );
 
-    neighbor_indices = current_graph.indices;
+template<>
+CSRMatrix<float>* NNDescent::get_data()
+{
+    if (!is_sparse)
+    {
+        throw std::runtime_error(
+            "The model was trained using a dense matrix. Applications using "
+            "a sparse matrix are not supported."
+        );
+    }
+    return &csr_data;
 }
 
 
-/*
- * @brief Prune long edges in the graph.
- *
- * This function prunes long edges in the graph, which are edges that are
- * closer to a node's neighbor than to the node itself. It helps to improve
- * the efficiency of the k-nearest neighbor graph query search.
- *
- * @param data The input data matrix.
- * @param graph The current k-nearest neighbor graph.
- * @param rng_state Random number generator state.
- * @param dist The distance metric used for pruning.
- * @param n_threads The number of threads to use for parallelization.
- * @param pruning_prob The probability of pruning a long edge.
- */
-template<class MatrixType, class DistType>
-void prune_long_edges(
-    const MatrixType &data,
-    HeapList<float> &graph,
-    RandomState &rng_state,
-    const DistType &dist,
-    int n_threads,
-    float pruning_prob
-)
+void NNDescent::to_original_ids(Matrix<int> &indices) const
 {
-    #pragma omp parallel for num_threads(n_threads)
-    for (size_t i = 0; i < graph.nheaps(); ++i)
+    if (point_ids.empty())
     {
-        std::vector<int> new_indices;
-        std::vector<float> new_keys;
-        // First element is node itself and can be pruned.
-        for (size_t j = 1; j < graph.nnodes(); ++j)
+        return;
+    }
+    for (size_t i = 0; i < indices.nrows(); ++i)
+    {
+        for (size_t j = 0; j < indices.ncols(); ++j)
         {
-            int idx = graph.indices(i, j);
-            float key = graph.keys(i, j);
-            if  (idx == NONE)
-            {
-                continue;
-            }
+            indices(i, j) = original_id(indices(i, j));
+        }
+    }
+}
 
-            bool add_node = true;
 
-            for (size_t k = 0; k < new_indices.size(); ++k)
-            {
-                int new_idx = new_indices[k];
-                float new_key = new_keys[k];
-                float d = dist(data, idx, new_idx);
-                if (new_key > FLOAT_EPS && d < key)
-                {
-                    // idx is closer to a node in the neighborhood than
-                    // to the central node i, i.e. it is a long edge.
-                    if (rand_float(rng_state) < pruning_prob)
-                    {
-                        add_node = false;
-                        break;
-                    }
+void NNDescent::place_on_numa_nodes()
+{
+    graph_replicas.clear();
+    data_replicas.clear();
+    if (numa == "none")
+    {
+        return;
+    }
+    data.first_touch(n_threads);
+    current_graph.first_touch(n_threads);
+    search_graph.first_touch(n_threads);
+}
 
 
-                }
-            }
-            if (add_node)
-            {
-                new_indices.push_back(idx);
-                new_keys.push_back(key);
-            }
-        }
-        for (size_t j = 0; j < graph.nnodes(); ++j)
+void NNDescent::replicate_index(const ThreadPinning &pinning)
+{
+    const std::vector<int> &nodes = pinning.nodes();
+    std::set<int> distinct_nodes(nodes.begin(), nodes.end());
+    if (distinct_nodes.size() < 2)
+    {
+        graph_replicas.clear();
+        data_replicas.clear();
+        return;
+    }
+    size_t n_nodes = *distinct_nodes.rbegin() + 1;
+    bool complete = graph_replicas.size() >= n_nodes;
+    for (int node : distinct_nodes)
+    {
+        complete = complete && graph_replicas[node].nnodes() == data_size;
+    }
+    if (complete)
+    {
+        return;
+    }
+    // The quantized data and sparse data are read from the shared copy.
+    bool dense = !is_sparse && storage == "float32";
+    graph_replicas = std::vector<CSRGraph>(n_nodes);
+    data_replicas = std::vector<Matrix<float>>(dense ? n_nodes : 0);
+    #pragma omp parallel num_threads(n_threads)
+    {
+        int thread = omp_get_thread_num();
+        int node = nodes[thread];
+        // The first thread of each node allocates and writes its replica.
+        if (
+            std::find(nodes.begin(), nodes.begin() + thread, node)
+                == nodes.begin() + thread
+        )
         {
-            if  (j < new_indices.size())
-            {
-                graph.indices(i, j) = new_indices[j];
-                graph.keys(i, j) = new_keys[j];
-            }
-            else
+            CSRGraph graph = search_graph;
+            graph.offsets.deep_copy();
+            graph.indices.deep_copy();
+            graph_replicas[node] = std::move(graph);
+            if (dense)
             {
-                graph.indices(i, j) = NONE;
-                graph.keys(i, j) = FLOAT_MAX;
+                Matrix<float> replica = data;
+                replica.deep_copy();
+                data_replicas[node] = std::move(replica);
             }
         }
     }
+    log(
+        "Replicated the search index on " + std::to_string(n_nodes)
+            + " NUMA nodes",
+        verbose
+    );
 }
 
 
-template<class DistType>
-void NNDescent::prepare(const DistType &dist)
+/*
+ * @brief Returns the nodes in the order of a breadth-first search, which
+ * starts from the first unvisited node of 'starts' whenever the queue runs
+ * empty.
+ *
+ * @param adjacency The neighbors of each node in the order they are
+ * visited.
+ * @param starts The candidates for the start nodes in order of preference.
+ */
+std::vector<int> breadth_first_order(
+    const std::vector<std::vector<int>> &adjacency,
+    const std::vector<int> &starts
+)
 {
-    // Make a search tree if necessary.
-    if (forest.size() == 0)
+    std::vector<int> order;
+    order.reserve(adjacency.size());
+    std::vector<char> visited(adjacency.size(), 0);
+    for (int start : starts)
     {
-        if (is_sparse)
+        if (visited[start])
         {
-            forest = make_forest(
-                csr_data, 1, leaf_size, rng_state
-            );
+            continue;
         }
-        else
+        visited[start] = 1;
+        size_t head = order.size();
+        order.push_back(start);
+        while (head < order.size())
         {
-            forest = make_forest(
-                data, 1, leaf_size, rng_state
-            );
+            for (int idx : adjacency[order[head++]])
+            {
+                if (!visited[idx])
+                {
+                    visited[idx] = 1;
+                    order.push_back(idx);
+                }
+            }
         }
     }
-    // The trees are very close in their performance, so the first is selected.
-    search_tree = forest[0];
+    return order;
+}
 
-    HeapList<float> forward_graph = current_graph;
 
-    if (is_sparse)
+std::vector<int> NNDescent::locality_order(const std::string &method)
+{
+    if (method == "none")
     {
-        prune_long_edges(
-            csr_data,
-            forward_graph,
-            rng_state,
-            dist,
-            n_threads,
-            pruning_prob
-        );
+        return std::vector<int>();
     }
-    else
+    if (method == "leaves")
     {
-        prune_long_edges(
-            data,
-            forward_graph,
-            rng_state,
-            dist,
-            n_threads,
-            pruning_prob
-        );
+        if (forest.size() == 0)
+        {
+            forest = is_sparse
+                ? make_forest(csr_data, 1, leaf_size, rng_state)
+                : make_forest(data, 1, leaf_size, rng_state);
+        }
+        // Points added after the tree was built follow in their order.
+        std::vector<int> order;
+        order.reserve(data_size);
+        std::vector<char> contained(data_size, 0);
+        for (int idx : forest[0].leaf_indices)
+        {
+            order.push_back(idx);
+            contained[idx] = 1;
+        }
+        for (size_t i = 0; i < data_size; ++i)
+        {
+            if (!contained[i])
+            {
+                order.push_back(i);
+            }
+        }
+        return order;
     }
 
-    if (verbose)
+    std::vector<std::vector<int>> adjacency(data_size);
+    for (size_t i = 0; i < data_size; ++i)
     {
-        size_t edges_cnt_before = forward_graph.indices.nrows()
-            * forward_graph.indices.ncols();
-        size_t edges_cnt_after = forward_graph.indices.non_none_cnt();
-        log(
-            "Forward graph pruning reduced edges from "
-                + std::to_string(edges_cnt_before)
-                + " to "
-                + std::to_string(edges_cnt_after)
-        );
+        for (size_t j = 0; j < current_graph.nnodes(); ++j)
+        {
+            int idx = current_graph.indices(i, j);
+            if (idx != NONE && (size_t)idx != i)
+            {
+                adjacency[i].push_back(idx);
+            }
+        }
     }
-
-    size_t n_search_cols = std::round(n_neighbors * pruning_degree_multiplier);
-    search_graph = HeapList<float>(data_size, n_search_cols, FLOAT_MAX);
-
-    for (size_t i = 0; i < forward_graph.nheaps(); ++i)
+    std::vector<int> all_nodes(data_size);
+    std::iota(all_nodes.begin(), all_nodes.end(), 0);
+    if (method == "bfs")
     {
-        for (size_t j = 0; j < forward_graph.nnodes(); ++j)
+        return breadth_first_order(adjacency, all_nodes);
+    }
+    if (method == "rcm")
+    {
+        // Cuthill-McKee visits the neighbors by increasing degree and starts
+        // from nodes of minimal degree. The order is reversed at the end.
+        // Neighbors are symmetrized first.
+        for (size_t i = 0; i < data_size; ++i)
         {
-            int idx = forward_graph.indices(i, j);
-            if (idx != NONE)
+            size_t n_forward = adjacency[i].size();
+            for (size_t j = 0; j < n_forward; ++j)
             {
-                float d = forward_graph.keys(i, j);
-                search_graph.checked_push(i, idx, d);
-                search_graph.checked_push(idx, i, d);
+                adjacency[adjacency[i][j]].push_back(i);
             }
         }
+        std::vector<size_t> degree(data_size);
+        for (size_t i = 0; i < data_size; ++i)
+        {
+            std::vector<int> &neighbors = adjacency[i];
+            std::sort(neighbors.begin(), neighbors.end());
+            neighbors.erase(
+                std::unique(neighbors.begin(), neighbors.end()),
+                neighbors.end()
+            );
+            degree[i] = neighbors.size();
+        }
+        auto by_degree = [&degree](int idx0, int idx1)
+        {
+            return degree[idx0] < degree[idx1];
+        };
+        for (std::vector<int> &neighbors : adjacency)
+        {
+            std::stable_sort(neighbors.begin(), neighbors.end(), by_degree);
+        }
+        std::stable_sort(all_nodes.begin(), all_nodes.end(), by_degree);
+        std::vector<int> order = breadth_first_order(adjacency, all_nodes);
+        std::reverse(order.begin(), order.end());
+        return order;
     }
+    throw std::invalid_argument("Invalid reorder method '" + method + "'");
+}
 
-    search_graph.heapsort();
 
-    if (verbose)
+/*
+ * @brief Moves row order[i] of 'graph' to row i and renumbers its indices,
+ * where 'position' is the inverse permutation of 'order'.
+ */
+void permute_graph(
+    HeapList<float> &graph,
+    const std::vector<int> &order,
+    const std::vector<int> &position
+)
+{
+    Matrix<int> indices = permute_rows(graph.indices, order);
+    for (int &idx : indices.m_data)
     {
-        log(
-            "Merging pruned graph with its transpose results in "
-                + std::to_string(search_graph.indices.non_none_cnt())
-                + " edges for the search graph."
-        );
+        idx = idx == NONE ? NONE : position[idx];
     }
-
+    graph = HeapList<float>(
+        std::move(indices),
+        permute_rows(graph.keys, order),
+        graph.noflags() ? Matrix<char>() : permute_rows(graph.flags, order)
+    );
 }
 
 
-template<class MatrixType, class DistType>
-void NNDescent::start_brute_force(
-    const MatrixType &train_data, const DistType &dist
+/*
+ * @brief Moves the adjacency list of node order[i] of 'graph' to node i and
+ * renumbers its neighbors, where 'position' is the inverse permutation of
+ * 'order'.
+ */
+void permute_graph(
+    CSRGraph &graph,
+    const std::vector<int> &order,
+    const std::vector<int> &position
 )
 {
-    ProgressBar bar(train_data.nrows(), verbose);
-    #pragma omp parallel for num_threads(n_threads)
-    for (size_t idx0 = 0; idx0 < train_data.nrows(); ++idx0)
+    Matrix<size_t> offsets(order.size() + 1, 1);
+    offsets(0, 0) = 0;
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        offsets(i + 1, 0) = offsets(i, 0) + graph.degree(order[i]);
+    }
+    Matrix<int> indices(graph.nedges(), 1);
+    for (size_t i = 0; i < order.size(); ++i)
     {
-        bar.show();
-        for (size_t idx1 = 0; idx1 < train_data.nrows(); ++idx1)
+        int *out = indices.m_ptr + offsets(i, 0);
+        for (
+            const int *it = graph.begin(order[i]);
+            it != graph.end(order[i]);
+            ++it
+        )
         {
-            float d = dist(train_data, idx0, idx1);
-            current_graph.simple_push(idx0, idx1, d);
+            *out++ = position[*it];
         }
     }
-    current_graph.heapsort();
-    neighbor_indices = current_graph.indices;
-    correct_distances(
-        dist, current_graph.keys, neighbor_distances
-    );
+    graph = CSRGraph(std::move(offsets), std::move(indices));
 }
 
 
-template<>
-Matrix<float>* NNDescent::get_data()
+void NNDescent::reorder_points(const std::string &method)
 {
-    if (is_sparse)
+    std::vector<int> order = locality_order(method);
+    if (order.empty())
     {
-        throw std::runtime_error(
-            "The model was trained using a sparse matrix. Applications using "
-            "a dense matrix are not supported."
+        return;
+    }
+    if (!has_float_data())
+    {
+        throw std::invalid_argument(
+            "An index which released its float32 training data cannot be "
+            "reordered"
         );
     }
-    return &data;
-}
+    log("Reorder points by '" + method + "'", verbose);
+    std::vector<int> position(data_size);
+    for (size_t i = 0; i < data_size; ++i)
+    {
+        position[order[i]] = i;
+    }
 
+    if (is_sparse)
+    {
+        csr_data = permute_rows(csr_data, order);
+    }
+    else
+    {
+        data = permute_rows(data, order);
+    }
+    // Quantized again by the next query.
+    quantized_data = QuantizedMatrix();
+    if (pq_data.nrows() > 0)
+    {
+        pq_data.codes = permute_rows(pq_data.codes, order);
+        pq_data.sq_norms = permute_rows(pq_data.sq_norms, order);
+    }
+    row_norms = RowNorms();
 
-template<>
-CSRMatrix<float>* NNDescent::get_data()
-{
-    if (!is_sparse)
+    permute_graph(current_graph, order, position);
+    if (search_graph.nnodes() > 0)
     {
-        throw std::runtime_error(
-            "The model was trained using a dense matrix. Applications using "
-            "a sparse matrix are not supported."
-        );
+        permute_graph(search_graph, order, position);
     }
-    return &csr_data;
+    for (int &idx : search_tree.leaf_indices)
+    {
+        idx = position[idx];
+    }
+    for (FlatRPTree &tree : forest)
+    {
+        for (int &idx : tree.leaf_indices)
+        {
+            idx = position[idx];
+        }
+    }
+
+    std::vector<int> ids(data_size);
+    for (size_t i = 0; i < data_size; ++i)
+    {
+        ids[i] = original_id(order[i]);
+    }
+    point_ids = std::move(ids);
+
+    ThreadPinning pinning(n_threads, numa != "none");
+    place_on_numa_nodes();
 }
 
 
@@ -930,6 +3295,13 @@ std::ostream& operator<<(std::ostream &out, const NNDescent &nnd)
         << "n_threads=" << nnd.n_threads  << ",\n\t"
         << "verbose=" << nnd.verbose  << ",\n\t"
         << "algorithm=" << nnd.algorithm  << ",\n\t"
+        << "storage=" << nnd.storage  << ",\n\t"
+        << "rerank=" << nnd.rerank  << ",\n\t"
+        << "reorder=" << nnd.reorder  << ",\n\t"
+        << "prepare_on_build=" << nnd.prepare_on_build  << ",\n\t"
+        << "cache_norms=" << nnd.cache_norms  << ",\n\t"
+        << "numa=" << nnd.numa  << ",\n\t"
+        << "pq_subspaces=" << nnd.pq_subspaces  << ",\n\t"
         << "angular_trees=" << nnd.angular_trees  << ",\n\t"
         << "is_sparse=" << nnd.is_sparse  << ",\n"
         << ")\n";
@@ -937,4 +3309,13 @@ std::ostream& operator<<(std::ostream &out, const NNDescent &nnd)
 }
 
 
+// Instantiates all algorithms of this file for dense and sparse data.
+template void NNDescent::set_dist_and_start_nn<Matrix<float>>(
+    NNDescent::Task, const Matrix<float>&, int, float
+);
+template void NNDescent::set_dist_and_start_nn<CSRMatrix<float>>(
+    NNDescent::Task, const CSRMatrix<float>&, int, float
+);
+
+
 } // namespace nndescent
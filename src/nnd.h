@@ -43,10 +43,16 @@
 
 #pragma once
 
+#include <memory>
+#include <numeric>
+
+#include <omp.h>
+
 #include "utils.h"
 #include "dtypes.h"
 #include "distances.h"
 #include "rp_trees.h"
+#include "serialize.h"
 
 
 namespace nndescent
@@ -66,6 +72,32 @@ const int MAX_INT = std::numeric_limits<int>::max();
 const int DEFAULT_K = 10;
 const float DEFAULT_EPSILON = 0.1f;
 
+// Number of work chunks per thread used for dynamic scheduling.
+const int CHUNKS_PER_THREAD = 16;
+
+// Factor by which the number of searched neighbors is increased before the
+// full precision re-ranking of a query on reduced-precision data.
+const int RERANK_MULTIPLIER = 2;
+
+// The same factor for training data compressed by product quantization, whose
+// distances are less accurate.
+const int PQ_RERANK_MULTIPLIER = 4;
+
+// The largest change of the epsilon of an adaptive query per query point, and
+// the range of the adapted epsilon (see QueryBudget::target_dist_evals).
+const float ADAPTIVE_EPSILON_STEP = 0.01f;
+const float MAX_ADAPTIVE_EPSILON = 0.5f;
+
+// The number of query points per tile of the exact search and the size of
+// the training data per tile, which should fit into the L2 cache.
+const size_t BRUTE_FORCE_QUERY_BLOCK = 64;
+const size_t BRUTE_FORCE_BLOCK_BYTES = 1 << 18;
+
+// The number of graph searches that each thread of a query runs interleaved,
+// such that the memory accesses of one overlap with the distance evaluations
+// of the others (see 'NNDescent::query'). At most VisitedSets::MAX_LANES.
+const int QUERY_LANES = 4;
+
 
 /*
  * Throws an exception if no sparse metric is implemented.
@@ -85,15 +117,22 @@ void throw_exception_if_sparse(std::string metric, bool is_sparse);
  * @param dist The distance function containing a correction function.
  * @param in The input matrix of distances to be corrected.
  * @param out The output matrix of corrected distances.
+ * @param n_threads The number of threads correcting the rows in parallel.
  */
 template<class DistType>
 void correct_distances(
     DistType &dist,
     Matrix<float> &in,
-    Matrix<float> &out
+    Matrix<float> &out,
+    int n_threads=1
 )
 {
-    out.resize(in.nrows(), in.ncols());
+    // Keeps 'out' if it is a view of external memory of the right shape.
+    if (out.nrows() != in.nrows() || out.ncols() != in.ncols())
+    {
+        out.resize(in.nrows(), in.ncols());
+    }
+    #pragma omp parallel for num_threads(n_threads)
     for (size_t i = 0; i < in.nrows(); ++i)
     {
         for (size_t j = 0; j < in.ncols(); ++j)
@@ -105,6 +144,125 @@ void correct_distances(
 }
 
 
+/*
+ * @brief Returns the number of training points per tile of the exact search,
+ * such that a tile takes about BRUTE_FORCE_BLOCK_BYTES.
+ */
+inline size_t brute_force_block_rows(const Matrix<float> &train_data)
+{
+    size_t row_bytes = std::max((size_t)1, train_data.ncols()) * sizeof(float);
+    return std::max((size_t)64, BRUTE_FORCE_BLOCK_BYTES / row_bytes);
+}
+
+inline size_t brute_force_block_rows(const CSRMatrix<float> &train_data)
+{
+    size_t nnz_per_row = train_data.nrows() == 0
+        ? 1 : train_data.nnz() / train_data.nrows() + 1;
+    size_t row_bytes = nnz_per_row * (sizeof(float) + sizeof(size_t));
+    return std::max((size_t)64, BRUTE_FORCE_BLOCK_BYTES / row_bytes);
+}
+
+
+/*
+ * @brief Computes the exact nearest neighbors of 'n_queries' query points
+ * among 'n_train' training points in tiles.
+ *
+ * A tile consists of BRUTE_FORCE_QUERY_BLOCK query points and 'train_block'
+ * consecutive training points, so that the training points of a tile are
+ * loaded into the cache once for all of its query points. The distances of a
+ * query point to the training points of a tile are computed by one batched
+ * call 'block_dist(idx_q, indices, n, out)', which e.g. for the dense
+ * euclidean and inner product metrics uses the vectorized batch kernels and
+ * for sparse query points scatters the query point once. If there are fewer
+ * blocks of query points than threads, the training points are split among
+ * the threads, which fill separate heaps that are merged at the end.
+ *
+ * @param result The heaps of the query points, which must be empty.
+ */
+template<class BlockDist>
+void brute_force_tiles(
+    size_t n_queries,
+    size_t n_train,
+    size_t train_block,
+    const BlockDist &block_dist,
+    HeapList<float> &result,
+    int n_threads,
+    bool verbose
+)
+{
+    std::vector<int> indices(n_train);
+    std::iota(indices.begin(), indices.end(), 0);
+    size_t n_query_blocks = (n_queries + BRUTE_FORCE_QUERY_BLOCK - 1)
+        / BRUTE_FORCE_QUERY_BLOCK;
+    size_t n_parts = n_query_blocks >= (size_t)n_threads ? 1 : n_threads;
+    std::vector<HeapList<float>> partial;
+    for (size_t part = 1; part < n_parts; ++part)
+    {
+        partial.emplace_back(n_queries, result.nnodes(), FLOAT_MAX);
+    }
+    ProgressBar bar(n_query_blocks * n_parts, verbose);
+
+    // Each task fills the rows of one block of query points in the heaps of
+    // one part of the training points, so no two tasks write the same heap.
+    #pragma omp parallel num_threads(n_threads)
+    {
+    std::vector<float> distances(train_block);
+    #pragma omp for schedule(dynamic)
+    for (size_t task = 0; task < n_query_blocks * n_parts; ++task)
+    {
+        bar.show();
+        size_t part = task % n_parts;
+        size_t q0 = (task / n_parts) * BRUTE_FORCE_QUERY_BLOCK;
+        size_t q1 = std::min(q0 + BRUTE_FORCE_QUERY_BLOCK, n_queries);
+        HeapList<float> &heaps = part == 0 ? result : partial[part - 1];
+        size_t part_end = (part + 1) * n_train / n_parts;
+        for (
+            size_t t0 = part * n_train / n_parts;
+            t0 < part_end;
+            t0 += train_block
+        )
+        {
+            size_t n = std::min(train_block, part_end - t0);
+            for (size_t idx_q = q0; idx_q < q1; ++idx_q)
+            {
+                block_dist(idx_q, &indices[t0], n, distances.data());
+                float bound = heaps.max(idx_q);
+                for (size_t j = 0; j < n; ++j)
+                {
+                    if (distances[j] < bound)
+                    {
+                        heaps.simple_push(idx_q, t0 + j, distances[j]);
+                        bound = heaps.max(idx_q);
+                    }
+                }
+            }
+        }
+    }
+    }
+
+    if (partial.empty())
+    {
+        return;
+    }
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t idx_q = 0; idx_q < n_queries; ++idx_q)
+    {
+        for (const HeapList<float> &heaps : partial)
+        {
+            for (size_t j = 0; j < heaps.nnodes(); ++j)
+            {
+                if (heaps.indices(idx_q, j) != NONE)
+                {
+                    result.simple_push(
+                        idx_q, heaps.indices(idx_q, j), heaps.keys(idx_q, j)
+                    );
+                }
+            }
+        }
+    }
+}
+
+
 /**
  * @brief Calculates the recall accuracy between two k-NN matrices.
  *
@@ -122,6 +280,381 @@ void correct_distances(
 float recall_accuracy(Matrix<int> apx, Matrix<int> ect);
 
 
+/**
+ * @brief Per-thread work counters of a parallel phase.
+ *
+ * Used to verify the load balance of the local join in 'nn_descent'. Entry
+ * 'i' of each vector belongs to OpenMP thread 'i'.
+ */
+struct ThreadLoad
+{
+    /**
+     * The number of distance evaluations of each thread.
+     */
+    std::vector<size_t> dist_evals;
+
+    /**
+     * The wall time in seconds spent by each thread.
+     */
+    std::vector<double> seconds;
+
+    /**
+     * Sets all counters of 'n_threads' threads to zero.
+     */
+    void reset(int n_threads)
+    {
+        dist_evals.assign(n_threads, 0);
+        seconds.assign(n_threads, 0.0);
+    }
+
+    /**
+     * Returns the number of distance evaluations of all threads.
+     */
+    size_t total_dist_evals() const;
+
+    /**
+     * Returns a one line description of the total work and its imbalance,
+     * i.e. the ratio of the maximal to the mean work per thread.
+     */
+    std::string summary() const;
+};
+
+
+/**
+ * @brief The wall times and counters of one NN-descent iteration.
+ */
+struct IterationStats
+{
+    /**
+     * The wall times in seconds of 'sample_candidates',
+     * 'generate_graph_updates' and 'apply_graph_updates'.
+     */
+    double sample_seconds = 0.0;
+    double generate_seconds = 0.0;
+    double apply_seconds = 0.0;
+
+    /**
+     * The number of distance evaluations of the local join.
+     */
+    size_t dist_evals = 0;
+
+    /**
+     * The number of generated graph updates and the number of those that
+     * changed the graph.
+     */
+    size_t updates_generated = 0;
+    size_t updates_applied = 0;
+};
+
+
+/**
+ * @brief Performance counters of an index.
+ *
+ * The build counters describe the last index construction, while the query
+ * counters accumulate over all queries until 'reset_queries' is called.
+ * Counters of parallel loops are kept per thread and added up at the end of
+ * the loop, so they need no synchronization. Wall times are in seconds.
+ */
+struct Stats
+{
+    /**
+     * The wall time of building the random projection forest.
+     */
+    double forest_seconds = 0.0;
+
+    /**
+     * The wall time and the distance evaluations of the graph update by the
+     * leaves of the forest.
+     */
+    double leaves_seconds = 0.0;
+    size_t leaves_dist_evals = 0;
+
+    /**
+     * The counters of each NN-descent iteration.
+     */
+    std::vector<IterationStats> iterations;
+
+    /**
+     * The wall time of building the search tree and the search graph.
+     */
+    double prepare_seconds = 0.0;
+
+    /**
+     * The number of query points and the wall time spent on them.
+     */
+    size_t n_queries = 0;
+    double query_seconds = 0.0;
+
+    /**
+     * The number of distance evaluations of the graph searches, which equals
+     * the number of visited nodes.
+     */
+    size_t query_dist_evals = 0;
+
+    /**
+     * Entry i is the number of queries that visited at least 2^i and less
+     * than 2^(i + 1) nodes.
+     */
+    std::vector<size_t> visited_histogram;
+
+    /**
+     * The number of query points whose search stopped at a limit of the
+     * query budget.
+     */
+    size_t query_budget_hits = 0;
+
+    /**
+     * The mean epsilon of the threads after the last query with a target
+     * of distance evaluations, or zero if there was none.
+     */
+    float adaptive_epsilon = 0.0f;
+
+    /**
+     * Sets all query counters to zero.
+     */
+    void reset_queries();
+
+    /**
+     * Returns a multi-line description of all counters.
+     */
+    std::string summary() const;
+};
+
+
+/**
+ * @brief Reusable scratch memory of the NN-descent iterations.
+ *
+ * The candidate heaps and the update buckets are allocated once per build and
+ * reused by 'update_by_leaves' and all iterations of 'nn_descent', so the
+ * memory is neither freed nor page-faulted again between iterations. The
+ * heaps are reset row by row by the thread owning the row.
+ */
+struct Workspace
+{
+    /**
+     * The heap of new candidate neighbors.
+     */
+    HeapList<int> new_candidates;
+
+    /**
+     * The heap of old candidate neighbors.
+     */
+    HeapList<int> old_candidates;
+
+    /**
+     * Reverse candidates bucketed by the partition of their destination row.
+     */
+    UpdateBuckets<CandidateUpdate> reverse_candidates;
+
+    /**
+     * Graph updates bucketed by the partition of their destination row.
+     */
+    UpdateBuckets<NNUpdate> updates;
+
+    /**
+     * The number of candidate pairs of each row of the local join.
+     */
+    std::vector<size_t> pair_cnt;
+
+    /**
+     * The maximal number of bytes allocated by the workspace so far.
+     */
+    size_t high_water_mark = 0;
+
+    /**
+     * Allocates the workspace for a graph with 'n_rows' rows.
+     */
+    void init(size_t n_rows, int max_candidates, int n_threads);
+
+    /**
+     * Frees all memory of the workspace. The high-water mark is kept.
+     */
+    void release();
+
+    /**
+     * Returns the number of bytes currently allocated by the workspace.
+     */
+    size_t nbytes() const;
+
+    /**
+     * Updates the high-water mark to the currently allocated memory.
+     */
+    void update_high_water_mark()
+    {
+        high_water_mark = std::max(high_water_mark, nbytes());
+    }
+};
+
+
+/**
+ * @brief The state of one of the interleaved graph searches of a thread in
+ * 'NNDescent::query'.
+ */
+struct SearchLane
+{
+    /**
+     * The query point of the search, and false if the lane is idle.
+     */
+    size_t query = 0;
+    bool active = false;
+
+    /**
+     * The queue of candidates of the search.
+     */
+    Heap<Candidate> search_candidates;
+
+    /**
+     * The unvisited neighbors of the candidate being expanded and their
+     * distances to the query point.
+     */
+    std::vector<int> neighbors;
+    std::vector<float> neighbor_distances;
+
+    /**
+     * The candidate being expanded, the epsilon of the search and the current
+     * bound of the distances of new candidates.
+     */
+    Candidate candidate;
+    float epsilon = 0.0f;
+    float distance_bound = 0.0f;
+
+    /**
+     * The numbers of visited and of expanded nodes.
+     */
+    size_t n_visited = 0;
+    size_t n_expanded = 0;
+
+    /**
+     * True if the search stopped at a budget, and true if the search has
+     * no candidate left to expand.
+     */
+    bool truncated = false;
+    bool exhausted = false;
+
+    /**
+     * The start of the search, which is only measured by timed budgets.
+     */
+    std::chrono::steady_clock::time_point search_start;
+};
+
+
+/**
+ * @brief Per-thread scratch memory of the graph search in 'NNDescent::query'.
+ *
+ * The contexts are kept between calls of 'query', so a search neither
+ * allocates nor clears memory proportional to the size of the index.
+ */
+struct QueryContext
+{
+    /**
+     * The nodes visited by the searches of the lanes.
+     */
+    VisitedSets visited;
+
+    /**
+     * The searches which the thread runs interleaved.
+     */
+    std::vector<SearchLane> lanes;
+
+    /**
+     * The random state of the thread.
+     */
+    RandomState rng_state;
+
+    /**
+     * The distance evaluations and the histogram of visited nodes (see
+     * Stats::visited_histogram) of the current call of 'query'.
+     */
+    size_t dist_evals = 0;
+    std::vector<size_t> visited_histogram;
+
+    /*
+     * The number of query points of the current call of 'query' that stopped
+     * at a budget.
+     */
+    size_t budget_hits = 0;
+
+    /*
+     * The epsilon adapted to QueryBudget::target_dist_evals by the previous
+     * searches of the thread, or a negative value if there were none.
+     */
+    float adaptive_epsilon = -1.0f;
+};
+
+
+/**
+ * @brief Limits of the search cost of each query point in 'NNDescent::query'.
+ *
+ * A search that reaches a limit stops and returns the nearest neighbors found
+ * so far, which is reported in 'NNDescent::query_truncated'. A limit of zero
+ * means no limit. The initial candidates from the search tree are always
+ * evaluated, so that each query point gets k neighbors.
+ */
+struct QueryBudget
+{
+    /**
+     * The maximal number of distance evaluations per query point.
+     */
+    size_t max_dist_evals = 0;
+
+    /**
+     * The maximal number of expanded candidates (nodes whose neighbors are
+     * evaluated) per query point.
+     */
+    size_t max_expansions = 0;
+
+    /**
+     * The maximal wall time in seconds per query point.
+     */
+    double max_seconds = 0.0;
+
+    /**
+     * The maximal wall time in seconds of a call of 'query', measured from
+     * the start of the search. The query points searched afterwards only get
+     * their initial candidates.
+     */
+    double batch_seconds = 0.0;
+
+    /**
+     * The targeted mean number of distance evaluations per query point. If
+     * set, each thread adapts the epsilon of its searches after every query
+     * point towards this target, starting from the epsilon passed to 'query'
+     * and keeping the adapted value for the following calls. The mean
+     * adapted epsilon is reported in 'Stats::adaptive_epsilon'.
+     */
+    size_t target_dist_evals = 0;
+
+    /**
+     * Whether the search time is limited.
+     */
+    bool timed() const { return max_seconds > 0.0 || batch_seconds > 0.0; }
+};
+
+
+/*
+ * @brief Returns true if a search started at 'search_start' in a call of
+ * 'query' started at 'batch_start' exceeds the time limits of 'budget'.
+ */
+inline bool over_time(
+    const QueryBudget &budget,
+    std::chrono::steady_clock::time_point batch_start,
+    std::chrono::steady_clock::time_point search_start
+)
+{
+    std::chrono::steady_clock::time_point now
+        = std::chrono::steady_clock::now();
+    return (
+        budget.max_seconds > 0.0
+        && std::chrono::duration<double>(now - search_start).count()
+            > budget.max_seconds
+    ) || (
+        budget.batch_seconds > 0.0
+        && std::chrono::duration<double>(now - batch_start).count()
+            > budget.batch_seconds
+    );
+}
+
+
 /**
  * @brief Structure representing the parameters for NNDescent.
  *
@@ -146,87 +679,259 @@ struct Parms
     int n_threads=NONE;
     bool verbose=false;
     std::string algorithm="nnd";
+    std::string storage="float32";
+    bool rerank=true;
+    std::string reorder="none";
+    bool prepare_on_build=true;
+    bool cache_norms=true;
+    std::string numa="none";
+    int pq_subspaces=NONE;
 };
 
 
-/**
- * @brief NNDescent class for fast approximate nearest neighbor queries.
- *
- * NNDescent is a flexible algorithm that supports a wide variety of distances,
- * including non-metric distances. It scales well against high-dimensional data
- * in many cases. This implementation provides a straightforward interface with
- * access to tuning parameters.
- */
-class NNDescent
-{
-private:
+/**
+ * @brief NNDescent class for fast approximate nearest neighbor queries.
+ *
+ * NNDescent is a flexible algorithm that supports a wide variety of distances,
+ * including non-metric distances. It scales well against high-dimensional data
+ * in many cases. This implementation provides a straightforward interface with
+ * access to tuning parameters.
+ */
+class NNDescent
+{
+private:
+
+    /*
+     * The training data matrix.
+     */
+    Matrix<float> data;
+
+    /*
+     * The training data as CSR matrix.
+     */
+    CSRMatrix<float> csr_data;
+
+    /*
+     * The size of the training data matrix.
+     */
+    size_t data_size;
+
+    /*
+     * The dimension of the training data matrix.
+     */
+    size_t data_dim;
+
+    /*
+     * The random state used for generating random numbers.
+     */
+    RandomState rng_state;
+
+    /*
+     * The collection of random projection trees.
+     */
+    std::vector<FlatRPTree> forest;
+
+    /*
+     * The search tree used for nearest neighbor queries.
+     */
+    FlatRPTree search_tree;
+
+    /*
+     * The search graph used for nearest neighbor queries, whose adjacency
+     * lists are sorted by increasing distance.
+     */
+    CSRGraph search_graph;
+
+    /*
+     * Scratch memory reused by the iterations of the index construction.
+     */
+    Workspace workspace;
+
+    /*
+     * The training data in reduced precision if 'storage' is not 'float32'.
+     */
+    QuantizedMatrix quantized_data;
+
+    /*
+     * The training data compressed by product quantization if 'storage' is
+     * 'pq'. It is trained by the first query and used by the graph search of
+     * all queries.
+     */
+    PQMatrix pq_data;
+
+    /*
+     * The cached norms of the training data if 'cache_norms' is set. They are
+     * computed by the first build, preparation or query that uses them and
+     * cleared whenever the training data changes.
+     */
+    RowNorms row_norms;
+
+    /*
+     * The copies of the search graph and of the dense training data on each
+     * NUMA node if 'numa' is 'replicate', indexed by the node. They are
+     * created by the first query and cleared whenever the index changes.
+     */
+    std::vector<CSRGraph> graph_replicas;
+    std::vector<Matrix<float>> data_replicas;
+
+    /*
+     * The memory mapped index file viewed by the matrices of an index loaded
+     * with 'mmap' enabled.
+     */
+    std::shared_ptr<MappedFile> mapped_file;
+
+    /*
+     * One search context per thread, created by the first query.
+     */
+    std::vector<QueryContext> query_contexts;
+
+    /*
+     * The matrices passed to 'query' for the results, or nullptr if the
+     * results are stored in newly allocated matrices.
+     */
+    Matrix<int> *query_indices_out = nullptr;
+    Matrix<float> *query_distances_out = nullptr;
+
+    /*
+     * The original index of the point in each row of the training data and
+     * the graphs, or empty if the points were not reordered.
+     */
+    std::vector<int> point_ids;
+
+    /*
+     * Flag indicating whether angular trees are used.
+     */
+    bool angular_trees;
+
+    /*
+     * Flag indicating whether the training data is sparse or dense.
+     */
+    bool is_sparse;
+
+    /*
+     * @brief Set the parameters for NNDescent.
+     */
+    void set_parameters(Parms &parms);
 
     /*
-     * The training data matrix.
+     * @brief Returns the original index of the point in row 'idx'.
      */
-    Matrix<float> data;
+    int original_id(int idx) const
+    {
+        return (idx == NONE || point_ids.empty()) ? idx : point_ids[idx];
+    }
 
     /*
-     * The training data as CSR matrix.
+     * @brief Places the training data and the graphs on the NUMA nodes of the
+     * threads working on their rows if 'numa' is not 'none' (see
+     * Matrix::first_touch) and drops the replicas.
      */
-    CSRMatrix<float> csr_data;
+    void place_on_numa_nodes();
 
     /*
-     * The size of the training data matrix.
+     * @brief Creates the replicas of the index on the NUMA nodes of the
+     * pinned threads unless they exist already. Each replica is copied by a
+     * thread on its node. No replicas are kept if all threads run on the same
+     * node.
      */
-    size_t data_size;
+    void replicate_index(const ThreadPinning &pinning);
 
     /*
-     * The dimension of the training data matrix.
+     * @brief Returns the training data to be read by threads on NUMA node
+     * 'node', i.e. its replica if there is one. Sparse data is not
+     * replicated.
      */
-    size_t data_dim;
+    const Matrix<float> &replica_data(
+        const Matrix<float> &train_data, int node
+    ) const
+    {
+        return data_replicas.empty() || &train_data != &data
+            ? train_data : data_replicas[node];
+    }
+
+    const CSRMatrix<float> &replica_data(
+        const CSRMatrix<float> &train_data, int
+    ) const
+    {
+        return train_data;
+    }
 
     /*
-     * The random state used for generating random numbers.
+     * @brief Replaces the row indices in 'indices' by the original indices.
      */
-    RandomState rng_state;
+    void to_original_ids(Matrix<int> &indices) const;
 
     /*
-     * The collection of random projection trees.
+     * @brief Returns the rows of 'matrix' in the original order of the
+     * points.
      */
-    std::vector<RPTree> forest;
+    template<class T>
+    Matrix<T> original_row_order(const Matrix<T> &matrix) const
+    {
+        std::vector<int> rows(point_ids.size());
+        for (size_t i = 0; i < point_ids.size(); ++i)
+        {
+            rows[point_ids[i]] = i;
+        }
+        return permute_rows(matrix, rows);
+    }
 
     /*
-     * The search tree used for nearest neighbor queries.
+     * @brief Returns the order of the rows after renumbering the points by
+     * 'method', or an empty vector for 'none'.
      */
-    RPTree search_tree;
+    std::vector<int> locality_order(const std::string &method);
 
     /*
-     * The search graph used for nearest neighbor queries.
+     * @brief Reads the parts of an index written by 'save' into 'nnd'.
      */
-    HeapList<float> search_graph;
+    static void read_index(BinaryReader &reader, NNDescent &nnd);
 
     /*
-     * Flag indicating whether angular trees are used.
+     * @brief Reorders the points and prepares the search index as requested
+     * by the parameters after the graph was built, and releases the float32
+     * training data if only the reduced-precision copy is used.
      */
-    bool angular_trees;
+    void finish_build();
 
     /*
-     * Flag indicating whether the training data is sparse or dense.
+     * @brief Returns true if the index keeps only the reduced-precision copy
+     * of the training data (see 'rerank').
      */
-    bool is_sparse;
+    bool releases_float_data() const
+    {
+        return !is_sparse && !rerank && storage != "float32"
+            && storage != "pq";
+    }
 
     /*
-     * @brief Set the parameters for NNDescent.
+     * The operations depending on the distance template.
      */
-    void set_parameters(Parms &parms);
+    enum class Task
+    {
+        BUILD,      // Index the training data.
+        QUERY,      // Query the points 'query_data'.
+        ADD_POINTS, // Add the points 'query_data' to the index.
+        BUILD_ON_DISK, // Write the graph of the training data to a file.
+        PREPARE     // Build the search tree and the search graph.
+    };
+
+    /*
+     * The number of rows per shard and the graph file of 'build_on_disk'.
+     */
+    size_t shard_size = 0;
+    std::string graph_path;
 
     /*
      * @brief Sets the distance template and performs either NN algorithm
-     * indexing/training or a query.
+     * indexing/training, a query or the insertion of new points.
      *
      * Sets the distance template based on the specified metric and performs
-     * either NN algorithm indexing or starts a query, depending on the
-     * 'perform_query' flag.
+     * the operation 'task'.
      */
     template<class MatrixType>
     void set_dist_and_start_nn(
-        bool perform_query=false,
+        Task task=Task::BUILD,
         const MatrixType &query_data=MatrixType(),
         int query_k=0,
         float query_epsilon=0
@@ -236,18 +941,167 @@ private:
      * @brief Starts the nearest neighbor search algorithm.
      *
      * This function starts the nearest neighbor search algorithm using the
-     * specified distance metric and performs either indexing/training or a
-     * query based on the 'perform_query' flag.
+     * specified distance metric and performs the operation 'task'.
      */
     template<class MatrixType, class DistType>
     void start_nn(
         DistType &dist,
-        bool perform_query,
+        Task task,
         const MatrixType &query_data,
         int query_k,
         float query_epsilon
     );
 
+    /*
+     * @brief Starts the nearest neighbor search on the training data stored
+     * in reduced precision.
+     *
+     * The overload taking std::false_type is chosen for sparse data and
+     * unsupported metrics and throws an exception.
+     */
+    template<class MatrixType, class DistType>
+    void start_nn_quantized(
+        DistType &dist,
+        Task task,
+        const MatrixType &query_data,
+        int query_k,
+        float query_epsilon,
+        std::true_type
+    );
+
+    template<class MatrixType, class DistType>
+    void start_nn_quantized(
+        DistType &dist,
+        Task task,
+        const MatrixType &query_data,
+        int query_k,
+        float query_epsilon,
+        std::false_type
+    );
+
+    /*
+     * @brief Performs the operation 'task' with the training data compressed
+     * by product quantization. Only queries use the compressed data.
+     *
+     * The overload taking std::false_type is chosen for sparse data and
+     * unsupported metrics and throws an exception.
+     */
+    template<class MatrixType, class DistType>
+    void start_nn_pq(
+        DistType &dist,
+        Task task,
+        const MatrixType &query_data,
+        int query_k,
+        float query_epsilon,
+        std::true_type
+    );
+
+    template<class MatrixType, class DistType>
+    void start_nn_pq(
+        DistType &dist,
+        Task task,
+        const MatrixType &query_data,
+        int query_k,
+        float query_epsilon,
+        std::false_type
+    );
+
+    /*
+     * @brief Performs the build, the preparation or a query with the norm
+     * based metric 'dist' evaluated from cached row norms (see
+     * 'NormCachedDist').
+     *
+     * The overload taking std::false_type is chosen for all other metrics and
+     * does nothing.
+     *
+     * @return True if the task was performed.
+     */
+    template<class MatrixType, class DistType>
+    bool start_nn_norm_cached(
+        Task task,
+        const MatrixType &query_data,
+        int query_k,
+        float query_epsilon,
+        std::true_type
+    );
+
+    template<class MatrixType, class DistType>
+    bool start_nn_norm_cached(
+        Task,
+        const MatrixType &,
+        int,
+        float,
+        std::false_type
+    )
+    {
+        return false;
+    }
+
+    /*
+     * @brief Returns the query points as needed by the metric.
+     *
+     * The dot product uses normalized points, which are stored in
+     * 'normalized_data' to leave the original data unmodified. For all other
+     * metrics 'query_data' is returned without copying it.
+     */
+    template<class MatrixType>
+    const MatrixType &metric_query_data(
+        const MatrixType &query_data, MatrixType &normalized_data
+    ) const;
+
+    /*
+     * @brief Creates the heaps collecting the 'k' nearest neighbors of
+     * 'n_queries' query points.
+     *
+     * The heaps are views of the output matrices passed to 'query', if any,
+     * so the final results are written in place.
+     */
+    HeapList<float> query_heaps(size_t n_queries, int k);
+
+    /*
+     * @brief Queries with the approximate distance 'search_dist' and
+     * re-ranks the results with 'dist' unless 'rerank' is false.
+     *
+     * The search collects 'multiplier * k' neighbors, of which the 'k'
+     * nearest by 'dist' are kept.
+     */
+    template<class SearchDistType, class DistType>
+    void query_and_rerank(
+        const Matrix<float> &query_data,
+        SearchDistType &search_dist,
+        DistType &dist,
+        int k,
+        float epsilon,
+        int multiplier
+    );
+
+    /*
+     * @brief Recomputes the distances of the current query results with
+     * 'dist' and keeps the 'k' nearest neighbors of each query point.
+     */
+    template<class MatrixType, class DistType>
+    void rerank_query(
+        const MatrixType &train_data,
+        const MatrixType &query_data,
+        DistType &dist,
+        int k
+    );
+
+    /*
+     * @brief Inserts the points 'new_data' into the index.
+     *
+     * The neighbors of the new points are seeded by a query, refined by
+     * NN-descent iterations restricted to the new points and the points whose
+     * neighborhoods changed, and the search graph is updated for these points
+     * only.
+     */
+    template<class MatrixType, class DistType>
+    void add_points(
+        MatrixType &train_data,
+        const MatrixType &new_data,
+        DistType &dist
+    );
+
     /*
      * @brief Performs the NN-d algorithm for nearest neighbor search on the
      * training data.
@@ -255,6 +1109,22 @@ private:
     template<class MatrixType, class DistType>
     void run_nn_descent(const MatrixType &train_data, const DistType &dist);
 
+    /*
+     * @brief Performs the NN-d algorithm shard by shard and writes the graph
+     * to the file 'graph_path'. Only dense data is supported.
+     */
+    template<class DistType>
+    void run_nn_descent_on_disk(
+        const Matrix<float> &train_data,
+        const DistType &dist
+    );
+
+    template<class DistType>
+    void run_nn_descent_on_disk(
+        const CSRMatrix<float> &train_data,
+        const DistType &dist
+    );
+
     /*
      * @brief Perform k-nearest neighbors search using brute force, used for
      * debugging purposes.
@@ -265,8 +1135,9 @@ private:
     /*
      * @brief Prepare the NNDescent object for querying.
      *
-     * This function is invoked the first time 'query' is called to construct
-     * a 'search_tree' and a 'pruned search_graph'.
+     * This function is invoked at the end of the index construction or the
+     * first time 'query' is called to construct a 'search_tree' and a
+     * 'pruned search_graph'.
      */
     template<class DistType>
     void prepare(const DistType &dist);
@@ -459,11 +1330,100 @@ public:
      */
     std::string algorithm;
 
+    /**
+     * The precision in which the training data is held for the distance
+     * evaluations. Available options are 'float32', 'float16', 'bfloat16' and
+     * 'int8' (scalar quantization per column). Reduced precision is supported
+     * for dense data and the metrics 'euclidean', 'sqeuclidean', 'cosine',
+     * 'alternative_cosine', 'dot', 'alternative_dot' and 'manhattan'. Query
+     * points are always used in full precision.
+     *
+     * The option 'pq' (product quantization, see 'pq_subspaces') compresses
+     * the training data for the queries only, which search the graph with
+     * table lookups on the compressed rows and re-rank the candidates with
+     * the full precision training data. The index is built in full
+     * precision. It is supported for dense data and the metrics 'euclidean',
+     * 'sqeuclidean', 'cosine' and 'dot'. Default is 'float32'.
+     */
+    std::string storage;
+
+    /**
+     * The number of subspaces of the product quantization if 'storage' is
+     * 'pq'. Each point is compressed to one byte per subspace plus its norm.
+     * The default of NONE means a fourth of the dimension.
+     */
+    int pq_subspaces;
+
+    /**
+     * Whether queries on reduced-precision data search 'RERANK_MULTIPLIER'
+     * ('PQ_RERANK_MULTIPLIER' for 'pq') times more neighbors and re-rank them
+     * with full precision distances. Default is true.
+     *
+     * With 'float16', 'bfloat16' or 'int8' and no re-ranking, the search graph
+     * is pruned on the reduced-precision data and the float32 training data
+     * is released at the end of the construction (see 'has_float_data'), so
+     * the index holds 2x or 4x less training data. Such an index cannot
+     * change 'storage' or 'rerank', insert points or be merged or reordered.
+     */
+    bool rerank;
+
+    /**
+     * The renumbering of the points for memory locality after the index
+     * construction. Available options are 'none', 'leaves' (the order of the
+     * leaves of a random projection tree), 'bfs' (breadth-first search of the
+     * nearest neighbor graph) and 'rcm' (reverse Cuthill-McKee ordering of
+     * the undirected nearest neighbor graph). The training data and
+     * 'current_graph' are stored in the new order, while 'neighbor_indices',
+     * 'neighbor_distances' and the query results refer to the original
+     * indices. Default is 'none'.
+     */
+    std::string reorder;
+
+    /**
+     * Whether the search tree and the search graph are built at the end of
+     * the index construction. Otherwise they are built by the first query.
+     * Default is true.
+     */
+    bool prepare_on_build;
+
+    /**
+     * Whether the metrics 'cosine', 'alternative_cosine' and 'true_angular'
+     * use cached row norms, such that each pair of points costs a single
+     * inner product. The norms of the training data take one float per
+     * point. Brute force always evaluates the exact metric. Default is true.
+     */
+    bool cache_norms;
+
+    /**
+     * The placement of the index on the memory of the NUMA nodes. Available
+     * options are 'none', 'local' and 'replicate'. With 'local' the threads
+     * are pinned to CPUs during the build and the queries, and the pages of
+     * the dense training data, 'current_graph' and the search graph are first
+     * touched by the thread that works on their rows, so that the graph
+     * updates of a thread read and write the memory of its own node.
+     * 'replicate' additionally keeps a copy of the search graph and the
+     * dense training data on each node, which the first query creates and
+     * the threads of the node search. This suits read-only serving and costs
+     * one copy of the index per node. Default is 'none'.
+     */
+    std::string numa;
+
     /**
      * The current nearest neighbor graph.
      */
     HeapList<float> current_graph;
 
+    /**
+     * Per-thread distance evaluations and times of the local join in the
+     * last NN-descent run.
+     */
+    ThreadLoad local_join_load;
+
+    /**
+     * Wall times and work counters of the construction and the queries.
+     */
+    Stats stats;
+
     /**
      * The indices of the nearest neighbors for each data entry.
      */
@@ -484,6 +1444,18 @@ public:
      */
     Matrix<float> query_distances;
 
+    /**
+     * The limits of the search cost of the query points, applied to all
+     * following queries. By default there are no limits.
+     */
+    QueryBudget query_budget;
+
+    /**
+     * Whether the search of each query point of the last query stopped at a
+     * limit of 'query_budget' (1) or finished (0).
+     */
+    std::vector<uint8_t> query_truncated;
+
     /**
      * Default constructor. Creates an empty object.
      */
@@ -521,18 +1493,205 @@ public:
      * @param query_data A matrix of points to query. It should have the
      * the same number of columns as 'self.data'.
      *
-     * @param k The number of nearest neighbors to return (default: 10).
-     * @param epsilon Controls the trade-off between accuracy and search cost.
-     * Larger values produce more accurate results at larger computational
-     * cost.  Values should be in the range 0.0 to 0.5, but typically not
-     * exceed 0.3 without good reason (default: 0.1).
+     * @param k The number of nearest neighbors to return (default: 10).
+     * @param epsilon Controls the trade-off between accuracy and search cost.
+     * Larger values produce more accurate results at larger computational
+     * cost.  Values should be in the range 0.0 to 0.5, but typically not
+     * exceed 0.3 without good reason (default: 0.1).
+     */
+    template<class MatrixType>
+    void query(
+        const MatrixType &query_data,
+        int k=DEFAULT_K,
+        float epsilon=DEFAULT_EPSILON
+    );
+
+    /**
+     * @brief Query the training data for the k nearest neighbors and write
+     * the results into the given matrices.
+     *
+     * Works like 'query' above, but the indices and distances are written
+     * directly into 'indices' and 'distances', which may be views of external
+     * memory (e.g. NumPy arrays). Afterwards 'query_indices' and
+     * 'query_distances' are views of these matrices.
+     *
+     * @throws std::invalid_argument if the shape of 'indices' or 'distances'
+     * is not (query_data.nrows(), k).
+     */
+    template<class MatrixType>
+    void query(
+        const MatrixType &query_data,
+        Matrix<int> &indices,
+        Matrix<float> &distances,
+        int k=DEFAULT_K,
+        float epsilon=DEFAULT_EPSILON
+    );
+
+    /**
+     * @brief Adds new points to a built index.
+     *
+     * The new points get the indices data_size, ..., data_size + n - 1 and
+     * are found by subsequent queries. The cost is proportional to the number
+     * of new points rather than to the size of the index. Only the first call
+     * copies training data that is viewed from external memory, and prepares
+     * the search graph if 'query' was not called before. The search tree is
+     * not updated, so queries reach the new points via the search graph.
+     *
+     * @param new_data The new points, dense or sparse like the training data
+     * and of the same dimension.
+     *
+     * @throws std::invalid_argument if the dimension does not match or the
+     * index was built by brute force.
+     */
+    template<class MatrixType>
+    void add_points(const MatrixType &new_data);
+
+    /**
+     * @brief Builds the nearest neighbor graph of data that does not fit into
+     * the main memory and writes it to the file 'path'.
+     *
+     * The data is processed in shards of 'shard_size' consecutive rows, so
+     * 'train_data' can be a view of a memory mapped file. First the graph of
+     * each shard is built by NN-descent. Then the shards are merged pair by
+     * pair: the graph rows of both shards are seeded with the leaves of random
+     * projection trees on their union and refined by NN-descent, keeping the
+     * neighbors in other shards. The next shard is read and the previous one
+     * written while the current pair is processed, so the data and graph rows
+     * of at most four shards are held in memory. The graph file is read and
+     * written sequentially shard by shard. The number of distance evaluations grows with the number of
+     * shard pairs.
+     *
+     * The file contains the header and the matrices of the neighbor indices
+     * and distances, each row sorted by distance, in the format of 'save'.
+     * Both can be read with BinaryReader, in place from a MappedFile.
+     *
+     * @param train_data The dense training data.
+     * @param parms The parameters. 'n_neighbors' applies to the whole data,
+     * the other defaults are chosen for a single shard.
+     * @param shard_size The number of rows per shard.
+     * @param path The graph file, which is overwritten.
+     *
+     * @throws std::invalid_argument if 'shard_size' is zero or the storage is
+     * not 'float32' or the algorithm is not 'nnd'.
+     */
+    static void build_on_disk(
+        const Matrix<float> &train_data,
+        Parms &parms,
+        size_t shard_size,
+        const std::string &path
+    );
+
+    /**
+     * @brief Merges indices built independently on shards of the training
+     * data into one index.
+     *
+     * The shards can be built in parallel, e.g. on different machines, and
+     * transferred with 'save' and 'load'. The training data of the merged
+     * index is the concatenation of the training data of the shards in the
+     * given order. The graphs of the shards are taken over as neighbors
+     * marked 'OLD', and the random projection trees on the whole data add new
+     * neighbors across the shards. Thus the NN-descent iterations only join
+     * new neighbors with the existing ones, and converge faster than a new
+     * build. Without 'tree_init' all neighbors are marked 'NEW'.
+     *
+     * The merged index is queried and saved like any other index.
+     *
+     * @param shards The indices of the shards, all dense or all sparse, of
+     * the same dimension and built with the metric of 'parms'.
+     * @param parms The parameters of the merged index. The defaults derived
+     * from the data size are chosen for the merged data.
+     *
+     * @throws std::invalid_argument if 'shards' is empty, the shards do not
+     * match or a shard has no nearest neighbor graph.
+     */
+    static NNDescent merge(
+        const std::vector<const NNDescent*> &shards,
+        Parms &parms
+    );
+
+    /**
+     * @brief Renumbers the points for memory locality.
+     *
+     * Permutes the training data, 'current_graph', the search graph and the
+     * trees, so that points close to each other are stored close to each
+     * other. This reduces cache and TLB misses of the following queries and
+     * NN-descent iterations of 'add_points'. Neighbor and query indices keep
+     * referring to the original indices. Repeated calls compose.
+     *
+     * @param method One of the options of 'reorder'.
+     *
+     * @throws std::invalid_argument if the method is invalid.
+     */
+    void reorder_points(const std::string &method);
+
+    /**
+     * @brief Returns the original index of the point in each row of the
+     * training data and 'current_graph', or an empty vector if the points
+     * were not reordered.
+     */
+    const std::vector<int> &original_indices() const { return point_ids; }
+
+    /**
+     * @brief Builds the search tree and the search graph if they do not exist
+     * yet, so that the following queries start immediately.
+     */
+    void prepare();
+
+    /**
+     * @brief Returns the dense training data (empty for sparse data and if
+     * the float32 data was released), in the order of 'original_indices'.
+     */
+    const Matrix<float> &dense_data() const { return data; }
+
+    /**
+     * @brief Returns false if the index released its float32 training data
+     * and keeps only the reduced-precision copy (see 'rerank').
+     */
+    bool has_float_data() const
+    {
+        return is_sparse || data.nrows() == data_size;
+    }
+
+    /**
+     * @brief Returns the sparse training data (empty for dense data), in the
+     * order of 'original_indices'.
+     */
+    const CSRMatrix<float> &sparse_data() const { return csr_data; }
+
+    /**
+     * @brief Writes the index to a binary output stream.
+     *
+     * The stream contains the parameters, the training data, the nearest
+     * neighbor graph and, if 'query' was called before, the search tree and
+     * the pruned search graph, so a loaded index answers queries without any
+     * preparation.
+     */
+    void save(std::ostream &out) const;
+
+    /**
+     * @brief Writes the index to the binary file 'path'.
+     */
+    void save(const std::string &path) const;
+
+    /**
+     * @brief Reads an index written by 'save' from a binary input stream.
+     *
+     * @throws std::runtime_error if the stream does not contain a valid index
+     * of the current format version.
+     */
+    static NNDescent load(std::istream &in);
+
+    /**
+     * @brief Reads an index from the binary file 'path'.
+     *
+     * @param path The file written by 'save'.
+     * @param mmap If true, the file is memory mapped and the training data
+     * and the graphs are used in place instead of being copied. The mapping
+     * is shared between all processes loading the same file, and loading
+     * takes constant time. Sparse training data and the search tree are
+     * still copied.
      */
-    template<class MatrixType>
-    void query(
-        const MatrixType &query_data,
-        int k=DEFAULT_K,
-        float epsilon=DEFAULT_EPSILON
-    );
+    static NNDescent load(const std::string &path, bool mmap=false);
 
     /*
      * @brief Prints a the parameters of an NNDescent object to an output
@@ -551,23 +1710,24 @@ void NNDescent::query_brute_force(
     int k
 )
 {
-    HeapList<float> query_nn(query_data.nrows(), k, FLOAT_MAX);
-    ProgressBar bar(query_data.nrows(), verbose);
-    #pragma omp parallel for num_threads(n_threads)
-    for (size_t idx_q = 0; idx_q < query_data.nrows(); ++idx_q)
-    {
-        bar.show();
-        for (size_t idx_t = 0; idx_t < data_size; ++idx_t)
+    HeapList<float> query_nn = query_heaps(query_data.nrows(), k);
+    brute_force_tiles(
+        query_data.nrows(),
+        data_size,
+        brute_force_block_rows(train_data),
+        [&](size_t idx_q, const int *indices, size_t n, float *out)
         {
-            float d = dist(train_data, idx_t, query_data, idx_q);
-            query_nn.simple_push(idx_q, idx_t, d);
-        }
-    }
-    query_nn.heapsort();
-    query_indices = query_nn.indices;
-    query_distances = query_nn.keys;
+            dist.one_to_many(train_data, indices, n, query_data, idx_q, out);
+        },
+        query_nn,
+        n_threads,
+        verbose
+    );
+    query_nn.parallel_heapsort(n_threads);
+    query_indices = std::move(query_nn.indices);
+    query_distances = std::move(query_nn.keys);
     correct_distances(
-        dist, query_distances, query_distances
+        dist, query_distances, query_distances, n_threads
     );
 }
 
@@ -575,27 +1735,384 @@ void NNDescent::query_brute_force(
 template<class MatrixType, class DistType>
 void NNDescent::start_nn(
     DistType &dist,
-    bool perform_query,
+    Task task,
     const MatrixType &query_data,
     int query_k,
     float query_epsilon
 )
 {
+    if (
+        !has_float_data()
+        && (
+               !releases_float_data()
+            || storage_type(storage) != quantized_data.type()
+            || (task != Task::QUERY && task != Task::PREPARE)
+        )
+    )
+    {
+        throw std::invalid_argument(
+            "The index released its float32 training data, so it supports "
+            "only queries with its storage and without re-ranking"
+        );
+    }
+    if (storage == "pq")
+    {
+        start_nn_pq(
+            dist,
+            task,
+            query_data,
+            query_k,
+            query_epsilon,
+            std::integral_constant<
+                bool,
+                std::is_same<MatrixType, Matrix<float>>::value
+                    && !std::is_void<
+                        typename pq_formula<DistType>::type
+                    >::value
+            >()
+        );
+        return;
+    }
+    if (storage != "float32")
+    {
+        start_nn_quantized(
+            dist,
+            task,
+            query_data,
+            query_k,
+            query_epsilon,
+            std::integral_constant<
+                bool,
+                std::is_same<MatrixType, Matrix<float>>::value
+                    && supports_quantized_storage<DistType>::value
+            >()
+        );
+        return;
+    }
+    typedef typename norm_cache_formula<DistType>::type Formula;
+    // Brute force gives the exact neighbors, so it keeps the exact metric.
+    if (
+        cache_norms
+        && algorithm != "bf"
+        && (
+               task == Task::BUILD
+            || task == Task::QUERY
+            || task == Task::PREPARE
+        )
+        && start_nn_norm_cached<MatrixType, DistType>(
+            task,
+            query_data,
+            query_k,
+            query_epsilon,
+            std::integral_constant<bool, !std::is_void<Formula>::value>()
+        )
+    )
+    {
+        return;
+    }
     MatrixType *data_ptr = this->get_data<MatrixType>();
-    if (perform_query)
+    switch (task)
     {
-        query(*data_ptr, query_data, dist, query_k, query_epsilon);
+        case Task::BUILD:
+            run_nn_descent(*data_ptr, dist);
+            break;
+        case Task::QUERY:
+            query(*data_ptr, query_data, dist, query_k, query_epsilon);
+            break;
+        case Task::ADD_POINTS:
+            add_points(*data_ptr, query_data, dist);
+            break;
+        case Task::BUILD_ON_DISK:
+            run_nn_descent_on_disk(*data_ptr, dist);
+            break;
+        case Task::PREPARE:
+            prepare(dist);
+            break;
     }
-    else
+}
+
+
+template<class MatrixType, class DistType>
+void NNDescent::start_nn_quantized(
+    DistType &dist,
+    Task task,
+    const MatrixType &query_data,
+    int query_k,
+    float query_epsilon,
+    std::true_type
+)
+{
+    if (
+        quantized_data.nrows() != data_size
+        || quantized_data.type() != storage_type(storage)
+    )
+    {
+        quantized_data = QuantizedMatrix(data, storage_type(storage));
+        log(
+            "Stored training data as " + storage + " ("
+                + std::to_string(quantized_data.nbytes() / (1 << 20))
+                + " MB instead of "
+                + std::to_string(data_size * data_dim * sizeof(float) / (1 << 20))
+                + " MB)",
+            verbose
+        );
+    }
+    if (task == Task::ADD_POINTS)
+    {
+        // The insertion uses full precision distances like the pruning.
+        size_t n_old = data_size;
+        add_points(data, query_data, dist);
+        quantized_data.append(
+            Matrix<float>(data_size - n_old, data_dim, data.begin(n_old))
+        );
+        return;
+    }
+    QuantizedDist<DistType> quantized_dist(dist, quantized_data, n_threads);
+    if (task == Task::BUILD)
+    {
+        run_nn_descent(data, quantized_dist);
+        return;
+    }
+    // The search graph is pruned with full precision distances, unless the
+    // float32 data is released.
+    if (search_graph.nnodes() == 0)
+    {
+        if (releases_float_data())
+        {
+            prepare(quantized_dist);
+        }
+        else
+        {
+            prepare(dist);
+        }
+    }
+    if (task == Task::PREPARE)
+    {
+        return;
+    }
+    query_and_rerank(
+        query_data,
+        quantized_dist,
+        dist,
+        query_k,
+        query_epsilon,
+        RERANK_MULTIPLIER
+    );
+}
+
+
+template<class MatrixType, class DistType>
+void NNDescent::start_nn_pq(
+    DistType &dist,
+    Task task,
+    const MatrixType &query_data,
+    int query_k,
+    float query_epsilon,
+    std::true_type
+)
+{
+    switch (task)
+    {
+        case Task::BUILD:
+            run_nn_descent(data, dist);
+            return;
+        case Task::PREPARE:
+            prepare(dist);
+            return;
+        case Task::BUILD_ON_DISK:
+            run_nn_descent_on_disk(data, dist);
+            return;
+        case Task::ADD_POINTS:
+        {
+            size_t n_old = data_size;
+            add_points(data, query_data, dist);
+            if (pq_data.nrows() == n_old)
+            {
+                pq_data.append(
+                    Matrix<float>(
+                        data_size - n_old, data_dim, data.begin(n_old)
+                    ),
+                    n_threads
+                );
+            }
+            return;
+        }
+        case Task::QUERY:
+            break;
+    }
+    if (search_graph.nnodes() == 0)
+    {
+        prepare(dist);
+    }
+    if (pq_data.nrows() != data_size)
+    {
+        size_t n_subspaces = pq_subspaces == NONE
+            ? std::max((size_t)1, data_dim / 4) : pq_subspaces;
+        pq_data = PQMatrix(data, n_subspaces, rng_state, n_threads);
+        log(
+            "Compressed training data by product quantization with "
+                + std::to_string(pq_data.nsubspaces()) + " subspaces ("
+                + std::to_string(pq_data.nbytes() / (1 << 20))
+                + " MB instead of "
+                + std::to_string(data_size * data_dim * sizeof(float) / (1 << 20))
+                + " MB)",
+            verbose
+        );
+    }
+    // One table more than searches per thread, so that the table of a search
+    // that stalls for a step is not replaced by the next one starting.
+    PQDist<DistType> pq_dist(dist, pq_data, n_threads, QUERY_LANES + 1);
+    query_and_rerank(
+        query_data,
+        pq_dist,
+        dist,
+        query_k,
+        query_epsilon,
+        PQ_RERANK_MULTIPLIER
+    );
+}
+
+
+template<class MatrixType, class DistType>
+void NNDescent::start_nn_pq(
+    DistType &,
+    Task,
+    const MatrixType &,
+    int,
+    float,
+    std::false_type
+)
+{
+    throw std::invalid_argument(
+        "Storage 'pq' is not supported for metric '" + metric + "'"
+            + (is_sparse ? " and sparse data" : "")
+    );
+}
+
+
+template<class SearchDistType, class DistType>
+void NNDescent::query_and_rerank(
+    const Matrix<float> &query_data,
+    SearchDistType &search_dist,
+    DistType &dist,
+    int k,
+    float epsilon,
+    int multiplier
+)
+{
+    if (!rerank)
+    {
+        query(data, query_data, search_dist, k, epsilon);
+        return;
+    }
+    int k_search = std::min(multiplier * k, (int)data_size);
+    // Only the re-ranked results go into the output matrices.
+    Matrix<int> *indices_out = query_indices_out;
+    Matrix<float> *distances_out = query_distances_out;
+    query_indices_out = nullptr;
+    query_distances_out = nullptr;
+    query(data, query_data, search_dist, k_search, epsilon);
+    query_indices_out = indices_out;
+    query_distances_out = distances_out;
+    rerank_query(data, query_data, dist, k);
+}
+
+
+template<class MatrixType, class DistType>
+bool NNDescent::start_nn_norm_cached(
+    Task task,
+    const MatrixType &query_data,
+    int query_k,
+    float query_epsilon,
+    std::true_type
+)
+{
+    typedef typename norm_cache_formula<DistType>::type Formula;
+    MatrixType *data_ptr = this->get_data<MatrixType>();
+    if (row_norms.size() != data_size)
+    {
+        row_norms = RowNorms(*data_ptr, n_threads);
+    }
+    RowNorms query_norms;
+    if (task == Task::QUERY)
+    {
+        query_norms = RowNorms(query_data, n_threads);
+    }
+    NormCachedDist<Formula> dist(row_norms, query_norms);
+    switch (task)
+    {
+        case Task::BUILD:
+            run_nn_descent(*data_ptr, dist);
+            break;
+        case Task::QUERY:
+            query(*data_ptr, query_data, dist, query_k, query_epsilon);
+            break;
+        case Task::PREPARE:
+            prepare(dist);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+template<class MatrixType, class DistType>
+void NNDescent::start_nn_quantized(
+    DistType &,
+    Task,
+    const MatrixType &,
+    int,
+    float,
+    std::false_type
+)
+{
+    throw std::invalid_argument(
+        "Storage '" + storage + "' is not supported for metric '" + metric
+            + "'" + (is_sparse ? " and sparse data" : "")
+    );
+}
+
+
+template<class MatrixType, class DistType>
+void NNDescent::rerank_query(
+    const MatrixType &train_data,
+    const MatrixType &query_data,
+    DistType &dist,
+    int k
+)
+{
+    MatrixType normalized_data;
+    const MatrixType &_query_data = metric_query_data(
+        query_data, normalized_data
+    );
+    HeapList<float> query_nn = query_heaps(_query_data.nrows(), k);
+    #pragma omp parallel for num_threads(n_threads)
+    for (size_t i = 0; i < query_nn.nheaps(); ++i)
     {
-        run_nn_descent(*data_ptr, dist);
+        for (size_t j = 0; j < query_indices.ncols(); ++j)
+        {
+            int idx = query_indices(i, j);
+            if (idx == NONE)
+            {
+                continue;
+            }
+            float d = dist(train_data, idx, _query_data, i);
+            query_nn.simple_push(i, idx, d);
+        }
     }
+    query_nn.parallel_heapsort(n_threads);
+    query_indices = std::move(query_nn.indices);
+    query_distances = std::move(query_nn.keys);
+    correct_distances(
+        dist, query_distances, query_distances, n_threads
+    );
 }
 
 
 template<class MatrixType>
 void NNDescent::set_dist_and_start_nn(
-    bool perform_query,
+    Task task,
     const MatrixType &query_data,
     int query_k,
     float query_epsilon
@@ -605,12 +2122,12 @@ void NNDescent::set_dist_and_start_nn(
     if (metric == "cosine")
     {
         Cosine dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "euclidean")
     {
         Euclidean dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
 
 // Useful for development as compile time is much shorter.
@@ -620,47 +2137,47 @@ void NNDescent::set_dist_and_start_nn(
     else if (metric == "alternative_cosine")
     {
         AltCosine dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "alternative_dot")
     {
         AltDot dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "alternative_jaccard")
     {
         AltJaccard dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "braycurtis")
     {
         BrayCurtis dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "canberra")
     {
         Canberra dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "chebyshev")
     {
         Chebyshev dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "dice")
     {
         Dice dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "dot")
     {
         Dot dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "hamming")
     {
         Hamming dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "haversine")
     {
@@ -672,53 +2189,53 @@ void NNDescent::set_dist_and_start_nn(
             );
         }
         Haversine dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "hellinger")
     {
         Hellinger dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "jaccard")
     {
         Jaccard dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "manhattan")
     {
         Manhattan dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "matching")
     {
         Matching dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "sokalsneath")
     {
         SokalSneath dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "spearmanr")
     {
         throw_exception_if_sparse(metric, is_sparse);
         SpearmanR dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "sqeuclidean")
     {
         SqEuclidean dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "true_angular")
     {
         TrueAngular dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "tsss")
     {
         Tsss dist;
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
 
     // METRICS WITH ONE FLOAT PARAMETER
@@ -726,60 +2243,60 @@ void NNDescent::set_dist_and_start_nn(
     {
         throw_exception_if_sparse(metric, is_sparse);
         CircularKantorovich dist(p_metric);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "minkowski")
     {
         Minkowski dist(p_metric);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "wasserstein_1d")
     {
         throw_exception_if_sparse(metric, is_sparse);
         Wasserstein dist(p_metric);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
 
     // METRICS WHERE THE SPARSE VERSION NEEDS KNOWLEDGE OF THE DIMENSION
     else if (metric == "correlation")
     {
         Correlation dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "jensen_shannon")
     {
         JensenShannon dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "kulsinski")
     {
         Kulsinski dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "rogerstanimoto")
     {
         RogersTanimoto dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "russellrao")
     {
         RussellRao dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "sokalmichener")
     {
         SokalMichener dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "symmetric_kl")
     {
         SymmetriyKL dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
     else if (metric == "yule")
     {
         Yule dist(data_dim);
-        start_nn(dist, perform_query, query_data, query_k, query_epsilon);
+        start_nn(dist, task, query_data, query_k, query_epsilon);
     }
 
 #endif // ALL_METRICS
@@ -791,14 +2308,92 @@ void NNDescent::set_dist_and_start_nn(
 }
 
 
+// Instantiated in nnd.cpp, where the algorithms called for each metric are
+// defined.
+extern template void NNDescent::set_dist_and_start_nn<Matrix<float>>(
+    NNDescent::Task, const Matrix<float>&, int, float
+);
+extern template void NNDescent::set_dist_and_start_nn<CSRMatrix<float>>(
+    NNDescent::Task, const CSRMatrix<float>&, int, float
+);
+
+
+template<class MatrixType>
+void NNDescent::query(
+    const MatrixType &query_data,
+    int k,
+    float epsilon
+)
+{
+    set_dist_and_start_nn(Task::QUERY, query_data, k, epsilon);
+    to_original_ids(query_indices);
+}
+
+
 template<class MatrixType>
 void NNDescent::query(
     const MatrixType &query_data,
+    Matrix<int> &indices,
+    Matrix<float> &distances,
     int k,
     float epsilon
 )
 {
-    set_dist_and_start_nn(true, query_data, k, epsilon);
+    if (
+        indices.nrows() != query_data.nrows()
+        || indices.ncols() != (size_t)k
+        || distances.nrows() != query_data.nrows()
+        || distances.ncols() != (size_t)k
+    )
+    {
+        throw std::invalid_argument(
+            "The result matrices must have the shape (n_queries, k)"
+        );
+    }
+    query_indices_out = &indices;
+    query_distances_out = &distances;
+    try
+    {
+        set_dist_and_start_nn(Task::QUERY, query_data, k, epsilon);
+    }
+    catch (...)
+    {
+        query_indices_out = nullptr;
+        query_distances_out = nullptr;
+        throw;
+    }
+    query_indices_out = nullptr;
+    query_distances_out = nullptr;
+    to_original_ids(query_indices);
+}
+
+
+template<class MatrixType>
+void NNDescent::add_points(const MatrixType &new_data)
+{
+    if (new_data.nrows() > 0 && new_data.ncols() != data_dim)
+    {
+        throw std::invalid_argument(
+            "The new points must have dimension " + std::to_string(data_dim)
+        );
+    }
+    set_dist_and_start_nn(Task::ADD_POINTS, new_data);
+}
+
+
+template<class MatrixType>
+const MatrixType &NNDescent::metric_query_data(
+    const MatrixType &query_data, MatrixType &normalized_data
+) const
+{
+    if (metric != "dot")
+    {
+        return query_data;
+    }
+    normalized_data = query_data;
+    normalized_data.deep_copy();
+    normalized_data.normalize();
+    return normalized_data;
 }
 
 
@@ -811,106 +2406,335 @@ void NNDescent::query(
     float epsilon
 )
 {
-    // Make shure original data cannot be modified.
-    MatrixType _query_data = query_data;
-    if (metric == "dot")
+    auto time_start = std::chrono::steady_clock::now();
+    MatrixType normalized_data;
+    const MatrixType &_query_data = metric_query_data(
+        query_data, normalized_data
+    );
+    ThreadPinning pinning(n_threads, numa != "none");
+    if (query_budget.max_seconds < 0.0 || query_budget.batch_seconds < 0.0)
     {
-        _query_data.deep_copy();
-        _query_data.normalize();
+        throw std::invalid_argument("Query time limits must be non-negative");
     }
+    query_truncated.assign(query_data.nrows(), 0);
 
     if (algorithm == "bf")
     {
         query_brute_force(train_data, _query_data, dist, k);
+        stats.n_queries += query_data.nrows();
+        stats.query_seconds += seconds_since(time_start);
         return;
     }
     // Check if search_graph already prepared.
-    if (search_graph.nheaps() == 0)
+    if (search_graph.nnodes() == 0)
     {
         prepare(dist);
+        // The query time excludes the preparation.
+        time_start = std::chrono::steady_clock::now();
     }
-    HeapList<float> query_nn(_query_data.nrows(), k, FLOAT_MAX);
-    #pragma omp parallel for num_threads(n_threads)
-    for (size_t i = 0; i < query_nn.nheaps(); ++i)
+    if (numa == "replicate")
     {
-
-        // Initialization
-        Heap<Candidate> search_candidates;
-        std::vector<bool> visited(data_size, 0);
-        std::vector<int> initial_candidates = search_tree.get_leaf(
-            _query_data, i, rng_state
-        );
-
-        for (auto const &idx : initial_candidates)
+        replicate_index(pinning);
+    }
+    if (
+        query_contexts.size() != (size_t)n_threads ||
+        query_contexts[0].visited.size() != data_size
+    )
+    {
+        query_contexts.resize(n_threads);
+        for (int thread = 0; thread < n_threads; ++thread)
         {
-            float d = dist(train_data, idx, _query_data, i);
-            // Don't need to check as indices are guaranteed to be different.
-            query_nn.simple_push(i, idx, d);
-            search_candidates.push({idx, d});
-            visited[idx] = 1;
+            query_contexts[thread].visited = VisitedSets(
+                data_size, QUERY_LANES
+            );
+            query_contexts[thread].lanes.assign(QUERY_LANES, SearchLane());
+            for (int state = 0; state < STATE_SIZE; ++state)
+            {
+                query_contexts[thread].rng_state[state] = rng_state[state]
+                    + thread + 1;
+            }
+        }
+    }
+    for (QueryContext &context : query_contexts)
+    {
+        context.dist_evals = 0;
+        context.visited_histogram.clear();
+        context.budget_hits = 0;
+        if (query_budget.target_dist_evals > 0 && context.adaptive_epsilon < 0)
+        {
+            context.adaptive_epsilon = epsilon;
         }
-        int n_random_samples = k - initial_candidates.size();
-        for (int j = 0; j < n_random_samples; ++j)
+    }
+    const QueryBudget budget = query_budget;
+    bool timed = budget.timed();
+    std::chrono::steady_clock::time_point batch_start = time_start;
+    HeapList<float> query_nn = query_heaps(_query_data.nrows(), k);
+    size_t n_queries = query_nn.nheaps();
+
+    // Each thread searches a contiguous block of query points, QUERY_LANES of
+    // them at a time. An expansion step of a search gathers the unvisited
+    // neighbors of its candidate and prefetches their data, and the distances
+    // are evaluated only after the other searches have gathered theirs. In the
+    // meantime the rows arrive in the cache, so the loads of all searches
+    // overlap instead of stalling each search at every neighbor.
+    #pragma omp parallel num_threads(n_threads)
+    {
+        int thread = omp_get_thread_num();
+        QueryContext &context = query_contexts[thread];
+        int node = graph_replicas.empty() ? 0 : pinning.nodes()[thread];
+        const CSRGraph &graph = graph_replicas.empty()
+            ? search_graph : graph_replicas[node];
+        const MatrixType &local_data = replica_data(train_data, node);
+        VisitedSets &visited = context.visited;
+        std::vector<SearchLane> &lanes = context.lanes;
+
+        // Initializes the search of the query point 'i' in lane 'l'. The
+        // searches start in the order of the query points, so the random
+        // state of the thread is used as by one search at a time.
+        auto start_search = [&](int l, size_t i)
         {
-            int idx = rand_int(rng_state) % data_size;
-            if (!visited[idx])
+            SearchLane &lane = lanes[l];
+            lane.query = i;
+            lane.active = true;
+            if (timed)
+            {
+                lane.search_start = std::chrono::steady_clock::now();
+            }
+            lane.epsilon = budget.target_dist_evals > 0
+                ? context.adaptive_epsilon : epsilon;
+            Heap<Candidate> &search_candidates = lane.search_candidates;
+            search_candidates.clear();
+            visited.clear(l);
+            IndexSpan initial_candidates = search_tree.get_leaf(
+                _query_data, i, context.rng_state
+            );
+
+            for (auto const &idx : initial_candidates)
             {
-                float d = dist(train_data, idx, _query_data, i);
+                float d = dist(local_data, idx, _query_data, i);
+                // Don't need to check as indices are guaranteed to be
+                // different.
                 query_nn.simple_push(i, idx, d);
                 search_candidates.push({idx, d});
-                visited[idx] = 1;
+                visited.insert(l, idx);
             }
-        }
-
-        // Search
-        Candidate candidate = search_candidates.pop();
-        float distance_bound = (1.0f + epsilon) * query_nn.max(i);
-        while (candidate.key < distance_bound)
+            lane.n_visited = initial_candidates.size();
+            int n_random_samples = k - initial_candidates.size();
+            for (int j = 0; j < n_random_samples; ++j)
+            {
+                int idx = rand_int(context.rng_state) % data_size;
+                if (!visited.contains(l, idx))
+                {
+                    float d = dist(local_data, idx, _query_data, i);
+                    query_nn.simple_push(i, idx, d);
+                    search_candidates.push({idx, d});
+                    visited.insert(l, idx);
+                    ++lane.n_visited;
+                }
+            }
+            lane.candidate = search_candidates.pop();
+            lane.distance_bound = (1.0f + lane.epsilon) * query_nn.max(i);
+            lane.n_expanded = 0;
+            lane.truncated = false;
+            lane.exhausted = false;
+            graph.prefetch_row(lane.candidate.idx);
+        };
+
+        // Gathers the unvisited neighbors of the candidate of lane 'l' and
+        // prefetches their data. Returns false if the search is finished.
+        auto gather = [&](int l) -> bool
         {
-            for (
-                auto it = search_graph.indices.begin(candidate.idx);
-                it != search_graph.indices.end(candidate.idx);
-                ++it
+            SearchLane &lane = lanes[l];
+            std::vector<int> &neighbors = lane.neighbors;
+            neighbors.clear();
+            if (lane.exhausted || lane.candidate.key >= lane.distance_bound)
+            {
+                return false;
+            }
+            // Stop at the first exhausted limit of the budget.
+            if (
+                (budget.max_dist_evals > 0
+                    && lane.n_visited >= budget.max_dist_evals)
+                || (budget.max_expansions > 0
+                    && lane.n_expanded >= budget.max_expansions)
+                || (timed && over_time(budget, batch_start, lane.search_start))
             )
+            {
+                lane.truncated = true;
+                return false;
+            }
+            ++lane.n_expanded;
+            int idx0 = lane.candidate.idx;
+            size_t max_neighbors = budget.max_dist_evals > 0
+                ? budget.max_dist_evals - lane.n_visited
+                : graph.degree(idx0);
+            for (const int *it = graph.begin(idx0); it != graph.end(idx0); ++it)
             {
                 int idx = *it;
-                if (idx == NONE)
+                if (visited.contains(l, idx))
                 {
-                    break;
+                    continue;
                 }
-                if (visited[idx])
+                if (neighbors.size() == max_neighbors)
                 {
-                    continue;
+                    lane.truncated = true;
+                    break;
                 }
-                visited[idx] = 1;
-                float d = dist(train_data, idx, _query_data, i);
-                if (d < distance_bound)
+                visited.insert(l, idx);
+                neighbors.push_back(idx);
+                dist.prefetch(local_data, idx);
+            }
+            return true;
+        };
+
+        // Evaluates the distances to the gathered neighbors of lane 'l' and
+        // moves on to its next candidate.
+        auto expand = [&](int l)
+        {
+            SearchLane &lane = lanes[l];
+            size_t i = lane.query;
+            std::vector<int> &neighbors = lane.neighbors;
+            lane.neighbor_distances.resize(neighbors.size());
+            dist.one_to_many(
+                local_data,
+                neighbors.data(),
+                neighbors.size(),
+                _query_data,
+                i,
+                lane.neighbor_distances.data()
+            );
+            lane.n_visited += neighbors.size();
+            for (size_t j = 0; j < neighbors.size(); ++j)
+            {
+                int idx = neighbors[j];
+                float d = lane.neighbor_distances[j];
+                if (d < lane.distance_bound)
                 {
                     query_nn.simple_push(i, idx, d);
-                    search_candidates.push({idx, d});
+                    lane.search_candidates.push({idx, d});
                     // Update bound
-                    distance_bound = (1.0f + epsilon) * query_nn.max(i);
+                    lane.distance_bound = (1.0f + lane.epsilon)
+                        * query_nn.max(i);
                 }
             }
             // The next candidate is the nearest among the search_candidates.
-            if (search_candidates.empty())
+            if (lane.search_candidates.empty())
             {
-                break;
+                lane.exhausted = true;
             }
             else
             {
-                candidate = search_candidates.pop();
+                lane.candidate = lane.search_candidates.pop();
+                graph.prefetch_row(lane.candidate.idx);
             }
-        }
+        };
 
+        // Records the statistics of the finished search of lane 'l'.
+        auto finish_search = [&](int l)
+        {
+            SearchLane &lane = lanes[l];
+            lane.active = false;
+            if (lane.truncated)
+            {
+                query_truncated[lane.query] = 1;
+                ++context.budget_hits;
+            }
+            size_t n_visited = lane.n_visited;
+            if (budget.target_dist_evals > 0)
+            {
+                // Move epsilon by at most one step towards the target.
+                float target = budget.target_dist_evals;
+                float error = (target - n_visited)
+                    / std::max(target, (float)n_visited);
+                context.adaptive_epsilon = std::min(
+                    std::max(
+                        context.adaptive_epsilon
+                            + ADAPTIVE_EPSILON_STEP * error,
+                        0.0f
+                    ),
+                    MAX_ADAPTIVE_EPSILON
+                );
+            }
+
+            // Every visited node costs one distance evaluation.
+            context.dist_evals += n_visited;
+            size_t bucket = 0;
+            while (n_visited >> (bucket + 1))
+            {
+                ++bucket;
+            }
+            if (context.visited_histogram.size() <= bucket)
+            {
+                context.visited_histogram.resize(bucket + 1, 0);
+            }
+            ++context.visited_histogram[bucket];
+        };
+
+        size_t next_query = n_queries * thread / n_threads;
+        size_t end_query = n_queries * (thread + 1) / n_threads;
+        int n_active = 0;
+        for (int l = 0; l < QUERY_LANES && next_query < end_query; ++l)
+        {
+            start_search(l, next_query++);
+            ++n_active;
+        }
+        while (n_active > 0)
+        {
+            for (int l = 0; l < QUERY_LANES; ++l)
+            {
+                // A finished search hands its lane to the next query point.
+                while (lanes[l].active && !gather(l))
+                {
+                    finish_search(l);
+                    if (next_query < end_query)
+                    {
+                        start_search(l, next_query++);
+                    }
+                    else
+                    {
+                        --n_active;
+                    }
+                }
+            }
+            for (int l = 0; l < QUERY_LANES; ++l)
+            {
+                if (lanes[l].active)
+                {
+                    expand(l);
+                }
+            }
+        }
     }
 
-    query_nn.heapsort();
-    query_indices = query_nn.indices;
-    query_distances = query_nn.keys;
+    query_nn.parallel_heapsort(n_threads);
+    query_indices = std::move(query_nn.indices);
+    query_distances = std::move(query_nn.keys);
     correct_distances(
-        dist, query_distances, query_distances
+        dist, query_distances, query_distances, n_threads
     );
+
+    float epsilon_sum = 0.0f;
+    for (const QueryContext &context : query_contexts)
+    {
+        stats.query_dist_evals += context.dist_evals;
+        stats.query_budget_hits += context.budget_hits;
+        epsilon_sum += context.adaptive_epsilon;
+        std::vector<size_t> &histogram = stats.visited_histogram;
+        if (histogram.size() < context.visited_histogram.size())
+        {
+            histogram.resize(context.visited_histogram.size(), 0);
+        }
+        for (size_t j = 0; j < context.visited_histogram.size(); ++j)
+        {
+            histogram[j] += context.visited_histogram[j];
+        }
+    }
+    if (budget.target_dist_evals > 0)
+    {
+        stats.adaptive_epsilon = epsilon_sum / query_contexts.size();
+    }
+    stats.n_queries += query_data.nrows();
+    stats.query_seconds += seconds_since(time_start);
 }
 
 
@@ -12,16 +12,69 @@ namespace nndescent
 {
 
 
-template<>
-std::tuple<std::vector<int>, std::vector<int>, std::vector<float>, float>
-random_projection_split<EuclideanSplit>(
-    const Matrix<float> &data,
-    const std::vector<int> &indices,
+/*
+ * @brief Partitions indices in place by the sign of their margin.
+ *
+ * Points with a negative margin are moved to the front (ties are broken by a
+ * coin flip). If all points end up on one side, something went wrong
+ * numerically. In this case, the points are assigned randomly; they are
+ * likely very close anyway.
+ *
+ * @param first Pointer to the first index.
+ * @param last Pointer past the last index.
+ * @param margin Function returning the margin of a point index.
+ * @param rng_state The random state used for generating random numbers.
+ *
+ * @return Pointer to the first index of the right side.
+ */
+template<class MarginFunc>
+int *partition_by_margin(
+    int *first,
+    int *last,
+    MarginFunc margin,
     RandomState &rng_state
 )
 {
-    size_t dim = data.ncols();
-    size_t size = indices.size();
+    int *middle = first;
+    for (int *it = first; it != last; ++it)
+    {
+        // Time consuming operation.
+        float m = margin(*it);
+        bool left = m < -EPS || (m <= EPS && rand_int(rng_state) % 2 == 0);
+        if (left)
+        {
+            std::iter_swap(it, middle);
+            ++middle;
+        }
+    }
+    if (middle == first || middle == last)
+    {
+        middle = first;
+        for (int *it = first; it != last; ++it)
+        {
+            if (rand_int(rng_state) % 2 == 0)
+            {
+                std::iter_swap(it, middle);
+                ++middle;
+            }
+        }
+    }
+    return middle;
+}
+
+
+/*
+ * @brief Selects two different points at random.
+ */
+void select_split_points(
+    const int *first,
+    const int *last,
+    RandomState &rng_state,
+    size_t &idx0,
+    size_t &idx1
+)
+{
+    size_t size = last - first;
 
     size_t rand0 = rand_int(rng_state) % size;
     size_t rand1 = rand_int(rng_state) % size;
@@ -32,18 +85,34 @@ random_projection_split<EuclideanSplit>(
         rand0 = (rand1 + 1) % size;
     }
 
-    size_t idx0 = indices[rand0];
-    size_t idx1 = indices[rand1];
+    idx0 = first[rand0];
+    idx1 = first[rand1];
+}
+
+
+template<>
+int *random_projection_split<EuclideanSplit>(
+    const Matrix<float> &data,
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    std::vector<float> &hyperplane_vector,
+    float &hyperplane_offset
+)
+{
+    size_t dim = data.ncols();
+    size_t idx0, idx1;
+    select_split_points(first, last, rng_state, idx0, idx1);
 
     std::vector<float> midpnt(dim);
-    std::vector<float> hyperplane_vector(dim);
+    hyperplane_vector.resize(dim);
     for (size_t i = 0; i < dim; ++i)
     {
         midpnt[i] = (data(idx0, i) + data(idx1, i)) / 2;
         hyperplane_vector[i] = data(idx0, i) - data(idx1, i);
     }
 
-    const float hyperplane_offset = std::inner_product(
+    hyperplane_offset = std::inner_product(
         hyperplane_vector.begin(),
         hyperplane_vector.end(),
         midpnt.begin(),
@@ -53,107 +122,35 @@ random_projection_split<EuclideanSplit>(
     // For each point compute the margin (project into normal vector). If we
     // are on lower side of the hyperplane put in one pile, otherwise put it in
     // the other pile (if we hit hyperplane on the nose, flip a coin)
-    std::vector<bool> side(size);
-    int cnt0 = 0;
-    int cnt1 = 0;
-
-    for (size_t i = 0; i < size; ++i)
-    {
-        // Time consuming operation.
-        float margin = std::inner_product(
-            hyperplane_vector.begin(),
-            hyperplane_vector.end(),
-            data.begin(indices[i]),
-            -hyperplane_offset
-        );
-
-        if (margin < -EPS)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else if (margin > EPS)
-        {
-            side[i] = 1;
-            ++cnt1;
-        }
-        else if (rand_int(rng_state) % 2 == 0)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else
-        {
-            side[i] = 1;
-            ++cnt1;
-        }
-    }
-
-    // If all points end up on one side, something went wrong numerically. In
-    // this case, assign points randomly; they are likely very close anyway.
-    if (cnt0 == 0 || cnt1 == 0)
-    {
-        cnt0 = 0;
-        cnt1 = 0;
-        for (size_t i = 0; i < size; ++i)
-        {
-            side[i] = rand_int(rng_state) % 2;
-            if (side[i] == 0)
-            {
-                ++cnt0;
-            }
-            else
-            {
-                ++cnt1;
-            }
-        }
-    }
-    std::vector<int> left_indices(cnt0);
-    std::vector<int> right_indices(cnt1);
-    cnt0 = 0;
-    cnt1 = 0;
-    for (size_t i = 0; i < size; ++i)
-    {
-        if (side[i] == 0)
+    const float *hyperplane = hyperplane_vector.data();
+    float offset = hyperplane_offset;
+    return partition_by_margin(
+        first,
+        last,
+        [&](int idx)
         {
-            left_indices[cnt0] = indices[i];
-            ++cnt0;
-        }
-        else
-        {
-            right_indices[cnt1] = indices[i];
-            ++cnt1;
-        }
-    }
-
-    return std::make_tuple(
-        left_indices, right_indices, hyperplane_vector, hyperplane_offset
+            return active_kernels->inner_product(
+                hyperplane, data.begin(idx), dim
+            ) - offset;
+        },
+        rng_state
     );
 }
 
 
 template<>
-std::tuple<std::vector<int>, std::vector<int>, std::vector<float>, float>
-random_projection_split<AngularSplit>(
+int *random_projection_split<AngularSplit>(
     const Matrix<float> &data,
-    const std::vector<int> &indices,
-    RandomState &rng_state
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    std::vector<float> &hyperplane_vector,
+    float &hyperplane_offset
 )
 {
     size_t dim = data.ncols();
-    size_t size = indices.size();
-
-    size_t rand0 = rand_int(rng_state) % size;
-    size_t rand1 = rand_int(rng_state) % size;
-
-    if (rand0 == rand1)
-    {
-        // Leads to non-uniform sampling but is simple and avoids looping.
-        rand0 = (rand1 + 1) % size;
-    }
-
-    size_t idx0 = indices[rand0];
-    size_t idx1 = indices[rand1];
+    size_t idx0, idx1;
+    select_split_points(first, last, rng_state, idx0, idx1);
 
     float norm0 = std::sqrt(
         std::inner_product(
@@ -177,7 +174,7 @@ random_projection_split<AngularSplit>(
 
     // Compute the normal vector to the hyperplane (the vector between
     // the two normalized points)
-    std::vector<float> hyperplane_vector(dim);
+    hyperplane_vector.resize(dim);
     for (size_t i = 0; i < dim; ++i)
     {
         hyperplane_vector[i] = data(idx0, i) / norm0
@@ -200,254 +197,88 @@ random_projection_split<AngularSplit>(
     {
         hyperplane_vector[i] = hyperplane_vector[i] / hyperplane_norm;
     }
+    hyperplane_offset = 0.0f;
 
-    // For each point compute the margin (project into normal vector). If we
-    // are on lower side of the hyperplane put in one pile, otherwise put it in
-    // the other pile (if we hit hyperplane on the nose, flip a coin)
-    std::vector<bool> side(size);
-    int cnt0 = 0;
-    int cnt1 = 0;
-
-    for (size_t i = 0; i < size; ++i)
-    {
-        // Time consuming operation.
-        float margin = std::inner_product(
-            hyperplane_vector.begin(),
-            hyperplane_vector.end(),
-            data.begin(indices[i]),
-            0.0f
-        );
-
-        if (margin < -EPS)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else if (margin > EPS)
-        {
-            side[i] = 1;
-            ++cnt1;
-        }
-        else if (rand_int(rng_state) % 2 == 0)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else
-        {
-            side[i] = 1;
-            ++cnt1;
-        }
-    }
-
-    // If all points end up on one side, something went wrong numerically. In
-    // this case, assign points randomly; they are likely very close anyway.
-    if (cnt0 == 0 || cnt1 == 0)
-    {
-        cnt0 = 0;
-        cnt1 = 0;
-        for (size_t i = 0; i < size; ++i)
-        {
-            side[i] = rand_int(rng_state) % 2;
-            if (side[i] == 0)
-            {
-                ++cnt0;
-            }
-            else
-            {
-                ++cnt1;
-            }
-        }
-    }
-
-    // Now that we have the counts allocate arrays
-    std::vector<int> left_indices(cnt0);
-    std::vector<int> right_indices(cnt1);
-    cnt0 = 0;
-    cnt1 = 0;
-
-    // Populate the arrays with graph_indices according to which
-    // side they fell on.
-    for (size_t i = 0; i < size; ++i)
-    {
-        if (side[i] == 0)
-        {
-            left_indices[cnt0] = indices[i];
-            ++cnt0;
-        }
-        else
+    const float *hyperplane = hyperplane_vector.data();
+    return partition_by_margin(
+        first,
+        last,
+        [&](int idx)
         {
-            right_indices[cnt1] = indices[i];
-            ++cnt1;
-        }
-    }
-    return std::make_tuple(left_indices, right_indices, hyperplane_vector, 0.0f);
+            return active_kernels->inner_product(
+                hyperplane, data.begin(idx), dim
+            );
+        },
+        rng_state
+    );
 }
 
 
 template<>
-std::tuple<
-    std::vector<int>,
-    std::vector<int>,
-    std::vector<size_t>,
-    std::vector<float>,
-    float
->
-sparse_random_projection_split<EuclideanSplit>(
+int *sparse_random_projection_split<EuclideanSplit>(
     const CSRMatrix<float> &data,
-    const std::vector<int> &indices,
-    RandomState &rng_state
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    std::vector<size_t> &hyperplane_ind,
+    std::vector<float> &hyperplane_data,
+    float &hyperplane_offset
 )
 {
-    size_t size = indices.size();
-
-    size_t rand0 = rand_int(rng_state) % size;
-    size_t rand1 = rand_int(rng_state) % size;
+    size_t idx0, idx1;
+    select_split_points(first, last, rng_state, idx0, idx1);
 
-    if (rand0 == rand1)
-    {
-        // Leads to non-uniform sampling but is simple and avoids looping.
-        rand0 = (rand1 + 1) % size;
-    }
-
-    size_t idx0 = indices[rand0];
-    size_t idx1 = indices[rand1];
-
-    std::vector<size_t> midpnt_col_ind;
-    std::vector<float> midpnt_data;
-
-    std::tie(midpnt_col_ind, midpnt_data) = sparse_sum(
+    sparse_diff(
         data.begin_col(idx0), data.end_col(idx0), data.begin_data(idx0),
-        data.begin_col(idx1), data.end_col(idx1), data.begin_data(idx1)
+        data.begin_col(idx1), data.end_col(idx1), data.begin_data(idx1),
+        hyperplane_ind, hyperplane_data
     );
 
-    for (float& element : midpnt_data)
-    {
-        element /= 2.0f;
-    }
-
-    std::vector<size_t> hyperplane_ind;
-    std::vector<float> hyperplane_data;
-
-    std::tie(hyperplane_ind, hyperplane_data) = sparse_diff(
-        data.begin_col(idx0), data.end_col(idx0), data.begin_data(idx0),
-        data.begin_col(idx1), data.end_col(idx1), data.begin_data(idx1)
-    );
-
-    const float hyperplane_offset = sparse_inner_product(
-        hyperplane_ind.begin(),
-        hyperplane_ind.end(),
-        hyperplane_data.begin(),
-        midpnt_col_ind.begin(),
-        midpnt_col_ind.end(),
-        midpnt_data.begin()
+    // The offset is the inner product of the hyperplane x0 - x1 with the
+    // midpoint (x0 + x1) / 2, i.e. (|x0|^2 - |x1|^2) / 2, which needs no
+    // temporary midpoint vector.
+    hyperplane_offset = 0.5f * (
+        sparse_inner_product(
+            data.begin_col(idx0), data.end_col(idx0), data.begin_data(idx0),
+            data.begin_col(idx0), data.end_col(idx0), data.begin_data(idx0)
+        ) - sparse_inner_product(
+            data.begin_col(idx1), data.end_col(idx1), data.begin_data(idx1),
+            data.begin_col(idx1), data.end_col(idx1), data.begin_data(idx1)
+        )
     );
 
-    // For each point compute the margin (project into normal vector). If we
-    // are on lower side of the hyperplane put in one pile, otherwise put it in
-    // the other pile (if we hit hyperplane on the nose, flip a coin)
-    std::vector<bool> side(size);
-    int cnt0 = 0;
-    int cnt1 = 0;
-
-    for (size_t i = 0; i < size; ++i)
-    {
-        // Time consuming operation.
-        float margin = -hyperplane_offset;
-        margin += sparse_inner_product(
-            hyperplane_ind.begin(),
-            hyperplane_ind.end(),
-            hyperplane_data.begin(),
-
-            data.begin_col(indices[i]),
-            data.end_col(indices[i]),
-            data.begin_data(indices[i])
-        );
-
-        if (margin < -EPS)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else if (margin > EPS)
-        {
-            side[i] = 1;
-            ++cnt1;
-        }
-        else if (rand_int(rng_state) % 2 == 0)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else
+    float offset = hyperplane_offset;
+    return partition_by_margin(
+        first,
+        last,
+        [&](int idx)
         {
-            side[i] = 1;
-            ++cnt1;
-        }
-    }
-
-    // If all points end up on one side, something went wrong numerically. In
-    // this case, assign points randomly; they are likely very close anyway.
-    if (cnt0 == 0 || cnt1 == 0)
-    {
-        cnt0 = 0;
-        cnt1 = 0;
-        for (size_t i = 0; i < size; ++i)
-        {
-            side[i] = rand_int(rng_state) % 2;
-            if (side[i] == 0)
-            {
-                ++cnt0;
-            }
-            else
-            {
-                ++cnt1;
-            }
-        }
-    }
-    std::vector<int> left_indices(cnt0);
-    std::vector<int> right_indices(cnt1);
-    cnt0 = 0;
-    cnt1 = 0;
-    for (size_t i = 0; i < size; ++i)
-    {
-        if (side[i] == 0)
-        {
-            left_indices[cnt0] = indices[i];
-            ++cnt0;
-        }
-        else
-        {
-            right_indices[cnt1] = indices[i];
-            ++cnt1;
-        }
-    }
-
-    return std::make_tuple(
-        left_indices,
-        right_indices,
-        hyperplane_ind,
-        hyperplane_data,
-        hyperplane_offset
+            return sparse_inner_product(
+                hyperplane_ind.begin(),
+                hyperplane_ind.end(),
+                hyperplane_data.begin(),
+                data.begin_col(idx),
+                data.end_col(idx),
+                data.begin_data(idx)
+            ) - offset;
+        },
+        rng_state
     );
 }
 
 
 template<>
-std::tuple<
-    std::vector<int>,
-    std::vector<int>,
-    std::vector<size_t>,
-    std::vector<float>,
-    float
->
-sparse_random_projection_split<AngularSplit>(
+int *sparse_random_projection_split<AngularSplit>(
     const CSRMatrix<float> &data,
-    const std::vector<int> &indices,
-    RandomState &rng_state
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    std::vector<size_t> &hyperplane_ind,
+    std::vector<float> &hyperplane_data,
+    float &hyperplane_offset
 )
 {
-    size_t size = indices.size();
+    size_t size = last - first;
 
     size_t rand0 = rand_int(rng_state) % size;
     size_t rand1 = rand_int(rng_state) % size;
@@ -458,17 +289,17 @@ sparse_random_projection_split<AngularSplit>(
         rand0 = (rand1 + 1) % size;
     }
 
-    size_t idx0 = indices[rand0];
-    size_t idx1 = indices[rand1];
+    size_t idx0 = first[rand0];
+    size_t idx1 = first[rand1];
 
     float norm0 = std::sqrt(
         sparse_inner_product(
-            data.begin_col(rand0),
-            data.end_col(rand0),
-            data.begin_data(rand0),
-            data.begin_col(rand0),
-            data.end_col(rand0),
-            data.begin_data(rand0)
+            data.begin_col(idx0),
+            data.end_col(idx0),
+            data.begin_data(idx0),
+            data.begin_col(idx0),
+            data.end_col(idx0),
+            data.begin_data(idx0)
         )
     );
     float norm1 = std::sqrt(
@@ -493,10 +324,7 @@ sparse_random_projection_split<AngularSplit>(
 
     // Compute the normal vector to the hyperplane (the vector between
     // the two normalized points)
-    std::vector<size_t> hyperplane_ind;
-    std::vector<float> hyperplane_data;
-
-    std::tie(hyperplane_ind, hyperplane_data) = sparse_weighted_diff(
+    sparse_weighted_diff(
         data.begin_col(idx0),
         data.end_col(idx0),
         data.begin_data(idx0),
@@ -504,7 +332,9 @@ sparse_random_projection_split<AngularSplit>(
         data.begin_col(idx1),
         data.end_col(idx1),
         data.begin_data(idx1),
-        norm1
+        norm1,
+        hyperplane_ind,
+        hyperplane_data
     );
 
     float hyperplane_norm = std::sqrt(
@@ -525,129 +355,176 @@ sparse_random_projection_split<AngularSplit>(
     {
         element /= hyperplane_norm;
     }
+    hyperplane_offset = 0.0f;
 
-    // For each point compute the margin (project into normal vector). If we
-    // are on lower side of the hyperplane put in one pile, otherwise put it in
-    // the other pile (if we hit hyperplane on the nose, flip a coin)
-    std::vector<bool> side(size);
-    int cnt0 = 0;
-    int cnt1 = 0;
+    return partition_by_margin(
+        first,
+        last,
+        [&](int idx)
+        {
+            return sparse_inner_product(
+                hyperplane_ind.begin(),
+                hyperplane_ind.end(),
+                hyperplane_data.begin(),
+                data.begin_col(idx),
+                data.end_col(idx),
+                data.begin_data(idx)
+            );
+        },
+        rng_state
+    );
+}
 
-    for (size_t i = 0; i < size; ++i)
-    {
-        // Time consuming operation.
-        float margin = 0.0f;
-        margin += sparse_inner_product(
-            hyperplane_ind.begin(),
-            hyperplane_ind.end(),
-            hyperplane_data.begin(),
 
-            data.begin_col(indices[i]),
-            data.end_col(indices[i]),
-            data.begin_data(indices[i])
-        );
+FlatRPTree::FlatRPTree(const RPTree &tree)
+    : leaf_size(tree.leaf_size)
+    , n_leaves(tree.n_leaves)
+{
+    size_t n_nodes = tree.nodes.size();
+    if (n_nodes == 0)
+    {
+        hyperplane_ptr.push_back(0);
+        leaf_ptr.push_back(0);
+        return;
+    }
 
-        if (margin < -EPS)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else if (margin > EPS)
-        {
-            side[i] = 1;
-            ++cnt1;
-        }
-        else if (rand_int(rng_state) % 2 == 0)
-        {
-            side[i] = 0;
-            ++cnt0;
-        }
-        else
+    // Depth-first order with the root, which is the last node, first.
+    std::vector<int> order;
+    std::vector<int> new_index(n_nodes);
+    std::vector<int> stack = {(int)n_nodes - 1};
+    order.reserve(n_nodes);
+    while (!stack.empty())
+    {
+        int node = stack.back();
+        stack.pop_back();
+        new_index[node] = order.size();
+        order.push_back(node);
+        if (tree.nodes[node].left != NONE)
         {
-            side[i] = 1;
-            ++cnt1;
+            stack.push_back(tree.nodes[node].right);
+            stack.push_back(tree.nodes[node].left);
         }
     }
 
-    // If all points end up on one side, something went wrong numerically. In
-    // this case, assign points randomly; they are likely very close anyway.
-    if (cnt0 == 0 || cnt1 == 0)
+    children.resize(2 * n_nodes);
+    offsets.resize(n_nodes);
+    hyperplane_ptr.resize(n_nodes + 1);
+    leaf_ptr.resize(n_nodes + 1);
+    size_t hyperplane_cnt = 0;
+    size_t leaf_cnt = 0;
+    bool sparse = false;
+    for (size_t i = 0; i < n_nodes; ++i)
     {
-        cnt0 = 0;
-        cnt1 = 0;
-        for (size_t i = 0; i < size; ++i)
-        {
-            side[i] = rand_int(rng_state) % 2;
-            if (side[i] == 0)
-            {
-                ++cnt0;
-            }
-            else
-            {
-                ++cnt1;
-            }
-        }
+        const RPTNode &node = tree.nodes[order[i]];
+        children[2 * i] = node.left == NONE ? NONE : new_index[node.left];
+        children[2 * i + 1] = node.right == NONE ? NONE : new_index[node.right];
+        offsets[i] = node.offset;
+        hyperplane_ptr[i] = hyperplane_cnt;
+        leaf_ptr[i] = leaf_cnt;
+        hyperplane_cnt += node.hyperplane.size();
+        leaf_cnt += node.indices.size();
+        sparse = sparse || !node.hyperplane_ind.empty();
     }
-    std::vector<int> left_indices(cnt0);
-    std::vector<int> right_indices(cnt1);
-    cnt0 = 0;
-    cnt1 = 0;
-    for (size_t i = 0; i < size; ++i)
+    hyperplane_ptr[n_nodes] = hyperplane_cnt;
+    leaf_ptr[n_nodes] = leaf_cnt;
+
+    hyperplane_data.reserve(hyperplane_cnt);
+    hyperplane_ind.reserve(sparse ? hyperplane_cnt : 0);
+    leaf_indices.reserve(leaf_cnt);
+    for (size_t i = 0; i < n_nodes; ++i)
     {
-        if (side[i] == 0)
-        {
-            left_indices[cnt0] = indices[i];
-            ++cnt0;
-        }
-        else
+        const RPTNode &node = tree.nodes[order[i]];
+        hyperplane_data.insert(
+            hyperplane_data.end(),
+            node.hyperplane.begin(),
+            node.hyperplane.end()
+        );
+        if (sparse)
         {
-            right_indices[cnt1] = indices[i];
-            ++cnt1;
+            hyperplane_ind.insert(
+                hyperplane_ind.end(),
+                node.hyperplane_ind.begin(),
+                node.hyperplane_ind.end()
+            );
         }
+        leaf_indices.insert(
+            leaf_indices.end(), node.indices.begin(), node.indices.end()
+        );
     }
-    return std::make_tuple(
-        left_indices,
-        right_indices,
-        hyperplane_ind,
-        hyperplane_data,
-        0.0f
-    );
 }
 
 
-Matrix<int> get_leaves_from_forest(
-    const std::vector<RPTree> &forest
+/*
+ * @brief Returns the child of an internal node on the side of the given
+ * margin, choosing a random child if the point lies on the hyperplane.
+ */
+inline size_t select_child(
+    const std::vector<int> &children,
+    size_t index,
+    float margin,
+    RandomState &rng_state
 )
 {
-    size_t leaf_size = forest[0].leaf_size;
-    size_t n_leaves = 0;
-    for (const auto& tree : forest)
+    if (margin < -EPS)
     {
-        n_leaves += tree.n_leaves;
+        return children[2 * index];
     }
-    Matrix<int> leaf_matrix(n_leaves, leaf_size, NONE);
+    if (margin > EPS)
+    {
+        return children[2 * index + 1];
+    }
+    return children[2 * index + rand_int(rng_state) % 2];
+}
 
-    int row = 0;
-    for (const auto& tree : forest)
+
+IndexSpan FlatRPTree::get_leaf(
+    const float *query_data,
+    RandomState &rng_state
+) const
+{
+    size_t index = 0;
+    while (children[2 * index] != NONE)
     {
-        for (const auto &node : tree.nodes)
-        {
-            if (node.indices.size() > 0)
-            {
-                for (size_t j = 0; j < node.indices.size(); ++j)
-                {
-                    leaf_matrix(row, j) = node.indices[j];
-                }
-                ++row;
-            }
-        }
+        size_t first = hyperplane_ptr[index];
+        float margin = active_kernels->inner_product(
+            hyperplane_data.data() + first,
+            query_data,
+            hyperplane_ptr[index + 1] - first
+        ) - offsets[index];
+        index = select_child(children, index, margin, rng_state);
     }
-    return leaf_matrix;
+    return leaf(index);
+}
+
+
+IndexSpan FlatRPTree::get_leaf(
+    const size_t *query_first_ind,
+    const size_t *query_last_ind,
+    const float *query_data,
+    RandomState &rng_state
+) const
+{
+    size_t index = 0;
+    while (children[2 * index] != NONE)
+    {
+        size_t first = hyperplane_ptr[index];
+        size_t last = hyperplane_ptr[index + 1];
+        float margin = sparse_inner_product(
+            hyperplane_ind.data() + first,
+            hyperplane_ind.data() + last,
+            hyperplane_data.data() + first,
+            query_first_ind,
+            query_last_ind,
+            query_data
+        ) - offsets[index];
+        index = select_child(children, index, margin, rng_state);
+    }
+    return leaf(index);
 }
 
 
 template<>
-std::vector<int> RPTree::get_leaf(
+IndexSpan FlatRPTree::get_leaf(
     const Matrix<float> &query_data,
     size_t row,
     RandomState &rng_state
@@ -658,7 +535,7 @@ std::vector<int> RPTree::get_leaf(
 
 
 template<>
-std::vector<int> RPTree::get_leaf(
+IndexSpan FlatRPTree::get_leaf(
     const CSRMatrix<float> &query_data,
     size_t row,
     RandomState &rng_state
@@ -673,6 +550,35 @@ std::vector<int> RPTree::get_leaf(
 }
 
 
+Matrix<int> get_leaves_from_forest(
+    const std::vector<FlatRPTree> &forest
+)
+{
+    size_t leaf_size = forest[0].leaf_size;
+    size_t n_leaves = 0;
+    for (const auto& tree : forest)
+    {
+        n_leaves += tree.n_leaves;
+    }
+    Matrix<int> leaf_matrix(n_leaves, leaf_size, NONE);
+
+    int row = 0;
+    for (const auto& tree : forest)
+    {
+        for (size_t i = 0; i < tree.nnodes(); ++i)
+        {
+            IndexSpan leaf = tree.leaf(i);
+            if (leaf.size() > 0)
+            {
+                std::copy(leaf.begin(), leaf.end(), leaf_matrix.begin(row));
+                ++row;
+            }
+        }
+    }
+    return leaf_matrix;
+}
+
+
 std::ostream& operator<<(std::ostream &out, const RPTNode &node)
 {
     out << "[of=" << node.offset
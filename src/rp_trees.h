@@ -26,6 +26,9 @@ class AngularSplit {};
 // Epsilon value used for random projection split.
 const float EPS = 1e-8;
 
+// Minimal number of points of a node whose subtrees are built in parallel.
+const size_t RP_TREE_TASK_SIZE = 4096;
+
 
 /*
  * @brief Counts the number of common elements between two ranges.
@@ -141,112 +144,6 @@ struct RPTNode
 class RPTree
 {
 
-private:
-
-    /*
-     * @brief Perform a nearest neighbor query on the tree.
-     *
-     * @param query_data Pointer to the beginning of the query point.
-     * @param rng_state The random state used for generating random numbers.
-     *
-     * @return The indices of the nearest neighbors.
-     */
-    std::vector<int> get_leaf(
-        float *query_data,
-        RandomState &rng_state
-    ) const
-    {
-        size_t index = get_index();
-        while (nodes[index].left != NONE)
-        {
-            const std::vector<float> &hyperplane_vector = nodes[index].hyperplane;
-            float hyperplane_offset = nodes[index].offset;
-
-            float margin = std::inner_product(
-                hyperplane_vector.begin(),
-                hyperplane_vector.end(),
-                query_data,
-                -hyperplane_offset
-            );
-
-            if (margin < -EPS)
-            {
-                index = nodes[index].left;
-            }
-            else if (margin > EPS)
-            {
-                index = nodes[index].right;
-            }
-            else if (rand_int(rng_state) % 2 == 0)
-            {
-                index = nodes[index].left;
-            }
-            else
-            {
-                index = nodes[index].right;
-            }
-        }
-        return nodes[index].indices;
-    }
-
-    /*
-     * @brief Perform a nearest neighbor query on the tree (sparse version).
-     *
-     * @param query_first_ind Pointer to the beginning of the array containing
-     * the CSR indices of the query point.
-     * @param query_last_ind Pointer to the end of the array containing the CSR
-     * indices of the query points.
-     * @param query_data Pointer to the beginning of the array containing the
-     * CSR data of the query point.
-     * query point data.
-     * @param rng_state The random state used for generating random numbers.
-     *
-     * @return The indices of the nearest neighbors.
-     */
-    std::vector<int> get_leaf(
-        size_t *query_first_ind,
-        size_t *query_last_ind,
-        float *query_data,
-        RandomState &rng_state
-    ) const
-    {
-        size_t index = get_index();
-        while (nodes[index].left != NONE)
-        {
-            std::vector<size_t> hyperplane_ind = nodes[index].hyperplane_ind;
-            std::vector<float> hyperplane_data = nodes[index].hyperplane;
-            float hyperplane_offset = nodes[index].offset;
-
-            float margin = -hyperplane_offset;
-            margin += sparse_inner_product(
-                hyperplane_ind.begin(),
-                hyperplane_ind.end(),
-                hyperplane_data.begin(),
-                query_first_ind,
-                query_last_ind,
-                query_data
-            );
-
-            if (margin < -EPS)
-            {
-                index = nodes[index].left;
-            }
-            else if (margin > EPS)
-            {
-                index = nodes[index].right;
-            }
-            else if (rand_int(rng_state) % 2 == 0)
-            {
-                index = nodes[index].left;
-            }
-            else
-            {
-                index = nodes[index].right;
-            }
-        }
-        return nodes[index].indices;
-    }
-
 public:
 
     /*
@@ -289,6 +186,27 @@ public:
         ++n_leaves;
     }
 
+    /*
+     * @brief Appends all nodes of another tree.
+     *
+     * @return The index of the root of the appended tree.
+     */
+    size_t append(RPTree &&subtree)
+    {
+        int shift = nodes.size();
+        for (RPTNode &node : subtree.nodes)
+        {
+            if (node.left != NONE)
+            {
+                node.left += shift;
+                node.right += shift;
+            }
+            nodes.push_back(std::move(node));
+        }
+        n_leaves += subtree.n_leaves;
+        return get_index();
+    }
+
     /*
      * @brief Get the index of the last added node.
      *
@@ -336,22 +254,6 @@ public:
         nodes.push_back(node);
     }
 
-    /*
-     * @brief Perform a nearest neighbor query on the tree.
-     *
-     * @param query_data The query data containing the query point.
-     * @param row The index of the query point in the query data.
-     * @param rng_state The random state used for generating random numbers.
-     *
-     * @return The indices of the nearest neighbors.
-     */
-    template<class MatrixType>
-    std::vector<int> get_leaf(
-        const MatrixType &query_data,
-        size_t row,
-        RandomState &rng_state
-    ) const;
-
     /*
      * @brief Calculate the score of the tree in comparison to the nearest
      * neighbor graph.
@@ -388,78 +290,258 @@ public:
 
 
 /*
- * @brief Performs a random projection tree split.
+ * @brief A contiguous range of point indices, e.g. the points of a leaf.
+ */
+struct IndexSpan
+{
+    const int *first;
+    const int *last;
+
+    const int *begin() const { return first; }
+    const int *end() const { return last; }
+    size_t size() const { return last - first; }
+};
+
+
+/*
+ * @brief Compact, read-only layout of a random projection tree.
+ *
+ * The nodes are stored in depth-first order starting with the root, so the
+ * left child of an internal node directly follows its parent. All hyperplanes
+ * share one array, as do the indices of all leaves; the hyperplane and the
+ * indices of node i are the ranges [hyperplane_ptr[i], hyperplane_ptr[i + 1])
+ * and [leaf_ptr[i], leaf_ptr[i + 1]) of these arrays, similar to the rows of a
+ * CSR matrix. Descending the tree and reading a leaf allocate no memory.
+ */
+class FlatRPTree
+{
+
+private:
+
+    /*
+     * @brief Descends from the root to a leaf (dense version).
+     */
+    IndexSpan get_leaf(const float *query_data, RandomState &rng_state) const;
+
+    /*
+     * @brief Descends from the root to a leaf (sparse version).
+     */
+    IndexSpan get_leaf(
+        const size_t *query_first_ind,
+        const size_t *query_last_ind,
+        const float *query_data,
+        RandomState &rng_state
+    ) const;
+
+public:
+
+    /*
+     * The maximum number of points in a leaf node.
+     */
+    size_t leaf_size;
+
+    /*
+     * The number of leaf nodes in the tree.
+     */
+    size_t n_leaves;
+
+    /*
+     * The left and right child of node i at positions 2*i and 2*i + 1, or NONE
+     * for leaves.
+     */
+    std::vector<int> children;
+
+    /*
+     * The hyperplane offsets of the nodes.
+     */
+    std::vector<float> offsets;
+
+    /*
+     * Start of the hyperplane of each node in 'hyperplane_data', followed by
+     * the total size.
+     */
+    std::vector<size_t> hyperplane_ptr;
+
+    /*
+     * The column indices of the hyperplanes used for sparse matrices, empty
+     * for dense ones.
+     */
+    std::vector<size_t> hyperplane_ind;
+
+    /*
+     * The concatenated hyperplanes.
+     */
+    std::vector<float> hyperplane_data;
+
+    /*
+     * Start of the indices of each node in 'leaf_indices', followed by the
+     * total size.
+     */
+    std::vector<size_t> leaf_ptr;
+
+    /*
+     * The concatenated indices of all leaves.
+     */
+    std::vector<int> leaf_indices;
+
+    /*
+     * @brief Default constructor builds an empty tree.
+     */
+    FlatRPTree() : leaf_size(0), n_leaves(0) {}
+
+    /*
+     * @brief Converts a tree to the flat layout.
+     */
+    explicit FlatRPTree(const RPTree &tree);
+
+    /*
+     * @brief Returns the number of nodes.
+     */
+    size_t nnodes() const { return offsets.size(); }
+
+    /*
+     * @brief Returns the indices of node i, which are empty for internal
+     * nodes.
+     */
+    IndexSpan leaf(size_t i) const
+    {
+        const int *first = leaf_indices.data();
+        return {first + leaf_ptr[i], first + leaf_ptr[i + 1]};
+    }
+
+    /*
+     * @brief Finds the leaf of a query point.
+     *
+     * Points on a hyperplane are assigned to a random side.
+     *
+     * @param query_data The query data containing the query point.
+     * @param row The index of the query point in the query data.
+     * @param rng_state The random state used for generating random numbers.
+     *
+     * @return The indices of the leaf, which are valid as long as the tree.
+     */
+    template<class MatrixType>
+    IndexSpan get_leaf(
+        const MatrixType &query_data,
+        size_t row,
+        RandomState &rng_state
+    ) const;
+};
+
+
+/*
+ * @brief Performs a random projection tree split in place.
  *
  * This function performs a random projection tree split on the given data
  * indices by selecting two points at random and splitting along the hyperplane
  * that goes through the midpoint between the two points and is normal to their
- * difference.
+ * difference. The indices are reordered such that the left side precedes the
+ * right side.
  *
  * @tparam SplitType The split type to use for the split, which can be either
  * EuclideanSplit or AngularSplit.
  *
  * @param data The input data matrix.
- * @param indices The indices of the data points to perform the split on.
+ * @param first Pointer to the first index of the data points to split.
+ * @param last Pointer past the last index of the data points to split.
  * @param rng_state The random state used for generating random numbers.
+ * @param hyperplane Output of the hyperplane normal vector.
+ * @param offset Output of the hyperplane offset.
  *
- * @return A tuple containing the left child indices, right child indices,
- * hyperplane normal vector, and hyperplane offset.
+ * @return Pointer to the first index of the right side.
  */
 template<class SplitType>
-std::tuple<std::vector<int>, std::vector<int>, std::vector<float>, float>
-random_projection_split(
+int *random_projection_split(
     const Matrix<float> &data,
-    const std::vector<int> &indices,
-    RandomState &rng_state
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    std::vector<float> &hyperplane,
+    float &offset
 );
 
 
 /*
- * @brief Performs a random projection tree split (sparse version).
- *
- * This function performs a random projection tree split on the given data
- * indices by selecting two points at random and splitting along the hyperplane
- * that goes through the midpoint between the two points and is normal to their
- * difference.
- *
- * @tparam SplitType The split type to use for the split, which can be either
- * EuclideanSplit or AngularSplit.
+ * @brief Performs a random projection tree split in place (sparse version).
  *
  * @param data The input sparse CSR matrix.
- * @param indices The indices of the data points to perform the split on.
+ * @param first Pointer to the first index of the data points to split.
+ * @param last Pointer past the last index of the data points to split.
  * @param rng_state The random state used for generating random numbers.
+ * @param hyperplane_ind Output of the hyperplane normal vector CSR-indices.
+ * @param hyperplane_data Output of the hyperplane normal vector CSR-data.
+ * @param offset Output of the hyperplane offset.
  *
- * @return A tuple containing the left child indices, right child indices,
- * hyperplane normal vector CSR-indices, hyperplane normal vector CSR-data, and
- * hyperplane offset.
+ * @return Pointer to the first index of the right side.
  */
 template<class SplitType>
-std::tuple<
-    std::vector<int>,
-    std::vector<int>,
-    std::vector<size_t>,
-    std::vector<float>,
-    float
->
-sparse_random_projection_split(
+int *sparse_random_projection_split(
     const CSRMatrix<float> &data,
-    const std::vector<int> &indices,
-    RandomState &rng_state
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    std::vector<size_t> &hyperplane_ind,
+    std::vector<float> &hyperplane_data,
+    float &offset
 );
 
 
+/*
+ * @brief Splits the data points and stores the hyperplane in 'node'.
+ */
+template<class SplitType>
+int *split_node(
+    const Matrix<float> &data,
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    RPTNode &node
+)
+{
+    return random_projection_split<SplitType>(
+        data, first, last, rng_state, node.hyperplane, node.offset
+    );
+}
+
+
+template<class SplitType>
+int *split_node(
+    const CSRMatrix<float> &data,
+    int *first,
+    int *last,
+    RandomState &rng_state,
+    RPTNode &node
+)
+{
+    return sparse_random_projection_split<SplitType>(
+        data,
+        first,
+        last,
+        rng_state,
+        node.hyperplane_ind,
+        node.hyperplane,
+        node.offset
+    );
+}
+
+
 /*
  * @brief Builds a random projection tree by recursively splitting.
  *
  * This function builds a random projection tree by recursively splitting the
- * data using random projection.
+ * data in place. Both subtrees of a node with at least RP_TREE_TASK_SIZE
+ * points are built as separate OpenMP tasks into their own trees, which are
+ * appended afterwards. For such nodes the right subtree uses a new random
+ * state drawn from the current one, so the tree does not depend on the
+ * number of threads.
  *
  * @tparam SplitType The split type to use for the split.
  * @tparam MatrixType The matrix type (either dense or sparse).
  *
  * @param rp_tree The random projection tree object to build.
  * @param data The input data matrix.
- * @param indices The indices of the data points to consider for splitting.
+ * @param first Pointer to the first index of the data points to split.
+ * @param last Pointer past the last index of the data points to split.
  * @param leaf_size The maximum number of points in a leaf node.
  * @param rng_state The random state used for generating random numbers.
  * @param max_depth The maximum depth of the tree (default: 100).
@@ -468,137 +550,62 @@ template<class SplitType, class MatrixType>
 void build_rp_tree_recursively(
     RPTree &rp_tree,
     const MatrixType &data,
-    std::vector<int> indices,
-    unsigned int leaf_size,
-    RandomState &rng_state,
-    int max_depth=100
-);
-
-
-template<class SplitType>
-void build_rp_tree_recursively(
-    RPTree &rp_tree,
-    const Matrix<float> &data,
-    std::vector<int> indices,
+    int *first,
+    int *last,
     unsigned int leaf_size,
     RandomState &rng_state,
     int max_depth=100
 )
 {
-    if (indices.size() <= leaf_size)
+    size_t size = last - first;
+    if (size <= leaf_size)
     {
-        rp_tree.add_leaf(indices);
+        rp_tree.add_leaf(std::vector<int>(first, last));
         return;
     }
     if (max_depth <= 0)
     {
         // Prune leaf to 'leaf_size'.
-        int parent_size = std::min(leaf_size, (unsigned int)indices.size());
-        indices.resize(parent_size);
-        rp_tree.add_leaf(indices);
+        rp_tree.add_leaf(std::vector<int>(first, first + leaf_size));
         return;
     }
 
-    std::vector<int> left_indices;
-    std::vector<int> right_indices;
-    std::vector<float> hyperplane;
-    float offset;
-
-    std::tie(
-        left_indices, right_indices, hyperplane, offset
-    ) = random_projection_split<SplitType>(
-        data,
-        indices,
-        rng_state
-    );
+    RPTNode node(NONE, NONE, 0.0f, {}, {});
+    int *middle = split_node<SplitType>(data, first, last, rng_state, node);
 
-    build_rp_tree_recursively<SplitType>(
-        rp_tree,
-        data,
-        left_indices,
-        leaf_size,
-        rng_state,
-        max_depth - 1
-    );
-
-    size_t left_subtree = rp_tree.get_index();
-
-    build_rp_tree_recursively<SplitType>(
-        rp_tree,
-        data,
-        right_indices,
-        leaf_size,
-        rng_state,
-        max_depth - 1
-    );
-
-    size_t right_subtree = rp_tree.get_index();
-    rp_tree.add_node(left_subtree, right_subtree, offset, hyperplane);
-}
-
-
-template<class SplitType>
-void build_rp_tree_recursively(
-    RPTree &rp_tree,
-    const CSRMatrix<float> &data,
-    std::vector<int> indices,
-    unsigned int leaf_size,
-    RandomState &rng_state,
-    int max_depth=100
-)
-{
-    if (indices.size() <= leaf_size)
+    if (size < RP_TREE_TASK_SIZE)
     {
-        rp_tree.add_leaf(indices);
+        build_rp_tree_recursively<SplitType>(
+            rp_tree, data, first, middle, leaf_size, rng_state, max_depth - 1
+        );
+        node.left = rp_tree.get_index();
+        build_rp_tree_recursively<SplitType>(
+            rp_tree, data, middle, last, leaf_size, rng_state, max_depth - 1
+        );
+        node.right = rp_tree.get_index();
+        rp_tree.nodes.push_back(std::move(node));
         return;
     }
-    if (max_depth <= 0)
+
+    RandomState right_rng_state;
+    for (int state = 0; state < STATE_SIZE; ++state)
     {
-        // Prune leaf to 'leaf_size'.
-        int parent_size = std::min(leaf_size, (unsigned int)indices.size());
-        indices.resize(parent_size);
-        rp_tree.add_leaf(indices);
-        return;
+        right_rng_state[state] = rand_int(rng_state);
     }
-
-    std::vector<int> left_indices;
-    std::vector<int> right_indices;
-    std::vector<size_t> hyperplane_ind;
-    std::vector<float> hyperplane_data;
-    float offset;
-
-    std::tie(
-        left_indices, right_indices, hyperplane_ind, hyperplane_data, offset
-    ) = sparse_random_projection_split<SplitType>(
-        data,
-        indices,
-        rng_state
-    );
-
+    RPTree left_tree(leaf_size);
+    RPTree right_tree(leaf_size);
+    #pragma omp task shared(left_tree, data, rng_state)
     build_rp_tree_recursively<SplitType>(
-        rp_tree,
-        data,
-        left_indices,
-        leaf_size,
-        rng_state,
-        max_depth - 1
+        left_tree, data, first, middle, leaf_size, rng_state, max_depth - 1
     );
-
-    size_t left_subtree = rp_tree.get_index();
-
     build_rp_tree_recursively<SplitType>(
-        rp_tree,
-        data,
-        right_indices,
-        leaf_size,
-        rng_state,
+        right_tree, data, middle, last, leaf_size, right_rng_state,
         max_depth - 1
     );
-
-    size_t right_subtree = rp_tree.get_index();
-    rp_tree.add_node(
-        left_subtree, right_subtree, offset, hyperplane_ind, hyperplane_data
-    );
+    #pragma omp taskwait
+    node.left = rp_tree.append(std::move(left_tree));
+    node.right = rp_tree.append(std::move(right_tree));
+    rp_tree.nodes.push_back(std::move(node));
 }
 
 
@@ -606,7 +613,8 @@ void build_rp_tree_recursively(
  * @brief Builds a random projection tree.
  *
  * This function builds a random projection tree. The tree partitions the data
- * points into leaves using random projections.
+ * points into leaves using random projections. Large trees are built by
+ * several OpenMP tasks if called from within a parallel region.
  *
  * @tparam MatrixType The matrix type (either dense or sparse).
  *
@@ -627,27 +635,21 @@ RPTree build_rp_tree(
 {
     RPTree rp_tree(leaf_size);
 
+    // The permutation of all points, which is partitioned in place.
     std::vector<int> all_points (data.nrows());
-    // all_points = [0,1,2,...]
     std::iota(all_points.begin(), all_points.end(), 0);
+    int *first = all_points.data();
+    int *last = first + all_points.size();
     if (angular)
     {
         build_rp_tree_recursively<AngularSplit>(
-            rp_tree,
-            data,
-            all_points,
-            leaf_size,
-            rng_state
+            rp_tree, data, first, last, leaf_size, rng_state
         );
     }
     else
     {
         build_rp_tree_recursively<EuclideanSplit>(
-            rp_tree,
-            data,
-            all_points,
-            leaf_size,
-            rng_state
+            rp_tree, data, first, last, leaf_size, rng_state
         );
     }
 
@@ -660,7 +662,9 @@ RPTree build_rp_tree(
  *
  * This function builds a vector of random projection trees. The forest
  * consists of multiple random projection trees, each constructed
- * independently.
+ * independently. Each tree is an OpenMP task that spawns further tasks for
+ * its large subtrees, so the build uses all threads even if there are fewer
+ * trees than threads.
  *
  * @tparam MatrixType The matrix type (either dense or sparse).
  *
@@ -669,27 +673,31 @@ RPTree build_rp_tree(
  * @param leaf_size The maximum number of points in a leaf node for each tree.
  * @param rng_state The random state used for generating random numbers.
  *
- * @return The constructed forest of random projection trees.
+ * @return The constructed forest of random projection trees in flat layout.
  */
 template<class MatrixType>
-std::vector<RPTree> make_forest(
+std::vector<FlatRPTree> make_forest(
     const MatrixType &data,
     int n_trees,
     int leaf_size,
     const RandomState &rng_state
 )
 {
-    std::vector<RPTree> forest(n_trees);
-    #pragma omp parallel for
+    std::vector<FlatRPTree> forest(n_trees);
+    #pragma omp parallel
+    #pragma omp single
     for (int i = 0; i < n_trees; ++i)
     {
-        RandomState local_rng_state;
-        for (int state = 0; state < STATE_SIZE; ++state)
+        #pragma omp task shared(forest, data, rng_state)
         {
-            local_rng_state[state] = rng_state[state] + i + 1;
+            RandomState local_rng_state;
+            for (int state = 0; state < STATE_SIZE; ++state)
+            {
+                local_rng_state[state] = rng_state[state] + i + 1;
+            }
+            RPTree tree = build_rp_tree(data, leaf_size, local_rng_state);
+            forest[i] = FlatRPTree(tree);
         }
-        RPTree tree = build_rp_tree(data, leaf_size, local_rng_state);
-        forest[i] = tree;
     }
     return forest;
 }
@@ -708,7 +716,7 @@ std::vector<RPTree> make_forest(
  *
  * @return A matrix containing the extracted leaves.
  */
-Matrix<int> get_leaves_from_forest(const std::vector<RPTree> &forest);
+Matrix<int> get_leaves_from_forest(const std::vector<FlatRPTree> &forest);
 
 
 /*
@@ -0,0 +1,518 @@
+/**
+ * @file serialize.cpp
+ *
+ * @brief Binary serialization of the data structures of an index.
+ */
+
+
+#include "serialize.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define NND_HAVE_MMAP
+#endif
+
+
+namespace nndescent
+{
+
+
+#ifdef NND_HAVE_MMAP
+
+MappedFile::MappedFile(const std::string &path)
+    : m_data(nullptr)
+    , m_size(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open '" + path + "' for reading");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error(
+            "Cannot determine the size of '" + path + "'"
+        );
+    }
+    m_size = st.st_size;
+    if (m_size > 0)
+    {
+        void *ptr = mmap(
+            nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0
+        );
+        if (ptr == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Cannot map '" + path + "' into memory");
+        }
+        m_data = static_cast<char*>(ptr);
+    }
+    // The mapping stays valid after closing the file descriptor.
+    close(fd);
+}
+
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+    {
+        munmap(m_data, m_size);
+    }
+}
+
+
+/*
+ * @brief Reads or writes 'n_bytes' at 'offset' of the file 'fd', continuing
+ * after partial transfers.
+ *
+ * @return False if the transfer failed.
+ */
+template<class Transfer, class Buffer>
+bool transfer_all(
+    Transfer transfer, int fd, Buffer buffer, size_t n_bytes, size_t offset
+)
+{
+    while (n_bytes > 0)
+    {
+        ssize_t done = transfer(fd, buffer, n_bytes, offset);
+        if (done <= 0)
+        {
+            return false;
+        }
+        buffer += done;
+        n_bytes -= done;
+        offset += done;
+    }
+    return true;
+}
+
+
+/*
+ * @brief Returns the smallest multiple of ARRAY_ALIGNMENT not less than
+ * 'position'.
+ */
+size_t aligned(size_t position)
+{
+    return (position + ARRAY_ALIGNMENT - 1) / ARRAY_ALIGNMENT * ARRAY_ALIGNMENT;
+}
+
+
+GraphFile::GraphFile(const std::string &path, size_t n_rows, size_t n_cols)
+    : n_rows(n_rows)
+    , n_cols(n_cols)
+{
+    // Header and shape of the indices, shape of the keys.
+    size_t header_size = 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    size_t shape_size = 2 * sizeof(uint64_t);
+    indices_offset = aligned(header_size);
+    keys_offset = aligned(
+        indices_offset + n_rows * n_cols * sizeof(int) + shape_size
+    );
+    size_t file_size = keys_offset + n_rows * n_cols * sizeof(float);
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open '" + path + "' for writing");
+    }
+    uint32_t header[2] = {FILE_MAGIC, FORMAT_VERSION};
+    uint64_t shape[2] = {n_rows, n_cols};
+    const char *shape_bytes = reinterpret_cast<const char*>(shape);
+    size_t indices_end = indices_offset + n_rows * n_cols * sizeof(int);
+    // The padding is zero filled by ftruncate.
+    bool success = ftruncate(fd, file_size) == 0
+        && transfer_all(
+            pwrite, fd, reinterpret_cast<const char*>(header),
+            sizeof(header), 0
+        )
+        && transfer_all(pwrite, fd, shape_bytes, shape_size, sizeof(header))
+        && transfer_all(pwrite, fd, shape_bytes, shape_size, indices_end);
+    if (!success)
+    {
+        close(fd);
+        throw std::runtime_error("Cannot create graph file '" + path + "'");
+    }
+}
+
+
+GraphFile::~GraphFile()
+{
+    close(fd);
+}
+
+
+void GraphFile::read_rows(size_t first, HeapList<float> &heaps) const
+{
+    size_t n_values = heaps.nheaps() * n_cols;
+    size_t row_offset = first * n_cols;
+    bool success = first + heaps.nheaps() <= n_rows
+        && heaps.nnodes() == n_cols
+        && transfer_all(
+            pread, fd, reinterpret_cast<char*>(heaps.indices.m_ptr),
+            n_values * sizeof(int), indices_offset + row_offset * sizeof(int)
+        )
+        && transfer_all(
+            pread, fd, reinterpret_cast<char*>(heaps.keys.m_ptr),
+            n_values * sizeof(float), keys_offset + row_offset * sizeof(float)
+        );
+    if (!success)
+    {
+        throw std::runtime_error("Reading the graph file failed");
+    }
+}
+
+
+void GraphFile::write_rows(size_t first, const HeapList<float> &heaps)
+{
+    size_t n_values = heaps.nheaps() * n_cols;
+    size_t row_offset = first * n_cols;
+    bool success = first + heaps.nheaps() <= n_rows
+        && heaps.nnodes() == n_cols
+        && transfer_all(
+            pwrite, fd, reinterpret_cast<const char*>(heaps.indices.m_ptr),
+            n_values * sizeof(int), indices_offset + row_offset * sizeof(int)
+        )
+        && transfer_all(
+            pwrite, fd, reinterpret_cast<const char*>(heaps.keys.m_ptr),
+            n_values * sizeof(float), keys_offset + row_offset * sizeof(float)
+        );
+    if (!success)
+    {
+        throw std::runtime_error("Writing the graph file failed");
+    }
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &)
+    : m_data(nullptr)
+    , m_size(0)
+{
+    throw std::runtime_error(
+        "Memory mapped files are not supported on this platform"
+    );
+}
+
+
+MappedFile::~MappedFile()
+{
+}
+
+
+GraphFile::GraphFile(const std::string &, size_t n_rows, size_t n_cols)
+    : fd(-1)
+    , n_rows(n_rows)
+    , n_cols(n_cols)
+{
+    throw std::runtime_error("Graph files are not supported on this platform");
+}
+
+
+GraphFile::~GraphFile()
+{
+}
+
+
+void GraphFile::read_rows(size_t, HeapList<float>&) const
+{
+}
+
+
+void GraphFile::write_rows(size_t, const HeapList<float>&)
+{
+}
+
+#endif
+
+
+void BinaryWriter::align()
+{
+    static const char zeros[ARRAY_ALIGNMENT] = {};
+    size_t padding = (ARRAY_ALIGNMENT - position % ARRAY_ALIGNMENT)
+        % ARRAY_ALIGNMENT;
+    write_array(zeros, padding);
+}
+
+
+void BinaryWriter::write_header()
+{
+    write(FILE_MAGIC);
+    write(FORMAT_VERSION);
+}
+
+
+void BinaryWriter::write(const std::string &str)
+{
+    write<uint64_t>(str.size());
+    write_array(str.data(), str.size());
+}
+
+
+void BinaryWriter::write(const CSRMatrix<float> &matrix)
+{
+    // Written like vectors, as the matrix may be a view of external arrays.
+    static const size_t no_rows_ptr = 0;
+    size_t nnz = matrix.nnz();
+    size_t n_ptr = matrix.nrows() + 1;
+    write<uint64_t>(matrix.nrows());
+    write<uint64_t>(matrix.ncols());
+    write<uint64_t>(nnz);
+    write_array(matrix.m_ptr_data, nnz);
+    write<uint64_t>(nnz);
+    write_array(matrix.m_ptr_col_ind, nnz);
+    write<uint64_t>(n_ptr);
+    write_array(
+        matrix.nrows() == 0 ? &no_rows_ptr : matrix.m_ptr_row_ptr, n_ptr
+    );
+}
+
+
+void BinaryWriter::write(const QuantizedMatrix &matrix)
+{
+    write<uint64_t>(matrix.m_rows);
+    write<uint64_t>(matrix.m_cols);
+    write<uint8_t>((uint8_t)matrix.m_type);
+    write(matrix.m_half);
+    write(matrix.m_int8);
+    write(matrix.m_offset);
+    write(matrix.m_scale);
+}
+
+
+void BinaryWriter::write(const FlatRPTree &tree)
+{
+    write<uint64_t>(tree.leaf_size);
+    write<uint64_t>(tree.n_leaves);
+    write(tree.children);
+    write(tree.offsets);
+    write(tree.hyperplane_ptr);
+    write(tree.hyperplane_ind);
+    write(tree.hyperplane_data);
+    write(tree.leaf_ptr);
+    write(tree.leaf_indices);
+}
+
+
+void BinaryReader::align()
+{
+    char padding[ARRAY_ALIGNMENT];
+    read_array(
+        padding,
+        (ARRAY_ALIGNMENT - position % ARRAY_ALIGNMENT) % ARRAY_ALIGNMENT
+    );
+}
+
+
+void BinaryReader::read_header()
+{
+    uint32_t magic, version;
+    read(magic);
+    if (magic != FILE_MAGIC)
+    {
+        throw std::runtime_error("Not an index file of nndescent");
+    }
+    read(version);
+    if (version != FORMAT_VERSION)
+    {
+        throw std::runtime_error(
+            "Unsupported index file version " + std::to_string(version)
+                + " (expected " + std::to_string(FORMAT_VERSION) + ")"
+        );
+    }
+}
+
+
+void BinaryReader::read(std::string &str)
+{
+    uint64_t size;
+    read(size);
+    checked_bytes<char>(size);
+    str.resize(size);
+    read_array(&str[0], size);
+}
+
+
+/*
+ * @brief Checks that 'ptr' holds n + 1 non-decreasing offsets ending at
+ * 'size'.
+ */
+bool valid_offsets(const std::vector<size_t> &ptr, size_t n, size_t size)
+{
+    if (ptr.size() != n + 1 || ptr[0] != 0 || ptr[n] != size)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (ptr[i] > ptr[i + 1])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void BinaryReader::read(CSRMatrix<float> &matrix)
+{
+    uint64_t rows, cols;
+    std::vector<float> data;
+    std::vector<size_t> col_ind;
+    std::vector<size_t> row_ptr;
+    read(rows);
+    read(cols);
+    read(data);
+    read(col_ind);
+    read(row_ptr);
+    bool valid = rows < SIZE_MAX
+        && col_ind.size() == data.size()
+        && valid_offsets(row_ptr, rows, data.size());
+    for (size_t i = 0; valid && i < col_ind.size(); ++i)
+    {
+        valid = col_ind[i] < cols;
+    }
+    if (!valid)
+    {
+        throw std::runtime_error("Inconsistent sparse matrix in index file");
+    }
+    matrix = CSRMatrix<float>(rows, cols, data, col_ind, row_ptr);
+}
+
+
+void BinaryReader::read(CSRGraph &graph)
+{
+    Matrix<size_t> offsets;
+    Matrix<int> indices;
+    read(offsets);
+    read(indices);
+    bool valid = (offsets.nrows() == 0 && indices.nrows() == 0)
+        || (
+            offsets.ncols() == 1
+            && (indices.nrows() == 0 || indices.ncols() == 1)
+            && offsets(0, 0) == 0
+            && offsets(offsets.nrows() - 1, 0) == indices.nrows()
+        );
+    for (size_t i = 1; valid && i < offsets.nrows(); ++i)
+    {
+        valid = offsets(i - 1, 0) <= offsets(i, 0);
+    }
+    if (!valid)
+    {
+        throw std::runtime_error("Inconsistent graph in index file");
+    }
+    graph = CSRGraph(std::move(offsets), std::move(indices));
+}
+
+
+void BinaryReader::read(QuantizedMatrix &matrix)
+{
+    uint64_t rows, cols;
+    uint8_t type;
+    QuantizedMatrix result;
+    read(rows);
+    read(cols);
+    read(type);
+    read(result.m_half);
+    read(result.m_int8);
+    read(result.m_offset);
+    read(result.m_scale);
+    result.m_rows = rows;
+    result.m_cols = cols;
+    result.m_type = (StorageType)type;
+    bool valid = cols == 0 || rows <= SIZE_MAX / cols;
+    switch (result.m_type)
+    {
+        case StorageType::FLOAT16:
+        case StorageType::BFLOAT16:
+            valid = valid
+                && result.m_half.size() == rows * cols
+                && result.m_int8.empty()
+                && result.m_offset.empty()
+                && result.m_scale.empty();
+            break;
+        case StorageType::INT8:
+            valid = valid
+                && result.m_int8.size() == rows * cols
+                && result.m_half.empty()
+                && result.m_offset.size() == cols
+                && result.m_scale.size() == cols;
+            break;
+        default:
+            valid = false;
+    }
+    if (!valid)
+    {
+        throw std::runtime_error(
+            "Inconsistent reduced-precision data in index file"
+        );
+    }
+    matrix = std::move(result);
+}
+
+
+void BinaryReader::read(PQMatrix &matrix)
+{
+    PQMatrix result;
+    read(result.centroids);
+    read(result.codes);
+    read(result.sq_norms);
+    bool valid = result.centroids.ncols() == PQ_CENTROIDS
+        && result.nsubspaces() > 0
+        && result.nsubspaces() <= result.ncols()
+        && result.sq_norms.nrows() == result.nrows()
+        && result.sq_norms.ncols() == 1;
+    if (!valid)
+    {
+        throw std::runtime_error(
+            "Inconsistent product quantization in index file"
+        );
+    }
+    matrix = std::move(result);
+}
+
+
+void BinaryReader::read(FlatRPTree &tree)
+{
+    uint64_t leaf_size, n_leaves;
+    read(leaf_size);
+    read(n_leaves);
+    tree.leaf_size = leaf_size;
+    tree.n_leaves = n_leaves;
+    read(tree.children);
+    read(tree.offsets);
+    read(tree.hyperplane_ptr);
+    read(tree.hyperplane_ind);
+    read(tree.hyperplane_data);
+    read(tree.leaf_ptr);
+    read(tree.leaf_indices);
+
+    size_t n_nodes = tree.offsets.size();
+    bool valid = tree.children.size() == 2 * n_nodes
+        && valid_offsets(
+            tree.hyperplane_ptr, n_nodes, tree.hyperplane_data.size()
+        )
+        && valid_offsets(tree.leaf_ptr, n_nodes, tree.leaf_indices.size())
+        && (
+            tree.hyperplane_ind.empty()
+            || tree.hyperplane_ind.size() == tree.hyperplane_data.size()
+        );
+    for (size_t i = 0; valid && i < tree.children.size(); ++i)
+    {
+        int child = tree.children[i];
+        // Children follow their parent in depth-first order.
+        valid = child == NONE
+            || ((size_t)child > i / 2 && (size_t)child < n_nodes);
+    }
+    if (!valid)
+    {
+        throw std::runtime_error("Inconsistent tree in index file");
+    }
+}
+
+
+} // namespace nndescent
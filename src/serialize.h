@@ -0,0 +1,417 @@
+/**
+ * @file serialize.h
+ *
+ * @brief Binary serialization of the data structures of an index.
+ *
+ * All values are written in the native byte order of the machine. Arrays are
+ * preceded by their length, so a file can be read sequentially without any
+ * seeking. The payload of every matrix starts at a multiple of
+ * ARRAY_ALIGNMENT bytes from the beginning of the file, which allows to use
+ * the matrices of a memory mapped file in place.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "dtypes.h"
+#include "rp_trees.h"
+
+
+namespace nndescent
+{
+
+
+// Identifies a file containing a serialized index.
+const uint32_t FILE_MAGIC = 0x49444e4e; // "NNDI" in little-endian order
+
+// Version of the binary format. Incremented on incompatible changes.
+const uint32_t FORMAT_VERSION = 7;
+
+// Alignment in bytes of the matrix payloads within a file.
+const size_t ARRAY_ALIGNMENT = 64;
+
+
+/*
+ * @brief A read-only memory mapping of a whole file.
+ *
+ * The pages are mapped copy-on-write, so the mapping is shared between all
+ * processes reading the same file and modifications stay private.
+ */
+class MappedFile
+{
+private:
+
+    char *m_data;
+
+    size_t m_size;
+
+public:
+
+    /*
+     * @brief Maps the file 'path'.
+     *
+     * @throws std::runtime_error if the file cannot be mapped.
+     */
+    explicit MappedFile(const std::string &path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    char *data() const { return m_data; }
+
+    size_t size() const { return m_size; }
+};
+
+
+/*
+ * @brief A nearest neighbor graph in a file whose rows are read and written
+ * in blocks.
+ *
+ * The file contains the header followed by the matrices of the neighbor
+ * indices and keys in the layout of BinaryWriter, so a finished graph can be
+ * read by BinaryReader, in place if the file is memory mapped. Rows are
+ * accessed with positional I/O, so disjoint blocks of rows can be read and
+ * written concurrently. Flags are not stored.
+ */
+class GraphFile
+{
+private:
+
+    int fd;
+
+    size_t n_rows;
+
+    size_t n_cols;
+
+    /*
+     * The offsets in bytes of the index and key payloads.
+     */
+    size_t indices_offset;
+    size_t keys_offset;
+
+public:
+
+    /*
+     * @brief Creates the file 'path' for a graph of 'n_rows' heaps with
+     * 'n_cols' nodes each. An existing file is overwritten.
+     *
+     * @throws std::runtime_error if the file cannot be created.
+     */
+    GraphFile(const std::string &path, size_t n_rows, size_t n_cols);
+
+    ~GraphFile();
+
+    GraphFile(const GraphFile&) = delete;
+    GraphFile& operator=(const GraphFile&) = delete;
+
+    size_t nrows() const { return n_rows; }
+
+    size_t ncols() const { return n_cols; }
+
+    /*
+     * @brief Reads the rows first, ..., first + heaps.nheaps() - 1 into the
+     * indices and keys of 'heaps'.
+     *
+     * @throws std::runtime_error if reading fails.
+     */
+    void read_rows(size_t first, HeapList<float> &heaps) const;
+
+    /*
+     * @brief Writes the indices and keys of 'heaps' to the rows first, ...,
+     * first + heaps.nheaps() - 1.
+     *
+     * @throws std::runtime_error if writing fails.
+     */
+    void write_rows(size_t first, const HeapList<float> &heaps);
+};
+
+
+/*
+ * @brief Writes binary data to an output stream.
+ */
+class BinaryWriter
+{
+private:
+
+    std::ostream &out;
+
+    /*
+     * The number of bytes written so far.
+     */
+    size_t position;
+
+    /*
+     * @brief Writes zero bytes up to the next multiple of ARRAY_ALIGNMENT.
+     */
+    void align();
+
+public:
+
+    explicit BinaryWriter(std::ostream &out) : out(out), position(0) {}
+
+    /*
+     * @brief Writes 'size' values of trivially copyable type.
+     */
+    template<class T>
+    void write_array(const T *values, size_t size)
+    {
+        static_assert(
+            std::is_trivially_copyable<T>::value,
+            "Only trivially copyable types can be written as raw bytes"
+        );
+        out.write(reinterpret_cast<const char*>(values), size * sizeof(T));
+        if (!out)
+        {
+            throw std::runtime_error("Writing the index failed");
+        }
+        position += size * sizeof(T);
+    }
+
+    /*
+     * @brief Writes a value of trivially copyable type.
+     */
+    template<class T>
+    void write(const T &value)
+    {
+        write_array(&value, 1);
+    }
+
+    /*
+     * @brief Writes the magic number and the format version.
+     */
+    void write_header();
+
+    void write(const std::string &str);
+
+    template<class T>
+    void write(const std::vector<T> &vec)
+    {
+        write<uint64_t>(vec.size());
+        write_array(vec.data(), vec.size());
+    }
+
+    template<class T>
+    void write(const Matrix<T> &matrix)
+    {
+        write<uint64_t>(matrix.nrows());
+        write<uint64_t>(matrix.ncols());
+        align();
+        write_array(matrix.m_ptr, matrix.nrows() * matrix.ncols());
+    }
+
+    void write(const CSRMatrix<float> &matrix);
+
+    template<class KeyType>
+    void write(const HeapList<KeyType> &heaplist)
+    {
+        write(heaplist.indices);
+        write(heaplist.keys);
+        write(heaplist.flags);
+    }
+
+    void write(const CSRGraph &graph)
+    {
+        write(graph.offsets);
+        write(graph.indices);
+    }
+
+    void write(const QuantizedMatrix &matrix);
+
+    void write(const PQMatrix &matrix)
+    {
+        write(matrix.centroids);
+        write(matrix.codes);
+        write(matrix.sq_norms);
+    }
+
+    void write(const FlatRPTree &tree);
+};
+
+
+/*
+ * @brief Reads binary data written by BinaryWriter either from an input
+ * stream or from a memory mapped file.
+ *
+ * Matrices read from a mapped file are views of the mapping, all other data
+ * is copied. All functions throw std::runtime_error if the data ends
+ * prematurely or is inconsistent.
+ */
+class BinaryReader
+{
+private:
+
+    std::istream *in;
+
+    const MappedFile *mapped;
+
+    /*
+     * The number of bytes read so far.
+     */
+    size_t position;
+
+    /*
+     * @brief Skips the padding up to the next multiple of ARRAY_ALIGNMENT.
+     */
+    void align();
+
+    /*
+     * @brief Returns the size in bytes of 'count' values of type T.
+     *
+     * Throws if the size overflows or, for a mapped file, exceeds the rest
+     * of the file, before any memory is allocated for the values.
+     */
+    template<class T>
+    size_t checked_bytes(uint64_t count) const
+    {
+        if (count > SIZE_MAX / sizeof(T))
+        {
+            throw std::runtime_error("Invalid array size in index file");
+        }
+        size_t n_bytes = count * sizeof(T);
+        if (mapped && n_bytes > mapped->size() - position)
+        {
+            throw std::runtime_error("Unexpected end of index file");
+        }
+        return n_bytes;
+    }
+
+public:
+
+    explicit BinaryReader(std::istream &in)
+        : in(&in)
+        , mapped(nullptr)
+        , position(0)
+    {
+    }
+
+    explicit BinaryReader(const MappedFile &mapped)
+        : in(nullptr)
+        , mapped(&mapped)
+        , position(0)
+    {
+    }
+
+    template<class T>
+    void read_array(T *values, size_t size)
+    {
+        static_assert(
+            std::is_trivially_copyable<T>::value,
+            "Only trivially copyable types can be read as raw bytes"
+        );
+        size_t n_bytes = checked_bytes<T>(size);
+        if (mapped)
+        {
+            std::memcpy(values, mapped->data() + position, n_bytes);
+        }
+        else
+        {
+            in->read(reinterpret_cast<char*>(values), n_bytes);
+            if (!*in)
+            {
+                throw std::runtime_error("Unexpected end of index file");
+            }
+        }
+        position += n_bytes;
+    }
+
+    template<class T>
+    void read(T &value)
+    {
+        read_array(&value, 1);
+    }
+
+    /*
+     * @brief Reads and checks the magic number and the format version.
+     */
+    void read_header();
+
+    void read(std::string &str);
+
+    template<class T>
+    void read(std::vector<T> &vec)
+    {
+        uint64_t size;
+        read(size);
+        checked_bytes<T>(size);
+        vec.resize(size);
+        read_array(vec.data(), size);
+    }
+
+    template<class T>
+    void read(Matrix<T> &matrix)
+    {
+        uint64_t rows, cols;
+        read(rows);
+        read(cols);
+        align();
+        if (cols != 0 && rows > SIZE_MAX / sizeof(T) / cols)
+        {
+            throw std::runtime_error("Invalid matrix shape in index file");
+        }
+        size_t n_bytes = checked_bytes<T>(rows * cols);
+        if (mapped)
+        {
+            matrix = Matrix<T>(
+                rows,
+                cols,
+                reinterpret_cast<T*>(mapped->data() + position)
+            );
+            position += n_bytes;
+        }
+        else
+        {
+            matrix = Matrix<T>(rows, cols);
+            read_array(matrix.m_ptr, rows * cols);
+        }
+    }
+
+    void read(CSRMatrix<float> &matrix);
+
+    template<class KeyType>
+    void read(HeapList<KeyType> &heaplist)
+    {
+        Matrix<int> indices;
+        Matrix<KeyType> keys;
+        Matrix<char> flags;
+        read(indices);
+        read(keys);
+        read(flags);
+        if (
+            keys.nrows() != indices.nrows()
+            || keys.ncols() != indices.ncols()
+            || (
+                flags.nrows() != 0 && (
+                    flags.nrows() != indices.nrows()
+                    || flags.ncols() != indices.ncols()
+                )
+            )
+        )
+        {
+            throw std::runtime_error("Inconsistent heap list in index file");
+        }
+        heaplist = HeapList<KeyType>(
+            std::move(indices), std::move(keys), std::move(flags)
+        );
+    }
+
+    void read(CSRGraph &graph);
+
+    void read(QuantizedMatrix &matrix);
+
+    void read(PQMatrix &matrix);
+
+    void read(FlatRPTree &tree);
+};
+
+
+} // namespace nndescent
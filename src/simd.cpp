@@ -0,0 +1,1109 @@
+/**
+ * @file simd.cpp
+ *
+ * @brief Vectorized kernels of the hot dense metrics with runtime CPU
+ * dispatch.
+ */
+
+
+#include <cmath>
+#include <stdexcept>
+
+#include "dtypes.h"
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NND_X86
+#include <immintrin.h>
+#define NND_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define NND_TARGET_AVX512 __attribute__((target("avx512f")))
+#elif defined(__aarch64__)
+#define NND_NEON
+#include <arm_neon.h>
+#endif
+
+
+namespace nndescent
+{
+
+
+/*
+ * Scalar kernels.
+ */
+
+static float scalar_squared_euclidean(
+    const float *x, const float *y, size_t size
+)
+{
+    float result = 0.0f;
+    for (size_t i = 0; i < size; ++i)
+    {
+        result += (x[i] - y[i]) * (x[i] - y[i]);
+    }
+    return result;
+}
+
+
+static float scalar_manhattan(const float *x, const float *y, size_t size)
+{
+    float result = 0.0f;
+    for (size_t i = 0; i < size; ++i)
+    {
+        result += std::abs(x[i] - y[i]);
+    }
+    return result;
+}
+
+
+static float scalar_inner_product(const float *x, const float *y, size_t size)
+{
+    float result = 0.0f;
+    for (size_t i = 0; i < size; ++i)
+    {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+
+
+static void scalar_inner_product_and_norms(
+    const float *x,
+    const float *y,
+    size_t size,
+    float &result,
+    float &norm_x,
+    float &norm_y
+)
+{
+    result = 0.0f;
+    norm_x = 0.0f;
+    norm_y = 0.0f;
+    for (size_t i = 0; i < size; ++i)
+    {
+        result += x[i] * y[i];
+        norm_x += x[i] * x[i];
+        norm_y += y[i] * y[i];
+    }
+}
+
+
+static void scalar_squared_euclidean_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    for (size_t j = 0; j < n; ++j)
+    {
+        out[j] = scalar_squared_euclidean(x, data + indices[j] * size, size);
+    }
+}
+
+
+static void scalar_inner_product_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    for (size_t j = 0; j < n; ++j)
+    {
+        out[j] = scalar_inner_product(x, data + indices[j] * size, size);
+    }
+}
+
+
+static void scalar_decode_float16(const uint16_t *in, size_t size, float *out)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        out[i] = half_to_float(in[i]);
+    }
+}
+
+
+static void scalar_decode_bfloat16(
+    const uint16_t *in, size_t size, float *out
+)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        out[i] = bfloat16_to_float(in[i]);
+    }
+}
+
+
+static void scalar_decode_int8(
+    const uint8_t *in,
+    const float *offset,
+    const float *scale,
+    size_t size,
+    float *out
+)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        out[i] = offset[i] + scale[i] * in[i];
+    }
+}
+
+
+static const DenseKernels SCALAR_KERNELS = {
+    "scalar",
+    scalar_squared_euclidean,
+    scalar_manhattan,
+    scalar_inner_product,
+    scalar_inner_product_and_norms,
+    scalar_squared_euclidean_batch,
+    scalar_inner_product_batch,
+    scalar_decode_float16,
+    scalar_decode_bfloat16,
+    scalar_decode_int8
+};
+
+
+#ifdef NND_X86
+
+/*
+ * AVX2 kernels. Each loop processes 16 floats with two independent
+ * accumulators to hide the latency of the fused multiply-add. The
+ * conversions from half precision use F16C, which all AVX2 CPUs provide.
+ */
+
+NND_TARGET_AVX2
+static inline float hsum_avx2(__m256 v)
+{
+    __m128 sum = _mm_add_ps(
+        _mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)
+    );
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+
+NND_TARGET_AVX2
+static float avx2_squared_euclidean(
+    const float *x, const float *y, size_t size
+)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        __m256 d1 = _mm256_sub_ps(
+            _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)
+        );
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= size; i += 8)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    float result = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < size; ++i)
+    {
+        result += (x[i] - y[i]) * (x[i] - y[i]);
+    }
+    return result;
+}
+
+
+NND_TARGET_AVX2
+static float avx2_manhattan(const float *x, const float *y, size_t size)
+{
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        __m256 d1 = _mm256_sub_ps(
+            _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)
+        );
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(sign_mask, d0));
+        acc1 = _mm256_add_ps(acc1, _mm256_andnot_ps(sign_mask, d1));
+    }
+    for (; i + 8 <= size; i += 8)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(sign_mask, d0));
+    }
+    float result = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < size; ++i)
+    {
+        result += std::abs(x[i] - y[i]);
+    }
+    return result;
+}
+
+
+NND_TARGET_AVX2
+static float avx2_inner_product(const float *x, const float *y, size_t size)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0
+        );
+        acc1 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1
+        );
+    }
+    for (; i + 8 <= size; i += 8)
+    {
+        acc0 = _mm256_fmadd_ps(
+            _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0
+        );
+    }
+    float result = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < size; ++i)
+    {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+
+
+NND_TARGET_AVX2
+static void avx2_inner_product_and_norms(
+    const float *x,
+    const float *y,
+    size_t size,
+    float &result,
+    float &norm_x,
+    float &norm_y
+)
+{
+    __m256 acc = _mm256_setzero_ps();
+    __m256 acc_x = _mm256_setzero_ps();
+    __m256 acc_y = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        __m256 vy = _mm256_loadu_ps(y + i);
+        acc = _mm256_fmadd_ps(vx, vy, acc);
+        acc_x = _mm256_fmadd_ps(vx, vx, acc_x);
+        acc_y = _mm256_fmadd_ps(vy, vy, acc_y);
+    }
+    result = hsum_avx2(acc);
+    norm_x = hsum_avx2(acc_x);
+    norm_y = hsum_avx2(acc_y);
+    for (; i < size; ++i)
+    {
+        result += x[i] * y[i];
+        norm_x += x[i] * x[i];
+        norm_y += y[i] * y[i];
+    }
+}
+
+
+NND_TARGET_AVX2
+static void avx2_squared_euclidean_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const float *y0 = data + indices[j] * size;
+        const float *y1 = data + indices[j + 1] * size;
+        const float *y2 = data + indices[j + 2] * size;
+        const float *y3 = data + indices[j + 3] * size;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            __m256 vx = _mm256_loadu_ps(x + i);
+            __m256 d0 = _mm256_sub_ps(vx, _mm256_loadu_ps(y0 + i));
+            __m256 d1 = _mm256_sub_ps(vx, _mm256_loadu_ps(y1 + i));
+            __m256 d2 = _mm256_sub_ps(vx, _mm256_loadu_ps(y2 + i));
+            __m256 d3 = _mm256_sub_ps(vx, _mm256_loadu_ps(y3 + i));
+            acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+            acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+            acc2 = _mm256_fmadd_ps(d2, d2, acc2);
+            acc3 = _mm256_fmadd_ps(d3, d3, acc3);
+        }
+        float r0 = hsum_avx2(acc0);
+        float r1 = hsum_avx2(acc1);
+        float r2 = hsum_avx2(acc2);
+        float r3 = hsum_avx2(acc3);
+        for (; i < size; ++i)
+        {
+            r0 += (x[i] - y0[i]) * (x[i] - y0[i]);
+            r1 += (x[i] - y1[i]) * (x[i] - y1[i]);
+            r2 += (x[i] - y2[i]) * (x[i] - y2[i]);
+            r3 += (x[i] - y3[i]) * (x[i] - y3[i]);
+        }
+        out[j] = r0;
+        out[j + 1] = r1;
+        out[j + 2] = r2;
+        out[j + 3] = r3;
+    }
+    for (; j < n; ++j)
+    {
+        out[j] = avx2_squared_euclidean(x, data + indices[j] * size, size);
+    }
+}
+
+
+NND_TARGET_AVX2
+static void avx2_inner_product_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const float *y0 = data + indices[j] * size;
+        const float *y1 = data + indices[j + 1] * size;
+        const float *y2 = data + indices[j + 2] * size;
+        const float *y3 = data + indices[j + 3] * size;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            __m256 vx = _mm256_loadu_ps(x + i);
+            acc0 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y0 + i), acc0);
+            acc1 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y1 + i), acc1);
+            acc2 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y2 + i), acc2);
+            acc3 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(y3 + i), acc3);
+        }
+        float r0 = hsum_avx2(acc0);
+        float r1 = hsum_avx2(acc1);
+        float r2 = hsum_avx2(acc2);
+        float r3 = hsum_avx2(acc3);
+        for (; i < size; ++i)
+        {
+            r0 += x[i] * y0[i];
+            r1 += x[i] * y1[i];
+            r2 += x[i] * y2[i];
+            r3 += x[i] * y3[i];
+        }
+        out[j] = r0;
+        out[j + 1] = r1;
+        out[j + 2] = r2;
+        out[j + 3] = r3;
+    }
+    for (; j < n; ++j)
+    {
+        out[j] = avx2_inner_product(x, data + indices[j] * size, size);
+    }
+}
+
+
+NND_TARGET_AVX2
+static void avx2_decode_float16(const uint16_t *in, size_t size, float *out)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        __m128i half = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(half));
+    }
+    for (; i < size; ++i)
+    {
+        out[i] = half_to_float(in[i]);
+    }
+}
+
+
+NND_TARGET_AVX2
+static void avx2_decode_bfloat16(const uint16_t *in, size_t size, float *out)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        __m256i bits = _mm256_slli_epi32(
+            _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + i))),
+            16
+        );
+        _mm256_storeu_ps(out + i, _mm256_castsi256_ps(bits));
+    }
+    for (; i < size; ++i)
+    {
+        out[i] = bfloat16_to_float(in[i]);
+    }
+}
+
+
+NND_TARGET_AVX2
+static void avx2_decode_int8(
+    const uint8_t *in,
+    const float *offset,
+    const float *scale,
+    size_t size,
+    float *out
+)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        __m256 q = _mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)))
+        );
+        _mm256_storeu_ps(
+            out + i,
+            _mm256_fmadd_ps(
+                q, _mm256_loadu_ps(scale + i), _mm256_loadu_ps(offset + i)
+            )
+        );
+    }
+    for (; i < size; ++i)
+    {
+        out[i] = offset[i] + scale[i] * in[i];
+    }
+}
+
+
+static const DenseKernels AVX2_KERNELS = {
+    "avx2",
+    avx2_squared_euclidean,
+    avx2_manhattan,
+    avx2_inner_product,
+    avx2_inner_product_and_norms,
+    avx2_squared_euclidean_batch,
+    avx2_inner_product_batch,
+    avx2_decode_float16,
+    avx2_decode_bfloat16,
+    avx2_decode_int8
+};
+
+
+/*
+ * AVX-512 kernels. The remainder is handled by a masked load, which reads
+ * zeros beyond the end of the arrays.
+ *
+ * Several AVX-512 intrinsics of GCC are implemented with deliberately
+ * undefined vectors, which triggers (maybe-)uninitialized warnings when they
+ * are inlined.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+NND_TARGET_AVX512
+static inline __mmask16 tail_mask_avx512(size_t remainder)
+{
+    return (__mmask16)((1u << remainder) - 1u);
+}
+
+
+NND_TARGET_AVX512
+static float avx512_squared_euclidean(
+    const float *x, const float *y, size_t size
+)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        __m512 d1 = _mm512_sub_ps(
+            _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16)
+        );
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= size; i += 16)
+    {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    if (i < size)
+    {
+        __mmask16 mask = tail_mask_avx512(size - i);
+        __m512 d0 = _mm512_sub_ps(
+            _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i)
+        );
+        acc1 = _mm512_fmadd_ps(d0, d0, acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+
+NND_TARGET_AVX512
+static float avx512_manhattan(const float *x, const float *y, size_t size)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        __m512 d1 = _mm512_sub_ps(
+            _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16)
+        );
+        acc0 = _mm512_add_ps(acc0, _mm512_abs_ps(d0));
+        acc1 = _mm512_add_ps(acc1, _mm512_abs_ps(d1));
+    }
+    for (; i + 16 <= size; i += 16)
+    {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        acc0 = _mm512_add_ps(acc0, _mm512_abs_ps(d0));
+    }
+    if (i < size)
+    {
+        __mmask16 mask = tail_mask_avx512(size - i);
+        __m512 d0 = _mm512_sub_ps(
+            _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i)
+        );
+        acc1 = _mm512_add_ps(acc1, _mm512_abs_ps(d0));
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+
+NND_TARGET_AVX512
+static float avx512_inner_product(const float *x, const float *y, size_t size)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        acc0 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0
+        );
+        acc1 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), acc1
+        );
+    }
+    for (; i + 16 <= size; i += 16)
+    {
+        acc0 = _mm512_fmadd_ps(
+            _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0
+        );
+    }
+    if (i < size)
+    {
+        __mmask16 mask = tail_mask_avx512(size - i);
+        acc1 = _mm512_fmadd_ps(
+            _mm512_maskz_loadu_ps(mask, x + i),
+            _mm512_maskz_loadu_ps(mask, y + i),
+            acc1
+        );
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+
+NND_TARGET_AVX512
+static void avx512_inner_product_and_norms(
+    const float *x,
+    const float *y,
+    size_t size,
+    float &result,
+    float &norm_x,
+    float &norm_y
+)
+{
+    __m512 acc = _mm512_setzero_ps();
+    __m512 acc_x = _mm512_setzero_ps();
+    __m512 acc_y = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m512 vx = _mm512_loadu_ps(x + i);
+        __m512 vy = _mm512_loadu_ps(y + i);
+        acc = _mm512_fmadd_ps(vx, vy, acc);
+        acc_x = _mm512_fmadd_ps(vx, vx, acc_x);
+        acc_y = _mm512_fmadd_ps(vy, vy, acc_y);
+    }
+    if (i < size)
+    {
+        __mmask16 mask = tail_mask_avx512(size - i);
+        __m512 vx = _mm512_maskz_loadu_ps(mask, x + i);
+        __m512 vy = _mm512_maskz_loadu_ps(mask, y + i);
+        acc = _mm512_fmadd_ps(vx, vy, acc);
+        acc_x = _mm512_fmadd_ps(vx, vx, acc_x);
+        acc_y = _mm512_fmadd_ps(vy, vy, acc_y);
+    }
+    result = _mm512_reduce_add_ps(acc);
+    norm_x = _mm512_reduce_add_ps(acc_x);
+    norm_y = _mm512_reduce_add_ps(acc_y);
+}
+
+
+NND_TARGET_AVX512
+static void avx512_squared_euclidean_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const float *y0 = data + indices[j] * size;
+        const float *y1 = data + indices[j + 1] * size;
+        const float *y2 = data + indices[j + 2] * size;
+        const float *y3 = data + indices[j + 3] * size;
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        __m512 acc2 = _mm512_setzero_ps();
+        __m512 acc3 = _mm512_setzero_ps();
+        for (size_t i = 0; i < size; i += 16)
+        {
+            __mmask16 mask = i + 16 <= size
+                ? (__mmask16)0xFFFF : tail_mask_avx512(size - i);
+            __m512 vx = _mm512_maskz_loadu_ps(mask, x + i);
+            __m512 d0 = _mm512_sub_ps(vx, _mm512_maskz_loadu_ps(mask, y0 + i));
+            __m512 d1 = _mm512_sub_ps(vx, _mm512_maskz_loadu_ps(mask, y1 + i));
+            __m512 d2 = _mm512_sub_ps(vx, _mm512_maskz_loadu_ps(mask, y2 + i));
+            __m512 d3 = _mm512_sub_ps(vx, _mm512_maskz_loadu_ps(mask, y3 + i));
+            acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+            acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+            acc2 = _mm512_fmadd_ps(d2, d2, acc2);
+            acc3 = _mm512_fmadd_ps(d3, d3, acc3);
+        }
+        out[j] = _mm512_reduce_add_ps(acc0);
+        out[j + 1] = _mm512_reduce_add_ps(acc1);
+        out[j + 2] = _mm512_reduce_add_ps(acc2);
+        out[j + 3] = _mm512_reduce_add_ps(acc3);
+    }
+    for (; j < n; ++j)
+    {
+        out[j] = avx512_squared_euclidean(x, data + indices[j] * size, size);
+    }
+}
+
+
+NND_TARGET_AVX512
+static void avx512_inner_product_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const float *y0 = data + indices[j] * size;
+        const float *y1 = data + indices[j + 1] * size;
+        const float *y2 = data + indices[j + 2] * size;
+        const float *y3 = data + indices[j + 3] * size;
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        __m512 acc2 = _mm512_setzero_ps();
+        __m512 acc3 = _mm512_setzero_ps();
+        for (size_t i = 0; i < size; i += 16)
+        {
+            __mmask16 mask = i + 16 <= size
+                ? (__mmask16)0xFFFF : tail_mask_avx512(size - i);
+            __m512 vx = _mm512_maskz_loadu_ps(mask, x + i);
+            acc0 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(mask, y0 + i), acc0);
+            acc1 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(mask, y1 + i), acc1);
+            acc2 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(mask, y2 + i), acc2);
+            acc3 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(mask, y3 + i), acc3);
+        }
+        out[j] = _mm512_reduce_add_ps(acc0);
+        out[j + 1] = _mm512_reduce_add_ps(acc1);
+        out[j + 2] = _mm512_reduce_add_ps(acc2);
+        out[j + 3] = _mm512_reduce_add_ps(acc3);
+    }
+    for (; j < n; ++j)
+    {
+        out[j] = avx512_inner_product(x, data + indices[j] * size, size);
+    }
+}
+
+
+static const DenseKernels AVX512_KERNELS = {
+    "avx512",
+    avx512_squared_euclidean,
+    avx512_manhattan,
+    avx512_inner_product,
+    avx512_inner_product_and_norms,
+    avx512_squared_euclidean_batch,
+    avx512_inner_product_batch,
+    // Every CPU with AVX-512 supports AVX2 and F16C, and the conversions are
+    // bound by memory bandwidth anyway.
+    avx2_decode_float16,
+    avx2_decode_bfloat16,
+    avx2_decode_int8
+};
+
+#pragma GCC diagnostic pop
+
+#endif // NND_X86
+
+
+#ifdef NND_NEON
+
+/*
+ * NEON kernels. NEON is part of the ARMv8-A baseline, so no runtime check is
+ * needed.
+ */
+
+static float neon_squared_euclidean(
+    const float *x, const float *y, size_t size
+)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(x + i), vld1q_f32(y + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(x + i + 4), vld1q_f32(y + i + 4));
+        acc0 = vfmaq_f32(acc0, d0, d0);
+        acc1 = vfmaq_f32(acc1, d1, d1);
+    }
+    float result = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < size; ++i)
+    {
+        result += (x[i] - y[i]) * (x[i] - y[i]);
+    }
+    return result;
+}
+
+
+static float neon_manhattan(const float *x, const float *y, size_t size)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        acc0 = vaddq_f32(acc0, vabdq_f32(vld1q_f32(x + i), vld1q_f32(y + i)));
+        acc1 = vaddq_f32(
+            acc1, vabdq_f32(vld1q_f32(x + i + 4), vld1q_f32(y + i + 4))
+        );
+    }
+    float result = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < size; ++i)
+    {
+        result += std::abs(x[i] - y[i]);
+    }
+    return result;
+}
+
+
+static float neon_inner_product(const float *x, const float *y, size_t size)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(x + i), vld1q_f32(y + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(x + i + 4), vld1q_f32(y + i + 4));
+    }
+    float result = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < size; ++i)
+    {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+
+
+static void neon_inner_product_and_norms(
+    const float *x,
+    const float *y,
+    size_t size,
+    float &result,
+    float &norm_x,
+    float &norm_y
+)
+{
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    float32x4_t acc_x = vdupq_n_f32(0.0f);
+    float32x4_t acc_y = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        float32x4_t vx = vld1q_f32(x + i);
+        float32x4_t vy = vld1q_f32(y + i);
+        acc = vfmaq_f32(acc, vx, vy);
+        acc_x = vfmaq_f32(acc_x, vx, vx);
+        acc_y = vfmaq_f32(acc_y, vy, vy);
+    }
+    result = vaddvq_f32(acc);
+    norm_x = vaddvq_f32(acc_x);
+    norm_y = vaddvq_f32(acc_y);
+    for (; i < size; ++i)
+    {
+        result += x[i] * y[i];
+        norm_x += x[i] * x[i];
+        norm_y += y[i] * y[i];
+    }
+}
+
+
+static void neon_squared_euclidean_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const float *y0 = data + indices[j] * size;
+        const float *y1 = data + indices[j + 1] * size;
+        const float *y2 = data + indices[j + 2] * size;
+        const float *y3 = data + indices[j + 3] * size;
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        float32x4_t acc2 = vdupq_n_f32(0.0f);
+        float32x4_t acc3 = vdupq_n_f32(0.0f);
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4)
+        {
+            float32x4_t vx = vld1q_f32(x + i);
+            float32x4_t d0 = vsubq_f32(vx, vld1q_f32(y0 + i));
+            float32x4_t d1 = vsubq_f32(vx, vld1q_f32(y1 + i));
+            float32x4_t d2 = vsubq_f32(vx, vld1q_f32(y2 + i));
+            float32x4_t d3 = vsubq_f32(vx, vld1q_f32(y3 + i));
+            acc0 = vfmaq_f32(acc0, d0, d0);
+            acc1 = vfmaq_f32(acc1, d1, d1);
+            acc2 = vfmaq_f32(acc2, d2, d2);
+            acc3 = vfmaq_f32(acc3, d3, d3);
+        }
+        float r0 = vaddvq_f32(acc0);
+        float r1 = vaddvq_f32(acc1);
+        float r2 = vaddvq_f32(acc2);
+        float r3 = vaddvq_f32(acc3);
+        for (; i < size; ++i)
+        {
+            r0 += (x[i] - y0[i]) * (x[i] - y0[i]);
+            r1 += (x[i] - y1[i]) * (x[i] - y1[i]);
+            r2 += (x[i] - y2[i]) * (x[i] - y2[i]);
+            r3 += (x[i] - y3[i]) * (x[i] - y3[i]);
+        }
+        out[j] = r0;
+        out[j + 1] = r1;
+        out[j + 2] = r2;
+        out[j + 3] = r3;
+    }
+    for (; j < n; ++j)
+    {
+        out[j] = neon_squared_euclidean(x, data + indices[j] * size, size);
+    }
+}
+
+
+static void neon_inner_product_batch(
+    const float *x,
+    const float *data,
+    size_t size,
+    const int *indices,
+    size_t n,
+    float *out
+)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const float *y0 = data + indices[j] * size;
+        const float *y1 = data + indices[j + 1] * size;
+        const float *y2 = data + indices[j + 2] * size;
+        const float *y3 = data + indices[j + 3] * size;
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        float32x4_t acc2 = vdupq_n_f32(0.0f);
+        float32x4_t acc3 = vdupq_n_f32(0.0f);
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4)
+        {
+            float32x4_t vx = vld1q_f32(x + i);
+            acc0 = vfmaq_f32(acc0, vx, vld1q_f32(y0 + i));
+            acc1 = vfmaq_f32(acc1, vx, vld1q_f32(y1 + i));
+            acc2 = vfmaq_f32(acc2, vx, vld1q_f32(y2 + i));
+            acc3 = vfmaq_f32(acc3, vx, vld1q_f32(y3 + i));
+        }
+        float r0 = vaddvq_f32(acc0);
+        float r1 = vaddvq_f32(acc1);
+        float r2 = vaddvq_f32(acc2);
+        float r3 = vaddvq_f32(acc3);
+        for (; i < size; ++i)
+        {
+            r0 += x[i] * y0[i];
+            r1 += x[i] * y1[i];
+            r2 += x[i] * y2[i];
+            r3 += x[i] * y3[i];
+        }
+        out[j] = r0;
+        out[j + 1] = r1;
+        out[j + 2] = r2;
+        out[j + 3] = r3;
+    }
+    for (; j < n; ++j)
+    {
+        out[j] = neon_inner_product(x, data + indices[j] * size, size);
+    }
+}
+
+
+static void neon_decode_float16(const uint16_t *in, size_t size, float *out)
+{
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(in + i))));
+    }
+    for (; i < size; ++i)
+    {
+        out[i] = half_to_float(in[i]);
+    }
+}
+
+
+static void neon_decode_bfloat16(const uint16_t *in, size_t size, float *out)
+{
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        uint32x4_t bits = vshlq_n_u32(vmovl_u16(vld1_u16(in + i)), 16);
+        vst1q_f32(out + i, vreinterpretq_f32_u32(bits));
+    }
+    for (; i < size; ++i)
+    {
+        out[i] = bfloat16_to_float(in[i]);
+    }
+}
+
+
+static void neon_decode_int8(
+    const uint8_t *in,
+    const float *offset,
+    const float *scale,
+    size_t size,
+    float *out
+)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint16x8_t q = vmovl_u8(vld1_u8(in + i));
+        float32x4_t q0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(q)));
+        float32x4_t q1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(q)));
+        vst1q_f32(
+            out + i, vfmaq_f32(vld1q_f32(offset + i), q0, vld1q_f32(scale + i))
+        );
+        vst1q_f32(
+            out + i + 4,
+            vfmaq_f32(vld1q_f32(offset + i + 4), q1, vld1q_f32(scale + i + 4))
+        );
+    }
+    for (; i < size; ++i)
+    {
+        out[i] = offset[i] + scale[i] * in[i];
+    }
+}
+
+
+static const DenseKernels NEON_KERNELS = {
+    "neon",
+    neon_squared_euclidean,
+    neon_manhattan,
+    neon_inner_product,
+    neon_inner_product_and_norms,
+    neon_squared_euclidean_batch,
+    neon_inner_product_batch,
+    neon_decode_float16,
+    neon_decode_bfloat16,
+    neon_decode_int8
+};
+
+#endif // NND_NEON
+
+
+/*
+ * Dispatch.
+ */
+
+const DenseKernels &scalar_kernels()
+{
+    return SCALAR_KERNELS;
+}
+
+
+std::vector<const DenseKernels*> supported_kernels()
+{
+    std::vector<const DenseKernels*> kernels = {&SCALAR_KERNELS};
+#ifdef NND_X86
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2")
+        && __builtin_cpu_supports("fma")
+        && __builtin_cpu_supports("f16c");
+    if (avx2)
+    {
+        kernels.push_back(&AVX2_KERNELS);
+    }
+    if (avx2 && __builtin_cpu_supports("avx512f"))
+    {
+        kernels.push_back(&AVX512_KERNELS);
+    }
+#endif
+#ifdef NND_NEON
+    kernels.push_back(&NEON_KERNELS);
+#endif
+    return kernels;
+}
+
+
+const DenseKernels *active_kernels = supported_kernels().back();
+
+
+void set_dense_kernels(const std::string &name)
+{
+    for (const DenseKernels *kernels : supported_kernels())
+    {
+        if (name == kernels->name)
+        {
+            active_kernels = kernels;
+            return;
+        }
+    }
+    throw std::invalid_argument(
+        "Instruction set '" + name + "' is not supported by this CPU"
+    );
+}
+
+
+} // namespace nndescent
@@ -0,0 +1,148 @@
+/**
+ * @file simd.h
+ *
+ * @brief Vectorized kernels of the hot dense metrics with runtime CPU
+ * dispatch.
+ *
+ * The kernels are compiled for several instruction sets (AVX2, AVX-512 on
+ * x86-64 or NEON on ARM) independently of the compiler flags, and the best
+ * set supported by the running CPU is selected at program start. Hence a
+ * binary built without '-march=native' still uses the widest vector units
+ * available.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+namespace nndescent
+{
+
+
+/*
+ * @brief A set of dense kernels compiled for one instruction set.
+ *
+ * The pairwise kernels take two arrays of 'size' floats. The batch kernels
+ * compare one array with several rows of a matrix; they process the rows in
+ * groups of four, so every element of 'x' is loaded once per group.
+ */
+struct DenseKernels
+{
+    /*
+     * The name of the instruction set.
+     */
+    const char *name;
+
+    /*
+     * Returns sum_i (x_i - y_i)^2.
+     */
+    float (*squared_euclidean)(const float *x, const float *y, size_t size);
+
+    /*
+     * Returns sum_i |x_i - y_i|.
+     */
+    float (*manhattan)(const float *x, const float *y, size_t size);
+
+    /*
+     * Returns sum_i x_i * y_i.
+     */
+    float (*inner_product)(const float *x, const float *y, size_t size);
+
+    /*
+     * Computes sum_i x_i * y_i, sum_i x_i^2 and sum_i y_i^2 in one pass.
+     */
+    void (*inner_product_and_norms)(
+        const float *x,
+        const float *y,
+        size_t size,
+        float &result,
+        float &norm_x,
+        float &norm_y
+    );
+
+    /*
+     * Computes out[j] = squared_euclidean(x, y_j) for j = 0, ..., n - 1, where
+     * y_j = data + indices[j] * size is a row of a row-major matrix.
+     */
+    void (*squared_euclidean_batch)(
+        const float *x,
+        const float *data,
+        size_t size,
+        const int *indices,
+        size_t n,
+        float *out
+    );
+
+    /*
+     * Computes out[j] = inner_product(x, y_j) for j = 0, ..., n - 1, where
+     * y_j = data + indices[j] * size is a row of a row-major matrix.
+     */
+    void (*inner_product_batch)(
+        const float *x,
+        const float *data,
+        size_t size,
+        const int *indices,
+        size_t n,
+        float *out
+    );
+
+    /*
+     * Converts 'size' IEEE half-precision values to float.
+     */
+    void (*decode_float16)(const uint16_t *in, size_t size, float *out);
+
+    /*
+     * Converts 'size' bfloat16 values to float.
+     */
+    void (*decode_bfloat16)(const uint16_t *in, size_t size, float *out);
+
+    /*
+     * Converts 'size' quantized values to out[i] = offset[i] + scale[i] *
+     * in[i].
+     */
+    void (*decode_int8)(
+        const uint8_t *in,
+        const float *offset,
+        const float *scale,
+        size_t size,
+        float *out
+    );
+};
+
+
+/*
+ * The kernels used by the dense metrics. Points to the widest instruction set
+ * supported by the CPU unless changed by 'set_dense_kernels'.
+ */
+extern const DenseKernels *active_kernels;
+
+
+/*
+ * @brief Returns the portable scalar kernels.
+ */
+const DenseKernels &scalar_kernels();
+
+
+/*
+ * @brief Returns all kernel sets supported by the running CPU, starting with
+ * the scalar kernels and ending with the widest instruction set.
+ */
+std::vector<const DenseKernels*> supported_kernels();
+
+
+/*
+ * @brief Selects the kernels used by the dense metrics.
+ *
+ * This is mainly intended for benchmarks and tests. It must not be called
+ * while distances are computed by other threads.
+ *
+ * @param name The name of a supported instruction set (e.g. "scalar").
+ */
+void set_dense_kernels(const std::string &name);
+
+
+} // namespace nndescent
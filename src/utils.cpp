@@ -5,6 +5,14 @@
  */
 
 
+#include <cctype>
+#include <omp.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#endif
+
 #include "utils.h"
 
 
@@ -81,6 +89,188 @@ void log(const std::string &text, bool verbose)
 }
 
 
+std::vector<size_t> balanced_chunks(
+    const std::vector<size_t> &work,
+    size_t n_chunks
+)
+{
+    size_t total = 0;
+    for (const auto &w : work)
+    {
+        total += w;
+    }
+    size_t chunk_work = total / std::max(n_chunks, (size_t)1) + 1;
+
+    std::vector<size_t> bounds = {0};
+    size_t acc = 0;
+    for (size_t i = 0; i < work.size(); ++i)
+    {
+        acc += work[i];
+        if (acc >= chunk_work)
+        {
+            bounds.push_back(i + 1);
+            acc = 0;
+        }
+    }
+    if (bounds.back() != work.size())
+    {
+        bounds.push_back(work.size());
+    }
+    return bounds;
+}
+
+
+#ifdef __linux__
+
+/*
+ * @brief Returns the NUMA node of 'cpu' from the sysfs entry
+ * '/sys/devices/system/cpu/cpu<cpu>/node<node>', or 0 if there is none.
+ */
+int numa_node_of_cpu(int cpu)
+{
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+    {
+        return 0;
+    }
+    int node = 0;
+    for (dirent *entry = readdir(dir); entry; entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (
+            name.size() > 4 && name.compare(0, 4, "node") == 0
+            && std::isdigit((unsigned char)name[4])
+        )
+        {
+            node = std::stoi(name.substr(4));
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+
+/*
+ * @brief Returns the CPUs the calling thread may run on.
+ */
+std::vector<int> get_affinity()
+{
+    std::vector<int> cpus;
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &mask))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+
+/*
+ * @brief Binds the calling thread to the CPUs 'first', ..., 'last' - 1.
+ */
+void set_affinity(const int *first, const int *last)
+{
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (; first != last; ++first)
+    {
+        CPU_SET(*first, &mask);
+    }
+    sched_setaffinity(0, sizeof(mask), &mask);
+}
+
+
+/*
+ * The CPUs the calling thread may run on outside of any ThreadPinning, their
+ * NUMA nodes and the number of ThreadPinning objects of the thread.
+ */
+thread_local std::vector<int> unpinned_cpus;
+thread_local std::vector<int> unpinned_cpu_nodes;
+thread_local int n_pinnings = 0;
+
+
+ThreadPinning::ThreadPinning(int n_threads, bool enabled)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    if (n_pinnings == 0)
+    {
+        std::vector<int> cpus = get_affinity();
+        if (cpus != unpinned_cpus)
+        {
+            unpinned_cpu_nodes.clear();
+            for (int cpu : cpus)
+            {
+                unpinned_cpu_nodes.push_back(numa_node_of_cpu(cpu));
+            }
+            unpinned_cpus = std::move(cpus);
+        }
+    }
+    // Nested objects pin the threads to the same CPUs again. The references
+    // are shared with the threads of the team, which have their own copies of
+    // the thread-local variables.
+    const std::vector<int> &cpus = unpinned_cpus;
+    const std::vector<int> &cpu_nodes = unpinned_cpu_nodes;
+    if (cpus.empty())
+    {
+        return;
+    }
+    ++n_pinnings;
+    thread_cpus.assign(n_threads, std::vector<int>());
+    thread_nodes.assign(n_threads, 0);
+    #pragma omp parallel num_threads(n_threads)
+    {
+        int thread = omp_get_thread_num();
+        size_t i = thread % cpus.size();
+        thread_cpus[thread] = get_affinity();
+        set_affinity(&cpus[i], &cpus[i] + 1);
+        thread_nodes[thread] = cpu_nodes[i];
+    }
+}
+
+
+ThreadPinning::~ThreadPinning()
+{
+    if (thread_cpus.empty())
+    {
+        return;
+    }
+    #pragma omp parallel num_threads(thread_cpus.size())
+    {
+        const std::vector<int> &cpus = thread_cpus[omp_get_thread_num()];
+        if (!cpus.empty())
+        {
+            set_affinity(cpus.data(), cpus.data() + cpus.size());
+        }
+    }
+    --n_pinnings;
+}
+
+
+#else
+
+ThreadPinning::ThreadPinning(int, bool)
+{
+}
+
+
+ThreadPinning::~ThreadPinning()
+{
+}
+
+#endif // __linux__
+
+
 std::ostream& operator<<(std::ostream& out, const RandomState& state)
 {
     out << "(";
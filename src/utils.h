@@ -7,11 +7,13 @@
 
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <iomanip>
+#include <vector>
 
 
 namespace nndescent
@@ -132,6 +134,46 @@ class Timer
 };
 
 
+// The size of a cache line and the maximal number of cache lines of a row
+// loaded ahead by 'prefetch'. The hardware prefetcher follows with the rest.
+const size_t CACHE_LINE_BYTES = 64;
+const size_t PREFETCH_LINES = 4;
+
+
+/*
+ * @brief Hints the CPU to load the beginning of the 'size' bytes at 'ptr'
+ * into the cache, at most PREFETCH_LINES cache lines.
+ *
+ * Issued some time before the memory is read, the loads of several rows
+ * overlap instead of stalling one after the other.
+ */
+inline void prefetch(const void *ptr, size_t size)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    const char *bytes = static_cast<const char*>(ptr);
+    size_t end = std::min(size, PREFETCH_LINES * CACHE_LINE_BYTES);
+    for (size_t offset = 0; offset < end; offset += CACHE_LINE_BYTES)
+    {
+        __builtin_prefetch(bytes + offset);
+    }
+#else
+    (void)ptr;
+    (void)size;
+#endif
+}
+
+
+/*
+ * @brief Returns the wall time in seconds passed since 'start'.
+ */
+inline double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> time_passed =
+        std::chrono::steady_clock::now() - start;
+    return time_passed.count();
+}
+
+
 /*
  * @brief Class for displaying a terminal progress bar.
  */
@@ -216,6 +258,69 @@ public:
 void log(const std::string &text, bool verbose=true);
 
 
+/*
+ * @brief Splits a range of items into chunks of roughly equal work.
+ *
+ * @param work The (estimated) work of each item.
+ * @param n_chunks The desired number of chunks.
+ *
+ * @return The chunk boundaries, i.e. chunk i consists of the items
+ * result[i], ..., result[i + 1] - 1. The first boundary is 0 and the last one
+ * is work.size().
+ */
+std::vector<size_t> balanced_chunks(
+    const std::vector<size_t> &work,
+    size_t n_chunks
+);
+
+
+/*
+ * @brief Pins the threads of the OpenMP parallel regions with 'n_threads'
+ * threads to single CPUs while the object exists.
+ *
+ * Thread t is bound to the CPU t (modulo their number) of the CPUs the
+ * constructing thread may run on, which keeps each thread on the NUMA node of
+ * the rows it first touched (see Matrix::first_touch). The destructor gives
+ * every thread of the team its previous CPUs back, which relies on OpenMP
+ * reusing the same threads for teams of the same size, as common runtimes do.
+ * Objects constructed while another one exists on the same thread pin to the
+ * same CPUs.
+ * On systems other than Linux the threads are not pinned.
+ */
+class ThreadPinning
+{
+private:
+
+    /*
+     * The NUMA node of the CPU of each thread.
+     */
+    std::vector<int> thread_nodes;
+
+    /*
+     * The CPUs each thread ran on before it was pinned.
+     */
+    std::vector<std::vector<int>> thread_cpus;
+
+public:
+
+    /*
+     * Constructor that pins the threads unless 'enabled' is false.
+     */
+    ThreadPinning(int n_threads, bool enabled=true);
+
+    ThreadPinning(const ThreadPinning&) = delete;
+    ThreadPinning& operator=(const ThreadPinning&) = delete;
+
+    ~ThreadPinning();
+
+    /*
+     * Returns the NUMA node of the CPU of each thread (0 if unknown), or an
+     * empty vector if the threads are not pinned.
+     */
+    const std::vector<int> &nodes() const { return thread_nodes; }
+};
+
+
 /*
  * @brief Counts the number of elements in a range that are not equal to a
  * given value.
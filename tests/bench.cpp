@@ -0,0 +1,631 @@
+/*
+ * Benchmark suite for the index build and the queries.
+ *
+ * Builds an index for each combination of metric, training size, number of
+ * threads and matrix format and reports the build time, the query throughput,
+ * the latency percentiles of single queries, the query recall and the peak
+ * resident set size. The results are printed as table and written as JSON to
+ * the output file, so that runs of different versions can be compared.
+ *
+ * By default synthetic clustered data is used. The exact neighbors are then
+ * computed by a brute force index, whose cost is quadratic in the training
+ * size. Data sets in the CSV format of 'make_test_data.py' (e.g. the ANN
+ * Benchmark data sets) are used with '--train' and '--test', and the
+ * precomputed exact neighbors with '--test_ect'.
+ *
+ * Usage:
+ * ./bench [--metrics euclidean,cosine] [--sizes 10000,20000] [--threads 1,8]
+ *         [--formats dense,sparse] [--dim 32] [--density 1.0]
+ *         [--n_queries 1000] [--n_neighbors 30] [--k 10] [--epsilon 0.1]
+ *         [--repeats 3] [--seed 1234] [--train PATH --test PATH]
+ *         [--test_ect PATH] [--output bench.json]
+ */
+
+
+#include <cmath>
+#include <fstream>
+
+#include <omp.h>
+#include <sys/resource.h>
+
+#include "../src/nnd.h"
+
+using namespace nndescent;
+
+
+// Read csv from disk and return as Matrix.
+template <class T>
+Matrix<T> read_csv(std::string file_path)
+{
+    std::cout << "Reading " << file_path << "\n";
+
+    std::fstream csv_file;
+    csv_file.open(file_path, std::ios::in);
+
+    if (!std::ifstream(file_path))
+    {
+        std::cerr << "Dataset '" << file_path
+                << "' not found. Did you try to run 'make_test_data.py'?\n";
+        exit(1);
+    }
+
+    size_t n_rows = 0;
+    std::vector<T> vec_data;
+    std::string line;
+    while (std::getline(csv_file, line))
+    {
+        ++n_rows;
+        std::stringstream ss_line(line);
+        while (ss_line.good())
+        {
+            std::string substr;
+            getline(ss_line, substr, ',');
+            vec_data.push_back(atof(substr.c_str()));
+        }
+    }
+    csv_file.close();
+
+    Matrix<T> matrix(n_rows, vec_data);
+
+    return matrix;
+}
+
+
+// Command line options of the benchmark.
+struct Options
+{
+    std::vector<std::string> metrics = {"euclidean", "cosine"};
+    std::vector<size_t> sizes = {10000, 20000};
+    std::vector<int> threads;
+    std::vector<std::string> formats = {"dense", "sparse"};
+    size_t dim = 32;
+    float density = 1.0f;
+    size_t n_queries = 1000;
+    int n_neighbors = 30;
+    int k = 10;
+    float epsilon = 0.1f;
+    int repeats = 3;
+    int seed = 1234;
+    std::string train_path;
+    std::string test_path;
+    std::string test_ect_path;
+    std::string output = "bench.json";
+};
+
+
+// Result of one benchmark configuration.
+struct Result
+{
+    std::string metric;
+    std::string format;
+    size_t n_train;
+    int n_threads;
+    double build_seconds;
+    double prepare_seconds;
+    size_t build_dist_evals;
+    size_t n_iters;
+    double qps;
+    double latency_p50_ms;
+    double latency_p99_ms;
+    double query_dist_evals;
+    float recall;
+    double peak_rss_mb;
+};
+
+
+// Split a comma separated list.
+std::vector<std::string> split(const std::string &text)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+
+Options parse_options(int argc, char* argv[])
+{
+    Options opt;
+    opt.threads = {1};
+    if (omp_get_max_threads() > 1)
+    {
+        opt.threads.push_back(omp_get_max_threads());
+    }
+    bool sizes_given = false;
+
+    for (int i = 1; i < argc; i += 2)
+    {
+        std::string key = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value of option '" << key << "'\n";
+            exit(1);
+        }
+        std::string value = argv[i + 1];
+
+        if (key == "--metrics")
+        {
+            opt.metrics = split(value);
+        }
+        else if (key == "--sizes")
+        {
+            opt.sizes.clear();
+            for (const auto &item : split(value))
+            {
+                opt.sizes.push_back(std::stoul(item));
+            }
+            sizes_given = true;
+        }
+        else if (key == "--threads")
+        {
+            opt.threads.clear();
+            for (const auto &item : split(value))
+            {
+                opt.threads.push_back(std::stoi(item));
+            }
+        }
+        else if (key == "--formats")
+        {
+            opt.formats = split(value);
+        }
+        else if (key == "--dim")
+        {
+            opt.dim = std::stoul(value);
+        }
+        else if (key == "--density")
+        {
+            opt.density = std::stof(value);
+        }
+        else if (key == "--n_queries")
+        {
+            opt.n_queries = std::stoul(value);
+        }
+        else if (key == "--n_neighbors")
+        {
+            opt.n_neighbors = std::stoi(value);
+        }
+        else if (key == "--k")
+        {
+            opt.k = std::stoi(value);
+        }
+        else if (key == "--epsilon")
+        {
+            opt.epsilon = std::stof(value);
+        }
+        else if (key == "--repeats")
+        {
+            opt.repeats = std::max(1, std::stoi(value));
+        }
+        else if (key == "--seed")
+        {
+            opt.seed = std::stoi(value);
+        }
+        else if (key == "--train")
+        {
+            opt.train_path = value;
+        }
+        else if (key == "--test")
+        {
+            opt.test_path = value;
+        }
+        else if (key == "--test_ect")
+        {
+            opt.test_ect_path = value;
+        }
+        else if (key == "--output")
+        {
+            opt.output = value;
+        }
+        else
+        {
+            std::cerr << "Unknown option '" << key << "'\n";
+            exit(1);
+        }
+    }
+    if (opt.train_path.empty() != opt.test_path.empty())
+    {
+        std::cerr << "Options '--train' and '--test' must be given together\n";
+        exit(1);
+    }
+    // Data sets from file are used completely unless sizes are given.
+    if (!opt.train_path.empty() && !sizes_given)
+    {
+        opt.sizes = {0};
+    }
+    return opt;
+}
+
+
+// Generate clustered data, where each entry is zero with probability
+// 1 - density.
+Matrix<float> make_blobs(
+    size_t n_rows, size_t dim, float density, RandomState &rng_state
+)
+{
+    const int n_centers = 20;
+    Matrix<float> centers(n_centers, dim);
+    for (size_t i = 0; i < n_centers; ++i)
+    {
+        for (size_t j = 0; j < dim; ++j)
+        {
+            centers(i, j) = 10.0f*rand_float(rng_state);
+        }
+    }
+    Matrix<float> data(n_rows, dim, 0.0f);
+    for (size_t i = 0; i < n_rows; ++i)
+    {
+        size_t center = rand_int(rng_state) % n_centers;
+        for (size_t j = 0; j < dim; ++j)
+        {
+            // Keep one entry per row, such that no row is zero.
+            if (j != i % dim && rand_float(rng_state) >= density)
+            {
+                continue;
+            }
+            // Approximately normal distributed noise.
+            float noise = rand_float(rng_state) + rand_float(rng_state)
+                + rand_float(rng_state) + rand_float(rng_state) - 2.0f;
+            data(i, j) = centers(center, j) + noise;
+        }
+    }
+    return data;
+}
+
+
+// Return the first rows of a matrix.
+Matrix<float> first_rows(Matrix<float> &matrix, size_t n_rows)
+{
+    Matrix<float> result(n_rows, matrix.ncols());
+    std::copy(
+        matrix.begin(0), matrix.begin(0) + n_rows*matrix.ncols(),
+        result.begin(0)
+    );
+    return result;
+}
+
+
+// Reset the peak resident set size of the process (Linux only).
+void reset_peak_rss()
+{
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs)
+    {
+        clear_refs << "5";
+    }
+}
+
+
+// Return the peak resident set size since the last reset in MB. Falls back to
+// the peak of the whole process if '/proc' is not available.
+double peak_rss_mb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return std::stod(line.substr(6)) / 1024.0;
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0*1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+
+// Return the q-th quantile (nearest rank) of the sorted values.
+double percentile(const std::vector<double> &sorted, double q)
+{
+    size_t rank = (size_t)std::ceil(q*sorted.size());
+    return sorted[std::max(rank, (size_t)1) - 1];
+}
+
+
+// Compute the exact k nearest neighbors of the queries by brute force.
+Matrix<int> exact_neighbors(
+    Matrix<float> &train_data,
+    const Matrix<float> &query_data,
+    const std::string &metric,
+    int k,
+    int n_threads
+)
+{
+    Parms parms;
+    parms.metric = metric;
+    parms.n_neighbors = 1;
+    parms.algorithm = "bf";
+    parms.n_threads = n_threads;
+    NNDescent nnd(train_data, parms);
+    nnd.query(query_data, k);
+    return nnd.query_indices;
+}
+
+
+// Build and query an index for one configuration.
+template<class MatrixType>
+Result run_config(
+    MatrixType &train_data,
+    const MatrixType &query_data,
+    std::vector<MatrixType> &single_queries,
+    Matrix<int> &ect_indices,
+    const Options &opt,
+    Parms parms
+)
+{
+    Result result;
+    result.metric = parms.metric;
+    result.format = std::is_same<MatrixType, CSRMatrix<float>>::value
+        ? "sparse" : "dense";
+    result.n_train = train_data.nrows();
+    result.n_threads = parms.n_threads;
+
+    reset_peak_rss();
+
+    auto time_start = std::chrono::steady_clock::now();
+    NNDescent nnd(train_data, parms);
+    result.build_seconds = seconds_since(time_start);
+    result.prepare_seconds = nnd.stats.prepare_seconds;
+    result.build_dist_evals = nnd.stats.leaves_dist_evals;
+    for (const auto &iteration : nnd.stats.iterations)
+    {
+        result.build_dist_evals += iteration.dist_evals;
+    }
+    result.n_iters = nnd.stats.iterations.size();
+
+    // Throughput of batch queries using all threads; best of all repeats.
+    double best_seconds = 0.0;
+    for (int i = 0; i < opt.repeats; ++i)
+    {
+        time_start = std::chrono::steady_clock::now();
+        nnd.query(query_data, opt.k, opt.epsilon);
+        double query_seconds = seconds_since(time_start);
+        if (i == 0 || query_seconds < best_seconds)
+        {
+            best_seconds = query_seconds;
+        }
+    }
+    result.qps = query_data.nrows() / best_seconds;
+    result.recall = recall_accuracy(nnd.query_indices, ect_indices);
+
+    // Latency of single queries.
+    nnd.stats.reset_queries();
+    std::vector<double> latencies;
+    latencies.reserve(single_queries.size());
+    for (const auto &single_query : single_queries)
+    {
+        time_start = std::chrono::steady_clock::now();
+        nnd.query(single_query, opt.k, opt.epsilon);
+        latencies.push_back(1000.0*seconds_since(time_start));
+    }
+    std::sort(latencies.begin(), latencies.end());
+    result.latency_p50_ms = percentile(latencies, 0.5);
+    result.latency_p99_ms = percentile(latencies, 0.99);
+    result.query_dist_evals = (double)nnd.stats.query_dist_evals
+        / std::max(nnd.stats.n_queries, (size_t)1);
+
+    result.peak_rss_mb = peak_rss_mb();
+    return result;
+}
+
+
+void write_json(
+    const std::string &path,
+    const std::string &dataset,
+    const Options &opt,
+    size_t dim,
+    size_t n_queries,
+    const std::vector<Result> &results
+)
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cerr << "Cannot write '" << path << "'\n";
+        exit(1);
+    }
+    out << std::setprecision(6);
+    out << "{\n"
+        << "  \"dataset\": \"" << dataset << "\",\n"
+        << "  \"dim\": " << dim << ",\n"
+        << "  \"n_queries\": " << n_queries << ",\n"
+        << "  \"n_neighbors\": " << opt.n_neighbors << ",\n"
+        << "  \"k\": " << opt.k << ",\n"
+        << "  \"epsilon\": " << opt.epsilon << ",\n"
+        << "  \"max_threads\": " << omp_get_max_threads() << ",\n"
+        << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result &r = results[i];
+        out << "    {"
+            << "\"metric\": \"" << r.metric << "\", "
+            << "\"format\": \"" << r.format << "\", "
+            << "\"n_train\": " << r.n_train << ", "
+            << "\"n_threads\": " << r.n_threads << ", "
+            << "\"build_seconds\": " << r.build_seconds << ", "
+            << "\"prepare_seconds\": " << r.prepare_seconds << ", "
+            << "\"build_dist_evals\": " << r.build_dist_evals << ", "
+            << "\"n_iters\": " << r.n_iters << ", "
+            << "\"qps\": " << r.qps << ", "
+            << "\"latency_p50_ms\": " << r.latency_p50_ms << ", "
+            << "\"latency_p99_ms\": " << r.latency_p99_ms << ", "
+            << "\"query_dist_evals\": " << r.query_dist_evals << ", "
+            << "\"recall\": " << r.recall << ", "
+            << "\"peak_rss_mb\": " << r.peak_rss_mb
+            << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+
+int main(int argc, char* argv[])
+{
+    Options opt = parse_options(argc, argv);
+
+    // DATA INPUT
+
+    std::string dataset;
+    Matrix<float> all_train_data;
+    Matrix<float> query_data;
+    Matrix<int> file_ect_indices;
+    if (opt.train_path.empty())
+    {
+        dataset = "synthetic";
+        RandomState rng_state;
+        seed_state(rng_state, opt.seed);
+        size_t max_size = *std::max_element(opt.sizes.begin(), opt.sizes.end());
+        Matrix<float> data = make_blobs(
+            opt.n_queries + max_size, opt.dim, opt.density, rng_state
+        );
+        query_data = first_rows(data, opt.n_queries);
+        all_train_data = Matrix<float>(max_size, opt.dim);
+        std::copy(
+            data.begin(opt.n_queries), data.begin(opt.n_queries)
+                + max_size*opt.dim,
+            all_train_data.begin(0)
+        );
+    }
+    else
+    {
+        dataset = opt.train_path;
+        all_train_data = read_csv<float>(opt.train_path);
+        Matrix<float> test_data = read_csv<float>(opt.test_path);
+        opt.n_queries = std::min(opt.n_queries, test_data.nrows());
+        query_data = first_rows(test_data, opt.n_queries);
+        if (!opt.test_ect_path.empty())
+        {
+            file_ect_indices = read_csv<int>(opt.test_ect_path);
+        }
+        for (auto &size : opt.sizes)
+        {
+            if (size == 0 || size > all_train_data.nrows())
+            {
+                size = all_train_data.nrows();
+            }
+        }
+    }
+    size_t dim = all_train_data.ncols();
+    int max_threads = *std::max_element(
+        opt.threads.begin(), opt.threads.end()
+    );
+
+    CSRMatrix<float> csr_query_data(query_data);
+    std::vector<Matrix<float>> single_queries;
+    std::vector<CSRMatrix<float>> csr_single_queries;
+    for (size_t i = 0; i < query_data.nrows(); ++i)
+    {
+        single_queries.push_back(Matrix<float>(1, dim));
+        std::copy(
+            query_data.begin(i), query_data.begin(i) + dim,
+            single_queries.back().begin(0)
+        );
+        csr_single_queries.push_back(CSRMatrix<float>(single_queries.back()));
+    }
+
+    // BENCHMARK
+
+    std::vector<Result> results;
+    for (size_t size : opt.sizes)
+    {
+        Matrix<float> train_data = first_rows(all_train_data, size);
+        CSRMatrix<float> csr_train_data(train_data);
+
+        for (const auto &metric : opt.metrics)
+        {
+            Matrix<int> ect_indices;
+            if (
+                file_ect_indices.nrows() > 0
+                && size == all_train_data.nrows()
+            )
+            {
+                // First column of result csv is index.
+                ect_indices = Matrix<int>(opt.n_queries, opt.k);
+                for (size_t i = 0; i < opt.n_queries; ++i)
+                {
+                    for (int j = 0; j < opt.k; ++j)
+                    {
+                        ect_indices(i, j) = file_ect_indices(i, j + 1);
+                    }
+                }
+            }
+            else
+            {
+                std::cout << "Computing exact neighbors (" << metric << ", "
+                    << size << " points)\n";
+                ect_indices = exact_neighbors(
+                    train_data, query_data, metric, opt.k, max_threads
+                );
+            }
+
+            for (int n_threads : opt.threads)
+            {
+                Parms parms;
+                parms.metric = metric;
+                parms.n_neighbors = opt.n_neighbors;
+                parms.n_threads = n_threads;
+                parms.seed = opt.seed;
+
+                for (const auto &format : opt.formats)
+                {
+                    std::cout << metric << ", " << format << ", " << size
+                        << " points, " << n_threads << " threads\n";
+                    if (format == "dense")
+                    {
+                        results.push_back(run_config(
+                            train_data, query_data, single_queries,
+                            ect_indices, opt, parms
+                        ));
+                    }
+                    else if (format == "sparse")
+                    {
+                        results.push_back(run_config(
+                            csr_train_data, csr_query_data,
+                            csr_single_queries, ect_indices, opt, parms
+                        ));
+                    }
+                    else
+                    {
+                        std::cerr << "Unknown format '" << format << "'\n";
+                        exit(1);
+                    }
+                }
+            }
+        }
+    }
+
+    // OUTPUT
+
+    std::cout << "\n"
+        << "metric        format  n_train threads  build [s]        qps"
+        << "  p50 [ms]  p99 [ms]  recall  rss [MB]\n"
+        << std::fixed;
+    for (const auto &r : results)
+    {
+        std::cout << std::left << std::setw(14) << r.metric
+            << std::setw(6) << r.format << std::right
+            << std::setw(9) << r.n_train
+            << std::setw(8) << r.n_threads
+            << std::setprecision(3) << std::setw(11) << r.build_seconds
+            << std::setprecision(0) << std::setw(11) << r.qps
+            << std::setprecision(3) << std::setw(10) << r.latency_p50_ms
+            << std::setw(10) << r.latency_p99_ms
+            << std::setw(8) << r.recall
+            << std::setprecision(1) << std::setw(10) << r.peak_rss_mb
+            << "\n";
+    }
+    write_json(opt.output, dataset, opt, dim, opt.n_queries, results);
+    std::cout << "Results written to " << opt.output << "\n";
+
+    return 0;
+}
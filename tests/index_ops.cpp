@@ -0,0 +1,166 @@
+/*
+ * Checks the operations on an index against the exact nearest neighbors:
+ * inserting points, merging shards, building the graph on disk and saving
+ * and loading the index. Returns a nonzero exit code if a check fails.
+ */
+
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../src/nnd.h"
+
+using namespace nndescent;
+
+
+// Minimal recall of the approximate graphs and queries.
+const float MIN_RECALL = 0.9f;
+
+int n_failed = 0;
+
+
+void check(bool passed, const std::string &name)
+{
+    std::cout << (passed ? "passed: " : "FAILED: ") << name << "\n";
+    if (!passed)
+    {
+        ++n_failed;
+    }
+}
+
+
+void check_recall(
+    const Matrix<int> &apx, const Matrix<int> &ect, const std::string &name
+)
+{
+    std::cout << name << ": ";
+    check(recall_accuracy(apx, ect) >= MIN_RECALL, name);
+}
+
+
+bool same_results(const NNDescent &nnd, const NNDescent &other)
+{
+    const Matrix<int> &indices = nnd.query_indices;
+    for (size_t i = 0; i < indices.nrows(); ++i)
+    {
+        for (size_t j = 0; j < indices.ncols(); ++j)
+        {
+            if (
+                indices(i, j) != other.query_indices(i, j)
+                || nnd.query_distances(i, j) != other.query_distances(i, j)
+            )
+            {
+                return false;
+            }
+        }
+    }
+    return indices.nrows() == other.query_indices.nrows();
+}
+
+
+int main()
+{
+    const size_t n = 10000;
+    const size_t n_first = 8000;
+    const size_t n_queries = 500;
+    const size_t dim = 16;
+    const int k = 10;
+    const float epsilon = 0.2f;
+
+    // Random data in a few clusters.
+    RandomState rng_state;
+    seed_state(rng_state, 42);
+    Matrix<float> data(n, dim);
+    Matrix<float> query_data(n_queries, dim);
+    for (size_t i = 0; i < n + n_queries; ++i)
+    {
+        float center = (float)(rand_int(rng_state) % 8);
+        float *row = i < n ? data.begin(i) : query_data.begin(i - n);
+        for (size_t j = 0; j < dim; ++j)
+        {
+            row[j] = center + rand_float(rng_state);
+        }
+    }
+
+    Parms parms;
+    parms.n_neighbors = 15;
+    parms.seed = 1;
+
+    // Exact nearest neighbors.
+    Parms bf_parms = parms;
+    bf_parms.algorithm = "bf";
+    NNDescent nnd_bf(data, bf_parms);
+    nnd_bf.query(query_data, k, epsilon);
+
+    NNDescent nnd(data, parms);
+    nnd.query(query_data, k, epsilon);
+    check_recall(nnd.neighbor_indices, nnd_bf.neighbor_indices, "build");
+    check_recall(nnd.query_indices, nnd_bf.query_indices, "query");
+
+
+    // INSERTING POINTS
+
+    Matrix<float> first(n_first, dim, data.begin(0));
+    Matrix<float> rest(n - n_first, dim, data.begin(n_first));
+    NNDescent nnd_added(first, parms);
+    nnd_added.add_points(rest);
+    nnd_added.query(query_data, k, epsilon);
+    check_recall(
+        nnd_added.neighbor_indices, nnd_bf.neighbor_indices, "add_points"
+    );
+    check_recall(
+        nnd_added.query_indices, nnd_bf.query_indices, "add_points query"
+    );
+
+
+    // MERGING SHARDS
+
+    NNDescent shard_first(first, parms);
+    NNDescent shard_rest(rest, parms);
+    std::vector<const NNDescent*> shards = {&shard_first, &shard_rest};
+    NNDescent nnd_merged = NNDescent::merge(shards, parms);
+    nnd_merged.query(query_data, k, epsilon);
+    check_recall(
+        nnd_merged.neighbor_indices, nnd_bf.neighbor_indices, "merge"
+    );
+    check_recall(
+        nnd_merged.query_indices, nnd_bf.query_indices, "merge query"
+    );
+
+
+    // BUILDING ON DISK
+
+    const std::string graph_path = "index_ops_graph.nnd";
+    Parms disk_parms = parms;
+    NNDescent::build_on_disk(data, disk_parms, n / 4, graph_path);
+    {
+        MappedFile graph_file(graph_path);
+        BinaryReader reader(graph_file);
+        reader.read_header();
+        Matrix<int> disk_indices;
+        Matrix<float> disk_distances;
+        reader.read(disk_indices);
+        reader.read(disk_distances);
+        check_recall(disk_indices, nnd_bf.neighbor_indices, "build_on_disk");
+    }
+    std::remove(graph_path.c_str());
+
+
+    // SAVING AND LOADING
+
+    const std::string index_path = "index_ops_index.nnd";
+    nnd.save(index_path);
+    NNDescent nnd_loaded = NNDescent::load(index_path);
+    nnd_loaded.query(query_data, k, epsilon);
+    check(same_results(nnd_loaded, nnd), "load");
+    {
+        NNDescent nnd_mapped = NNDescent::load(index_path, true);
+        nnd_mapped.query(query_data, k, epsilon);
+        check(same_results(nnd_mapped, nnd), "load with mmap");
+    }
+    std::remove(index_path.c_str());
+
+    std::cout << n_failed << " checks failed\n";
+    return n_failed == 0 ? 0 : 1;
+}
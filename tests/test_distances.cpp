@@ -1,14 +1,25 @@
 /*
  * Tests all implemented functions of nndescent. The values are the same
  * as in the corresponding py file.
+ *
+ * Afterwards the accuracy of the optimized kernels is checked against
+ * reference implementations, and the exit code is nonzero if a check fails.
+ *
+ * Run with '--bench' to compare the vectorized dense kernels of all
+ * instruction sets supported by the CPU with the scalar kernels.
  */
 
 
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #include "../src/distances.h"
 #include "../src/dtypes.h"
+#include "../src/simd.h"
 
 using namespace nndescent;
 
@@ -173,8 +184,326 @@ void test_all_distances(
 }
 
 
-int main()
+/*
+ * Returns the mean time in nanoseconds of one distance evaluation between all
+ * pairs of consecutive rows and stores the sum of all distances in 'checksum'.
+ */
+template<class DistType>
+double time_distance(
+    const DistType &dist, const Matrix<float> &mtx, int repeats, float &checksum
+)
+{
+    checksum = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r)
+    {
+        for (size_t i = 0; i + 1 < mtx.nrows(); ++i)
+        {
+            checksum += dist(mtx, i, i + 1);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> time_passed = end - start;
+    return time_passed.count() / (repeats * (mtx.nrows() - 1));
+}
+
+
+template<class DistType>
+void bench_distance(
+    const std::string &dist_name, const DistType &dist, const Matrix<float> &mtx
+)
+{
+    const int repeats = 200;
+    double scalar_ns = 0.0;
+    float scalar_checksum = 0.0f;
+    for (const DenseKernels *kernels : supported_kernels())
+    {
+        set_dense_kernels(kernels->name);
+        float checksum;
+        double ns = time_distance(dist, mtx, repeats, checksum);
+        if (kernels == &scalar_kernels())
+        {
+            scalar_ns = ns;
+            scalar_checksum = checksum;
+        }
+        std::cout << dist_name << "\tdim=" << mtx.ncols() << "\t"
+            << kernels->name << "\t" << ns << " ns\tspeedup="
+            << scalar_ns / ns << "\trel_diff="
+            << std::abs(checksum - scalar_checksum)
+                / std::max(std::abs(scalar_checksum), FLOAT_MIN)
+            << "\n";
+    }
+    set_dense_kernels(supported_kernels().back()->name);
+}
+
+
+void bench_all_kernels()
 {
+    std::cout << "# Microbenchmark of the dense kernels\n\n";
+    const size_t n_rows = 1000;
+    for (size_t dim : {3, 16, 100, 784, 960})
+    {
+        Matrix<float> mtx(n_rows, dim);
+        unsigned int state = 0;
+        for (size_t i = 0; i < n_rows; ++i)
+        {
+            for (size_t j = 0; j < dim; ++j)
+            {
+                state = ((state * 1664525) + 1013904223) % 4294967296;
+                mtx(i, j) = (state % 1000) / 1000.0f;
+            }
+        }
+        bench_distance("sqeuclidean", SqEuclidean(), mtx);
+        bench_distance("manhattan", Manhattan(), mtx);
+        bench_distance("cosine", Cosine(), mtx);
+        bench_distance("dot", Dot(), mtx);
+        std::cout << "\n";
+    }
+}
+
+
+/*
+ * The number of failed accuracy checks.
+ */
+int n_failed = 0;
+
+
+void check_error(float error, float tolerance, const std::string &name)
+{
+    bool passed = error <= tolerance;
+    std::cout << (passed ? "passed: " : "FAILED: ") << name
+        << "\tmax_error=" << error << "\ttolerance=" << tolerance << "\n";
+    if (!passed)
+    {
+        ++n_failed;
+    }
+}
+
+
+/*
+ * Returns a matrix of uniform random values in [offset, offset + 1).
+ */
+Matrix<float> random_matrix(size_t n_rows, size_t dim, float offset)
+{
+    Matrix<float> mtx(n_rows, dim);
+    unsigned int state = 0;
+    for (size_t i = 0; i < n_rows; ++i)
+    {
+        for (size_t j = 0; j < dim; ++j)
+        {
+            state = ((state * 1664525) + 1013904223) % 4294967296;
+            mtx(i, j) = offset + (state % 1000) / 1000.0f;
+        }
+    }
+    return mtx;
+}
+
+
+/*
+ * Correlation in double precision as reference.
+ */
+double reference_correlation(const Matrix<float> &mtx, size_t i, size_t j)
+{
+    size_t dim = mtx.ncols();
+    double mu0 = 0.0;
+    double mu1 = 0.0;
+    for (size_t c = 0; c < dim; ++c)
+    {
+        mu0 += mtx(i, c);
+        mu1 += mtx(j, c);
+    }
+    mu0 /= dim;
+    mu1 /= dim;
+    double norm0 = 0.0;
+    double norm1 = 0.0;
+    double dot_product = 0.0;
+    for (size_t c = 0; c < dim; ++c)
+    {
+        double shifted0 = mtx(i, c) - mu0;
+        double shifted1 = mtx(j, c) - mu1;
+        norm0 += shifted0 * shifted0;
+        norm1 += shifted1 * shifted1;
+        dot_product += shifted0 * shifted1;
+    }
+    return 1.0 - dot_product / std::sqrt(norm0 * norm1);
+}
+
+
+/*
+ * Correlation of data far from the origin. The index evaluates it with the
+ * exact kernel, since the norm cache would take the centered inner product
+ * from <x, y> - dim * mean(x) * mean(y), which cancels badly in float.
+ */
+void check_correlation_offset()
+{
+    check_error(
+        std::is_same<norm_cache_formula<Correlation>::type, void>::value
+            ? 0.0f : 1.0f,
+        0.0f,
+        "correlation without norm cache"
+    );
+    const size_t dim = 256;
+    Correlation dist(dim);
+    for (float offset : {0.0f, 10.0f, 100.0f, 1000.0f})
+    {
+        Matrix<float> mtx = random_matrix(20, dim, offset);
+        float error = 0.0f;
+        for (size_t i = 0; i < mtx.nrows(); ++i)
+        {
+            for (size_t j = i + 1; j < mtx.nrows(); ++j)
+            {
+                error = std::max(
+                    error,
+                    (float)std::abs(
+                        dist(mtx, i, j) - reference_correlation(mtx, i, j)
+                    )
+                );
+            }
+        }
+        check_error(
+            error,
+            1e-5f,
+            "correlation offset=" + std::to_string((int)offset)
+        );
+    }
+}
+
+
+/*
+ * Returns the largest error of the distances between all pairs of rows of
+ * 'mtx' stored as 'type' against the float32 kernel, relative to the distance
+ * if its magnitude exceeds one.
+ */
+template<class DistType>
+float quantized_error(
+    const DistType &dist, const Matrix<float> &mtx, StorageType type
+)
+{
+    QuantizedMatrix storage(mtx, type);
+    QuantizedDist<DistType> quantized_dist(dist, storage, 1);
+    float error = 0.0f;
+    for (size_t i = 0; i < mtx.nrows(); ++i)
+    {
+        for (size_t j = i + 1; j < mtx.nrows(); ++j)
+        {
+            float expected = dist(mtx, i, j);
+            float scale = std::max(std::abs(expected), 1.0f);
+            error = std::max(
+                error, std::abs(quantized_dist(mtx, i, j) - expected) / scale
+            );
+            // Asymmetric distance to a float32 query point.
+            error = std::max(
+                error,
+                std::abs(quantized_dist(mtx, i, mtx, j) - expected) / scale
+            );
+        }
+    }
+    return error;
+}
+
+
+/*
+ * Distances on training data in reduced precision against the float32
+ * kernels. The tolerances follow from the precision of the formats: 11
+ * significant bits for float16, 8 for bfloat16 and 256 levels per column for
+ * int8.
+ */
+void check_quantized_kernels()
+{
+    Matrix<float> mtx = random_matrix(30, 100, -0.5f);
+    std::vector<std::string> names = {"float16", "bfloat16", "int8"};
+    std::vector<float> tolerances = {2e-3f, 2e-2f, 2e-2f};
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        StorageType type = storage_type(names[i]);
+        check_error(
+            quantized_error(SqEuclidean(), mtx, type),
+            tolerances[i],
+            "sqeuclidean " + names[i]
+        );
+        check_error(
+            quantized_error(Manhattan(), mtx, type),
+            tolerances[i],
+            "manhattan " + names[i]
+        );
+        check_error(
+            quantized_error(Cosine(), mtx, type),
+            tolerances[i],
+            "cosine " + names[i]
+        );
+        check_error(
+            quantized_error(Dot(), mtx, type),
+            tolerances[i],
+            "dot " + names[i]
+        );
+    }
+}
+
+
+/*
+ * Squared euclidean distances of sparse rows from the scattered kernel, which
+ * expands |x - y|^2 around the scattered row, against the dense kernel. The
+ * rows are close to each other but far from the origin and have partially
+ * different supports, so a float expansion cancels badly: its error would be
+ * about 1e-7 |y|^2, far above the distances of about 1e-3. The double
+ * expansion stays well below the tolerance.
+ */
+void check_scattered_offset()
+{
+    const size_t n_rows = 200;
+    const size_t dim = 1000;
+    Matrix<float> mtx(n_rows, dim);
+    unsigned int state = 0;
+    auto next_float = [&state]()
+    {
+        state = ((state * 1664525) + 1013904223) % 4294967296;
+        return (state % 1000) / 1000.0f;
+    };
+    for (size_t j = 0; j < dim; ++j)
+    {
+        mtx(0, j) = j % 3 == 0 ? 1000.0f + 100.0f * next_float() : 0.0f;
+    }
+    for (size_t i = 1; i < n_rows; ++i)
+    {
+        for (size_t j = 0; j < dim; ++j)
+        {
+            if (mtx(0, j) != 0.0f)
+            {
+                mtx(i, j) = mtx(0, j) + 0.01f * (next_float() - 0.5f);
+            }
+            else
+            {
+                mtx(i, j) = next_float() < 0.01f ? 0.01f : 0.0f;
+            }
+        }
+    }
+    CSRMatrix<float> csr_mtx(mtx);
+    std::vector<int> indices;
+    for (size_t i = 1; i < n_rows; ++i)
+    {
+        indices.push_back(i);
+    }
+    std::vector<float> out(indices.size());
+    SqEuclidean dist;
+    dist.one_to_many(csr_mtx, 0, indices.data(), indices.size(), out.data());
+    float error = 0.0f;
+    for (size_t i = 1; i < n_rows; ++i)
+    {
+        float expected = dist(mtx, 0, i);
+        error = std::max(error, std::abs(out[i - 1] - expected) / expected);
+    }
+    check_error(error, 1e-3f, "scattered sqeuclidean offset=1000");
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "--bench")
+    {
+        bench_all_kernels();
+        return 0;
+    }
+
     std::vector<float> data_U = {
         9,5,6,7,3,2,1,0,8,-4,
         6,8,-2,3,6,5,4,-9,1,0,
@@ -203,5 +532,11 @@ int main()
     test_all_distances("V", V, 2.0f);
     test_all_distances("W", W, 2.0f);
 
-    return 0;
+    std::cout << "\n# Accuracy checks:\n\n";
+    check_correlation_offset();
+    check_quantized_kernels();
+    check_scattered_offset();
+    std::cout << n_failed << " checks failed\n";
+
+    return n_failed == 0 ? 0 : 1;
 }